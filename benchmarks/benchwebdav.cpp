@@ -0,0 +1,763 @@
+#include "asyncpg.h"
+#include "cloudlyst.h"
+#include "filessqlasync.h"
+#include "iopolicy.h"
+#include "webdav.h"
+#include "webdavmemorypropertystorage.h"
+
+#include <Cutelyst/Plugins/Utils/Sql>
+
+#include <QtTest/QtTest>
+
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QEventLoop>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QTemporaryDir>
+#include <QTemporaryFile>
+#include <QXmlStreamWriter>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace Cutelyst;
+
+/**
+ * Microbenchmarks for the hot paths of the WebDAV controller.
+ *
+ * The SQL benchmarks need a throwaway PostgreSQL database, set
+ * CLOUDLYST_BENCH_DB to its name (and PGHOST/PGUSER as usual), the
+ * cloudlyst schema in it is dropped and recreated. With
+ * CLOUDLYST_BENCH_SQLITE set they run on a temporary SQLite database
+ * instead.
+ *
+ * ioPolicyCache streams CLOUDLYST_BENCH_IO_MB (1024) through the page
+ * cache while reading a hot set of small files, it only tells something
+ * when run with less memory than that, e.g. in a cgroup with MemoryMax.
+ */
+class BenchWebdav : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void writePropFindResponseItem_data();
+    void writePropFindResponseItem();
+
+    void parsePropFindRequest_data();
+    void parsePropFindRequest();
+
+    void parsePropPatch_data();
+    void parsePropPatch();
+
+    void memoryStorageTransaction_data();
+    void memoryStorageTransaction();
+
+    void uriPathParts_data();
+    void uriPathParts();
+
+    void pathFiles_data();
+    void pathFiles();
+
+    void putHash_data();
+    void putHash();
+
+    void sqlFilesItem();
+
+    void sqlFilesItems_data();
+    void sqlFilesItems();
+
+    void sqlFilesPut_data();
+    void sqlFilesPut();
+
+    void writePropFindDeadProperties_data();
+    void writePropFindDeadProperties();
+
+    void ioPolicyCache_data();
+    void ioPolicyCache();
+
+private:
+    void setupDatabase();
+    void setupSqliteDatabase();
+    void sizes();
+    static std::vector<FileItem> fileItems(int count);
+    GetProperties desktopClientProps();
+    static QByteArray readData(const QString &name);
+    static qint64 residentPages(const QString &fileName, qint64 &pages);
+
+    Webdav *m_webdav = nullptr;
+    WebdavPropertyStorage *m_sqlStorage = nullptr;
+    WebdavMemoryPropertyStorage *m_memoryStorage = nullptr;
+    QHash<int, qint64> m_dirIds;
+    QVariant m_userId;
+    QTemporaryDir m_sqliteDir;
+    bool m_hasDb = false;
+    bool m_sqlite = false;
+};
+
+static const int benchSizes[] = { 10, 100, 1000, 10000, 100000 };
+
+void BenchWebdav::initTestCase()
+{
+    m_webdav = new Webdav(this);
+    m_sqlStorage = m_webdav->m_propStorage;
+    m_memoryStorage = new WebdavMemoryPropertyStorage(this);
+
+    setupDatabase();
+}
+
+void BenchWebdav::cleanupTestCase()
+{
+    if (m_hasDb && !m_sqlite) {
+        QSqlQuery query(Sql::databaseThread(QStringLiteral("cloudlyst")));
+        query.exec(QStringLiteral("DROP SCHEMA cloudlyst CASCADE"));
+    }
+}
+
+void BenchWebdav::sizes()
+{
+    QTest::addColumn<int>("count");
+    for (int count : benchSizes) {
+        QTest::newRow(QByteArray::number(count).constData()) << count;
+    }
+}
+
+void BenchWebdav::writePropFindResponseItem_data()
+{
+    sizes();
+}
+
+void BenchWebdav::writePropFindResponseItem()
+{
+    QFETCH(int, count);
+
+    const std::vector<FileItem> files = fileItems(count);
+    const GetProperties props = desktopClientProps();
+    const QString baseUri = QStringLiteral("/remote.php/dav/files/bench/");
+
+    QBuffer buffer;
+    buffer.open(QIODevice::WriteOnly);
+
+    QBENCHMARK {
+        buffer.seek(0);
+        QXmlStreamWriter stream(&buffer);
+        stream.writeStartDocument();
+        stream.writeNamespace(QStringLiteral("DAV:"), QStringLiteral("d"));
+        stream.writeStartElement(QStringLiteral("d:multistatus"));
+        for (const FileItem &file : files) {
+            m_webdav->writePropFindResponseItem(file, stream, baseUri, props, PropertyValueHash());
+        }
+        stream.writeEndElement();
+        stream.writeEndDocument();
+    }
+}
+
+void BenchWebdav::parsePropFindRequest_data()
+{
+    QTest::addColumn<QByteArray>("body");
+    QTest::newRow("nextcloud-desktop") << readData(QStringLiteral("propfind-nextcloud-desktop.xml"));
+    QTest::newRow("windows-explorer") << readData(QStringLiteral("propfind-windows-explorer.xml"));
+    QTest::newRow("allprop") << readData(QStringLiteral("propfind-allprop.xml"));
+}
+
+void BenchWebdav::parsePropFindRequest()
+{
+    QFETCH(QByteArray, body);
+
+    QBENCHMARK {
+        GetProperties props;
+        QString error;
+        m_webdav->parsePropFindData(body, props, error);
+    }
+}
+
+void BenchWebdav::parsePropPatch_data()
+{
+    QTest::addColumn<QByteArray>("body");
+    QTest::newRow("windows-explorer") << readData(QStringLiteral("proppatch-windows-explorer.xml"));
+    QTest::newRow("set-remove") << readData(QStringLiteral("proppatch-set-remove.xml"));
+}
+
+void BenchWebdav::parsePropPatch()
+{
+    QFETCH(QByteArray, body);
+
+    // Measures parsing only, storage is the in memory one
+    m_webdav->m_propStorage = m_memoryStorage;
+    qint64 fileId = 0;
+    QBENCHMARK {
+        QString error;
+        PropPatches updates;
+        m_webdav->parsePropPatchData(body, updates, error);
+        m_webdav->queuePropPatch(++fileId, updates);
+        m_memoryStorage->commit();
+    }
+    m_webdav->m_propStorage = m_sqlStorage;
+}
+
+void BenchWebdav::memoryStorageTransaction_data()
+{
+    sizes();
+}
+
+void BenchWebdav::memoryStorageTransaction()
+{
+    QFETCH(int, count);
+
+    // A PROPPATCH worth of changes against count files already stored,
+    // the cost should not depend on count
+    WebdavMemoryPropertyStorage storage;
+    for (int i = 0; i < count; ++i) {
+        storage.setValue(i, QStringLiteral("{http://owncloud.org/ns}favorite"), QStringLiteral("1"));
+        storage.setValue(i, QStringLiteral("{http://example.com/ns}author"), QStringLiteral("bench"));
+    }
+
+    qint64 fileId = 0;
+    QBENCHMARK {
+        storage.begin();
+        fileId = (fileId + 1) % count;
+        for (int i = 0; i < 8; ++i) {
+            storage.setValue(fileId, QLatin1String("{urn:schemas-microsoft-com:}p") + QString::number(i), QStringLiteral("value"));
+        }
+        storage.remove(fileId, QStringLiteral("{http://example.com/ns}author"));
+        storage.commit();
+    }
+}
+
+void BenchWebdav::uriPathParts_data()
+{
+    QTest::addColumn<QString>("path");
+    QTest::newRow("short") << QStringLiteral("Documents/report.pdf");
+    QTest::newRow("encoded") << QStringLiteral("Fotos/F%C3%A9rias%202018/Praia%20do%20Forte/IMG_0001.JPG");
+    QTest::newRow("deep") << QStringLiteral("a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p/q/r/s/t/file.txt");
+}
+
+void BenchWebdav::uriPathParts()
+{
+    QFETCH(QString, path);
+
+    QBENCHMARK {
+        Webdav::uriPathParts(path);
+    }
+}
+
+void BenchWebdav::pathFiles_data()
+{
+    QTest::addColumn<QStringList>("parts");
+    QTest::newRow("1") << QStringList{ QStringLiteral("file.txt") };
+    QTest::newRow("5") << QStringLiteral("Documents/2019/Taxes/Receipts/scan.pdf").split(QLatin1Char('/'));
+    QTest::newRow("20") << QStringLiteral("a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p/q/r/s/file.txt").split(QLatin1Char('/'));
+}
+
+void BenchWebdav::pathFiles()
+{
+    QFETCH(QStringList, parts);
+
+    QBENCHMARK {
+        Webdav::pathFiles(parts);
+    }
+}
+
+void BenchWebdav::putHash_data()
+{
+    QTest::addColumn<int>("size");
+    QTest::addColumn<bool>("copy");
+    for (int size : { 4 * 1024, 1024 * 1024, 64 * 1024 * 1024 }) {
+        QTest::newRow(qPrintable(QStringLiteral("hash-%1").arg(size))) << size << false;
+        QTest::newRow(qPrintable(QStringLiteral("copy-%1").arg(size))) << size << true;
+    }
+}
+
+void BenchWebdav::putHash()
+{
+    QFETCH(int, size);
+    QFETCH(bool, copy);
+
+    QByteArray data(size, Qt::Uninitialized);
+    for (int i = 0; i < size; ++i) {
+        data[i] = char(i * 31);
+    }
+    QBuffer in(&data);
+    in.open(QIODevice::ReadOnly);
+
+    QTemporaryFile out;
+    QVERIFY(out.open());
+
+    QBENCHMARK {
+        in.seek(0);
+        out.seek(0);
+        QCryptographicHash hash(QCryptographicHash::Md5);
+        Webdav::copyAndHash(&in, copy ? &out : nullptr, hash);
+        hash.result();
+    }
+}
+
+void BenchWebdav::sqlFilesItem()
+{
+    if (!m_hasDb) {
+        QSKIP("Neither CLOUDLYST_BENCH_DB nor CLOUDLYST_BENCH_SQLITE set");
+    }
+
+    const QString path = QStringLiteral("files/d1000/f500");
+    QBENCHMARK {
+        QEventLoop loop;
+        FilesSqlAsync::item(path, m_userId, &loop, [&loop] (const FileItem &, const QString &) {
+            loop.quit();
+        });
+        loop.exec();
+    }
+}
+
+void BenchWebdav::sqlFilesItems_data()
+{
+    sizes();
+}
+
+void BenchWebdav::sqlFilesItems()
+{
+    if (!m_hasDb) {
+        QSKIP("Neither CLOUDLYST_BENCH_DB nor CLOUDLYST_BENCH_SQLITE set");
+    }
+    QFETCH(int, count);
+
+    const qint64 parentId = m_dirIds.value(count);
+    QBENCHMARK {
+        QEventLoop loop;
+        FilesSqlAsync::children(parentId, m_userId, &loop, [&loop] (const std::vector<FileItem> &, const QString &) {
+            loop.quit();
+        });
+        loop.exec();
+    }
+}
+
+void BenchWebdav::sqlFilesPut_data()
+{
+    QTest::addColumn<int>("count");
+    QTest::addColumn<bool>("bulk");
+    for (int count : { 100, 1000 }) {
+        QTest::newRow(qPrintable(QStringLiteral("put-%1").arg(count))) << count << false;
+        QTest::newRow(qPrintable(QStringLiteral("bulk-%1").arg(count))) << count << true;
+    }
+}
+
+void BenchWebdav::sqlFilesPut()
+{
+    if (!m_hasDb) {
+        QSKIP("Neither CLOUDLYST_BENCH_DB nor CLOUDLYST_BENCH_SQLITE set");
+    }
+    QFETCH(int, count);
+    QFETCH(bool, bulk);
+
+    // The same small file under many names in a directory two levels
+    // down, as a sync of a fresh folder would upload them
+    QTemporaryFile file;
+    QVERIFY(file.open());
+    file.write("small file");
+    file.close();
+    const QFileInfo info(file.fileName());
+
+    std::vector<FilePut> puts;
+    for (int i = 0; i < count; ++i) {
+        FilePut put;
+        put.path = QStringLiteral("files/d10/upload%1").arg(i);
+        put.parentPath = QStringLiteral("files/d10");
+        put.name = QStringLiteral("upload%1").arg(i);
+        put.mimetype = QStringLiteral("text/plain");
+        put.etag = QStringLiteral("etag%1").arg(i);
+        put.mtime = 1546300800;
+        put.storageMtime = 1546300800;
+        put.size = info.size();
+        puts.push_back(put);
+    }
+
+    QString error;
+    QBENCHMARK {
+        QEventLoop loop;
+        if (bulk) {
+            FilesSqlAsync::putBulk(puts, m_userId, &loop, [&loop, &error] (const QHash<QString, qint64> &, const QString &putError) {
+                error = putError;
+                loop.quit();
+            });
+        } else {
+            // What as many PUTs send, pipelined on one connection
+            int pending = count;
+            for (const FilePut &put : puts) {
+                FilesSqlAsync::upsert(put.path, info, put.mtime, put.etag, m_userId, &loop, [&loop, &pending, &error] (int, const QString &putError) {
+                    if (!putError.isEmpty()) {
+                        error = putError;
+                    }
+                    if (--pending == 0) {
+                        loop.quit();
+                    }
+                });
+            }
+        }
+        loop.exec();
+    }
+    QVERIFY2(error.isEmpty(), qPrintable(error));
+}
+
+void BenchWebdav::writePropFindDeadProperties_data()
+{
+    QTest::addColumn<int>("count");
+    QTest::addColumn<bool>("jsonb");
+    for (int count : { 10, 100, 1000 }) {
+        QTest::newRow(qPrintable(QStringLiteral("rows-%1").arg(count))) << count << false;
+        QTest::newRow(qPrintable(QStringLiteral("jsonb-%1").arg(count))) << count << true;
+    }
+}
+
+void BenchWebdav::writePropFindDeadProperties()
+{
+    if (!m_hasDb) {
+        QSKIP("Neither CLOUDLYST_BENCH_DB nor CLOUDLYST_BENCH_SQLITE set");
+    }
+    QFETCH(int, count);
+    QFETCH(bool, jsonb);
+    if (jsonb && m_sqlite) {
+        QSKIP("The jsonb layout needs PostgreSQL");
+    }
+
+    GetProperties props = desktopClientProps();
+    props.push_back({ QStringLiteral("favorite"), QStringLiteral("http://owncloud.org/ns") });
+    props.push_back({ QStringLiteral("author"), QStringLiteral("http://example.com/ns") });
+
+    QBuffer buffer;
+    buffer.open(QIODevice::WriteOnly);
+    const QString baseUri = QStringLiteral("/remote.php/dav/files/bench/");
+    const qint64 parentId = m_dirIds.value(count);
+
+    // A Depth 1 listing as PROPFIND does it: rows needs the children plus
+    // a properties query, jsonb gets the properties along with the children
+    FilesSqlAsync::setInlineProperties(jsonb);
+    std::vector<FileItem> files;
+    QBENCHMARK {
+        PathPropertyHash deadProps;
+        QEventLoop loop;
+        int pending = jsonb ? 1 : 2;
+        auto done = [&loop, &pending] {
+            if (--pending == 0) {
+                loop.quit();
+            }
+        };
+        FilesSqlAsync::children(parentId, m_userId, &loop, [&files, &done] (const std::vector<FileItem> &items, const QString &) {
+            files = items;
+            done();
+        });
+        if (!jsonb) {
+            FilesSqlAsync::childProperties(parentId, m_userId, &loop, [&deadProps, &done] (const PathPropertyHash &properties, const QString &) {
+                deadProps = properties;
+                done();
+            });
+        }
+        loop.exec();
+
+        buffer.seek(0);
+        QXmlStreamWriter stream(&buffer);
+        for (const FileItem &file : files) {
+            m_webdav->writePropFindResponseItem(file, stream, baseUri, props, jsonb ? file.properties : deadProps.value(file.id));
+        }
+    }
+    FilesSqlAsync::setInlineProperties(false);
+    QCOMPARE(int(files.size()), count);
+}
+
+void BenchWebdav::ioPolicyCache_data()
+{
+    QTest::addColumn<bool>("policy");
+    QTest::newRow("plain") << false;
+    QTest::newRow("policy") << true;
+}
+
+void BenchWebdav::ioPolicyCache()
+{
+    QFETCH(bool, policy);
+
+    const qint64 MiB = 1024 * 1024;
+    const int streamMiB = qEnvironmentVariableIntValue("CLOUDLYST_BENCH_IO_MB");
+    const qint64 streamSize = (streamMiB > 0 ? streamMiB : 1024) * MiB;
+    if (policy) {
+        IoPolicy::setup(MiB, 64 * MiB, 8 * MiB);
+    } else {
+        IoPolicy::setup(0, 0, 0);
+    }
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    // The hot set, small files read all the time while big ones stream by
+    const int hotFiles = 256;
+    const QByteArray hotData(256 * 1024, 'h');
+    QStringList hot;
+    for (int i = 0; i < hotFiles; ++i) {
+        QFile file(dir.path() + QLatin1String("/hot-") + QString::number(i));
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        file.write(hotData);
+        hot.append(file.fileName());
+    }
+
+    qint64 hits = 0;
+    qint64 accesses = 0;
+    int next = 0;
+    auto readHot = [&] {
+        QFile file(hot.at(next++ % hotFiles));
+        qint64 pages;
+        hits += residentPages(file.fileName(), pages);
+        accesses += pages;
+        file.open(QIODevice::ReadOnly);
+        file.readAll();
+    };
+    for (int i = 0; i < hotFiles; ++i) {
+        readHot();
+    }
+    hits = accesses = 0;
+
+    const QString bigName = dir.path() + QLatin1String("/big");
+    QBENCHMARK_ONCE {
+        // An upload, then its download, a hot file read after every MiB
+        const QByteArray block(64 * 1024, 's');
+        QFile big(bigName);
+        QVERIFY(big.open(QIODevice::WriteOnly));
+        IoPolicy::preallocate(&big, streamSize);
+        IoPolicy write(&big, streamSize, IoPolicy::Write);
+        for (qint64 done = 0; done < streamSize;) {
+            QCOMPARE(big.write(block), qint64(block.size()));
+            done += block.size();
+            write.advance(done);
+            if (done % MiB == 0) {
+                readHot();
+            }
+        }
+        big.close();
+
+        SequentialFile in(bigName);
+        QVERIFY(in.open(QIODevice::ReadOnly));
+        char buffer[64 * 1024];
+        qint64 done = 0;
+        qint64 len;
+        while ((len = in.read(buffer, sizeof(buffer))) > 0) {
+            done += len;
+            if (done % MiB == 0) {
+                readHot();
+            }
+        }
+    }
+
+    qint64 streamPages;
+    const qint64 streamResident = residentPages(bigName, streamPages);
+    qInfo("hot set hit ratio %.1f%%, %.1f%% of the stream left in the page cache",
+          accesses ? 100.0 * hits / accesses : 0.0, streamPages ? 100.0 * streamResident / streamPages : 0.0);
+
+    IoPolicy::setup(MiB, 64 * MiB, 8 * MiB);
+}
+
+qint64 BenchWebdav::residentPages(const QString &fileName, qint64 &pages)
+{
+    pages = 0;
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly) || !file.size()) {
+        return 0;
+    }
+
+    const size_t size = size_t(file.size());
+    const long pageSize = sysconf(_SC_PAGESIZE);
+    pages = qint64((size + size_t(pageSize) - 1) / size_t(pageSize));
+
+    void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, file.handle(), 0);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    std::vector<unsigned char> resident(static_cast<size_t>(pages));
+    qint64 ret = 0;
+    if (mincore(map, size, resident.data()) == 0) {
+        for (unsigned char page : resident) {
+            ret += page & 1;
+        }
+    }
+    munmap(map, size);
+    return ret;
+}
+
+void BenchWebdav::setupDatabase()
+{
+    if (qEnvironmentVariableIsSet("CLOUDLYST_BENCH_SQLITE")) {
+        setupSqliteDatabase();
+        return;
+    }
+
+    const QString dbName = QString::fromLocal8Bit(qgetenv("CLOUDLYST_BENCH_DB"));
+    if (dbName.isEmpty()) {
+        return;
+    }
+
+    QSqlDatabase db = QSqlDatabase::addDatabase(QStringLiteral("QPSQL"), Sql::databaseNameThread(QStringLiteral("cloudlyst")));
+    db.setDatabaseName(dbName);
+    AsyncPgConnection::setConnInfo(QLatin1String("dbname=") + dbName);
+    QVERIFY2(db.open(), qPrintable(db.lastError().databaseText()));
+
+    QSqlQuery query(db);
+    QVERIFY(query.exec(QStringLiteral("DROP SCHEMA IF EXISTS cloudlyst CASCADE")));
+    QVERIFY(query.exec(QStringLiteral("CREATE SCHEMA cloudlyst")));
+    QVERIFY(Cloudlyst::createDB());
+
+    QFile procedures(QStringLiteral(CLOUDLYST_PROCEDURES));
+    QVERIFY(procedures.open(QIODevice::ReadOnly));
+    QVERIFY2(query.exec(QString::fromUtf8(procedures.readAll())), qPrintable(query.lastError().databaseText()));
+
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO cloudlyst.users (username, password) VALUES ('bench', 'bench') RETURNING id")));
+    QVERIFY(query.next());
+    m_userId = query.value(0);
+
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO cloudlyst.mimetypes (name) VALUES ('httpd/unix-directory'), ('text/plain')")));
+
+    // Bulk load without the parent etag triggers, they're irrelevant here
+    QVERIFY(query.exec(QStringLiteral("ALTER TABLE cloudlyst.files DISABLE TRIGGER USER")));
+
+    QVERIFY(query.prepare(QStringLiteral("INSERT INTO cloudlyst.files "
+                                         "(path, name, mtime, storage_mtime, mimetype_id, size, etag, owner_id, parent_id) "
+                                         "SELECT :path, :name, 1546300800, 1546300800, m.id, 0, 'dir', :owner_id, "
+                                         "(SELECT id FROM cloudlyst.files WHERE path = 'files') "
+                                         "FROM cloudlyst.mimetypes m WHERE m.name = 'httpd/unix-directory' "
+                                         "RETURNING id")));
+    query.bindValue(QStringLiteral(":path"), QStringLiteral("files"));
+    query.bindValue(QStringLiteral(":name"), QStringLiteral("files"));
+    query.bindValue(QStringLiteral(":owner_id"), m_userId);
+    QVERIFY2(query.exec(), qPrintable(query.lastError().databaseText()));
+
+    for (int count : benchSizes) {
+        const QString dir = QLatin1String("d") + QString::number(count);
+        query.bindValue(QStringLiteral(":path"), QLatin1String("files/") + dir);
+        query.bindValue(QStringLiteral(":name"), dir);
+        query.bindValue(QStringLiteral(":owner_id"), m_userId);
+        QVERIFY2(query.exec() && query.next(), qPrintable(query.lastError().databaseText()));
+        m_dirIds.insert(count, query.value(0).toLongLong());
+    }
+
+    QSqlQuery children(db);
+    QVERIFY(children.prepare(QStringLiteral("INSERT INTO cloudlyst.files "
+                                            "(path, name, mtime, storage_mtime, mimetype_id, size, etag, owner_id, parent_id) "
+                                            "SELECT p.path || '/f' || i, 'f' || i, 1546300800, 1546300800, m.id, i, md5(i::text), p.owner_id, p.id "
+                                            "FROM cloudlyst.files p, cloudlyst.mimetypes m, generate_series(1, :count) i "
+                                            "WHERE p.id = :parent_id AND m.name = 'text/plain'")));
+    for (auto it = m_dirIds.constBegin(); it != m_dirIds.constEnd(); ++it) {
+        children.bindValue(QStringLiteral(":count"), it.key());
+        children.bindValue(QStringLiteral(":parent_id"), it.value());
+        QVERIFY2(children.exec(), qPrintable(children.lastError().databaseText()));
+    }
+
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO cloudlyst.file_properties (file_id, name, value) "
+                                      "SELECT f.id, p.name, 'value' FROM cloudlyst.files f, "
+                                      "(VALUES ('{http://owncloud.org/ns}favorite'), ('{http://example.com/ns}author'), "
+                                      "('{urn:schemas-microsoft-com:}Win32FileAttributes')) AS p(name) "
+                                      "WHERE f.path LIKE 'files/d%/f%'")));
+    // The same properties in the jsonb layout, as cloudlyst-migrate-props does
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO cloudlyst.file_props (file_id, props) "
+                                      "SELECT file_id, jsonb_object_agg(name, value) "
+                                      "FROM cloudlyst.file_properties GROUP BY file_id")));
+    QVERIFY(query.exec(QStringLiteral("ALTER TABLE cloudlyst.files ENABLE TRIGGER USER")));
+    QVERIFY(query.exec(QStringLiteral("ANALYZE")));
+
+    m_hasDb = true;
+}
+
+void BenchWebdav::setupSqliteDatabase()
+{
+    QVERIFY(m_sqliteDir.isValid());
+    Cloudlyst::setSqliteDatabase(m_sqliteDir.filePath(QStringLiteral("bench.sqlite")));
+    QVERIFY(Cloudlyst::openDatabase());
+    QVERIFY(Cloudlyst::createDB());
+    m_sqlite = true;
+
+    QSqlDatabase db = Sql::databaseThread(QStringLiteral("cloudlyst"));
+    QSqlQuery query(db);
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO cloudlyst.users (username, password) VALUES ('bench', 'bench')")));
+    m_userId = query.lastInsertId();
+
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO cloudlyst.mimetypes (name) VALUES ('httpd/unix-directory'), ('text/plain')")));
+
+    // A single transaction, the parent etag triggers stay on
+    QVERIFY(db.transaction());
+
+    QVERIFY(query.prepare(QStringLiteral("INSERT INTO cloudlyst.files "
+                                         "(path, name, mtime, storage_mtime, mimetype_id, size, etag, owner_id, parent_id) "
+                                         "SELECT :path, :name, 1546300800, 1546300800, m.id, 0, 'dir', :owner_id, "
+                                         "(SELECT id FROM cloudlyst.files WHERE path = 'files') "
+                                         "FROM cloudlyst.mimetypes m WHERE m.name = 'httpd/unix-directory'")));
+    query.bindValue(QStringLiteral(":path"), QStringLiteral("files"));
+    query.bindValue(QStringLiteral(":name"), QStringLiteral("files"));
+    query.bindValue(QStringLiteral(":owner_id"), m_userId);
+    QVERIFY2(query.exec(), qPrintable(query.lastError().databaseText()));
+
+    for (int count : benchSizes) {
+        const QString dir = QLatin1String("d") + QString::number(count);
+        query.bindValue(QStringLiteral(":path"), QLatin1String("files/") + dir);
+        query.bindValue(QStringLiteral(":name"), dir);
+        query.bindValue(QStringLiteral(":owner_id"), m_userId);
+        QVERIFY2(query.exec(), qPrintable(query.lastError().databaseText()));
+        m_dirIds.insert(count, query.lastInsertId().toLongLong());
+    }
+
+    QSqlQuery children(db);
+    QVERIFY(children.prepare(QStringLiteral("WITH RECURSIVE s(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM s WHERE i < :count) "
+                                            "INSERT INTO cloudlyst.files "
+                                            "(path, name, mtime, storage_mtime, mimetype_id, size, etag, owner_id, parent_id) "
+                                            "SELECT p.path || '/f' || i, 'f' || i, 1546300800, 1546300800, m.id, i, printf('%032x', i), p.owner_id, p.id "
+                                            "FROM cloudlyst.files p, cloudlyst.mimetypes m, s "
+                                            "WHERE p.id = :parent_id AND m.name = 'text/plain'")));
+    for (auto it = m_dirIds.constBegin(); it != m_dirIds.constEnd(); ++it) {
+        children.bindValue(QStringLiteral(":count"), it.key());
+        children.bindValue(QStringLiteral(":parent_id"), it.value());
+        QVERIFY2(children.exec(), qPrintable(children.lastError().databaseText()));
+    }
+
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO cloudlyst.file_properties (file_id, name, value) "
+                                      "SELECT f.id, p.column1, 'value' FROM cloudlyst.files f, "
+                                      "(VALUES ('{http://owncloud.org/ns}favorite'), ('{http://example.com/ns}author'), "
+                                      "('{urn:schemas-microsoft-com:}Win32FileAttributes')) AS p "
+                                      "WHERE f.path LIKE 'files/d%/f%'")));
+    QVERIFY(db.commit());
+    QVERIFY(query.exec(QStringLiteral("ANALYZE cloudlyst")));
+
+    m_hasDb = true;
+}
+
+std::vector<FileItem> BenchWebdav::fileItems(int count)
+{
+    std::vector<FileItem> files;
+    files.reserve(size_t(count));
+    for (int i = 0; i < count; ++i) {
+        FileItem file;
+        file.id = i + 1;
+        file.name = QLatin1String("IMG_") + QString::number(i) + QLatin1String(".jpg");
+        file.path = QLatin1String("files/Photos/") + file.name;
+        file.etag = QString::fromLatin1(QCryptographicHash::hash(QByteArray::number(i), QCryptographicHash::Md5).toHex());
+        file.mimetype = (i % 10) ? QStringLiteral("image/jpeg") : QStringLiteral("httpd/unix-directory");
+        file.mtime = 1546300800 + i;
+        file.size = 1024 * i;
+        files.push_back(file);
+    }
+    return files;
+}
+
+GetProperties BenchWebdav::desktopClientProps()
+{
+    GetProperties props;
+    QString error;
+    m_webdav->parsePropFindData(readData(QStringLiteral("propfind-nextcloud-desktop.xml")), props, error);
+    return props;
+}
+
+QByteArray BenchWebdav::readData(const QString &name)
+{
+    QFile file(QStringLiteral(BENCH_DATA_DIR "/") + name);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qFatal("Failed to open %s", qPrintable(file.fileName()));
+    }
+    return file.readAll();
+}
+
+QTEST_GUILESS_MAIN(BenchWebdav)
+
+#include "benchwebdav.moc"
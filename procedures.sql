@@ -11,6 +11,11 @@ CREATE OR REPLACE FUNCTION cloudlyst_files_update_parent_etag() RETURNS trigger
 DECLARE
     v_size_diff bigint;
 BEGIN
+    -- cloudlyst_put_bulk() updates the parents once for all of its rows
+    IF current_setting('cloudlyst.bulk_put', true) = 'on' THEN
+        RETURN NEW;
+    END IF;
+
     IF TG_OP = 'UPDATE' THEN
         IF NEW.parent_id != OLD.parent_id THEN
             UPDATE cloudlyst.files SET size = size - OLD.size, mtime = extract(epoch from now()), etag = to_hex(mtime)||to_hex(id) WHERE id = OLD.parent_id;
@@ -79,6 +84,44 @@ BEGIN
 END;
 $$ LANGUAGE plpgsql;
 
+CREATE OR REPLACE FUNCTION cloudlyst_put_bulk(v_paths varchar[], v_names varchar[], v_parent_paths varchar[], v_mtimes integer[], v_storage_mtimes integer[], v_mimetypes varchar[], v_sizes bigint[], v_etags varchar[], v_owner_id integer) RETURNS TABLE(file_id bigint, file_path varchar) AS $$
+DECLARE
+    v_now integer := extract(epoch from now());
+BEGIN
+    -- The parent trigger would update every ancestor once per row, with
+    -- it off each ancestor is updated once with the sum of the changes
+    PERFORM set_config('cloudlyst.bulk_put', 'on', true);
+
+    INSERT INTO cloudlyst.mimetypes (name) SELECT DISTINCT unnest(v_mimetypes) ON CONFLICT (name) DO NOTHING;
+
+    RETURN QUERY
+    WITH RECURSIVE input AS (
+        SELECT * FROM unnest(v_paths, v_names, v_parent_paths, v_mtimes, v_storage_mtimes, v_mimetypes, v_sizes, v_etags)
+            AS t(path, name, parent_path, mtime, storage_mtime, mimetype, size, etag)
+    ), previous AS (
+        SELECT f.path, f.size FROM cloudlyst.files f INNER JOIN input i ON i.path = f.path WHERE f.owner_id = v_owner_id
+    ), put AS (
+        INSERT INTO cloudlyst.files (path, name, mtime, storage_mtime, mimetype_id, size, etag, owner_id, parent_id)
+            SELECT i.path, i.name, i.mtime, i.storage_mtime, m.id, i.size, i.etag, v_owner_id, p.id
+            FROM input i
+            INNER JOIN cloudlyst.mimetypes m ON m.name = i.mimetype
+            INNER JOIN cloudlyst.files p ON p.path = CASE WHEN i.parent_path <> '' THEN i.parent_path ELSE 'files' END AND p.owner_id = v_owner_id
+        ON CONFLICT ON CONSTRAINT files_path_owner_id_key DO UPDATE SET mtime = EXCLUDED.mtime, storage_mtime = EXCLUDED.storage_mtime, mimetype_id = EXCLUDED.mimetype_id, size = EXCLUDED.size, etag = EXCLUDED.etag
+        RETURNING id, path, parent_id, size
+    ), ancestors(id, size_diff) AS (
+        SELECT put.parent_id, put.size - coalesce(previous.size, 0) FROM put LEFT JOIN previous ON previous.path = put.path
+      UNION ALL
+        SELECT f.parent_id, a.size_diff FROM ancestors a INNER JOIN cloudlyst.files f ON f.id = a.id WHERE f.parent_id IS NOT NULL
+    ), touched AS (
+        UPDATE cloudlyst.files f SET size = f.size + a.size_diff, mtime = v_now, etag = to_hex(v_now)||to_hex(f.id)
+            FROM (SELECT id, sum(size_diff) AS size_diff FROM ancestors GROUP BY id) a WHERE f.id = a.id
+    )
+    SELECT put.id, put.path FROM put;
+
+    PERFORM set_config('cloudlyst.bulk_put', 'off', true);
+END;
+$$ LANGUAGE plpgsql;
+
 CREATE OR REPLACE FUNCTION cloudlyst_copy(v_path varchar, v_dest_parent_path varchar, v_dest_path varchar, v_dest_name varchar, v_owner_id integer) RETURNS bigint AS $$
 DECLARE
     v_parent_id bigint;
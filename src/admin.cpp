@@ -0,0 +1,179 @@
+#include "admin.h"
+
+#include "cloudlyst.h"
+#include "filesscanner.h"
+#include "metrics.h"
+#include "sqlquery.h"
+
+#include <Cutelyst/Plugins/Authentication/authentication.h>
+#include <Cutelyst/Plugins/Utils/Sql>
+#include <Cutelyst/Application>
+
+#include <QSqlQuery>
+#include <QSqlError>
+
+#include <QJsonObject>
+#include <QStandardPaths>
+#include <QMutex>
+#include <QThread>
+
+#include <QLoggingCategory>
+
+Q_LOGGING_CATEGORY(CLOUDLYST_ADMIN, "cloudlyst.admin", QtWarningMsg)
+
+using namespace Cutelyst;
+
+namespace {
+
+struct ScanStatus
+{
+    bool running = false;
+    bool ok = false;
+    QString report;
+};
+
+QMutex scansMutex;
+QHash<QString, ScanStatus> scans;
+
+class ScanJob : public QThread
+{
+public:
+    ScanJob(const QString &username, const QString &userDir, const QVariant &userId,
+            int threads, int batchSize, qint64 rateLimit)
+        : m_username(username), m_userDir(userDir), m_userId(userId)
+        , m_threads(threads), m_batchSize(batchSize), m_rateLimit(rateLimit)
+    {
+        connect(this, &QThread::finished, this, &QObject::deleteLater);
+    }
+
+protected:
+    void run() override
+    {
+        ScanStatus status;
+        if (Cloudlyst::openDatabase()) {
+            FilesScanner scanner;
+            if (m_threads > 0) {
+                scanner.setThreads(m_threads);
+            }
+            scanner.setBatchSize(m_batchSize);
+            scanner.setRateLimit(m_rateLimit);
+
+            status.ok = scanner.scan(m_userDir, m_userId);
+            status.report = status.ok ? scanner.report() : scanner.errorString() + QLatin1String("; ") + scanner.report();
+            Cloudlyst::closeDatabase();
+        } else {
+            status.report = QStringLiteral("Failed to open database");
+        }
+
+        QMutexLocker locker(&scansMutex);
+        scans[m_username] = status;
+    }
+
+private:
+    QString m_username;
+    QString m_userDir;
+    QVariant m_userId;
+    int m_threads;
+    int m_batchSize;
+    qint64 m_rateLimit;
+};
+
+}
+
+Admin::Admin(QObject *parent) : Controller(parent)
+{
+}
+
+Admin::~Admin()
+{
+}
+
+bool Admin::Auto(Context *c)
+{
+    if (!Authentication::userExists(c) && !Authentication::authenticate(c, QStringLiteral("Cloudlyst"))) {
+        return false;
+    }
+
+    const QString username = Authentication::user(c).value(QStringLiteral("username")).toString();
+    if (!m_adminUsers.contains(username)) {
+        qCWarning(CLOUDLYST_ADMIN) << "Denied admin access to" << username;
+        c->response()->setStatus(Response::Forbidden);
+        return false;
+    }
+
+    return true;
+}
+
+void Admin::scan(Context *c, const QString &username)
+{
+    Response *res = c->response();
+
+    if (c->request()->isPost()) {
+        SqlQuery query(SqlQuery::UserIdByName);
+        query.bindValue(QStringLiteral(":username"), username);
+        if (!query.exec() || !query.next()) {
+            res->setStatus(Response::NotFound);
+            res->setJsonObjectBody({
+                                       {QStringLiteral("error"), QStringLiteral("User not found")},
+                                   });
+            return;
+        }
+        const QVariant userId = query.value(0);
+
+        QMutexLocker locker(&scansMutex);
+        ScanStatus &status = scans[username];
+        if (status.running) {
+            res->setStatus(Response::Conflict);
+            res->setJsonObjectBody({
+                                       {QStringLiteral("error"), QStringLiteral("Scan already running")},
+                                   });
+            return;
+        }
+        status.running = true;
+        locker.unlock();
+
+        auto job = new ScanJob(username, m_baseDir + username, userId, m_scanThreads, m_scanBatchSize, m_scanRateLimit);
+        job->start(QThread::LowPriority);
+
+        res->setStatus(Response::Accepted);
+        res->setJsonObjectBody({
+                                   {QStringLiteral("status"), QStringLiteral("started")},
+                               });
+        return;
+    }
+
+    QMutexLocker locker(&scansMutex);
+    auto it = scans.constFind(username);
+    if (it == scans.constEnd()) {
+        res->setStatus(Response::NotFound);
+        return;
+    }
+
+    res->setJsonObjectBody({
+                               {QStringLiteral("running"), it->running},
+                               {QStringLiteral("ok"), it->ok},
+                               {QStringLiteral("report"), it->report},
+                           });
+}
+
+void Admin::sql(Context *c)
+{
+    c->response()->setJsonObjectBody({
+                                          {QStringLiteral("statements"), Metrics::statementStats()},
+                                      });
+}
+
+bool Admin::preFork(Application *app)
+{
+    m_baseDir = app->config(QStringLiteral("DataDir"), QStandardPaths::writableLocation(QStandardPaths::DataLocation)).toString();
+    if (!m_baseDir.endsWith(QLatin1Char('/'))) {
+        m_baseDir.append(QLatin1Char('/'));
+    }
+
+    m_adminUsers = app->config(QStringLiteral("AdminUsers")).toStringList();
+    m_scanThreads = app->config(QStringLiteral("ScanThreads"), 0).toInt();
+    m_scanBatchSize = app->config(QStringLiteral("ScanBatchSize"), 500).toInt();
+    // MiB/s read from disk while hashing, 0 means unlimited
+    m_scanRateLimit = app->config(QStringLiteral("ScanRateLimit"), 0).toLongLong() * 1024 * 1024;
+    return true;
+}
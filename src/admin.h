@@ -0,0 +1,37 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <Cutelyst/Controller>
+
+using namespace Cutelyst;
+
+class Admin : public Controller
+{
+    Q_OBJECT
+    C_NAMESPACE("admin")
+public:
+    explicit Admin(QObject *parent = nullptr);
+    ~Admin();
+
+    C_ATTR(Auto, :Private)
+    bool Auto(Context *c);
+
+    // POST starts a reconcile of the user's data dir, GET shows the last report
+    C_ATTR(scan, :Local :AutoArgs)
+    void scan(Context *c, const QString &username);
+
+    // Execution statistics of the registered SQL statements, all workers
+    C_ATTR(sql, :Local :AutoArgs)
+    void sql(Context *c);
+
+    virtual bool preFork(Application *app) override final;
+
+private:
+    QStringList m_adminUsers;
+    QString m_baseDir;
+    int m_scanThreads = 0;
+    int m_scanBatchSize = 500;
+    qint64 m_scanRateLimit = 0;
+};
+
+#endif // ADMIN_H
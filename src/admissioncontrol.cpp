@@ -0,0 +1,488 @@
+#include "admissioncontrol.h"
+
+#include "metrics.h"
+
+#include <Cutelyst/Application>
+#include <Cutelyst/Context>
+#include <Cutelyst/Request>
+#include <Cutelyst/Response>
+
+#include <QHash>
+#include <QMutex>
+#include <QPointer>
+#include <QTimer>
+
+#include <QLoggingCategory>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+Q_LOGGING_CATEGORY(CLOUDLYST_ADMISSION, "cloudlyst.admission", QtWarningMsg)
+
+namespace {
+
+const int UserSlots = 4096;
+const int UserProbe = 8;
+const int MaxWorkers = 256;
+
+// Queues are polled this often for slots freed by other workers
+const int PollMsecs = 10;
+
+// Fair queueing weights, an expensive request costs as much as this many cheap ones
+const double CheapCost = 1;
+const double ExpensiveCost = 4;
+
+// Requests in flight of a user that started or finished none for this long
+// were lost with a crashed worker
+const qint64 StaleUsecs = Q_INT64_C(10) * 60 * 1000 * 1000;
+
+struct User {
+    std::atomic<qint64> user;
+    std::atomic<int> active;
+    // The token bucket as a theoretical arrival time (GCRA), full once
+    // it is in the past
+    std::atomic<qint64> tat;
+    std::atomic<qint64> touched;
+};
+
+// Per process, so a respawned worker takes over what a crashed one held
+struct Worker {
+    std::atomic<qint64> pid;
+    std::atomic<int> expensive;
+    std::atomic<int> queued;
+};
+
+struct Shared {
+    std::atomic<int> nextWorker;
+    Worker workers[MaxWorkers];
+    User users[UserSlots];
+};
+
+struct Held {
+    User *user;
+    bool expensive;
+};
+
+struct Waiter {
+    QPointer<Context> c;
+    QString action;
+    qint64 user;
+    qint64 deadline;
+    double finish;
+    bool expensive;
+};
+
+struct Scheduler {
+    // Ordered by finish tag
+    std::deque<Waiter> waiters;
+    QHash<qint64, double> lastFinish;
+    double virtualTime = 0;
+    std::unique_ptr<QTimer> timer;
+    bool pumping = false;
+};
+
+Shared *shared = nullptr;
+std::atomic<Worker *> currentWorker(nullptr);
+qint64 currentWorkerPid = 0;
+QMutex workerMutex;
+
+int userConcurrency = 16;
+qint64 userIntervalUsecs = 0;
+qint64 userBurstUsecs = 0;
+int expensiveSlots = 64;
+int queueDepth = 1024;
+qint64 queueTimeoutUsecs = Q_INT64_C(10000) * 1000;
+int retryAfter = 1;
+
+thread_local Scheduler scheduler;
+thread_local QHash<Context *, Held> held;
+
+// Monotonic clock, the same one in every process
+inline qint64 now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline int slotIndex(qint64 user, int probe)
+{
+    return int((quint64(user) * Q_UINT64_C(0x9E3779B97F4A7C15) >> 32) + quint64(probe)) & (UserSlots - 1);
+}
+
+bool alive(qint64 pid)
+{
+    return pid > 0 && (kill(pid_t(pid), 0) == 0 || errno == EPERM);
+}
+
+bool idle(const User &user, qint64 t)
+{
+    return user.tat.load() <= t && (user.active.load() <= 0 || t - user.touched.load() > StaleUsecs);
+}
+
+User *claimUser(qint64 user, qint64 t)
+{
+    for (int i = 0; i < UserProbe; ++i) {
+        User &slot = shared->users[slotIndex(user, i)];
+        if (slot.user.load() == user) {
+            return &slot;
+        }
+    }
+
+    for (int i = 0; i < UserProbe; ++i) {
+        User &slot = shared->users[slotIndex(user, i)];
+        qint64 current = slot.user.load();
+        if ((current == 0 || idle(slot, t)) && slot.user.compare_exchange_strong(current, user)) {
+            slot.active.store(0);
+            slot.tat.store(0);
+            slot.touched.store(t);
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+// Takes a token, or returns how many usecs until there is one
+qint64 takeToken(User &user, qint64 t)
+{
+    if (!userIntervalUsecs) {
+        return 0;
+    }
+
+    qint64 tat = user.tat.load();
+    for (;;) {
+        const qint64 next = qMax(tat, t) + userIntervalUsecs;
+        if (next - t > userBurstUsecs) {
+            return next - t - userBurstUsecs;
+        }
+        if (user.tat.compare_exchange_weak(tat, next)) {
+            return 0;
+        }
+    }
+}
+
+template <typename Get>
+int sumWorkers(Get get)
+{
+    const int workers = qMin(shared->nextWorker.load(), MaxWorkers);
+    int total = 0;
+    for (int i = 0; i < workers; ++i) {
+        total += get(shared->workers[i]).load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+bool isExpensive(Context *c)
+{
+    Request *req = c->request();
+    const QString method = req->method();
+    if (method == QLatin1String("PROPFIND")) {
+        const QString depth = req->header(QStringLiteral("DEPTH"));
+        return depth == QLatin1String("1") || depth == QLatin1String("infinity");
+    }
+    if (method == QLatin1String("GET")) {
+        return req->queryParam(QStringLiteral("download")) == QLatin1String("zip");
+    }
+    if (method == QLatin1String("POST")) {
+        // Bulk uploads, creating a resumable upload is cheap
+        return req->header(QStringLiteral("CONTENT_TYPE")).startsWith(QLatin1String("multipart/"), Qt::CaseInsensitive);
+    }
+    return method == QLatin1String("COPY") || method == QLatin1String("MOVE");
+}
+
+void release(Context *c);
+
+// Limits are raised first and checked after, racing workers can only
+// turn each other down
+bool acquire(Context *c, User *user, bool expensive, qint64 t)
+{
+    Worker *worker = currentWorker.load(std::memory_order_relaxed);
+
+    if (user) {
+        int active = user->active.load();
+        if (active > 0 && t - user->touched.load() > StaleUsecs) {
+            user->active.compare_exchange_strong(active, 0);
+        }
+        const int before = user->active.fetch_add(1);
+        if (userConcurrency && before >= userConcurrency) {
+            user->active.fetch_sub(1);
+            return false;
+        }
+    }
+
+    if (expensive && expensiveSlots && worker) {
+        worker->expensive.fetch_add(1);
+        if (sumWorkers([] (Worker &w) -> std::atomic<int> & { return w.expensive; }) > expensiveSlots) {
+            worker->expensive.fetch_sub(1);
+            if (user) {
+                user->active.fetch_sub(1);
+            }
+            return false;
+        }
+    }
+
+    if (user) {
+        user->touched.store(t);
+    }
+    held.insert(c, { user, expensive && expensiveSlots && worker });
+
+    // Requests that are dropped without finishing release on destruction
+    QObject::connect(c, &QObject::destroyed, [c] {
+        release(c);
+    });
+    return true;
+}
+
+void reject(Context *c, quint16 status, qint64 retrySecs)
+{
+    Response *res = c->response();
+    res->headers().setHeader(QStringLiteral("RETRY_AFTER"), QString::number(qMax(Q_INT64_C(1), retrySecs)));
+    res->setStatus(status);
+}
+
+void pump();
+
+void schedule()
+{
+    Scheduler &s = scheduler;
+    if (!s.timer) {
+        s.timer.reset(new QTimer);
+        s.timer->setInterval(PollMsecs);
+        QObject::connect(s.timer.get(), &QTimer::timeout, pump);
+    }
+    if (!s.timer->isActive()) {
+        s.timer->start();
+    }
+}
+
+void pump()
+{
+    Scheduler &s = scheduler;
+    if (s.pumping) {
+        return;
+    }
+    s.pumping = true;
+
+    Worker *worker = currentWorker.load(std::memory_order_relaxed);
+    const qint64 t = now();
+
+    // Anything resumed or rejected may finish and change the queue, the
+    // walk starts over after each of them
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (auto it = s.waiters.begin(); it != s.waiters.end(); ++it) {
+            if (it->c && it->deadline > t) {
+                User *user = claimUser(it->user, t);
+                if (!acquire(it->c.data(), user, it->expensive, t)) {
+                    continue;
+                }
+            }
+
+            const Waiter waiter = *it;
+            s.waiters.erase(it);
+            if (worker) {
+                worker->queued.fetch_sub(1);
+            }
+
+            Context *c = waiter.c.data();
+            if (c && waiter.deadline <= t) {
+                qCDebug(CLOUDLYST_ADMISSION) << "Timed out in the queue" << waiter.user << waiter.action;
+                Metrics::recordAdmission(Metrics::AdmissionTimedOut);
+                reject(c, Response::ServiceUnavailable, retryAfter);
+                c->attachAsync();
+            } else if (c) {
+                s.virtualTime = qMax(s.virtualTime, waiter.finish);
+                Metrics::recordAdmission(Metrics::AdmissionAdmitted);
+                c->forward(waiter.action);
+                c->attachAsync();
+            }
+            progress = true;
+            break;
+        }
+    }
+
+    if (s.waiters.empty()) {
+        s.lastFinish.clear();
+        if (s.timer) {
+            s.timer->stop();
+        }
+    } else {
+        schedule();
+    }
+
+    s.pumping = false;
+}
+
+void release(Context *c)
+{
+    auto it = held.find(c);
+    if (it == held.end()) {
+        return;
+    }
+    const Held h = it.value();
+    held.erase(it);
+
+    if (h.user) {
+        int active = h.user->active.load();
+        while (active > 0 && !h.user->active.compare_exchange_weak(active, active - 1)) {
+        }
+        h.user->touched.store(now());
+    }
+    if (h.expensive) {
+        currentWorker.load(std::memory_order_relaxed)->expensive.fetch_sub(1);
+    }
+
+    if (!scheduler.waiters.empty()) {
+        pump();
+    }
+}
+
+void claimWorker()
+{
+    QMutexLocker locker(&workerMutex);
+    const qint64 pid = getpid();
+    if (!shared || currentWorkerPid == pid) {
+        return;
+    }
+
+    // A dead worker's slot is taken over with whatever it still held
+    Worker *worker = nullptr;
+    const int workers = qMin(shared->nextWorker.load(), MaxWorkers);
+    for (int i = 0; i < workers && !worker; ++i) {
+        qint64 owner = shared->workers[i].pid.load();
+        if (owner != pid && !alive(owner) && shared->workers[i].pid.compare_exchange_strong(owner, pid)) {
+            worker = &shared->workers[i];
+        }
+    }
+    if (!worker) {
+        const int index = shared->nextWorker.fetch_add(1);
+        if (index >= MaxWorkers) {
+            qCWarning(CLOUDLYST_ADMISSION) << "No free admission slot, sharing the last one";
+            worker = &shared->workers[MaxWorkers - 1];
+        } else {
+            worker = &shared->workers[index];
+        }
+    }
+    worker->pid.store(pid);
+    worker->expensive.store(0);
+    worker->queued.store(0);
+
+    currentWorkerPid = pid;
+    currentWorker.store(worker);
+}
+
+}
+
+AdmissionControl::AdmissionControl(Application *parent) : Plugin(parent)
+{
+}
+
+bool AdmissionControl::setup(Application *app)
+{
+    {
+        QMutexLocker locker(&workerMutex);
+        if (!shared) {
+            if (!app->config(QStringLiteral("AdmissionControl"), true).toBool()) {
+                return true;
+            }
+
+            userConcurrency = qMax(0, app->config(QStringLiteral("AdmissionUserConcurrency"), 16).toInt());
+            const double rate = app->config(QStringLiteral("AdmissionUserRate"), 0).toDouble();
+            if (rate > 0) {
+                userIntervalUsecs = qMax(Q_INT64_C(1), qint64(1e6 / rate));
+                userBurstUsecs = userIntervalUsecs * qMax(1, app->config(QStringLiteral("AdmissionUserBurst"), 100).toInt());
+            }
+            expensiveSlots = qMax(0, app->config(QStringLiteral("AdmissionExpensiveSlots"), 64).toInt());
+            queueDepth = qMax(0, app->config(QStringLiteral("AdmissionQueueDepth"), 1024).toInt());
+            queueTimeoutUsecs = qMax(Q_INT64_C(100), app->config(QStringLiteral("AdmissionQueueTimeout"), 10000).toLongLong()) * 1000;
+            retryAfter = qMax(1, app->config(QStringLiteral("AdmissionRetryAfter"), 1).toInt());
+
+            // Anonymous and shared, so it survives fork() and is visible to every worker
+            void *mem = mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) {
+                qCCritical(CLOUDLYST_ADMISSION) << "Failed to map admission counters" << strerror(errno);
+                return false;
+            }
+            shared = static_cast<Shared *>(mem);
+        }
+    }
+    claimWorker();
+
+    connect(app, &Application::postForked, this, [] {
+        claimWorker();
+    });
+    connect(app, &Application::afterDispatch, this, &AdmissionControl::afterDispatch);
+
+    return true;
+}
+
+bool AdmissionControl::admit(Context *c, const QVariant &userId, const QString &action)
+{
+    if (!shared || held.contains(c)) {
+        return true;
+    }
+
+    const qint64 t = now();
+    const qint64 userKey = userId.toLongLong();
+    const bool expensive = isExpensive(c);
+
+    // With the table full users go without limits of their own
+    User *user = claimUser(userKey, t);
+    if (!user) {
+        qCWarning(CLOUDLYST_ADMISSION) << "User table full, admitting" << userKey << "without per user limits";
+    }
+
+    const qint64 wait = user ? takeToken(*user, t) : 0;
+    if (wait) {
+        qCDebug(CLOUDLYST_ADMISSION) << "Rate limited" << userKey << wait;
+        Metrics::recordAdmission(Metrics::AdmissionThrottled);
+        reject(c, Response::TooManyRequests, (wait + 999999) / 1000000);
+        return false;
+    }
+
+    // Nobody jumps the queue of its thread, the scheduler picks the order
+    Scheduler &s = scheduler;
+    if (s.waiters.empty() && acquire(c, user, expensive, t)) {
+        Metrics::recordAdmission(Metrics::AdmissionAdmitted);
+        return true;
+    }
+
+    Worker *worker = currentWorker.load(std::memory_order_relaxed);
+    if (!worker || sumWorkers([] (Worker &w) -> std::atomic<int> & { return w.queued; }) >= queueDepth) {
+        qCDebug(CLOUDLYST_ADMISSION) << "Queue full, shedding" << userKey << c->request()->method();
+        Metrics::recordAdmission(Metrics::AdmissionShed);
+        reject(c, Response::ServiceUnavailable, retryAfter);
+        return false;
+    }
+
+    // Finish tags advance per user, so a user with many waiting queues
+    // behind everyone else's next request
+    const double finish = qMax(s.virtualTime, s.lastFinish.value(userKey)) + (expensive ? ExpensiveCost : CheapCost);
+    s.lastFinish.insert(userKey, finish);
+
+    Waiter waiter{ c, action, userKey, t + queueTimeoutUsecs, finish, expensive };
+    auto pos = std::upper_bound(s.waiters.begin(), s.waiters.end(), finish, [] (double f, const Waiter &w) {
+        return f < w.finish;
+    });
+    s.waiters.insert(pos, waiter);
+    worker->queued.fetch_add(1);
+
+    // Pumped from the event loop, never from within the action
+    Metrics::recordAdmission(Metrics::AdmissionQueued);
+    c->detachAsync();
+    schedule();
+    return false;
+}
+
+void AdmissionControl::afterDispatch(Context *c)
+{
+    release(c);
+}
@@ -0,0 +1,49 @@
+#ifndef ADMISSIONCONTROL_H
+#define ADMISSIONCONTROL_H
+
+#include <Cutelyst/Plugin>
+
+#include <QVariant>
+
+using namespace Cutelyst;
+
+/**
+ * Keeps a single user from taking every worker.
+ *
+ * Each user has a token bucket of AdmissionUserRate requests per second,
+ * AdmissionUserBurst deep, and at most AdmissionUserConcurrency requests
+ * in flight. Expensive requests (PROPFIND with Depth 1 or infinity, COPY,
+ * MOVE, ZIP downloads and bulk uploads) also share AdmissionExpensiveSlots
+ * for the whole server.
+ *
+ * A request over a concurrency limit waits in its thread's queue, ordered
+ * by weighted fair queueing so a user with hundreds of requests waiting
+ * doesn't delay the first one of another user. A user out of tokens gets
+ * 429, and once AdmissionQueueDepth requests wait server wide new ones
+ * get 503, as do those still waiting after AdmissionQueueTimeout ms, all
+ * with a Retry-After.
+ *
+ * Counters live in memory shared by all workers like Metrics, queues are
+ * pumped when a request of their thread finishes and by a timer for
+ * slots freed by other workers.
+ */
+class AdmissionControl : public Plugin
+{
+    Q_OBJECT
+public:
+    explicit AdmissionControl(Application *parent);
+
+    virtual bool setup(Application *app) override;
+
+    /**
+     * True if \p c may run now. Otherwise \p c was either rejected, with
+     * its response set, or queued and detached, to be forwarded to
+     * \p action once admitted, where this returns true.
+     */
+    static bool admit(Context *c, const QVariant &userId, const QString &action);
+
+private:
+    void afterDispatch(Context *c);
+};
+
+#endif // ADMISSIONCONTROL_H
@@ -0,0 +1,702 @@
+#include "asyncpg.h"
+
+#include "metrics.h"
+#include "requesttrace.h"
+
+#include <Cutelyst/Plugins/Utils/Sql>
+
+#include <QSocketNotifier>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlRecord>
+#include <QTimer>
+
+#include <QLoggingCategory>
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+
+#include <libpq-fe.h>
+
+Q_LOGGING_CATEGORY(CLOUDLYST_APG, "cloudlyst.asyncpg", QtWarningMsg)
+
+static QByteArray defaultConnInfo = QByteArrayLiteral("dbname=cloudlyst");
+static bool pipelineEnabled = true;
+
+static inline qint64 now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+AsyncPgResult::AsyncPgResult(PGresult *result, const QString &error)
+    : m_result(result, PQclear)
+    , m_error(error)
+{
+}
+
+AsyncPgResult::AsyncPgResult(QSqlQuery &query)
+    : m_rowsAffected(query.numRowsAffected())
+{
+    auto rows = std::make_shared<std::vector<QVector<QVariant>>>();
+    const int columns = query.record().count();
+    while (query.next()) {
+        QVector<QVariant> row(columns);
+        for (int i = 0; i < columns; ++i) {
+            row[i] = query.value(i);
+        }
+        rows->push_back(row);
+    }
+    // Done with the statement, SQLite would otherwise keep its read open
+    query.finish();
+    m_rows = rows;
+}
+
+int AsyncPgResult::size() const
+{
+    if (m_rows) {
+        return int(m_rows->size());
+    }
+    return m_result ? PQntuples(m_result.get()) : 0;
+}
+
+int AsyncPgResult::numRowsAffected() const
+{
+    if (m_rows) {
+        return m_rowsAffected;
+    }
+    return m_result ? QByteArray(PQcmdTuples(m_result.get())).toInt() : 0;
+}
+
+bool AsyncPgResult::isNull(int row, int column) const
+{
+    if (m_rows) {
+        return m_rows->at(size_t(row)).at(column).isNull();
+    }
+    return PQgetisnull(m_result.get(), row, column);
+}
+
+QString AsyncPgResult::value(int row, int column) const
+{
+    if (m_rows) {
+        return m_rows->at(size_t(row)).at(column).toString();
+    }
+    return QString::fromUtf8(PQgetvalue(m_result.get(), row, column), PQgetlength(m_result.get(), row, column));
+}
+
+qint64 AsyncPgResult::toLongLong(int row, int column) const
+{
+    if (m_rows) {
+        return m_rows->at(size_t(row)).at(column).toLongLong();
+    }
+    return QByteArray::fromRawData(PQgetvalue(m_result.get(), row, column), PQgetlength(m_result.get(), row, column)).toLongLong();
+}
+
+bool AsyncPgResult::toBool(int row, int column) const
+{
+    if (m_rows) {
+        return m_rows->at(size_t(row)).at(column).toBool();
+    }
+    return *PQgetvalue(m_result.get(), row, column) == 't';
+}
+
+AsyncPgConnection::AsyncPgConnection(const QByteArray &connInfo, QObject *parent) : QObject(parent)
+  , m_connInfo(connInfo)
+{
+}
+
+AsyncPgConnection::~AsyncPgConnection()
+{
+    if (m_lastResult) {
+        PQclear(m_lastResult);
+    }
+    if (m_conn) {
+        PQfinish(m_conn);
+    }
+}
+
+void AsyncPgConnection::setConnInfo(const QString &info)
+{
+    defaultConnInfo = info.toUtf8();
+}
+
+void AsyncPgConnection::setPipelineEnabled(bool enabled)
+{
+    pipelineEnabled = enabled;
+}
+
+AsyncPgConnection *AsyncPgConnection::thread()
+{
+    static thread_local std::unique_ptr<AsyncPgConnection> connection;
+    if (!connection) {
+        connection.reset(new AsyncPgConnection(defaultConnInfo));
+    }
+    return connection.get();
+}
+
+void AsyncPgConnection::exec(SqlQuery::Statement statement, const QVector<QByteArray> &params, const QVector<bool> &nulls,
+                             QObject *receiver, AsyncPgCallback callback)
+{
+    Command command;
+    command.statement = statement;
+    command.params = params;
+    command.nulls = nulls;
+    command.receiver = receiver;
+    command.hasReceiver = receiver;
+    command.callback = std::move(callback);
+    command.trace = RequestTrace::current();
+    enqueue(std::move(command));
+}
+
+void AsyncPgConnection::exec(const QByteArray &sql, QObject *receiver, AsyncPgCallback callback)
+{
+    Command command;
+    command.kind = Sql;
+    command.sql = sql;
+    command.receiver = receiver;
+    command.hasReceiver = receiver;
+    command.callback = std::move(callback);
+    command.trace = RequestTrace::current();
+    enqueue(std::move(command));
+}
+
+void AsyncPgConnection::beginBatch()
+{
+    Command command;
+    command.kind = BatchBegin;
+    enqueue(std::move(command));
+    m_batch = true;
+}
+
+void AsyncPgConnection::endBatch(QObject *receiver, AsyncPgCallback callback)
+{
+    Command command;
+    command.kind = BatchEnd;
+    command.receiver = receiver;
+    command.hasReceiver = receiver;
+    command.callback = std::move(callback);
+    command.trace = RequestTrace::current();
+    enqueue(std::move(command));
+    m_batch = false;
+}
+
+void AsyncPgConnection::enqueue(Command &&command)
+{
+    command.batch = m_batch;
+    m_queue.push_back(std::move(command));
+
+    // Start from the event loop so callbacks never run inside exec(),
+    // and so everything a handler queues goes out in one write
+    if (!m_scheduled) {
+        m_scheduled = true;
+        QTimer::singleShot(0, this, [this] {
+            m_scheduled = false;
+            if (SqlQuery::driver() == SqlQuery::SQLite) {
+                runLocal();
+            } else if (!m_connected) {
+                if (!m_connecting) {
+                    connectStart();
+                }
+            } else {
+                sendNext();
+            }
+        });
+    }
+}
+
+void AsyncPgConnection::connectStart()
+{
+    if (m_conn) {
+        PQfinish(m_conn);
+    }
+    m_prepared.clear();
+    m_connecting = true;
+
+    m_conn = PQconnectStart(m_connInfo.constData());
+    if (!m_conn || PQstatus(m_conn) == CONNECTION_BAD) {
+        m_connecting = false;
+        failAll(m_conn ? QString::fromUtf8(PQerrorMessage(m_conn)) : QStringLiteral("Out of memory"));
+        return;
+    }
+    setupNotifiers();
+    connectPoll();
+}
+
+void AsyncPgConnection::setupNotifiers()
+{
+    const int socket = PQsocket(m_conn);
+    if (socket == m_socket) {
+        return;
+    }
+
+    // libpq may switch sockets while trying the hosts of a multi-host conninfo
+    if (m_readNotifier) {
+        m_readNotifier->setEnabled(false);
+        m_readNotifier->deleteLater();
+        m_writeNotifier->setEnabled(false);
+        m_writeNotifier->deleteLater();
+    }
+    m_socket = socket;
+
+    m_readNotifier = new QSocketNotifier(socket, QSocketNotifier::Read, this);
+    connect(m_readNotifier, &QSocketNotifier::activated, this, [this] {
+        if (m_connecting) {
+            connectPoll();
+        } else {
+            readResults();
+        }
+    });
+
+    m_writeNotifier = new QSocketNotifier(socket, QSocketNotifier::Write, this);
+    m_writeNotifier->setEnabled(false);
+    connect(m_writeNotifier, &QSocketNotifier::activated, this, [this] {
+        if (m_connecting) {
+            connectPoll();
+        } else {
+            flush();
+        }
+    });
+}
+
+void AsyncPgConnection::connectPoll()
+{
+    switch (PQconnectPoll(m_conn)) {
+    case PGRES_POLLING_READING:
+        setupNotifiers();
+        m_readNotifier->setEnabled(true);
+        m_writeNotifier->setEnabled(false);
+        break;
+    case PGRES_POLLING_WRITING:
+        setupNotifiers();
+        m_readNotifier->setEnabled(false);
+        m_writeNotifier->setEnabled(true);
+        break;
+    case PGRES_POLLING_OK:
+        m_connecting = false;
+        m_connected = true;
+        PQsetnonblocking(m_conn, 1);
+#ifdef LIBPQ_HAS_PIPELINING
+        m_pipeline = pipelineEnabled && PQenterPipelineMode(m_conn);
+#endif
+        setupNotifiers();
+        m_readNotifier->setEnabled(true);
+        m_writeNotifier->setEnabled(false);
+        qCDebug(CLOUDLYST_APG) << "Connected, pipeline" << m_pipeline;
+        sendNext();
+        break;
+    default:
+        m_connecting = false;
+        qCWarning(CLOUDLYST_APG) << "Failed to connect" << PQerrorMessage(m_conn);
+        failAll(QString::fromUtf8(PQerrorMessage(m_conn)));
+        break;
+    }
+}
+
+void AsyncPgConnection::sendNext()
+{
+    bool sent = false;
+
+    // Without a pipeline libpq takes one command at a time
+    while (!m_queue.empty() && (m_pipeline || m_sent.empty())) {
+        Command &front = m_queue.front();
+
+        if (front.kind == Statement && !m_prepared.contains(front.statement)) {
+            // Prepared once per connection, marked right away so a pipeline
+            // doesn't prepare it twice
+            const auto statement = SqlQuery::Statement(front.statement);
+            const QByteArray name = QByteArray("cloudlyst_") + SqlQuery::name(statement);
+            const QByteArray sql = SqlQuery::positionalSql(statement);
+            if (!PQsendPrepare(m_conn, name.constData(), sql.constData(), 0, nullptr)) {
+                failAll(QString::fromUtf8(PQerrorMessage(m_conn)));
+                return;
+            }
+            m_prepared.insert(front.statement);
+
+            Command prepare;
+            prepare.kind = Prepare;
+            prepare.statement = front.statement;
+            prepare.batch = front.batch;
+            prepare.sent = now();
+            m_sent.push_back(std::move(prepare));
+            sent = true;
+
+            if (!m_pipeline) {
+                break;
+            }
+        }
+
+        Command command = std::move(m_queue.front());
+        m_queue.pop_front();
+
+        if (!send(command)) {
+            failAll(QString::fromUtf8(PQerrorMessage(m_conn)));
+            return;
+        }
+        sent = true;
+    }
+
+    if (sent) {
+        flush();
+    }
+}
+
+bool AsyncPgConnection::send(Command &command)
+{
+    int ok = 1;
+    switch (command.kind) {
+    case Statement:
+    {
+        const QByteArray name = QByteArray("cloudlyst_") + SqlQuery::name(SqlQuery::Statement(command.statement));
+        const int count = command.params.size();
+        QVector<const char *> values(count);
+        QVector<int> lengths(count);
+        for (int i = 0; i < count; ++i) {
+            values[i] = command.nulls.at(i) ? nullptr : command.params.at(i).constData();
+            lengths[i] = command.params.at(i).size();
+        }
+        ok = PQsendQueryPrepared(m_conn, name.constData(), count, values.constData(), lengths.constData(), nullptr, 0);
+        break;
+    }
+    case Sql:
+        // The simple protocol isn't allowed in a pipeline
+        ok = m_pipeline ? PQsendQueryParams(m_conn, command.sql.constData(), 0, nullptr, nullptr, nullptr, nullptr, 0)
+                        : PQsendQuery(m_conn, command.sql.constData());
+        break;
+    case BatchBegin:
+        if (m_pipeline) {
+            // Everything up to the sync is one implicit transaction
+            return true;
+        }
+        ok = PQsendQuery(m_conn, "BEGIN");
+        break;
+    case BatchEnd:
+#ifdef LIBPQ_HAS_PIPELINING
+        if (m_pipeline) {
+            ok = PQpipelineSync(m_conn);
+            break;
+        }
+#endif
+        ok = PQsendQuery(m_conn, "COMMIT");
+        break;
+    case Prepare:
+    case Sync:
+        break;
+    }
+
+    if (!ok) {
+        return false;
+    }
+
+    const bool sync = m_pipeline && !command.batch && command.kind != BatchEnd;
+    command.sent = now();
+    m_sent.push_back(std::move(command));
+
+#ifdef LIBPQ_HAS_PIPELINING
+    // Commands outside a batch get their own sync, a failure in one must
+    // not abort the ones queued by other requests
+    if (sync) {
+        if (!PQpipelineSync(m_conn)) {
+            return false;
+        }
+        Command marker;
+        marker.kind = Sync;
+        m_sent.push_back(std::move(marker));
+    }
+#else
+    Q_UNUSED(sync)
+#endif
+
+    return true;
+}
+
+void AsyncPgConnection::flush()
+{
+    const int ret = PQflush(m_conn);
+    if (ret == -1) {
+        failAll(QString::fromUtf8(PQerrorMessage(m_conn)));
+        return;
+    }
+    m_writeNotifier->setEnabled(ret == 1);
+}
+
+void AsyncPgConnection::readResults()
+{
+    if (!PQconsumeInput(m_conn)) {
+        failAll(QString::fromUtf8(PQerrorMessage(m_conn)));
+        return;
+    }
+
+    while (!m_sent.empty() && !PQisBusy(m_conn)) {
+        PGresult *result = PQgetResult(m_conn);
+
+#ifdef LIBPQ_HAS_PIPELINING
+        const Kind kind = m_sent.front().kind;
+        if (kind == Sync || (kind == BatchEnd && m_pipeline)) {
+            // A sync has a single result and no terminating null
+            if (!result) {
+                break;
+            }
+            const ExecStatusType status = PQresultStatus(result);
+            PQclear(result);
+            if (status != PGRES_PIPELINE_SYNC) {
+                qCWarning(CLOUDLYST_APG) << "Unexpected result while waiting for a sync" << PQresStatus(status);
+                continue;
+            }
+
+            Command command = std::move(m_sent.front());
+            m_sent.pop_front();
+            if (kind == BatchEnd) {
+                finishCommand(command, nullptr, QString());
+            }
+            continue;
+        }
+#endif
+
+        if (result) {
+            // Keep the last one, a failed statement reports its error there
+            const ExecStatusType status = PQresultStatus(result);
+            if (status == PGRES_FATAL_ERROR || status == PGRES_BAD_RESPONSE) {
+                m_lastError = QString::fromUtf8(PQresultErrorMessage(result));
+#ifdef LIBPQ_HAS_PIPELINING
+            } else if (status == PGRES_PIPELINE_ABORTED) {
+                m_lastError = QStringLiteral("Skipped, an earlier statement of the batch failed");
+#endif
+            }
+            if (m_lastResult) {
+                PQclear(m_lastResult);
+            }
+            m_lastResult = result;
+            continue;
+        }
+
+        // Command done
+        Command command = std::move(m_sent.front());
+        m_sent.pop_front();
+        PGresult *last = m_lastResult;
+        const QString error = m_lastError;
+        m_lastResult = nullptr;
+        m_lastError.clear();
+
+        if (command.kind == Prepare) {
+            if (last) {
+                PQclear(last);
+            }
+            if (!error.isEmpty()) {
+                qCWarning(CLOUDLYST_APG) << "Failed to prepare" << SqlQuery::name(SqlQuery::Statement(command.statement)) << error;
+                m_prepared.remove(command.statement);
+                if (command.batch && m_batchError.isEmpty()) {
+                    m_batchError = error;
+                }
+
+                // In a pipeline the statement was sent already and fails on
+                // its own, otherwise it is still waiting in the queue
+                if (!m_pipeline && !m_queue.empty()) {
+                    Command statement = std::move(m_queue.front());
+                    m_queue.pop_front();
+                    finishCommand(statement, nullptr, error);
+                }
+            }
+            continue;
+        }
+
+        finishCommand(command, last, error);
+    }
+
+    if (m_connected) {
+        sendNext();
+    }
+}
+
+void AsyncPgConnection::finishCommand(Command &command, PGresult *result, const QString &error)
+{
+    // Pipelined commands overlap, count each from when the previous one ended
+    const qint64 t = now();
+    const qint64 nsecs = command.sent ? t - qMax(command.sent, m_lastDone) : 0;
+    m_lastDone = t;
+
+    QString ret = error;
+    if (command.batch && !error.isEmpty() && m_batchError.isEmpty()) {
+        m_batchError = error;
+    }
+    if (command.kind == BatchEnd) {
+        if (!m_batchError.isEmpty()) {
+            ret = m_batchError;
+        }
+        m_batchError.clear();
+    }
+
+    if (command.kind == Statement) {
+        const int rows = result ? (PQntuples(result) ? PQntuples(result) : QByteArray(PQcmdTuples(result)).toInt()) : 0;
+        Metrics::recordStatement(command.statement, nsecs, rows, error.isEmpty());
+        if (!error.isEmpty()) {
+            qCWarning(CLOUDLYST_APG) << "Failed" << SqlQuery::name(SqlQuery::Statement(command.statement)) << error;
+        }
+    }
+
+    AsyncPgResult res(result, ret);
+    runCallback(command, res, nsecs);
+}
+
+void AsyncPgConnection::runCallback(Command &command, AsyncPgResult &result, qint64 nsecs)
+{
+    if (!command.callback || (command.hasReceiver && !command.receiver)) {
+        return;
+    }
+
+    // The receiver being alive means its request, and so its trace, is too
+    if (command.trace && command.hasReceiver) {
+        command.trace->account(RequestTrace::Sql, nsecs);
+        RequestTrace *previous = RequestTrace::setCurrent(command.trace);
+        command.callback(result);
+        RequestTrace::setCurrent(previous);
+    } else {
+        command.callback(result);
+    }
+}
+
+void AsyncPgConnection::failAll(const QString &error)
+{
+    qCWarning(CLOUDLYST_APG) << "Connection failed" << error;
+
+    // Reconnect on the next command, callbacks below may already queue one
+    if (m_readNotifier) {
+        m_readNotifier->setEnabled(false);
+        m_readNotifier->deleteLater();
+        m_writeNotifier->setEnabled(false);
+        m_writeNotifier->deleteLater();
+        m_readNotifier = m_writeNotifier = nullptr;
+    }
+    m_socket = -1;
+    m_connected = false;
+    m_pipeline = false;
+    if (m_lastResult) {
+        PQclear(m_lastResult);
+        m_lastResult = nullptr;
+    }
+    m_lastError.clear();
+    m_batchError.clear();
+    if (m_conn) {
+        PQfinish(m_conn);
+        m_conn = nullptr;
+    }
+
+    std::deque<Command> commands;
+    commands.swap(m_sent);
+    std::move(m_queue.begin(), m_queue.end(), std::back_inserter(commands));
+    m_queue.clear();
+
+    for (Command &command : commands) {
+        AsyncPgResult ret(nullptr, error);
+        runCallback(command, ret, 0);
+    }
+}
+
+// SqlQuery accounts the statement in Metrics itself
+static AsyncPgResult execLocal(SqlQuery::Statement statement, const QVector<QByteArray> &params, const QVector<bool> &nulls)
+{
+    const QStringList names = SqlQuery::placeholders(statement);
+    SqlQuery query(statement);
+    for (int i = 0; i < names.size(); ++i) {
+        query.bindValue(names.at(i), nulls.at(i) ? QVariant(QVariant::String) : QVariant(QString::fromUtf8(params.at(i))));
+    }
+
+    if (!query.exec()) {
+        return AsyncPgResult(nullptr, query.lastError().databaseText());
+    }
+    return AsyncPgResult(query);
+}
+
+void AsyncPgConnection::runLocal()
+{
+    QSqlDatabase db = Cutelyst::Sql::databaseThread(QStringLiteral("cloudlyst"));
+
+    // Callbacks may queue more, those run in this same pass
+    while (!m_queue.empty()) {
+        Command command = std::move(m_queue.front());
+        m_queue.pop_front();
+        command.sent = now();
+
+        AsyncPgResult result;
+        switch (command.kind) {
+        case Statement:
+            if (command.batch && !m_batchError.isEmpty()) {
+                result = AsyncPgResult(nullptr, QStringLiteral("Skipped, an earlier statement of the batch failed"));
+            } else {
+                result = execLocal(SqlQuery::Statement(command.statement), command.params, command.nulls);
+            }
+            break;
+        case Sql:
+        {
+            QSqlQuery query(db);
+            result = query.exec(QString::fromUtf8(command.sql)) ? AsyncPgResult(query) : AsyncPgResult(nullptr, query.lastError().databaseText());
+            break;
+        }
+        case BatchBegin:
+            if (!db.transaction()) {
+                m_batchError = db.lastError().databaseText();
+            }
+            continue;
+        case BatchEnd:
+            if (m_batchError.isEmpty() && !db.commit()) {
+                m_batchError = db.lastError().databaseText();
+            }
+            if (!m_batchError.isEmpty()) {
+                db.rollback();
+            }
+            result = AsyncPgResult(nullptr, m_batchError);
+            m_batchError.clear();
+            runCallback(command, result, now() - command.sent);
+            continue;
+        case Prepare:
+        case Sync:
+            continue;
+        }
+
+        if (command.batch && result.error() && m_batchError.isEmpty()) {
+            m_batchError = result.errorString();
+        }
+        runCallback(command, result, now() - command.sent);
+    }
+}
+
+AsyncPgQuery::AsyncPgQuery(SqlQuery::Statement statement) : m_statement(statement)
+{
+    const int count = SqlQuery::placeholders(statement).size();
+    m_params.resize(count);
+    m_nulls.fill(true, count);
+}
+
+void AsyncPgQuery::bindValue(const QString &placeholder, const QVariant &value)
+{
+    const int pos = SqlQuery::placeholders(m_statement).indexOf(placeholder);
+    if (pos == -1) {
+        qCWarning(CLOUDLYST_APG) << "Unknown placeholder" << placeholder << SqlQuery::name(m_statement);
+        return;
+    }
+
+    m_nulls[pos] = value.isNull();
+    switch (value.type()) {
+    case QVariant::Bool:
+        m_params[pos] = value.toBool() ? "t" : "f";
+        break;
+    case QVariant::ByteArray:
+        m_params[pos] = value.toByteArray();
+        break;
+    case QVariant::StringList:
+        m_params[pos] = SqlQuery::arrayLiteral(value.toStringList()).toUtf8();
+        break;
+    default:
+        m_params[pos] = value.toString().toUtf8();
+        break;
+    }
+}
+
+void AsyncPgQuery::exec(QObject *receiver, AsyncPgCallback callback)
+{
+    exec(AsyncPgConnection::thread(), receiver, std::move(callback));
+}
+
+void AsyncPgQuery::exec(AsyncPgConnection *connection, QObject *receiver, AsyncPgCallback callback)
+{
+    connection->exec(m_statement, m_params, m_nulls, receiver, std::move(callback));
+}
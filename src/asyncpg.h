@@ -0,0 +1,176 @@
+#ifndef ASYNCPG_H
+#define ASYNCPG_H
+
+#include <QObject>
+#include <QPointer>
+#include <QSet>
+#include <QVariant>
+#include <QVector>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "sqlquery.h"
+
+typedef struct pg_conn PGconn;
+typedef struct pg_result PGresult;
+
+class QSocketNotifier;
+class QSqlQuery;
+class RequestTrace;
+
+class AsyncPgResult
+{
+public:
+    AsyncPgResult() = default;
+    AsyncPgResult(PGresult *result, const QString &error);
+    /** The rows of an executed \p query, with the SQLite driver */
+    explicit AsyncPgResult(QSqlQuery &query);
+
+    bool error() const { return !m_error.isEmpty(); }
+    QString errorString() const { return m_error; }
+
+    int size() const;
+    int numRowsAffected() const;
+
+    bool isNull(int row, int column) const;
+    QString value(int row, int column) const;
+    qint64 toLongLong(int row, int column) const;
+    bool toBool(int row, int column) const;
+
+private:
+    std::shared_ptr<PGresult> m_result;
+    std::shared_ptr<const std::vector<QVector<QVariant>>> m_rows;
+    QString m_error;
+    int m_rowsAffected = 0;
+};
+
+typedef std::function<void(AsyncPgResult &result)> AsyncPgCallback;
+
+/**
+ * Non blocking libpq connection, one per thread.
+ *
+ * Commands are queued while the thread's event loop keeps serving other
+ * requests, results are delivered to the callback from the event loop of
+ * this thread unless the receiver was destroyed.
+ *
+ * With a PostgreSQL 14 libpq (and DatabasePipeline, on by default) the
+ * connection runs in pipeline mode: everything queued while handling an
+ * event goes out in a single write, so the statements of one WebDAV
+ * operation cost about one round trip. Otherwise commands are sent one
+ * at a time.
+ *
+ * With the SQLite driver (see SqlQuery::setDriver()) nothing connects:
+ * queued commands run in process on the thread's database from the same
+ * event loop tick, a batch being a transaction.
+ */
+class AsyncPgConnection : public QObject
+{
+    Q_OBJECT
+public:
+    /** A connection to \p connInfo, thread() is the one to the primary */
+    explicit AsyncPgConnection(const QByteArray &connInfo, QObject *parent = nullptr);
+    ~AsyncPgConnection();
+
+    static void setConnInfo(const QString &connInfo);
+    static void setPipelineEnabled(bool enabled);
+
+    /** This thread's connection, connecting on first use */
+    static AsyncPgConnection *thread();
+
+    void exec(SqlQuery::Statement statement, const QVector<QByteArray> &params, const QVector<bool> &nulls,
+              QObject *receiver, AsyncPgCallback callback);
+
+    /** A single parameterless statement */
+    void exec(const QByteArray &sql, QObject *receiver, AsyncPgCallback callback);
+
+    /**
+     * Commands queued until endBatch() run as one transaction: a failure
+     * skips the rest and rolls back. \p callback of endBatch() gets the
+     * first error of the batch, if any.
+     */
+    void beginBatch();
+    void endBatch(QObject *receiver, AsyncPgCallback callback);
+
+    bool isPipelined() const { return m_pipeline; }
+    bool inBatch() const { return m_batch; }
+
+private:
+    enum Kind {
+        Statement,
+        Sql,
+        BatchBegin,
+        BatchEnd,
+        Prepare,
+        Sync,
+    };
+
+    struct Command {
+        QByteArray sql;
+        QVector<QByteArray> params;
+        QVector<bool> nulls;
+        QPointer<QObject> receiver;
+        AsyncPgCallback callback;
+        RequestTrace *trace = nullptr;
+        qint64 sent = 0;
+        int statement = -1;
+        Kind kind = Statement;
+        bool hasReceiver = false;
+        bool batch = false;
+    };
+
+    void connectStart();
+    void connectPoll();
+    void setupNotifiers();
+    void enqueue(Command &&command);
+    void sendNext();
+    bool send(Command &command);
+    void flush();
+    void readResults();
+    void finishCommand(Command &command, PGresult *result, const QString &error);
+    static void runCallback(Command &command, AsyncPgResult &result, qint64 nsecs);
+    void failAll(const QString &error);
+    void runLocal();
+
+    QByteArray m_connInfo;
+    PGconn *m_conn = nullptr;
+    QSocketNotifier *m_readNotifier = nullptr;
+    QSocketNotifier *m_writeNotifier = nullptr;
+    std::deque<Command> m_queue;
+    std::deque<Command> m_sent;
+    QSet<int> m_prepared;
+    PGresult *m_lastResult = nullptr;
+    QString m_lastError;
+    QString m_batchError;
+    qint64 m_lastDone = 0;
+    int m_socket = -1;
+    bool m_connected = false;
+    bool m_connecting = false;
+    bool m_scheduled = false;
+    bool m_pipeline = false;
+    bool m_batch = false;
+};
+
+/**
+ * Binds a registry statement for AsyncPgConnection, named placeholders
+ * are mapped to libpq's positional ones.
+ */
+class AsyncPgQuery
+{
+public:
+    explicit AsyncPgQuery(SqlQuery::Statement statement);
+
+    void bindValue(const QString &placeholder, const QVariant &value);
+
+    void exec(QObject *receiver, AsyncPgCallback callback);
+    void exec(AsyncPgConnection *connection, QObject *receiver, AsyncPgCallback callback);
+
+private:
+    SqlQuery::Statement m_statement;
+    QVector<QByteArray> m_params;
+    QVector<bool> m_nulls;
+};
+
+#endif // ASYNCPG_H
@@ -1,5 +1,7 @@
 #include "authstoresql.h"
 
+#include "sqlquery.h"
+
 #include <Cutelyst/Plugins/Utils/Sql>
 #include <Cutelyst/Context>
 
@@ -19,15 +21,20 @@ AuthenticationUser AuthStoreSql::findUser(Context *c, const ParamsMultiMap &user
     AuthenticationUser ret;
     const QString username = userinfo.value(QStringLiteral("username"));
 
-    QSqlQuery findUserQuery = CPreparedSqlQueryThreadForDB(QStringLiteral("SELECT id, username, displayname, password "
-                                                                     "FROM cloudlyst.users "
-                                                                     "WHERE username = :username"),
-                                                           QStringLiteral("cloudlyst"));
+    SqlQuery findUserQuery(SqlQuery::UserByName, SqlQuery::Replica);
 
     findUserQuery.bindValue(QStringLiteral(":username"), username);
 //    qDebug() << findUserQuery.executedQuery() << username;
 
-    if (findUserQuery.exec() && findUserQuery.next()) {
+    bool found = findUserQuery.exec() && findUserQuery.next();
+    if (!found && findUserQuery.target() == SqlQuery::Replica) {
+        // The replica may be down or not have replayed a new user yet
+        findUserQuery = SqlQuery(SqlQuery::UserByName);
+        findUserQuery.bindValue(QStringLiteral(":username"), username);
+        found = findUserQuery.exec() && findUserQuery.next();
+    }
+
+    if (found) {
         const QVariant userId = findUserQuery.value(QStringLiteral("id"));
 //        qDebug() << "FOUND USER -> " << userId;
         ret.setId(userId);
@@ -0,0 +1,163 @@
+#include "bulkuploadparser.h"
+
+#include <QCryptographicHash>
+#include <QIODevice>
+#include <QVector>
+
+namespace {
+
+const qint64 MaxHeaderLine = 8 * 1024;
+const int MaxHeaders = 32;
+
+// Reads a line without its CRLF, false at the end of the body
+bool readLine(QIODevice *body, QByteArray &line, bool &tooLong)
+{
+    if (body->atEnd()) {
+        return false;
+    }
+
+    line = body->readLine(MaxHeaderLine);
+    tooLong = !line.endsWith('\n') && !body->atEnd();
+    if (line.endsWith('\n')) {
+        line.chop(1);
+    }
+    if (line.endsWith('\r')) {
+        line.chop(1);
+    }
+    return true;
+}
+
+}
+
+BulkUploadParser::BulkUploadParser(QIODevice *body, const QByteArray &boundary)
+    : m_body(body)
+    , m_delimiter(QByteArrayLiteral("--") + boundary)
+{
+}
+
+QByteArray BulkUploadParser::boundary(const QString &contentType)
+{
+    const QVector<QStringRef> params = contentType.splitRef(QLatin1Char(';'));
+    if (params.isEmpty() || params.first().trimmed().compare(QLatin1String("multipart/related"), Qt::CaseInsensitive) != 0) {
+        return QByteArray();
+    }
+
+    for (int i = 1; i < params.size(); ++i) {
+        const QStringRef param = params.at(i).trimmed();
+        if (param.startsWith(QLatin1String("boundary="), Qt::CaseInsensitive)) {
+            QStringRef value = param.mid(9);
+            if (value.size() > 1 && value.startsWith(QLatin1Char('"')) && value.endsWith(QLatin1Char('"'))) {
+                value = value.mid(1, value.size() - 2);
+            }
+            return value.toLatin1();
+        }
+    }
+    return QByteArray();
+}
+
+bool BulkUploadParser::next()
+{
+    if (m_end || hasError()) {
+        return false;
+    }
+
+    // Content the caller didn't want is skipped
+    if (m_pending && !readContent(nullptr, nullptr)) {
+        return false;
+    }
+
+    if (!readDelimiter()) {
+        return false;
+    }
+
+    m_headers.clear();
+    QByteArray line;
+    bool tooLong;
+    while (readLine(m_body, line, tooLong)) {
+        if (line.isEmpty()) {
+            break;
+        }
+        if (tooLong || m_headers.size() == MaxHeaders) {
+            return fail(QStringLiteral("Part headers too large"));
+        }
+
+        const int colon = line.indexOf(':');
+        if (colon < 1) {
+            return fail(QStringLiteral("Malformed part header"));
+        }
+        m_headers.insert(line.left(colon).trimmed().toLower(), line.mid(colon + 1).trimmed());
+    }
+    if (!line.isEmpty() || m_body->atEnd()) {
+        return fail(QStringLiteral("Body ends inside part headers"));
+    }
+
+    // Parts are not searched for the boundary, they must be sized
+    bool ok;
+    m_contentLength = m_headers.value(QByteArrayLiteral("content-length")).toLongLong(&ok);
+    if (!ok || m_contentLength < 0) {
+        return fail(QStringLiteral("Part without a valid Content-Length"));
+    }
+
+    m_pending = true;
+    return true;
+}
+
+bool BulkUploadParser::readContent(QIODevice *out, QCryptographicHash *hash)
+{
+    if (!m_pending) {
+        return false;
+    }
+    m_pending = false;
+
+    char block[64 * 1024];
+    qint64 remaining = m_contentLength;
+    while (remaining > 0) {
+        const qint64 len = m_body->read(block, qMin(remaining, qint64(sizeof(block))));
+        if (len <= 0) {
+            return fail(QStringLiteral("Body ends inside a part"));
+        }
+
+        if (out && out->write(block, len) != len) {
+            out = nullptr;
+        }
+        if (hash) {
+            hash->addData(block, int(len));
+        }
+        remaining -= len;
+    }
+    return true;
+}
+
+bool BulkUploadParser::readDelimiter()
+{
+    QByteArray line;
+    bool tooLong;
+    // Before the first part anything goes, after a part only the CRLF
+    // that belongs to the delimiter
+    while (readLine(m_body, line, tooLong)) {
+        if (line.startsWith(m_delimiter)) {
+            const QByteArray rest = line.mid(m_delimiter.size()).trimmed();
+            if (rest == "--") {
+                m_end = true;
+                return false;
+            }
+            if (rest.isEmpty()) {
+                m_started = true;
+                return true;
+            }
+        }
+
+        if (m_started && !line.isEmpty()) {
+            return fail(QStringLiteral("Part content longer than its Content-Length"));
+        }
+    }
+
+    return fail(QStringLiteral("Body ends without the closing boundary"));
+}
+
+bool BulkUploadParser::fail(const QString &error)
+{
+    m_error = error;
+    m_pending = false;
+    return false;
+}
@@ -0,0 +1,59 @@
+#ifndef BULKUPLOADPARSER_H
+#define BULKUPLOADPARSER_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+
+class QIODevice;
+class QCryptographicHash;
+
+/**
+ * Reads the parts of a Nextcloud bulk upload, a multipart/related body
+ * whose parts carry X-File-Path, X-File-MD5, X-File-Mtime and a
+ * Content-Length.
+ *
+ * Parts are read one after the other from the request body, next() reads
+ * the headers and readContent() copies the content to its destination,
+ * so no part is ever held in memory.
+ */
+class BulkUploadParser
+{
+public:
+    BulkUploadParser(QIODevice *body, const QByteArray &boundary);
+
+    /** The boundary parameter of a multipart/related \p contentType, empty if it is not one */
+    static QByteArray boundary(const QString &contentType);
+
+    /** Moves to the next part and reads its headers, false at the end or on errors */
+    bool next();
+
+    /** A header of the current part, \p name in lower case */
+    QByteArray header(const QByteArray &name) const { return m_headers.value(name); }
+    qint64 contentLength() const { return m_contentLength; }
+
+    /**
+     * Copies the content of the current part to \p out and \p hash, both
+     * may be null. A failed write leaves \p out with its error and only
+     * stops the copy, false means the body itself is broken.
+     */
+    bool readContent(QIODevice *out, QCryptographicHash *hash);
+
+    bool hasError() const { return !m_error.isEmpty(); }
+    QString errorString() const { return m_error; }
+
+private:
+    bool readDelimiter();
+    bool fail(const QString &error);
+
+    QIODevice *m_body;
+    QByteArray m_delimiter;
+    QHash<QByteArray, QByteArray> m_headers;
+    QString m_error;
+    qint64 m_contentLength = -1;
+    bool m_started = false;
+    bool m_pending = false;
+    bool m_end = false;
+};
+
+#endif // BULKUPLOADPARSER_H
@@ -2,6 +2,9 @@
 
 #include <QCoreApplication>
 #include <QMutexLocker>
+#include <QDir>
+#include <QFileInfo>
+#include <QStandardPaths>
 
 #include <Cutelyst/Plugins/Authentication/credentialhttp.h>
 #include <Cutelyst/Plugins/Authentication/minimal.h>
@@ -12,15 +15,70 @@
 
 #include "root.h"
 #include "webdav.h"
+#include "admin.h"
+#include "metrics.h"
+#include "admissioncontrol.h"
+#include "requesttrace.h"
+#include "sqlquery.h"
+#include "asyncpg.h"
+#include "replicarouter.h"
 
 #include <QSqlQuery>
 #include <QSqlError>
 
 #include <QLoggingCategory>
 
+#include <libpq-fe.h>
+
 using namespace Cutelyst;
 
 static QMutex dbMutex;
+static QString replicaConnInfo;
+static QString sqlitePath;
+static int sqliteMmapSize = 256;
+
+// Sets up \p db from a libpq connection string, what QSqlDatabase has no
+// setter for goes into the connect options
+static bool setConnInfo(QSqlDatabase &db, const QString &connInfo)
+{
+    char *error = nullptr;
+    PQconninfoOption *options = PQconninfoParse(connInfo.toUtf8().constData(), &error);
+    if (!options) {
+        qCritical() << "Invalid connection string" << (error ? error : "");
+        PQfreemem(error);
+        return false;
+    }
+
+    QStringList connectOptions;
+    for (PQconninfoOption *option = options; option->keyword; ++option) {
+        if (!option->val) {
+            continue;
+        }
+
+        const QByteArray keyword(option->keyword);
+        const QString value = QString::fromUtf8(option->val);
+        if (keyword == "host") {
+            db.setHostName(value);
+        } else if (keyword == "port") {
+            db.setPort(value.toInt());
+        } else if (keyword == "dbname") {
+            db.setDatabaseName(value);
+        } else if (keyword == "user") {
+            db.setUserName(value);
+        } else if (keyword == "password") {
+            db.setPassword(value);
+        } else {
+            // Quoted as libpq wants, QPSQL joins them with spaces
+            QString quoted = value;
+            quoted.replace(QLatin1Char('\\'), QLatin1String("\\\\")).replace(QLatin1Char('\''), QLatin1String("\\'"));
+            connectOptions.append(QString::fromLatin1(keyword) + QLatin1String("='") + quoted + QLatin1Char('\''));
+        }
+    }
+    PQconninfoFree(options);
+
+    db.setConnectOptions(connectOptions.join(QLatin1Char(';')));
+    return true;
+}
 
 Cloudlyst::Cloudlyst(QObject *parent) : Application(parent)
 {
@@ -33,8 +91,33 @@ Cloudlyst::~Cloudlyst()
 
 bool Cloudlyst::init()
 {
+    SqlQuery::setSlowQueryThreshold(config(QStringLiteral("SqlSlowQuery"), 100).toInt());
+    AsyncPgConnection::setConnInfo(config(QStringLiteral("DatabaseConnInfo"), QStringLiteral("dbname=cloudlyst")).toString());
+    AsyncPgConnection::setPipelineEnabled(config(QStringLiteral("DatabasePipeline"), true).toBool());
+
+    const QString driver = config(QStringLiteral("DatabaseDriver"), QStringLiteral("postgres")).toString();
+    if (driver == QLatin1String("sqlite")) {
+        const QString defaultPath = QStandardPaths::writableLocation(QStandardPaths::DataLocation) + QLatin1String("/cloudlyst.sqlite");
+        setSqliteDatabase(config(QStringLiteral("DatabasePath"), defaultPath).toString(),
+                          config(QStringLiteral("DatabaseMmapSize"), 256).toInt());
+        if (!config(QStringLiteral("DatabaseReplicaConnInfo")).toString().isEmpty()) {
+            qWarning() << "DatabaseReplicaConnInfo is ignored with DatabaseDriver=sqlite";
+        }
+    } else if (driver != QLatin1String("postgres")) {
+        qCritical() << "Unknown DatabaseDriver" << driver;
+        return false;
+    } else {
+        replicaConnInfo = config(QStringLiteral("DatabaseReplicaConnInfo")).toString();
+        if (!ReplicaRouter::setup(replicaConnInfo,
+                                  config(QStringLiteral("ReplicaPollInterval"), 100).toInt(),
+                                  config(QStringLiteral("ReplicaPinTimeout"), 30000).toInt())) {
+            return false;
+        }
+    }
+
     new Root(this);
     new Webdav(this);
+    new Admin(this);
 
     auto httpCred = new CredentialHttp;
     httpCred->setPasswordType(CredentialHttp::None);
@@ -47,11 +130,30 @@ bool Cloudlyst::init()
 
     new Session(this);
 
+    new Metrics(this);
+
+    new AdmissionControl(this);
+
+    new RequestTracer(this);
+
     return true;
 }
 
 bool Cloudlyst::postFork()
 {
+    if (!openDatabase()) {
+        return false;
+    }
+
+    return createDB();
+}
+
+bool Cloudlyst::openDatabase()
+{
+    if (SqlQuery::driver() == SqlQuery::SQLite) {
+        return openSqliteDatabase();
+    }
+
     QMutexLocker locker(&dbMutex);
 
     QSqlDatabase db = QSqlDatabase::addDatabase(QStringLiteral("QPSQL"), Sql::databaseNameThread(QStringLiteral("cloudlyst")));
@@ -61,11 +163,95 @@ bool Cloudlyst::postFork()
         return false;
     }
 
-    return createDB();
+    // Only a few synchronous reads use it, they fall back to the primary
+    if (!replicaConnInfo.isEmpty()) {
+        QSqlDatabase replica = QSqlDatabase::addDatabase(QStringLiteral("QPSQL"), Sql::databaseNameThread(QStringLiteral("cloudlyst_replica")));
+        replica.setDatabaseName(QStringLiteral("cloudlyst"));
+        if (setConnInfo(replica, replicaConnInfo) && !replica.open()) {
+            qWarning() << "Failed to open replica db" << replica.lastError().databaseText();
+        }
+    }
+    return true;
+}
+
+void Cloudlyst::closeDatabase()
+{
+    QMutexLocker locker(&dbMutex);
+
+    SqlQuery::clearThread();
+
+    const QStringList names = {
+        Sql::databaseNameThread(QStringLiteral("cloudlyst")),
+        Sql::databaseNameThread(QStringLiteral("cloudlyst_replica")),
+    };
+    for (const QString &name : names) {
+        if (!QSqlDatabase::contains(name)) {
+            continue;
+        }
+        {
+            QSqlDatabase db = QSqlDatabase::database(name, false);
+            db.close();
+        }
+        QSqlDatabase::removeDatabase(name);
+    }
+}
+
+void Cloudlyst::setSqliteDatabase(const QString &path, int mmapSize)
+{
+    SqlQuery::setDriver(SqlQuery::SQLite);
+    sqlitePath = path;
+    sqliteMmapSize = mmapSize;
+}
+
+bool Cloudlyst::openSqliteDatabase()
+{
+    QMutexLocker locker(&dbMutex);
+
+    QDir().mkpath(QFileInfo(sqlitePath).absolutePath());
+
+    // Statements name their tables cloudlyst.*, so the file is attached
+    // under that schema name to an otherwise unused in memory database
+    QSqlDatabase db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), Sql::databaseNameThread(QStringLiteral("cloudlyst")));
+    db.setDatabaseName(QStringLiteral(":memory:"));
+    db.setConnectOptions(QStringLiteral("QSQLITE_BUSY_TIMEOUT=5000"));
+    if (!db.open()) {
+        qCritical() << "Failed to open db" << db.lastError().databaseText();
+        return false;
+    }
+
+    QSqlQuery query(db);
+    query.prepare(QStringLiteral("ATTACH DATABASE :path AS cloudlyst"));
+    query.bindValue(QStringLiteral(":path"), sqlitePath);
+    if (!query.exec()) {
+        qCritical() << "Failed to open db" << sqlitePath << query.lastError().databaseText();
+        return false;
+    }
+
+    // WAL lets readers in other threads and workers go on while one of
+    // them writes, the parent etag triggers update their own table
+    const QStringList setup = {
+        QStringLiteral("PRAGMA foreign_keys = ON"),
+        QStringLiteral("PRAGMA recursive_triggers = ON"),
+        QStringLiteral("PRAGMA cloudlyst.journal_mode = WAL"),
+        QStringLiteral("PRAGMA cloudlyst.synchronous = NORMAL"),
+        QStringLiteral("PRAGMA cloudlyst.mmap_size = %1").arg(qint64(sqliteMmapSize) * 1024 * 1024),
+        QStringLiteral("CREATE TEMP TABLE removed_ids (id INTEGER)"),
+    };
+    for (const QString &sql : setup) {
+        if (!query.exec(sql)) {
+            qCritical() << "Failed to set up db" << sql << query.lastError().databaseText();
+            return false;
+        }
+    }
+    return true;
 }
 
 bool Cloudlyst::createDB()
 {
+    if (SqlQuery::driver() == SqlQuery::SQLite) {
+        return createSqliteDB();
+    }
+
     QSqlDatabase db = Sql::databaseThread(QStringLiteral("cloudlyst"));
     const QStringList tables = db.tables();
     qDebug() << "tables" << tables;
@@ -122,5 +308,110 @@ bool Cloudlyst::createDB()
         return false;
     }
 
+    // PropertyStorage=jsonb, all dead properties of a file in one row
+    if (!tables.contains(QLatin1String("cloudlyst.file_props")) &&
+            (!query.exec(QStringLiteral("CREATE TABLE cloudlyst.file_props "
+                                        "( file_id bigint PRIMARY KEY REFERENCES cloudlyst.files(id) ON DELETE CASCADE"
+                                        ", props jsonb NOT NULL DEFAULT '{}'"
+                                        ");")) ||
+             !query.exec(QStringLiteral("CREATE INDEX file_props_props_idx ON cloudlyst.file_props USING gin (props)")))) {
+        qDebug() << "error" << query.lastError().databaseText();
+        return false;
+    }
+
+    // PackMaxSize, where the content of packed files is
+    if (!tables.contains(QLatin1String("cloudlyst.file_packs")) &&
+            (!query.exec(QStringLiteral("CREATE TABLE cloudlyst.file_packs "
+                                        "( file_id bigint PRIMARY KEY REFERENCES cloudlyst.files(id) ON DELETE CASCADE"
+                                        ", owner_id integer NOT NULL"
+                                        ", pack_id integer NOT NULL"
+                                        ", pack_offset bigint NOT NULL"
+                                        ", pack_length integer NOT NULL"
+                                        ", etag character varying(40) NOT NULL"
+                                        ");")) ||
+             !query.exec(QStringLiteral("CREATE INDEX file_packs_owner_id_pack_id_idx ON cloudlyst.file_packs (owner_id, pack_id)")))) {
+        qDebug() << "error" << query.lastError().databaseText();
+        return false;
+    }
+
+    return true;
+}
+
+bool Cloudlyst::createSqliteDB()
+{
+    QSqlDatabase db = Sql::databaseThread(QStringLiteral("cloudlyst"));
+    QSqlQuery query(db);
+
+    // The plpgsql procedures are SqlQuery scripts, the triggers are ported
+    // here. Files use AUTOINCREMENT so ids of deleted files aren't reused.
+    const QString touchParent = QStringLiteral("mtime = CAST(strftime('%s', 'now') AS INTEGER), etag = printf('%x%x', mtime, id)");
+    const QStringList schema = {
+        QStringLiteral("CREATE TABLE IF NOT EXISTS cloudlyst.users "
+                       "( id INTEGER PRIMARY KEY"
+                       ", username TEXT UNIQUE NOT NULL"
+                       ", displayname TEXT"
+                       ", password TEXT NOT NULL"
+                       ")"),
+        QStringLiteral("CREATE TABLE IF NOT EXISTS cloudlyst.mimetypes "
+                       "( id INTEGER PRIMARY KEY"
+                       ", name TEXT UNIQUE NOT NULL"
+                       ")"),
+        QStringLiteral("CREATE TABLE IF NOT EXISTS cloudlyst.files "
+                       "( id INTEGER PRIMARY KEY AUTOINCREMENT"
+                       ", parent_id INTEGER REFERENCES files(id) ON DELETE CASCADE"
+                       ", owner_id INTEGER REFERENCES users(id) NOT NULL"
+                       ", path TEXT NOT NULL"
+                       ", name TEXT"
+                       ", mimetype_id INTEGER REFERENCES mimetypes(id)"
+                       ", mtime INTEGER NOT NULL"
+                       ", storage_mtime INTEGER NOT NULL"
+                       ", size INTEGER NOT NULL"
+                       ", etag TEXT NOT NULL"
+                       ", UNIQUE(path, owner_id)"
+                       ")"),
+        QStringLiteral("CREATE INDEX IF NOT EXISTS cloudlyst.files_parent_id_idx ON files (parent_id)"),
+        QStringLiteral("CREATE TABLE IF NOT EXISTS cloudlyst.file_properties "
+                       "( id INTEGER PRIMARY KEY"
+                       ", file_id INTEGER REFERENCES files(id) ON DELETE CASCADE NOT NULL"
+                       ", name TEXT NOT NULL"
+                       ", value TEXT NOT NULL"
+                       ", UNIQUE(file_id, name)"
+                       ")"),
+        QStringLiteral("CREATE TABLE IF NOT EXISTS cloudlyst.file_packs "
+                       "( file_id INTEGER PRIMARY KEY REFERENCES files(id) ON DELETE CASCADE"
+                       ", owner_id INTEGER NOT NULL"
+                       ", pack_id INTEGER NOT NULL"
+                       ", pack_offset INTEGER NOT NULL"
+                       ", pack_length INTEGER NOT NULL"
+                       ", etag TEXT NOT NULL"
+                       ")"),
+        QStringLiteral("CREATE INDEX IF NOT EXISTS cloudlyst.file_packs_owner_id_pack_id_idx ON file_packs (owner_id, pack_id)"),
+        QStringLiteral("CREATE TRIGGER IF NOT EXISTS cloudlyst.files_parent_insert AFTER INSERT ON files "
+                       "BEGIN "
+                       "UPDATE files SET size = size + NEW.size, %1 WHERE id = NEW.parent_id; "
+                       "END").arg(touchParent),
+        QStringLiteral("CREATE TRIGGER IF NOT EXISTS cloudlyst.files_parent_move AFTER UPDATE OF parent_id ON files "
+                       "WHEN NEW.parent_id != OLD.parent_id "
+                       "BEGIN "
+                       "UPDATE files SET size = size - OLD.size, %1 WHERE id = OLD.parent_id; "
+                       "UPDATE files SET size = size + NEW.size, %1 WHERE id = NEW.parent_id; "
+                       "END").arg(touchParent),
+        QStringLiteral("CREATE TRIGGER IF NOT EXISTS cloudlyst.files_parent_size AFTER UPDATE OF size ON files "
+                       "WHEN NEW.parent_id IS OLD.parent_id AND NEW.size != OLD.size "
+                       "BEGIN "
+                       "UPDATE files SET size = size + NEW.size - OLD.size, %1 WHERE id = NEW.parent_id; "
+                       "END").arg(touchParent),
+        QStringLiteral("CREATE TRIGGER IF NOT EXISTS cloudlyst.files_parent_delete AFTER DELETE ON files "
+                       "BEGIN "
+                       "UPDATE files SET size = size - OLD.size, %1 WHERE id = OLD.parent_id; "
+                       "END").arg(touchParent),
+    };
+
+    for (const QString &sql : schema) {
+        if (!query.exec(sql)) {
+            qDebug() << "error" << query.lastError().databaseText();
+            return false;
+        }
+    }
     return true;
 }
@@ -16,7 +16,20 @@ public:
     bool init() override;
     bool postFork() override;
 
-    bool createDB();
+    static bool createDB();
+
+    static bool openDatabase();
+    static void closeDatabase();
+
+    /**
+     * Keeps the metadata in the SQLite database at \p path rather than
+     * in PostgreSQL, call before openDatabase(). \p mmapSize in MiB.
+     */
+    static void setSqliteDatabase(const QString &path, int mmapSize = 256);
+
+private:
+    static bool openSqliteDatabase();
+    static bool createSqliteDB();
 };
 
 #endif //CLOUDLYST_H
@@ -0,0 +1,255 @@
+#include "filecache.h"
+
+#include "metrics.h"
+
+#include <QLoggingCategory>
+
+#include <atomic>
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+Q_LOGGING_CATEGORY(CLOUDLYST_FILECACHE, "cloudlyst.filecache", QtWarningMsg)
+
+namespace {
+
+const int Ways = 4;
+const int DoorkeeperSize = 65536;
+// Expected average record, for sizing the index
+const quint64 AverageRecord = 4096;
+
+struct Entry {
+    // Odd while being written
+    std::atomic<quint32> seq;
+    std::atomic<qint64> fileId;
+    // Where in the ring, counting every byte ever written
+    std::atomic<quint64> pos;
+    std::atomic<quint32> length;
+};
+
+struct Header {
+    std::atomic<quint64> head;
+    // Pid holding the write lock
+    std::atomic<qint64> writer;
+    // Keys that missed once
+    std::atomic<quint64> doorkeeper[DoorkeeperSize];
+};
+
+// Followed by the etag and the content, 8 byte aligned
+struct Record {
+    qint64 fileId;
+    quint32 etagSize;
+    quint32 contentSize;
+};
+
+Header *header = nullptr;
+Entry *entries = nullptr;
+char *ring = nullptr;
+quint64 ringSize = 0;
+quint64 bucketMask = 0;
+qint64 maxSize = 0;
+
+bool alive(qint64 pid)
+{
+    return pid > 0 && (kill(pid_t(pid), 0) == 0 || errno == EPERM);
+}
+
+// FNV-1a, the same in every worker unlike qHash()
+quint64 keyHash(qint64 fileId, const QByteArray &etag)
+{
+    quint64 hash = Q_UINT64_C(14695981039346656037) ^ quint64(fileId);
+    for (char ch : etag) {
+        hash ^= uchar(ch);
+        hash *= Q_UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+inline Entry *bucket(qint64 fileId)
+{
+    return entries + ((quint64(fileId) * Q_UINT64_C(0x9E3779B97F4A7C15) >> 32) & bucketMask) * Ways;
+}
+
+// False once a writer went a whole ring past \p pos
+inline bool current(quint64 pos)
+{
+    return header->head.load(std::memory_order_relaxed) <= pos + ringSize;
+}
+
+bool readEntry(const Entry &entry, qint64 fileId, quint64 &pos, quint32 &length)
+{
+    const quint32 seq = entry.seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+        return false;
+    }
+
+    const qint64 id = entry.fileId.load(std::memory_order_relaxed);
+    pos = entry.pos.load(std::memory_order_relaxed);
+    length = entry.length.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return entry.seq.load(std::memory_order_relaxed) == seq && id == fileId && length;
+}
+
+bool readRecord(quint64 pos, quint32 length, qint64 fileId, const QByteArray &etag, QByteArray &content)
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!current(pos)) {
+        return false;
+    }
+
+    // Whatever is read here may be torn, it only counts if still current after
+    const char *data = ring + pos % ringSize;
+    Record record;
+    memcpy(&record, data, sizeof(record));
+    if (record.fileId != fileId || record.etagSize != quint32(etag.size()) ||
+            sizeof(Record) + record.etagSize + record.contentSize > length ||
+            memcmp(data + sizeof(Record), etag.constData(), size_t(etag.size())) != 0) {
+        return false;
+    }
+    content = QByteArray(data + sizeof(Record) + record.etagSize, int(record.contentSize));
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return current(pos);
+}
+
+bool lock()
+{
+    const qint64 pid = getpid();
+    qint64 owner = 0;
+    if (header->writer.compare_exchange_strong(owner, pid, std::memory_order_acquire)) {
+        return true;
+    }
+
+    // Left behind by a worker that died while writing
+    return owner != pid && !alive(owner) && header->writer.compare_exchange_strong(owner, pid, std::memory_order_acquire);
+}
+
+void unlock()
+{
+    header->writer.store(0, std::memory_order_release);
+}
+
+}
+
+bool FileCache::setup(qint64 size, qint64 maxFileSize)
+{
+    if (size <= 0 || maxFileSize <= 0 || header) {
+        return true;
+    }
+
+    // The ring holds at least a few of the largest files
+    ringSize = (quint64(size) + 7) & ~Q_UINT64_C(7);
+    maxSize = qMin(maxFileSize, size / 16);
+
+    quint64 buckets = 256;
+    while (buckets * Ways * AverageRecord < ringSize) {
+        buckets *= 2;
+    }
+    bucketMask = buckets - 1;
+
+    // Anonymous and shared, so it survives fork() and is visible to every worker
+    const quint64 entriesSize = buckets * Ways * sizeof(Entry);
+    void *mem = mmap(nullptr, sizeof(Header) + entriesSize + ringSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        qCCritical(CLOUDLYST_FILECACHE) << "Failed to map file cache" << strerror(errno);
+        return false;
+    }
+    header = static_cast<Header *>(mem);
+    entries = reinterpret_cast<Entry *>(static_cast<char *>(mem) + sizeof(Header));
+    ring = static_cast<char *>(mem) + sizeof(Header) + entriesSize;
+
+    qCInfo(CLOUDLYST_FILECACHE) << "File cache of" << ringSize << "bytes for files up to" << maxSize << "bytes";
+    return true;
+}
+
+bool FileCache::fits(qint64 size)
+{
+    return header && size <= maxSize;
+}
+
+bool FileCache::find(qint64 fileId, const QString &etag, QByteArray &content)
+{
+    if (!header) {
+        return false;
+    }
+
+    const QByteArray tag = etag.toUtf8();
+    Entry *ways = bucket(fileId);
+    for (int i = 0; i < Ways; ++i) {
+        quint64 pos;
+        quint32 length;
+        if (readEntry(ways[i], fileId, pos, length) && readRecord(pos, length, fileId, tag, content)) {
+            Metrics::recordCache(Metrics::FileCache, true);
+            return true;
+        }
+    }
+    Metrics::recordCache(Metrics::FileCache, false);
+    return false;
+}
+
+bool FileCache::admit(qint64 fileId, const QString &etag)
+{
+    if (!header) {
+        return false;
+    }
+
+    // Never 0, which is an empty slot
+    const quint64 key = keyHash(fileId, etag.toUtf8()) | 1;
+    return header->doorkeeper[(key >> 32) & (DoorkeeperSize - 1)].exchange(key, std::memory_order_relaxed) == key;
+}
+
+void FileCache::insert(qint64 fileId, const QString &etag, const QByteArray &content)
+{
+    if (!header || content.size() > maxSize) {
+        return;
+    }
+
+    const QByteArray tag = etag.toUtf8();
+    const quint64 length = (sizeof(Record) + quint64(tag.size()) + quint64(content.size()) + 7) & ~Q_UINT64_C(7);
+    if (length > ringSize || !lock()) {
+        return;
+    }
+
+    // Records don't wrap around, the end of the ring is skipped instead
+    quint64 pos = header->head.load(std::memory_order_relaxed);
+    if (pos % ringSize + length > ringSize) {
+        pos += ringSize - pos % ringSize;
+    }
+
+    // Readers see the new head before the bytes they are copying change
+    header->head.store(pos + length, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    char *data = ring + pos % ringSize;
+    const Record record = { fileId, quint32(tag.size()), quint32(content.size()) };
+    memcpy(data, &record, sizeof(record));
+    memcpy(data + sizeof(Record), tag.constData(), size_t(tag.size()));
+    memcpy(data + sizeof(Record) + tag.size(), content.constData(), size_t(content.size()));
+
+    // The way of an older version of the file, or the one written longest ago
+    Entry *ways = bucket(fileId);
+    Entry *victim = ways;
+    for (int i = 0; i < Ways; ++i) {
+        if (ways[i].fileId.load(std::memory_order_relaxed) == fileId) {
+            victim = ways + i;
+            break;
+        } else if (ways[i].pos.load(std::memory_order_relaxed) < victim->pos.load(std::memory_order_relaxed)) {
+            victim = ways + i;
+        }
+    }
+
+    // Still odd if its last writer died halfway
+    const quint32 seq = victim->seq.load(std::memory_order_relaxed) | 1;
+    victim->seq.store(seq, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    victim->fileId.store(fileId, std::memory_order_relaxed);
+    victim->pos.store(pos, std::memory_order_relaxed);
+    victim->length.store(quint32(length), std::memory_order_relaxed);
+    victim->seq.store(seq + 1, std::memory_order_release);
+
+    unlock();
+}
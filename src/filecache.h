@@ -0,0 +1,39 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <QByteArray>
+#include <QString>
+
+/**
+ * Content of small files read again and again, such as icons and config
+ * files, kept once for all workers in memory mapped before fork.
+ *
+ * Files of up to FileCacheMaxFile KiB are appended to a ring of
+ * FileCacheSize MiB that overwrites the oldest first, keyed by file id
+ * and etag so a changed file is never served from it. A file only gets
+ * in on its second miss, so one-off downloads don't push the hot set
+ * out.
+ *
+ * Readers take no lock, they copy an entry and check that no writer went
+ * a whole ring past it meanwhile. Writers take a lock in the mapping, a
+ * writer finding it taken skips caching that file this time.
+ */
+class FileCache
+{
+public:
+    /** Called before forking, sizes in bytes, a \p size of 0 turns it off */
+    static bool setup(qint64 size, qint64 maxFileSize);
+
+    /** Whether a file of \p size is cached */
+    static bool fits(qint64 size);
+
+    /** The content of \p fileId at \p etag, counted as a hit or a miss */
+    static bool find(qint64 fileId, const QString &etag, QByteArray &content);
+
+    /** Whether a miss of \p fileId at \p etag should be inserted, which is from the second on */
+    static bool admit(qint64 fileId, const QString &etag);
+
+    static void insert(qint64 fileId, const QString &etag, const QByteArray &content);
+};
+
+#endif // FILECACHE_H
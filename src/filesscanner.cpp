@@ -0,0 +1,573 @@
+#include "filesscanner.h"
+
+#include "filessql.h"
+#include "sqlquery.h"
+#include "storedfile.h"
+
+#include <Cutelyst/Plugins/Utils/Sql>
+
+#include <QSqlQuery>
+#include <QSqlError>
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSet>
+
+#include <QLoggingCategory>
+
+#include <algorithm>
+#include <memory>
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+
+Q_LOGGING_CATEGORY(CLOUDLYST_SCAN, "cloudlyst.scan", QtInfoMsg)
+
+using namespace Cutelyst;
+
+IoRateLimiter::IoRateLimiter(qint64 bytesPerSecond) : m_rate(bytesPerSecond)
+{
+}
+
+void IoRateLimiter::setRate(qint64 bytesPerSecond)
+{
+    QMutexLocker locker(&m_mutex);
+    m_rate = bytesPerSecond;
+    m_tokens = 0;
+    m_lastRefill = 0;
+}
+
+void IoRateLimiter::acquire(qint64 bytes)
+{
+    if (m_rate <= 0) {
+        return;
+    }
+
+    qint64 sleepMs = 0;
+    {
+        QMutexLocker locker(&m_mutex);
+        const qint64 now = QDateTime::currentMSecsSinceEpoch();
+        if (m_lastRefill) {
+            // Allow at most one second worth of burst
+            m_tokens = qMin<double>(m_rate, m_tokens + double(now - m_lastRefill) * m_rate / 1000.0);
+        }
+        m_lastRefill = now;
+        m_tokens -= bytes;
+        if (m_tokens < 0) {
+            sleepMs = qint64(-m_tokens * 1000.0 / m_rate);
+        }
+    }
+
+    if (sleepMs > 0) {
+        QThread::msleep(sleepMs);
+    }
+}
+
+namespace {
+
+struct WalkContext
+{
+    QByteArray root;
+    QThreadPool *pool;
+    QMutex *mutex;
+    std::vector<ScanEntry> *entries;
+    // Paths that couldn't be read, relative to root
+    QStringList *failed;
+    qint64 dirs = 0;
+    qint64 files = 0;
+    qint64 errors = 0;
+};
+
+#ifdef Q_OS_LINUX
+struct cloudlyst_dirent64 {
+    quint64 d_ino;
+    qint64 d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+class DirTask : public QRunnable
+{
+public:
+    DirTask(WalkContext *ctx, const QByteArray &relPath) : m_ctx(ctx), m_relPath(relPath) {}
+
+    void run() override
+    {
+        const QByteArray absPath = m_ctx->root + m_relPath;
+        int fd = ::open(absPath.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            qCWarning(CLOUDLYST_SCAN) << "Failed to open directory" << absPath << qt_error_string(errno);
+            fail(m_relPath);
+            return;
+        }
+
+        std::vector<ScanEntry> entries;
+        qint64 dirs = 0;
+        qint64 files = 0;
+
+        char buf[32 * 1024];
+        for (;;) {
+            const long nread = ::syscall(SYS_getdents64, fd, buf, sizeof(buf));
+            if (nread == -1) {
+                qCWarning(CLOUDLYST_SCAN) << "Failed to read directory" << absPath << qt_error_string(errno);
+                fail(m_relPath);
+                break;
+            } else if (nread == 0) {
+                break;
+            }
+
+            for (long pos = 0; pos < nread;) {
+                auto dirent = reinterpret_cast<cloudlyst_dirent64 *>(buf + pos);
+                pos += dirent->d_reclen;
+
+                const char *name = dirent->d_name;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                    continue;
+                }
+
+                const QByteArray relPath = m_relPath + '/' + name;
+                ScanEntry entry;
+#ifdef STATX_BASIC_STATS
+                struct statx stx;
+                if (::statx(fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                            STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx) == -1) {
+                    qCWarning(CLOUDLYST_SCAN) << "Failed to stat" << m_ctx->root + relPath << qt_error_string(errno);
+                    fail(relPath);
+                    continue;
+                }
+                const mode_t mode = stx.stx_mode;
+                entry.size = qint64(stx.stx_size);
+                entry.mtime = qint64(stx.stx_mtime.tv_sec);
+#else
+                struct stat st;
+                if (::fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                    qCWarning(CLOUDLYST_SCAN) << "Failed to stat" << m_ctx->root + relPath << qt_error_string(errno);
+                    fail(relPath);
+                    continue;
+                }
+                const mode_t mode = st.st_mode;
+                entry.size = qint64(st.st_size);
+                entry.mtime = qint64(st.st_mtime);
+#endif
+                if (S_ISDIR(mode)) {
+                    entry.dir = true;
+                    entry.size = 0;
+                    ++dirs;
+                    m_ctx->pool->start(new DirTask(m_ctx, relPath));
+                } else if (S_ISREG(mode)) {
+                    ++files;
+                } else {
+                    continue;
+                }
+                entry.path = QFile::decodeName(relPath);
+                entries.push_back(entry);
+            }
+        }
+        ::close(fd);
+
+        QMutexLocker locker(m_ctx->mutex);
+        m_ctx->dirs += dirs;
+        m_ctx->files += files;
+        m_ctx->entries->insert(m_ctx->entries->end(), entries.begin(), entries.end());
+    }
+
+private:
+    void fail(const QByteArray &relPath)
+    {
+        QMutexLocker locker(m_ctx->mutex);
+        m_ctx->failed->append(QFile::decodeName(relPath));
+        ++m_ctx->errors;
+    }
+
+    WalkContext *m_ctx;
+    QByteArray m_relPath;
+};
+#endif
+
+class HashTask : public QRunnable
+{
+public:
+    HashTask(const QString &fileName, QString *etag, qint64 *size, IoRateLimiter *limiter, QMutex *mutex, ScanStats *stats)
+        : m_fileName(fileName), m_etag(etag), m_size(size), m_limiter(limiter), m_mutex(mutex), m_stats(stats) {}
+
+    void run() override
+    {
+        // The content, as PUT hashes it, also when compressed at rest
+        QString error;
+        std::unique_ptr<QIODevice> file(StoredFile::open(m_fileName, error));
+        if (!file) {
+            qCWarning(CLOUDLYST_SCAN) << "Failed to open file for hashing" << m_fileName << error;
+            QMutexLocker locker(m_mutex);
+            ++m_stats->errors;
+            return;
+        }
+
+        QCryptographicHash hash(QCryptographicHash::Md5);
+        qint64 total = 0;
+        char block[64 * 1024];
+        while (!file->atEnd()) {
+            m_limiter->acquire(sizeof(block));
+            const qint64 in = file->read(block, sizeof(block));
+            if (in <= 0) {
+                break;
+            }
+            hash.addData(block, int(in));
+            total += in;
+        }
+        *m_etag = QString::fromLatin1(hash.result().toHex());
+        *m_size = file->size();
+
+        QMutexLocker locker(m_mutex);
+        ++m_stats->hashedFiles;
+        m_stats->hashedBytes += total;
+    }
+
+private:
+    QString m_fileName;
+    QString *m_etag;
+    qint64 *m_size;
+    IoRateLimiter *m_limiter;
+    QMutex *m_mutex;
+    ScanStats *m_stats;
+};
+
+}
+
+FilesScanner::FilesScanner(QObject *parent) : QObject(parent)
+  , m_threads(QThread::idealThreadCount())
+{
+}
+
+void FilesScanner::setThreads(int threads)
+{
+    m_threads = qMax(1, threads);
+}
+
+void FilesScanner::setRateLimit(qint64 bytesPerSecond)
+{
+    m_rateLimiter.setRate(bytesPerSecond);
+}
+
+void FilesScanner::setBatchSize(int batchSize)
+{
+    m_batchSize = qMax(1, batchSize);
+}
+
+void FilesScanner::setDryRun(bool dryRun)
+{
+    m_dryRun = dryRun;
+}
+
+bool FilesScanner::scan(const QString &userDir, const QVariant &userId)
+{
+    m_stats = ScanStats();
+    m_entries.clear();
+    m_dbEntries.clear();
+    m_failed.clear();
+    m_error.clear();
+
+    QString root = userDir;
+    if (!root.endsWith(QLatin1Char('/'))) {
+        root.append(QLatin1Char('/'));
+    }
+
+    if (!QFileInfo(root + QLatin1String("files")).isDir()) {
+        m_error = QLatin1String("Not a data directory: ") + root;
+        return false;
+    }
+
+    // The rows are loaded before walking, so one added meanwhile is at
+    // worst upserted again and never removed for not having been walked
+    QElapsedTimer timer;
+    timer.start();
+    if (!loadDatabase(userId)) {
+        return false;
+    }
+
+    walk(root);
+    std::sort(m_entries.begin(), m_entries.end(), [] (const ScanEntry &a, const ScanEntry &b) {
+        return a.path < b.path;
+    });
+    m_stats.walkMs = timer.restart();
+
+    // Parents sort before their children, so inserts can be applied in order
+    std::vector<ScanEntry> changed;
+    std::vector<QString> removed;
+    QSet<QString> seen;
+    seen.reserve(int(m_entries.size()));
+    for (const ScanEntry &entry : m_entries) {
+        seen.insert(entry.path);
+        auto it = m_dbEntries.constFind(entry.path);
+        if (it == m_dbEntries.constEnd()) {
+            changed.push_back(entry);
+        } else if (it->dir != entry.dir) {
+            removed.push_back(entry.path);
+            changed.push_back(entry);
+        } else if (!entry.dir && (it->storageMtime != entry.mtime ||
+                                  (it->size != entry.size && StoredFile::contentSize(root + entry.path, entry.size) != it->size))) {
+            // Files compressed at rest are smaller on disk than in the database
+            changed.push_back(entry);
+        }
+    }
+
+    // Nothing under a path that couldn't be read counts as missing
+    auto unreadable = [this] (const QString &path) {
+        for (const QString &failed : m_failed) {
+            if (path.startsWith(failed) && (path.size() == failed.size() || path.at(failed.size()) == QLatin1Char('/'))) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    QStringList missing;
+    for (auto it = m_dbEntries.constBegin(); it != m_dbEntries.constEnd(); ++it) {
+        if (it.key() != QLatin1String("files") && !it->packed && !seen.contains(it.key()) && !unreadable(it.key())) {
+            missing.append(it.key());
+        }
+    }
+    missing.sort();
+
+    // Children go away with ON DELETE CASCADE, only remove the topmost rows
+    QSet<QString> missingSet;
+    for (const QString &path : missing) {
+        const QString parent = FilesSql::parentPath(path);
+        if (!missingSet.contains(parent)) {
+            removed.push_back(path);
+        }
+        missingSet.insert(path);
+    }
+
+    std::vector<QString> etags(changed.size());
+    hashChanged(root, changed, etags);
+    m_stats.hashMs = timer.restart();
+
+    const bool ret = apply(root, userId, changed, etags, removed);
+    m_stats.applyMs = timer.elapsed();
+
+    qCInfo(CLOUDLYST_SCAN).noquote() << root << report();
+
+    return ret;
+}
+
+ScanStats FilesScanner::stats() const
+{
+    return m_stats;
+}
+
+QString FilesScanner::report() const
+{
+    const qint64 entries = m_stats.dirs + m_stats.files;
+    const double walkSecs = qMax<qint64>(1, m_stats.walkMs) / 1000.0;
+    const double hashSecs = qMax<qint64>(1, m_stats.hashMs) / 1000.0;
+    const double applySecs = qMax<qint64>(1, m_stats.applyMs) / 1000.0;
+    const qint64 applied = m_stats.inserted + m_stats.updated + m_stats.deleted;
+
+    return QStringLiteral("walked %1 dirs, %2 files in %3s (%4 entries/s); "
+                          "hashed %5 files, %6 MiB in %7s (%8 MiB/s); "
+                          "applied %9 inserts, %10 updates, %11 deletes in %12s (%13 rows/s); %14 errors%15")
+            .arg(m_stats.dirs)
+            .arg(m_stats.files)
+            .arg(walkSecs, 0, 'f', 2)
+            .arg(qint64(entries / walkSecs))
+            .arg(m_stats.hashedFiles)
+            .arg(m_stats.hashedBytes / (1024.0 * 1024.0), 0, 'f', 1)
+            .arg(hashSecs, 0, 'f', 2)
+            .arg(m_stats.hashedBytes / (1024.0 * 1024.0) / hashSecs, 0, 'f', 1)
+            .arg(m_stats.inserted)
+            .arg(m_stats.updated)
+            .arg(m_stats.deleted)
+            .arg(applySecs, 0, 'f', 2)
+            .arg(qint64(applied / applySecs))
+            .arg(m_stats.errors)
+            .arg(m_dryRun ? QStringLiteral(" (dry run)") : QString());
+}
+
+QString FilesScanner::errorString() const
+{
+    return m_error;
+}
+
+void FilesScanner::walk(const QString &userDir)
+{
+#ifdef Q_OS_LINUX
+    QThreadPool pool;
+    pool.setMaxThreadCount(m_threads);
+
+    WalkContext ctx;
+    ctx.root = QFile::encodeName(userDir);
+    ctx.pool = &pool;
+    ctx.mutex = &m_entriesMutex;
+    ctx.entries = &m_entries;
+    ctx.failed = &m_failed;
+
+    // Tasks queue their subdirectories before finishing, so waitForDone()
+    // only returns once the whole tree was visited
+    pool.start(new DirTask(&ctx, QByteArrayLiteral("files")));
+    pool.waitForDone();
+
+    m_stats.dirs = ctx.dirs;
+    m_stats.files = ctx.files;
+    m_stats.errors += ctx.errors;
+#else
+    QDirIterator it(userDir + QLatin1String("files"), QDir::Dirs | QDir::Files | QDir::Hidden | QDir::NoDotAndDotDot,
+                    QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        it.next();
+        const QFileInfo info = it.fileInfo();
+        if (info.isSymLink()) {
+            continue;
+        }
+
+        ScanEntry entry;
+        entry.path = info.absoluteFilePath().mid(userDir.size());
+        if (info.isDir() && !info.isReadable()) {
+            // QDirIterator silently skips what it can't list
+            qCWarning(CLOUDLYST_SCAN) << "Failed to read directory" << info.absoluteFilePath();
+            m_failed.append(entry.path);
+            ++m_stats.errors;
+        }
+        entry.mtime = info.lastModified().toSecsSinceEpoch();
+        entry.dir = info.isDir();
+        if (entry.dir) {
+            ++m_stats.dirs;
+        } else {
+            entry.size = info.size();
+            ++m_stats.files;
+        }
+        m_entries.push_back(entry);
+    }
+#endif
+}
+
+bool FilesScanner::loadDatabase(const QVariant &userId)
+{
+    SqlQuery query(SqlQuery::FilesScanList);
+    query.setForwardOnly(true);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    if (!query.exec()) {
+        m_error = query.lastError().databaseText();
+        return false;
+    }
+
+    while (query.next()) {
+        DbEntry entry;
+        entry.size = query.value(1).toLongLong();
+        entry.storageMtime = query.value(2).toLongLong();
+        entry.dir = query.value(3).toBool();
+        entry.packed = query.value(4).toBool();
+        m_dbEntries.insert(query.value(0).toString(), entry);
+    }
+    return true;
+}
+
+void FilesScanner::hashChanged(const QString &userDir, std::vector<ScanEntry> &changed, std::vector<QString> &etags)
+{
+    QThreadPool pool;
+    pool.setMaxThreadCount(m_threads);
+
+    for (size_t i = 0; i < changed.size(); ++i) {
+        const ScanEntry &entry = changed[i];
+        if (entry.dir) {
+            // Same scheme MKCOL uses for collections
+            const QByteArray mtime = QDateTime::fromSecsSinceEpoch(entry.mtime).toUTC().toString(Qt::ISODate).toLatin1();
+            etags[i] = QString::fromLatin1(QCryptographicHash::hash(mtime, QCryptographicHash::Md5).toHex());
+        } else {
+            pool.start(new HashTask(userDir + entry.path, &etags[i], &changed[i].size, &m_rateLimiter, &m_entriesMutex, &m_stats));
+        }
+    }
+    pool.waitForDone();
+}
+
+bool FilesScanner::apply(const QString &userDir, const QVariant &userId,
+                         const std::vector<ScanEntry> &changed, const std::vector<QString> &etags,
+                         const std::vector<QString> &removed)
+{
+    if (m_dryRun) {
+        for (const QString &path : removed) {
+            qCInfo(CLOUDLYST_SCAN) << "would remove" << path;
+        }
+        for (const ScanEntry &entry : changed) {
+            qCInfo(CLOUDLYST_SCAN) << "would upsert" << entry.path << entry.size << entry.mtime;
+        }
+        return true;
+    }
+
+    QSqlDatabase db = Sql::databaseThread(QStringLiteral("cloudlyst"));
+
+    // Removals first: a path that changed type is removed and then inserted again
+    const size_t total = removed.size() + changed.size();
+    auto applyOne = [&] (size_t i, QString &error) -> bool {
+        if (i < removed.size()) {
+            return FilesSql::remove(removed[i], userId, error) >= 0;
+        }
+
+        const size_t c = i - removed.size();
+        const ScanEntry &entry = changed[c];
+        if (!entry.dir && etags[c].isEmpty()) {
+            error = QLatin1String("File could not be hashed");
+            return false;
+        }
+
+        const QString mimetype = entry.dir ? QStringLiteral("httpd/unix-directory")
+                                           : m_mimeDb.mimeTypeForFile(userDir + entry.path).name();
+        const int slash = entry.path.lastIndexOf(QLatin1Char('/'));
+        return FilesSql::put(entry.path, FilesSql::parentPath(entry.path), entry.path.mid(slash + 1),
+                             entry.mtime, entry.mtime, mimetype, entry.size, etags[c], userId, error);
+    };
+
+    auto count = [&] (size_t i) {
+        if (i < removed.size()) {
+            ++m_stats.deleted;
+        } else if (m_dbEntries.contains(changed[i - removed.size()].path)) {
+            ++m_stats.updated;
+        } else {
+            ++m_stats.inserted;
+        }
+    };
+
+    for (size_t begin = 0; begin < total; begin += size_t(m_batchSize)) {
+        const size_t end = qMin(total, begin + size_t(m_batchSize));
+
+        QString error;
+        bool ok = db.transaction();
+        for (size_t i = begin; ok && i < end; ++i) {
+            ok = applyOne(i, error);
+        }
+
+        if (ok && db.commit()) {
+            for (size_t i = begin; i < end; ++i) {
+                count(i);
+            }
+            continue;
+        }
+
+        // Some statement failed and aborted the transaction, retry one by one
+        // so a single bad entry doesn't discard the whole batch
+        qCWarning(CLOUDLYST_SCAN) << "Batch failed, retrying individually" << error;
+        db.rollback();
+        for (size_t i = begin; i < end; ++i) {
+            if (applyOne(i, error)) {
+                count(i);
+            } else {
+                qCWarning(CLOUDLYST_SCAN) << "Failed to apply" << i << error;
+                ++m_stats.errors;
+            }
+        }
+    }
+
+    return m_stats.errors == 0;
+}
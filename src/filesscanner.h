@@ -0,0 +1,113 @@
+#ifndef FILESSCANNER_H
+#define FILESSCANNER_H
+
+#include <QObject>
+#include <QHash>
+#include <QMutex>
+#include <QMimeDatabase>
+#include <QStringList>
+#include <QVariant>
+
+#include <vector>
+
+struct ScanEntry
+{
+    QString path;
+    qint64 size = 0;
+    qint64 mtime = 0;
+    bool dir = false;
+};
+
+struct ScanStats
+{
+    qint64 dirs = 0;
+    qint64 files = 0;
+    qint64 hashedFiles = 0;
+    qint64 hashedBytes = 0;
+    qint64 inserted = 0;
+    qint64 updated = 0;
+    qint64 deleted = 0;
+    qint64 errors = 0;
+    qint64 walkMs = 0;
+    qint64 hashMs = 0;
+    qint64 applyMs = 0;
+};
+
+/**
+ * Token bucket used to cap the read bandwidth of a scan so it can
+ * run on a live node without starving regular requests.
+ */
+class IoRateLimiter
+{
+public:
+    explicit IoRateLimiter(qint64 bytesPerSecond = 0);
+
+    void setRate(qint64 bytesPerSecond);
+    void acquire(qint64 bytes);
+
+private:
+    QMutex m_mutex;
+    qint64 m_rate;
+    double m_tokens = 0;
+    qint64 m_lastRefill = 0;
+};
+
+/**
+ * Reconciles a user's data directory with cloudlyst.files.
+ *
+ * The tree is walked in parallel, entries are compared against the
+ * database by size and storage mtime, only new or changed files are
+ * hashed and the resulting fixes are applied in batched transactions
+ * using the thread's "cloudlyst" connection.
+ */
+class FilesScanner : public QObject
+{
+    Q_OBJECT
+public:
+    explicit FilesScanner(QObject *parent = nullptr);
+
+    void setThreads(int threads);
+    void setRateLimit(qint64 bytesPerSecond);
+    void setBatchSize(int batchSize);
+    void setDryRun(bool dryRun);
+
+    /**
+     * Scans \p userDir (the directory holding "files") owned by \p userId,
+     * blocks until done.
+     */
+    bool scan(const QString &userDir, const QVariant &userId);
+
+    ScanStats stats() const;
+    QString report() const;
+    QString errorString() const;
+
+private:
+    struct DbEntry {
+        qint64 size;
+        qint64 storageMtime;
+        bool dir;
+        // Only in the database, see PackStore
+        bool packed;
+    };
+
+    void walk(const QString &userDir);
+    bool loadDatabase(const QVariant &userId);
+    void hashChanged(const QString &userDir, std::vector<ScanEntry> &changed, std::vector<QString> &etags);
+    bool apply(const QString &userDir, const QVariant &userId,
+               const std::vector<ScanEntry> &changed, const std::vector<QString> &etags,
+               const std::vector<QString> &removed);
+
+    QMimeDatabase m_mimeDb;
+    IoRateLimiter m_rateLimiter;
+    QMutex m_entriesMutex;
+    std::vector<ScanEntry> m_entries;
+    QHash<QString, DbEntry> m_dbEntries;
+    QStringList m_failed;
+    ScanStats m_stats;
+    QString m_error;
+    int m_threads;
+    int m_batchSize = 500;
+    bool m_dryRun = false;
+};
+
+#endif // FILESSCANNER_H
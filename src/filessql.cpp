@@ -0,0 +1,105 @@
+#include "filessql.h"
+
+#include "sqlquery.h"
+
+#include <QSqlError>
+
+#include <QFileInfo>
+#include <QDateTime>
+#include <QMimeDatabase>
+
+bool FilesSql::put(const QString &path, const QString &parentPath, const QString &name,
+                   qint64 mtime, qint64 storageMtime, const QString &mimetype, qint64 size,
+                   const QString &etag, const QVariant &userId, QString &error)
+{
+    SqlQuery query(SqlQuery::FilesPut);
+
+    query.bindValue(QStringLiteral(":path"), path);
+    query.bindValue(QStringLiteral(":parent_path"), parentPath);
+    query.bindValue(QStringLiteral(":name"), name);
+    query.bindValue(QStringLiteral(":mtime"), mtime);
+    query.bindValue(QStringLiteral(":storage_mtime"), storageMtime);
+    query.bindValue(QStringLiteral(":mimetype"), mimetype);
+    query.bindValue(QStringLiteral(":size"), size);
+    query.bindValue(QStringLiteral(":etag"), etag);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    if (query.exec()) {
+        return true;
+    } else {
+        error = query.lastError().databaseText();
+        return false;
+    }
+}
+
+bool FilesSql::upsert(const QString &path, const QFileInfo &info, qint64 size, qint64 mTime,
+                      const QString &etag, const QVariant &userId, QString &error)
+{
+    const qint64 storageMTime = info.lastModified().toSecsSinceEpoch();
+
+    return put(path, parentPath(path), info.fileName(), mTime ? mTime : storageMTime, storageMTime,
+               mimetype(info), info.isDir() ? 0 : size >= 0 ? size : info.size(), etag, userId, error);
+}
+
+QString FilesSql::mimetype(const QFileInfo &info)
+{
+    if (info.isDir()) {
+        return QStringLiteral("httpd/unix-directory");
+    }
+
+    // QMimeDatabase is thread safe and shares its data between instances
+    QMimeDatabase db;
+    return db.mimeTypeForFile(info).name();
+}
+
+int FilesSql::remove(const QString &path, const QVariant &userId, QString &error)
+{
+    SqlQuery query(SqlQuery::FilesRemove);
+
+    query.bindValue(QStringLiteral(":path"), path);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    if (query.exec()) {
+        return query.numRowsAffected();
+    } else {
+        error = query.lastError().databaseText();
+        return -1;
+    }
+}
+
+FileItem FilesSql::itemById(qint64 id, const QVariant &userId, QString &error)
+{
+    FileItem ret;
+
+    SqlQuery query(SqlQuery::FilesItemById);
+
+    query.bindValue(QStringLiteral(":id"), id);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    if (query.exec()) {
+        if (query.next()) {
+            ret.id = query.value(0).toLongLong();
+            ret.path = query.value(1).toString();
+            ret.name = query.value(2).toString();
+            ret.size = query.value(3).toLongLong();
+            ret.mimetype = query.value(4).toString();
+            ret.etag = query.value(5).toString();
+            ret.mtime = query.value(6).toLongLong();
+            ret.packId = query.value(7).toInt();
+            ret.packOffset = query.value(8).toLongLong();
+            ret.packLength = query.value(9).toInt();
+        }
+    } else {
+        error = query.lastError().databaseText();
+    }
+    return ret;
+}
+
+QString FilesSql::parentPath(const QString &path)
+{
+    const int pos = path.lastIndexOf(QLatin1Char('/'));
+    if (pos == -1) {
+        return QString();
+    }
+    return path.left(pos);
+}
@@ -0,0 +1,56 @@
+#ifndef FILESSQL_H
+#define FILESSQL_H
+
+#include <QHash>
+#include <QString>
+#include <QVariant>
+
+class QFileInfo;
+
+struct FileItem
+{
+    QString path;
+    QString name;
+    QString etag;
+    QString mimetype;
+    qint64 mtime = -1;
+    qint64 id = 0;
+    qint64 size = -1;
+    // Where the content is when packed, see PackStore
+    int packId = 0;
+    qint64 packOffset = 0;
+    int packLength = 0;
+    // Dead properties, only filled with PropertyStorage=jsonb
+    QHash<QString, QString> properties;
+};
+
+/**
+ * Synchronous access to the cloudlyst.files table, shared by the
+ * WebDAV controller and the background scanner so that both go through
+ * the same stored procedures.
+ */
+class FilesSql
+{
+public:
+    static bool put(const QString &path, const QString &parentPath, const QString &name,
+                    qint64 mtime, qint64 storageMtime, const QString &mimetype, qint64 size,
+                    const QString &etag, const QVariant &userId, QString &error);
+
+    /**
+     * Upserts \p path from what is on disk, the same way a PUT or MKCOL
+     * does, \p mTime overrides the file mtime when not zero and \p size
+     * the file size when not negative, for files compressed at rest.
+     */
+    static bool upsert(const QString &path, const QFileInfo &info, qint64 size, qint64 mTime,
+                       const QString &etag, const QVariant &userId, QString &error);
+
+    static int remove(const QString &path, const QVariant &userId, QString &error);
+
+    static FileItem itemById(qint64 id, const QVariant &userId, QString &error);
+
+    static QString mimetype(const QFileInfo &info);
+
+    static QString parentPath(const QString &path);
+};
+
+#endif // FILESSQL_H
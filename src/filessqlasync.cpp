@@ -0,0 +1,347 @@
+#include "filessqlasync.h"
+
+#include "asyncpg.h"
+#include "replicarouter.h"
+#include "webdavpgsqlpropertystorage.h"
+
+#include <QFileInfo>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QPointer>
+#include <QTimer>
+
+static bool inlineProps = false;
+static FilesSqlAsync::RemovedCallback removedHook;
+
+static FileItem fileItem(const AsyncPgResult &result, int row, bool props)
+{
+    FileItem ret;
+    ret.id = result.toLongLong(row, 0);
+    ret.path = result.value(row, 1);
+    ret.name = result.value(row, 2);
+    ret.size = result.toLongLong(row, 3);
+    ret.mimetype = result.value(row, 4);
+    ret.etag = result.value(row, 5);
+    ret.mtime = result.toLongLong(row, 6);
+    if (!result.isNull(row, 7)) {
+        ret.packId = int(result.toLongLong(row, 7));
+        ret.packOffset = result.toLongLong(row, 8);
+        ret.packLength = int(result.toLongLong(row, 9));
+    }
+    if (props && !result.isNull(row, 10)) {
+        const QJsonObject props = QJsonDocument::fromJson(result.value(row, 10).toUtf8()).object();
+        for (auto it = props.constBegin(); it != props.constEnd(); ++it) {
+            ret.properties.insert(it.key(), it.value().toString());
+        }
+    }
+    return ret;
+}
+
+static AsyncPgCallback rowsCallback(FilesSqlAsync::RowsCallback callback, bool select)
+{
+    if (!callback) {
+        return AsyncPgCallback();
+    }
+
+    return [callback, select] (AsyncPgResult &result) {
+        if (result.error()) {
+            callback(-1, result.errorString());
+        } else {
+            callback(select ? result.size() : result.numRowsAffected(), QString());
+        }
+    };
+}
+
+static AsyncPgCallback propertiesCallback(FilesSqlAsync::PropertiesCallback callback)
+{
+    return [callback] (AsyncPgResult &result) {
+        PathPropertyHash properties;
+        const int size = result.size();
+        for (int i = 0; i < size; ++i) {
+            properties[result.toLongLong(i, 0)].insert(result.value(i, 1), result.value(i, 2));
+        }
+        callback(properties, result.errorString());
+    };
+}
+
+void FilesSqlAsync::setInlineProperties(bool enabled)
+{
+    inlineProps = enabled;
+}
+
+void FilesSqlAsync::setRemovedHook(RemovedCallback hook)
+{
+    removedHook = hook;
+}
+
+bool FilesSqlAsync::inlineProperties()
+{
+    return inlineProps;
+}
+
+void FilesSqlAsync::item(const QString &path, const QVariant &userId, QObject *receiver, ItemCallback callback)
+{
+    AsyncPgQuery query(inlineProps ? SqlQuery::FilesItemByPathProps : SqlQuery::FilesItemByPath);
+    query.bindValue(QStringLiteral(":path"), path);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    query.exec(ReplicaRouter::readConnection(userId), receiver, [callback] (AsyncPgResult &result) {
+        if (result.size()) {
+            callback(fileItem(result, 0, inlineProps), QString());
+        } else {
+            callback(FileItem(), result.errorString());
+        }
+    });
+}
+
+void FilesSqlAsync::children(qint64 parentId, const QVariant &userId, QObject *receiver, ItemsCallback callback)
+{
+    AsyncPgQuery query(inlineProps ? SqlQuery::FilesChildrenProps : SqlQuery::FilesChildren);
+    query.bindValue(QStringLiteral(":parent_id"), parentId);
+
+    query.exec(ReplicaRouter::readConnection(userId), receiver, [callback] (AsyncPgResult &result) {
+        std::vector<FileItem> items;
+        const int size = result.size();
+        items.reserve(size_t(size));
+        for (int i = 0; i < size; ++i) {
+            items.push_back(fileItem(result, i, inlineProps));
+        }
+        callback(items, result.errorString());
+    });
+}
+
+void FilesSqlAsync::upsert(const QString &path, const QFileInfo &info, qint64 size, qint64 mTime, const QString &etag,
+                           const QVariant &userId, QObject *receiver, RowsCallback callback)
+{
+    const qint64 storageMTime = info.lastModified().toSecsSinceEpoch();
+
+    AsyncPgQuery query(SqlQuery::FilesPut);
+    query.bindValue(QStringLiteral(":path"), path);
+    query.bindValue(QStringLiteral(":parent_path"), FilesSql::parentPath(path));
+    query.bindValue(QStringLiteral(":name"), info.fileName());
+    query.bindValue(QStringLiteral(":mtime"), mTime ? mTime : storageMTime);
+    query.bindValue(QStringLiteral(":storage_mtime"), storageMTime);
+    query.bindValue(QStringLiteral(":mimetype"), FilesSql::mimetype(info));
+    query.bindValue(QStringLiteral(":size"), info.isDir() ? 0 : size >= 0 ? size : info.size());
+    query.bindValue(QStringLiteral(":etag"), etag);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    query.exec(receiver, rowsCallback(callback, true));
+}
+
+void FilesSqlAsync::put(const FilePut &file, const QVariant &userId, QObject *receiver, RowsCallback callback)
+{
+    AsyncPgQuery query(SqlQuery::FilesPut);
+    query.bindValue(QStringLiteral(":path"), file.path);
+    query.bindValue(QStringLiteral(":parent_path"), file.parentPath);
+    query.bindValue(QStringLiteral(":name"), file.name);
+    query.bindValue(QStringLiteral(":mtime"), file.mtime);
+    query.bindValue(QStringLiteral(":storage_mtime"), file.storageMtime);
+    query.bindValue(QStringLiteral(":mimetype"), file.mimetype);
+    query.bindValue(QStringLiteral(":size"), file.size);
+    query.bindValue(QStringLiteral(":etag"), file.etag);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    query.exec(receiver, rowsCallback(callback, true));
+}
+
+void FilesSqlAsync::lookup(const QString &path, const QVariant &userId, QObject *receiver, RowsCallback callback)
+{
+    AsyncPgQuery query(SqlQuery::FilesScanLookup);
+    query.bindValue(QStringLiteral(":path"), path);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    query.exec(receiver, rowsCallback(callback, true));
+}
+
+void FilesSqlAsync::putBulk(const std::vector<FilePut> &files, const QVariant &userId, QObject *receiver, PutBulkCallback callback)
+{
+    QStringList paths, names, parentPaths, mtimes, storageMtimes, mimetypes, sizes, etags;
+    for (const FilePut &file : files) {
+        paths.append(file.path);
+        names.append(file.name);
+        parentPaths.append(file.parentPath);
+        mtimes.append(QString::number(file.mtime));
+        storageMtimes.append(QString::number(file.storageMtime));
+        mimetypes.append(file.mimetype);
+        sizes.append(QString::number(file.size));
+        etags.append(file.etag);
+    }
+
+    AsyncPgQuery query(SqlQuery::FilesPutBulk);
+    query.bindValue(QStringLiteral(":paths"), SqlQuery::arrayLiteral(paths));
+    query.bindValue(QStringLiteral(":names"), SqlQuery::arrayLiteral(names));
+    query.bindValue(QStringLiteral(":parent_paths"), SqlQuery::arrayLiteral(parentPaths));
+    query.bindValue(QStringLiteral(":mtimes"), SqlQuery::arrayLiteral(mtimes));
+    query.bindValue(QStringLiteral(":storage_mtimes"), SqlQuery::arrayLiteral(storageMtimes));
+    query.bindValue(QStringLiteral(":mimetypes"), SqlQuery::arrayLiteral(mimetypes));
+    query.bindValue(QStringLiteral(":sizes"), SqlQuery::arrayLiteral(sizes));
+    query.bindValue(QStringLiteral(":etags"), SqlQuery::arrayLiteral(etags));
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    query.exec(receiver, [callback] (AsyncPgResult &result) {
+        QHash<QString, qint64> fileIds;
+        const int size = result.size();
+        fileIds.reserve(size);
+        for (int i = 0; i < size; ++i) {
+            fileIds.insert(result.value(i, 1), result.toLongLong(i, 0));
+        }
+        callback(fileIds, result.errorString());
+    });
+}
+
+void FilesSqlAsync::remove(const QString &path, const QVariant &userId, QObject *receiver, RowsCallback callback)
+{
+    AsyncPgConnection *conn = AsyncPgConnection::thread();
+    if (!removedHook || conn->inBatch()) {
+        AsyncPgQuery query(SqlQuery::FilesRemove);
+        query.bindValue(QStringLiteral(":path"), path);
+        query.bindValue(QStringLiteral(":owner_id"), userId);
+
+        query.exec(conn, receiver, rowsCallback(callback, false));
+        return;
+    }
+
+    AsyncPgQuery query(SqlQuery::FilesRemoveTree);
+    query.bindValue(QStringLiteral(":path"), path);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    // The hook runs even if the receiver is gone, the rows are deleted anyway
+    const AsyncPgCallback done = rowsCallback(callback, true);
+    const QPointer<QObject> guard(receiver);
+    query.exec(conn, nullptr, [done, guard] (AsyncPgResult &result) {
+        if (!result.error()) {
+            std::vector<qint64> fileIds;
+            const int size = result.size();
+            fileIds.reserve(size_t(size));
+            for (int i = 0; i < size; ++i) {
+                fileIds.push_back(result.toLongLong(i, 0));
+            }
+            removedHook(fileIds);
+        }
+        if (guard && done) {
+            done(result);
+        }
+    });
+}
+
+void FilesSqlAsync::copy(const QString &path, const QString &destParentPath, const QString &destPath, const QString &destName,
+                         const QVariant &userId, QObject *receiver, RowsCallback callback)
+{
+    AsyncPgQuery query(SqlQuery::FilesCopy);
+    query.bindValue(QStringLiteral(":path"), path);
+    query.bindValue(QStringLiteral(":dest_parent_path"), destParentPath);
+    query.bindValue(QStringLiteral(":dest_path"), destPath);
+    query.bindValue(QStringLiteral(":dest_name"), destName);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    query.exec(receiver, rowsCallback(callback, true));
+}
+
+void FilesSqlAsync::move(const QString &path, const QString &destPath, const QString &destName,
+                         const QVariant &userId, QObject *receiver, RowsCallback callback)
+{
+    AsyncPgQuery query(SqlQuery::FilesMove);
+    query.bindValue(QStringLiteral(":path"), path);
+    query.bindValue(QStringLiteral(":destPath"), destPath);
+    query.bindValue(QStringLiteral(":destName"), destName);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    query.exec(receiver, rowsCallback(callback, true));
+}
+
+void FilesSqlAsync::setPack(const QString &path, const PackStore::Blob &blob, const QVariant &userId,
+                            QObject *receiver, RowsCallback callback)
+{
+    AsyncPgQuery query(SqlQuery::FilesPackSet);
+    query.bindValue(QStringLiteral(":pack_id"), blob.packId);
+    query.bindValue(QStringLiteral(":pack_offset"), blob.offset);
+    query.bindValue(QStringLiteral(":pack_length"), blob.length);
+    query.bindValue(QStringLiteral(":path"), path);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    query.exec(receiver, rowsCallback(callback, false));
+}
+
+void FilesSqlAsync::copyPack(const QString &path, const QString &destPath, const QVariant &userId,
+                             QObject *receiver, RowsCallback callback)
+{
+    AsyncPgQuery query(SqlQuery::FilesPackCopy);
+    query.bindValue(QStringLiteral(":path"), path);
+    query.bindValue(QStringLiteral(":dest_path"), destPath);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    query.exec(receiver, rowsCallback(callback, false));
+}
+
+void FilesSqlAsync::packedTree(const QString &path, const QVariant &userId, QObject *receiver, ItemsCallback callback)
+{
+    AsyncPgQuery query(SqlQuery::FilesPackTree);
+    query.bindValue(QStringLiteral(":path"), path);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    query.exec(ReplicaRouter::readConnection(userId), receiver, [callback] (AsyncPgResult &result) {
+        std::vector<FileItem> items;
+        const int size = result.size();
+        items.reserve(size_t(size));
+        for (int i = 0; i < size; ++i) {
+            items.push_back(fileItem(result, i, false));
+        }
+        callback(items, result.errorString());
+    });
+}
+
+void FilesSqlAsync::properties(const std::vector<qint64> &fileIds, const QVariant &userId, QObject *receiver, PropertiesCallback callback)
+{
+    // Only what the thread's property cache doesn't have is queried
+    PathPropertyHash cached;
+    std::vector<qint64> missing;
+    if (WebdavPgSqlPropertyStorage::cacheEnabled() && !inlineProps) {
+        for (qint64 id : fileIds) {
+            PropertyValueHash values;
+            if (!WebdavPgSqlPropertyStorage::cachedProperties(id, values)) {
+                missing.push_back(id);
+            } else if (!values.isEmpty()) {
+                cached.insert(id, values);
+            }
+        }
+
+        if (missing.empty()) {
+            QTimer::singleShot(0, receiver, [callback, cached] {
+                callback(cached, QString());
+            });
+            return;
+        }
+    } else {
+        missing = fileIds;
+    }
+
+    AsyncPgQuery query(inlineProps ? SqlQuery::PropertiesJsonbByFiles : SqlQuery::PropertiesByFiles);
+    query.bindValue(QStringLiteral(":file_ids"), SqlQuery::idArrayLiteral(missing));
+
+    // A lagging replica may miss commits older than the snapshot, so only
+    // what the primary returns is cached
+    AsyncPgConnection *conn = ReplicaRouter::readConnection(userId);
+    const bool cacheable = conn == AsyncPgConnection::thread();
+    const quint64 snapshot = WebdavPgSqlPropertyStorage::cacheSnapshot();
+    query.exec(conn, receiver, propertiesCallback([callback, cached, missing, snapshot, cacheable] (const PathPropertyHash &properties, const QString &error) {
+        if (cacheable && error.isEmpty()) {
+            WebdavPgSqlPropertyStorage::cacheProperties(missing, properties, snapshot);
+        }
+
+        PathPropertyHash ret = cached;
+        for (auto it = properties.constBegin(); it != properties.constEnd(); ++it) {
+            ret.insert(it.key(), it.value());
+        }
+        callback(ret, error);
+    }));
+}
+
+void FilesSqlAsync::childProperties(qint64 parentId, const QVariant &userId, QObject *receiver, PropertiesCallback callback)
+{
+    AsyncPgQuery query(inlineProps ? SqlQuery::PropertiesJsonbByParent : SqlQuery::PropertiesByParent);
+    query.bindValue(QStringLiteral(":parent_id"), parentId);
+
+    query.exec(ReplicaRouter::readConnection(userId), receiver, propertiesCallback(callback));
+}
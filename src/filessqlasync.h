@@ -0,0 +1,116 @@
+#ifndef FILESSQLASYNC_H
+#define FILESSQLASYNC_H
+
+#include <QString>
+#include <QVariant>
+
+#include <functional>
+#include <vector>
+
+#include "filessql.h"
+#include "packstore.h"
+#include "webdavpropertystorage.h"
+
+class QObject;
+class QFileInfo;
+
+/** A file written to disk whose metadata goes in with FilesSqlAsync::putBulk() */
+struct FilePut
+{
+    QString path;
+    QString parentPath;
+    QString name;
+    QString mimetype;
+    QString etag;
+    qint64 mtime = 0;
+    qint64 storageMtime = 0;
+    qint64 size = 0;
+};
+
+/**
+ * The WebDAV side of FilesSql on the thread's AsyncPgConnection, the
+ * callbacks run from the event loop once the result arrives and are
+ * dropped if \p receiver was destroyed meanwhile.
+ *
+ * Reads take \p userId to pick the replica or the primary, see
+ * ReplicaRouter, writes always go to the primary.
+ *
+ * With inline properties (the jsonb layout) item() and children() also
+ * fill FileItem::properties from the same row fetch.
+ */
+class FilesSqlAsync
+{
+public:
+    typedef std::function<void(const FileItem &item, const QString &error)> ItemCallback;
+    typedef std::function<void(const std::vector<FileItem> &items, const QString &error)> ItemsCallback;
+    /** rows is -1 when the statement failed, may be empty inside a batch */
+    typedef std::function<void(int rows, const QString &error)> RowsCallback;
+    typedef std::function<void(const PathPropertyHash &properties, const QString &error)> PropertiesCallback;
+    typedef std::function<void(const std::vector<qint64> &fileIds)> RemovedCallback;
+    /** The ids of the files that went in by path, those left out have no parent */
+    typedef std::function<void(const QHash<QString, qint64> &fileIds, const QString &error)> PutBulkCallback;
+
+    static void setInlineProperties(bool enabled);
+    static bool inlineProperties();
+
+    /**
+     * Called with the ids of everything remove() deleted, descendants
+     * included, so storages outside the database can drop them. Removes
+     * inside a batch are left out as the batch may still roll back.
+     */
+    static void setRemovedHook(RemovedCallback hook);
+
+    static void item(const QString &path, const QVariant &userId, QObject *receiver, ItemCallback callback);
+
+    static void children(qint64 parentId, const QVariant &userId, QObject *receiver, ItemsCallback callback);
+
+    /** Same as FilesSql::upsert() */
+    static void upsert(const QString &path, const QFileInfo &info, qint64 size, qint64 mTime, const QString &etag,
+                       const QVariant &userId, QObject *receiver, RowsCallback callback);
+
+    /** Same as upsert() for a file that isn't on disk, a packed one */
+    static void put(const FilePut &file, const QVariant &userId, QObject *receiver, RowsCallback callback);
+
+    /** rows is 1 if \p path is in the database, asks the primary so it can go in a batch */
+    static void lookup(const QString &path, const QVariant &userId, QObject *receiver, RowsCallback callback);
+
+    /**
+     * Upserts all of \p files in one statement, the ancestors get their
+     * size and etag updated once rather than once per file. A path must
+     * not be in \p files twice.
+     */
+    static void putBulk(const std::vector<FilePut> &files, const QVariant &userId, QObject *receiver, PutBulkCallback callback);
+
+    static void remove(const QString &path, const QVariant &userId, QObject *receiver, RowsCallback callback);
+
+    static void copy(const QString &path, const QString &destParentPath, const QString &destPath, const QString &destName,
+                     const QVariant &userId, QObject *receiver, RowsCallback callback);
+
+    static void move(const QString &path, const QString &destPath, const QString &destName,
+                     const QVariant &userId, QObject *receiver, RowsCallback callback);
+
+    /** Points \p path at \p blob, for its current etag */
+    static void setPack(const QString &path, const PackStore::Blob &blob, const QVariant &userId,
+                        QObject *receiver, RowsCallback callback);
+
+    /** Points \p destPath, a copy of \p path, at the same blob */
+    static void copyPack(const QString &path, const QString &destPath, const QVariant &userId,
+                         QObject *receiver, RowsCallback callback);
+
+    /** The packed files below \p path */
+    static void packedTree(const QString &path, const QVariant &userId, QObject *receiver, ItemsCallback callback);
+
+    /**
+     * Dead properties of all \p fileIds in a single round trip, or none
+     * when the property cache has them all
+     */
+    static void properties(const std::vector<qint64> &fileIds, const QVariant &userId, QObject *receiver, PropertiesCallback callback);
+
+    /**
+     * Dead properties of \p parentId and its children, needs no ids so it
+     * can go out in the same pipeline as children()
+     */
+    static void childProperties(qint64 parentId, const QVariant &userId, QObject *receiver, PropertiesCallback callback);
+};
+
+#endif // FILESSQLASYNC_H
@@ -0,0 +1,534 @@
+#include "fileswatcher.h"
+
+#include "cloudlyst.h"
+#include "filesscanner.h"
+#include "filessql.h"
+#include "sqlquery.h"
+#include "storedfile.h"
+
+#include <Cutelyst/Plugins/Utils/Sql>
+
+#include <QSqlQuery>
+#include <QSqlError>
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSocketNotifier>
+#include <QThread>
+
+#include <QLoggingCategory>
+
+#include <memory>
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+#endif
+
+Q_LOGGING_CATEGORY(CLOUDLYST_WATCHER, "cloudlyst.watcher", QtInfoMsg)
+
+using namespace Cutelyst;
+
+namespace {
+
+struct DbRow
+{
+    qint64 size = 0;
+    qint64 storageMtime = 0;
+    bool dir = false;
+};
+
+bool lookup(const QString &path, const QVariant &userId, DbRow &row, QString &error)
+{
+    SqlQuery query(SqlQuery::FilesScanLookup);
+    query.bindValue(QStringLiteral(":path"), path);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+
+    if (!query.exec()) {
+        error = query.lastError().databaseText();
+        return false;
+    }
+
+    if (query.next()) {
+        row.size = query.value(0).toLongLong();
+        row.storageMtime = query.value(1).toLongLong();
+        row.dir = query.value(2).toBool();
+        return true;
+    }
+    return false;
+}
+
+QString fileEtag(const QFileInfo &info)
+{
+    if (info.isDir()) {
+        // Same scheme MKCOL uses for collections
+        const QByteArray mtime = info.lastModified().toUTC().toString(Qt::ISODate).toLatin1();
+        return QString::fromLatin1(QCryptographicHash::hash(mtime, QCryptographicHash::Md5).toHex());
+    }
+
+    // The content, as PUT hashes it, also when compressed at rest
+    QString error;
+    std::unique_ptr<QIODevice> file(StoredFile::open(info.absoluteFilePath(), error));
+    if (!file) {
+        return QString();
+    }
+
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    hash.addData(file.get());
+    return QString::fromLatin1(hash.result().toHex());
+}
+
+}
+
+FilesWatcher::FilesWatcher(const QString &baseDir, QObject *parent) : QObject(parent)
+  , m_baseDir(baseDir)
+{
+    if (!m_baseDir.endsWith(QLatin1Char('/'))) {
+        m_baseDir.append(QLatin1Char('/'));
+    }
+
+    m_debounceTimer.setSingleShot(true);
+    m_debounceTimer.setInterval(500);
+    connect(&m_debounceTimer, &QTimer::timeout, this, &FilesWatcher::processBatch);
+}
+
+FilesWatcher::~FilesWatcher()
+{
+#ifdef Q_OS_LINUX
+    if (m_fd != -1) {
+        ::close(m_fd);
+    }
+    if (m_mountFd != -1) {
+        ::close(m_mountFd);
+    }
+#endif
+}
+
+void FilesWatcher::setDebounce(int msecs)
+{
+    m_debounceTimer.setInterval(msecs);
+}
+
+void FilesWatcher::setMaxLatency(int msecs)
+{
+    m_maxLatency = msecs;
+}
+
+void FilesWatcher::startService(const QString &baseDir, int debounce)
+{
+#ifdef Q_OS_LINUX
+    const QByteArray lockFile = QFile::encodeName(baseDir + QLatin1String(".watcher.lock"));
+    int lockFd = ::open(lockFile.constData(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lockFd == -1) {
+        qCWarning(CLOUDLYST_WATCHER) << "Failed to open watcher lock" << lockFile << qt_error_string(errno);
+        return;
+    }
+
+    // Only one worker watches, the lock goes away together with its process
+    if (::flock(lockFd, LOCK_EX | LOCK_NB) == -1) {
+        ::close(lockFd);
+        QTimer::singleShot(30 * 1000, [baseDir, debounce] {
+            startService(baseDir, debounce);
+        });
+        return;
+    }
+
+    auto thread = new QThread;
+    auto watcher = new FilesWatcher(baseDir);
+    watcher->setDebounce(debounce);
+    watcher->moveToThread(thread);
+    connect(thread, &QThread::started, watcher, &FilesWatcher::start);
+    connect(thread, &QThread::finished, watcher, &QObject::deleteLater);
+    thread->setObjectName(QStringLiteral("FilesWatcher"));
+    thread->start(QThread::LowPriority);
+#else
+    Q_UNUSED(baseDir)
+    Q_UNUSED(debounce)
+    qCWarning(CLOUDLYST_WATCHER) << "Data directory watcher is not supported on this platform";
+#endif
+}
+
+bool FilesWatcher::start()
+{
+    if (!Cloudlyst::openDatabase()) {
+        return false;
+    }
+
+    if (startFanotify()) {
+        qCInfo(CLOUDLYST_WATCHER) << "Watching" << m_baseDir << "with fanotify";
+        return true;
+    }
+
+    if (startInotify()) {
+        qCInfo(CLOUDLYST_WATCHER) << "Watching" << m_baseDir << "with inotify," << m_watches.size() << "directories";
+        return true;
+    }
+
+    qCWarning(CLOUDLYST_WATCHER) << "Failed to watch" << m_baseDir;
+    return false;
+}
+
+bool FilesWatcher::startFanotify()
+{
+#if defined(Q_OS_LINUX) && defined(FAN_REPORT_DFID_NAME)
+    // Needs CAP_SYS_ADMIN, and CAP_DAC_READ_SEARCH to resolve the handles
+    m_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE);
+    if (m_fd == -1) {
+        qCDebug(CLOUDLYST_WATCHER) << "fanotify_init failed" << qt_error_string(errno);
+        return false;
+    }
+
+    const QByteArray baseDir = QFile::encodeName(m_baseDir);
+    const uint64_t mask = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_CLOSE_WRITE | FAN_ONDIR;
+    if (fanotify_mark(m_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, baseDir.constData()) == -1) {
+        qCDebug(CLOUDLYST_WATCHER) << "fanotify_mark failed" << qt_error_string(errno);
+        ::close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    m_mountFd = ::open(baseDir.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (m_mountFd == -1) {
+        ::close(m_fd);
+        m_fd = -1;
+        return false;
+    }
+
+    m_fanotify = true;
+    m_notifier = new QSocketNotifier(m_fd, QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &FilesWatcher::readFanotify);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool FilesWatcher::startInotify()
+{
+#ifdef Q_OS_LINUX
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd == -1) {
+        qCWarning(CLOUDLYST_WATCHER) << "inotify_init1 failed" << qt_error_string(errno);
+        return false;
+    }
+
+    addInotifyWatches(m_baseDir);
+
+    m_notifier = new QSocketNotifier(m_fd, QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &FilesWatcher::readInotify);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void FilesWatcher::addInotifyWatches(const QString &dir)
+{
+#ifdef Q_OS_LINUX
+    const uint32_t mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+            IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+    int wd = inotify_add_watch(m_fd, QFile::encodeName(dir).constData(), mask);
+    if (wd == -1) {
+        qCWarning(CLOUDLYST_WATCHER) << "inotify_add_watch failed" << dir << qt_error_string(errno);
+        return;
+    }
+    m_watches.insert(wd, dir.endsWith(QLatin1Char('/')) ? dir : dir + QLatin1Char('/'));
+
+    // Hidden entries of DataDir and of the user directories are our spool,
+    // pack and cache directories, under files/ they are user data
+    const bool inFiles = dir.mid(m_baseDir.size()).contains(QLatin1Char('/'));
+    const QStringList subdirs = QDir(dir).entryList(QDir::Dirs | QDir::Hidden | QDir::NoDotAndDotDot | QDir::NoSymLinks);
+    for (const QString &subdir : subdirs) {
+        if (inFiles || !subdir.startsWith(QLatin1Char('.'))) {
+            addInotifyWatches(QDir(dir).filePath(subdir));
+        }
+    }
+#else
+    Q_UNUSED(dir)
+#endif
+}
+
+void FilesWatcher::readFanotify()
+{
+#if defined(Q_OS_LINUX) && defined(FAN_REPORT_DFID_NAME)
+    alignas(struct fanotify_event_metadata) char buf[64 * 1024];
+    for (;;) {
+        const ssize_t len = ::read(m_fd, buf, sizeof(buf));
+        if (len <= 0) {
+            break;
+        }
+
+        auto metadata = reinterpret_cast<const struct fanotify_event_metadata *>(buf);
+        ssize_t remaining = len;
+        for (; FAN_EVENT_OK(metadata, remaining); metadata = FAN_EVENT_NEXT(metadata, remaining)) {
+            if (metadata->mask & FAN_Q_OVERFLOW) {
+                qCWarning(CLOUDLYST_WATCHER) << "Event queue overflow, rescanning";
+                scanAll();
+                continue;
+            }
+
+            auto fid = reinterpret_cast<const struct fanotify_event_info_fid *>(metadata + 1);
+            if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                continue;
+            }
+
+            auto handle = reinterpret_cast<struct file_handle *>(const_cast<unsigned char *>(fid->handle));
+            const char *name = reinterpret_cast<const char *>(handle->f_handle + handle->handle_bytes);
+
+            int dirFd = open_by_handle_at(m_mountFd, handle, O_RDONLY | O_PATH);
+            if (dirFd == -1) {
+                // The directory is already gone, its own event will remove it
+                continue;
+            }
+
+            char dirPath[PATH_MAX];
+            const QByteArray procPath = "/proc/self/fd/" + QByteArray::number(dirFd);
+            const ssize_t dirLen = ::readlink(procPath.constData(), dirPath, sizeof(dirPath) - 1);
+            ::close(dirFd);
+            if (dirLen <= 0) {
+                continue;
+            }
+
+            QString absPath = QFile::decodeName(QByteArray(dirPath, int(dirLen)));
+            if (qstrcmp(name, ".") != 0) {
+                absPath += QLatin1Char('/') + QFile::decodeName(name);
+            }
+            queuePath(absPath);
+        }
+    }
+#endif
+}
+
+void FilesWatcher::readInotify()
+{
+#ifdef Q_OS_LINUX
+    alignas(struct inotify_event) char buf[64 * 1024];
+    for (;;) {
+        const ssize_t len = ::read(m_fd, buf, sizeof(buf));
+        if (len <= 0) {
+            break;
+        }
+
+        for (ssize_t pos = 0; pos < len;) {
+            auto event = reinterpret_cast<const struct inotify_event *>(buf + pos);
+            pos += ssize_t(sizeof(struct inotify_event) + event->len);
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                qCWarning(CLOUDLYST_WATCHER) << "Event queue overflow, rescanning";
+                scanAll();
+                continue;
+            }
+
+            if (event->mask & IN_IGNORED) {
+                m_watches.remove(event->wd);
+                continue;
+            }
+
+            const QString dir = m_watches.value(event->wd);
+            if (dir.isEmpty() || !event->len) {
+                continue;
+            }
+
+            const QString absPath = dir + QFile::decodeName(event->name);
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                addInotifyWatches(absPath);
+            }
+            queuePath(absPath);
+        }
+    }
+#endif
+}
+
+void FilesWatcher::queuePath(const QString &absPath)
+{
+    if (!absPath.startsWith(m_baseDir)) {
+        return;
+    }
+
+    if (m_pending.isEmpty()) {
+        m_firstPending.start();
+    }
+    m_pending.insert(absPath);
+
+    // Debounce bursts but never hold changes back longer than max latency
+    if (m_firstPending.elapsed() >= m_maxLatency) {
+        m_debounceTimer.stop();
+        processBatch();
+    } else {
+        m_debounceTimer.start();
+    }
+}
+
+void FilesWatcher::processBatch()
+{
+    if (m_pending.isEmpty()) {
+        return;
+    }
+
+    QStringList paths = m_pending.toList();
+    m_pending.clear();
+    paths.sort();
+
+    struct Change {
+        QString absPath;
+        QString path;
+        QVariant userId;
+    };
+    std::vector<Change> changes;
+
+    for (const QString &absPath : paths) {
+        // <user>/files/...
+        const QString relPath = absPath.mid(m_baseDir.size());
+        const QVector<QStringRef> parts = relPath.splitRef(QLatin1Char('/'));
+        if (parts.size() < 3 || parts.at(1) != QLatin1String("files")) {
+            continue;
+        }
+
+        const QVariant id = userId(parts.at(0).toString());
+        if (id.isNull()) {
+            continue;
+        }
+
+        changes.push_back({ absPath, relPath.mid(parts.at(0).size() + 1), id });
+    }
+
+    if (changes.empty()) {
+        return;
+    }
+
+    QSqlDatabase db = Sql::databaseThread(QStringLiteral("cloudlyst"));
+    QString error;
+    bool ok = db.transaction();
+    for (const Change &change : changes) {
+        if (!ok) {
+            break;
+        }
+        ok = ingest(change.absPath, change.path, change.userId, true, error);
+    }
+
+    if (ok && db.commit()) {
+        qCDebug(CLOUDLYST_WATCHER) << "Ingested" << changes.size() << "changes";
+        return;
+    }
+
+    qCWarning(CLOUDLYST_WATCHER) << "Batch failed, retrying individually" << error;
+    db.rollback();
+    for (const Change &change : changes) {
+        if (!ingest(change.absPath, change.path, change.userId, true, error)) {
+            qCWarning(CLOUDLYST_WATCHER) << "Failed to ingest" << change.absPath << error;
+        }
+    }
+}
+
+bool FilesWatcher::ingest(const QString &absPath, const QString &path, const QVariant &userId, bool recurse, QString &error)
+{
+    const QFileInfo info(absPath);
+    if (!info.exists() || info.isSymLink() || (!info.isFile() && !info.isDir())) {
+        return FilesSql::remove(path, userId, error) >= 0;
+    }
+
+    const qint64 size = info.isDir() ? 0 : StoredFile::contentSize(absPath, info.size());
+
+    DbRow row;
+    if (lookup(path, userId, row, error)) {
+        if (row.dir == info.isDir() &&
+                (row.dir || (row.size == size && row.storageMtime == info.lastModified().toSecsSinceEpoch()))) {
+            // Already up to date, most likely our own WebDAV write
+            return true;
+        }
+
+        if (row.dir != info.isDir() && FilesSql::remove(path, userId, error) < 0) {
+            return false;
+        }
+    } else if (!error.isEmpty()) {
+        return false;
+    }
+
+    const QString userDir = absPath.left(absPath.size() - path.size());
+    if (!ingestParents(userDir, path, userId, error)) {
+        return false;
+    }
+
+    const QString etag = fileEtag(info);
+    if (etag.isEmpty()) {
+        // Vanished or unreadable, a later event will tell
+        return true;
+    }
+
+    if (!FilesSql::upsert(path, info, size, 0, etag, userId, error)) {
+        return false;
+    }
+
+    // A tree moved into place only notifies about its top directory
+    if (recurse && info.isDir()) {
+        const QFileInfoList children = QDir(absPath).entryInfoList(QDir::Dirs | QDir::Files | QDir::Hidden |
+                                                                      QDir::NoDotAndDotDot | QDir::NoSymLinks);
+        for (const QFileInfo &child : children) {
+            if (!ingest(child.absoluteFilePath(), path + QLatin1Char('/') + child.fileName(), userId, true, error)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool FilesWatcher::ingestParents(const QString &userDir, const QString &path, const QVariant &userId, QString &error)
+{
+    const QString parent = FilesSql::parentPath(path);
+    if (parent.isEmpty() || parent == QLatin1String("files")) {
+        return true;
+    }
+
+    DbRow row;
+    if (lookup(parent, userId, row, error)) {
+        return true;
+    } else if (!error.isEmpty()) {
+        return false;
+    }
+
+    return ingest(userDir + parent, parent, userId, false, error);
+}
+
+QVariant FilesWatcher::userId(const QString &username)
+{
+    auto it = m_userIds.constFind(username);
+    if (it != m_userIds.constEnd()) {
+        return it.value();
+    }
+
+    SqlQuery query(SqlQuery::UserIdByName);
+    query.bindValue(QStringLiteral(":username"), username);
+
+    QVariant ret;
+    if (query.exec() && query.next()) {
+        ret = query.value(0);
+        m_userIds.insert(username, ret);
+    }
+    return ret;
+}
+
+void FilesWatcher::scanAll()
+{
+    m_pending.clear();
+
+    QSqlQuery query(Sql::databaseThread(QStringLiteral("cloudlyst")));
+    if (!query.exec(QStringLiteral("SELECT id, username FROM cloudlyst.users"))) {
+        qCWarning(CLOUDLYST_WATCHER) << "Failed to list users" << query.lastError().databaseText();
+        return;
+    }
+
+    FilesScanner scanner;
+    while (query.next()) {
+        const QString userDir = m_baseDir + query.value(1).toString();
+        if (QFileInfo(userDir).isDir() && !scanner.scan(userDir, query.value(0))) {
+            qCWarning(CLOUDLYST_WATCHER) << "Rescan failed" << userDir << scanner.errorString();
+        }
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef FILESWATCHER_H
+#define FILESWATCHER_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QSet>
+#include <QTimer>
+#include <QVariant>
+
+class QSocketNotifier;
+
+/**
+ * Picks up changes written straight into the data directory by admins
+ * or batch jobs and upserts them the same way WebDAV requests do, so
+ * etags propagate to the clients within seconds.
+ *
+ * fanotify is used when the process is allowed to watch the whole
+ * filesystem, otherwise every directory gets an inotify watch.
+ */
+class FilesWatcher : public QObject
+{
+    Q_OBJECT
+public:
+    explicit FilesWatcher(const QString &baseDir, QObject *parent = nullptr);
+    ~FilesWatcher();
+
+    void setDebounce(int msecs);
+    void setMaxLatency(int msecs);
+
+    /**
+     * Starts a watcher thread unless another worker already holds the
+     * data dir watcher lock, in which case it keeps retrying so that a
+     * new watcher takes over if the owner goes away.
+     */
+    static void startService(const QString &baseDir, int debounce);
+
+public Q_SLOTS:
+    bool start();
+
+private:
+    bool startFanotify();
+    bool startInotify();
+    void addInotifyWatches(const QString &dir);
+    void readFanotify();
+    void readInotify();
+    void queuePath(const QString &absPath);
+    void processBatch();
+    bool ingest(const QString &absPath, const QString &path, const QVariant &userId, bool recurse, QString &error);
+    bool ingestParents(const QString &userDir, const QString &path, const QVariant &userId, QString &error);
+    QVariant userId(const QString &username);
+    void scanAll();
+
+    QString m_baseDir;
+    QHash<int, QString> m_watches;
+    QHash<QString, QVariant> m_userIds;
+    QSet<QString> m_pending;
+    QElapsedTimer m_firstPending;
+    QTimer m_debounceTimer;
+    QSocketNotifier *m_notifier = nullptr;
+    int m_fd = -1;
+    int m_mountFd = -1;
+    int m_maxLatency = 2000;
+    bool m_fanotify = false;
+};
+
+#endif // FILESWATCHER_H
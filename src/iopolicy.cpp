@@ -0,0 +1,132 @@
+#include "iopolicy.h"
+
+#include <QLoggingCategory>
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+Q_LOGGING_CATEGORY(CLOUDLYST_IO, "cloudlyst.io", QtWarningMsg)
+
+namespace {
+
+qint64 minPreallocate = 1024 * 1024;
+qint64 minStream = 64 * 1024 * 1024;
+qint64 windowSize = 8 * 1024 * 1024;
+
+}
+
+void IoPolicy::setup(qint64 preallocateMin, qint64 streamMin, qint64 window)
+{
+    minPreallocate = preallocateMin;
+    minStream = streamMin;
+    windowSize = window;
+}
+
+void IoPolicy::preallocate(QFileDevice *file, qint64 size)
+{
+#ifdef Q_OS_LINUX
+    if (!minPreallocate || size < minPreallocate) {
+        return;
+    }
+
+    // Filesystems without fallocate just allocate as the data comes
+    if (::fallocate(file->handle(), FALLOC_FL_KEEP_SIZE, 0, size) != 0 && errno != EOPNOTSUPP) {
+        qCDebug(CLOUDLYST_IO) << "fallocate failed" << file->fileName() << size << strerror(errno);
+    }
+#else
+    Q_UNUSED(file)
+    Q_UNUSED(size)
+#endif
+}
+
+IoPolicy::IoPolicy(QFileDevice *file, qint64 size, Mode mode, qint64 from)
+    : m_mode(mode)
+{
+#ifdef Q_OS_LINUX
+    if (!minStream || !windowSize || size < minStream || file->handle() == -1) {
+        return;
+    }
+    m_file = file;
+    m_start = from - from % windowSize;
+    m_done = m_start;
+
+    if (mode == Read) {
+        ::posix_fadvise(file->handle(), 0, 0, POSIX_FADV_SEQUENTIAL);
+        ::posix_fadvise(file->handle(), from, windowSize, POSIX_FADV_WILLNEED);
+    }
+#else
+    Q_UNUSED(file)
+    Q_UNUSED(size)
+    Q_UNUSED(from)
+#endif
+}
+
+void IoPolicy::advance(qint64 pos)
+{
+#ifdef Q_OS_LINUX
+    if (!m_file || pos < m_done + windowSize) {
+        return;
+    }
+
+    const int fd = m_file->handle();
+    if (m_mode == Write) {
+        m_file->flush();
+    }
+
+    // Each completed window starts its writeback, the one before it is
+    // waited for and dropped, so one window is in flight while the next
+    // fills up
+    while (pos >= m_done + windowSize) {
+        if (m_mode == Write) {
+            ::sync_file_range(fd, m_done, windowSize, SYNC_FILE_RANGE_WRITE);
+        }
+
+        const qint64 previous = m_done - windowSize;
+        if (previous >= m_start) {
+            if (m_mode == Write) {
+                ::sync_file_range(fd, previous, windowSize,
+                                  SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            }
+            ::posix_fadvise(fd, previous, windowSize, POSIX_FADV_DONTNEED);
+        }
+        m_done += windowSize;
+    }
+#else
+    Q_UNUSED(pos)
+#endif
+}
+
+SequentialFile::SequentialFile(const QString &name, QObject *parent) : QFile(name, parent)
+{
+}
+
+SequentialFile::~SequentialFile()
+{
+}
+
+bool SequentialFile::open(OpenMode mode)
+{
+    if (!QFile::open(mode)) {
+        return false;
+    }
+
+    if (mode & QIODevice::ReadOnly) {
+        m_policy.reset(new IoPolicy(this, size(), IoPolicy::Read));
+        if (!m_policy->isStreaming()) {
+            m_policy.reset();
+        }
+    }
+    return true;
+}
+
+qint64 SequentialFile::readData(char *data, qint64 maxSize)
+{
+    const qint64 len = QFile::readData(data, maxSize);
+    if (m_policy && len > 0) {
+        m_policy->advance(pos());
+    }
+    return len;
+}
@@ -0,0 +1,72 @@
+#ifndef IOPOLICY_H
+#define IOPOLICY_H
+
+#include <QFile>
+
+#include <memory>
+
+/**
+ * Keeps large sequential transfers from flooding the page cache.
+ *
+ * Files of at least the stream size (IoStreamMin, 64 MiB) are read with
+ * sequential readahead and written with write-behind: a window
+ * (IoWindow, 8 MiB) behind the current position is written back and
+ * dropped from the cache, so small hot files and database pages stay
+ * cached while they pass. Files of at least IoPreallocateMin (1 MiB) get
+ * their blocks allocated up front, before they are written in pieces.
+ *
+ * Only does anything on Linux.
+ */
+class IoPolicy
+{
+public:
+    enum Mode {
+        Read,
+        Write,
+    };
+
+    /** Called before forking, sizes in bytes, 0 turns that part off */
+    static void setup(qint64 preallocateMin, qint64 streamMin, qint64 window);
+
+    /** Allocates the blocks of \p file for \p size bytes, without changing its size */
+    static void preallocate(QFileDevice *file, qint64 size);
+
+    /**
+     * Applies the policy to \p file, to be read or written from \p from
+     * up to \p size, call advance() as it goes.
+     */
+    IoPolicy(QFileDevice *file, qint64 size, Mode mode, qint64 from = 0);
+
+    bool isStreaming() const { return m_file != nullptr; }
+
+    /** Writes back and drops whatever is a window behind \p pos */
+    void advance(qint64 pos);
+
+private:
+    QFileDevice *m_file = nullptr;
+    qint64 m_start = 0;
+    qint64 m_done = 0;
+    Mode m_mode;
+};
+
+/**
+ * A file read once from start to end, such as a response body, under
+ * the read policy.
+ */
+class SequentialFile : public QFile
+{
+    Q_OBJECT
+public:
+    explicit SequentialFile(const QString &name, QObject *parent = nullptr);
+    ~SequentialFile();
+
+    bool open(OpenMode mode) override;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+
+private:
+    std::unique_ptr<IoPolicy> m_policy;
+};
+
+#endif // IOPOLICY_H
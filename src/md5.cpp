@@ -0,0 +1,167 @@
+#include "md5.h"
+
+#include <QtEndian>
+
+#include <string.h>
+
+namespace {
+
+const quint32 K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+const int S[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+// h[4], the length, then what is buffered of the last block
+const int StateHeader = 4 * 4 + 8;
+
+inline quint32 rotl(quint32 x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+}
+
+Md5::Md5()
+{
+    m_h[0] = 0x67452301;
+    m_h[1] = 0xefcdab89;
+    m_h[2] = 0x98badcfe;
+    m_h[3] = 0x10325476;
+}
+
+void Md5::addData(const char *data, qint64 len)
+{
+    auto in = reinterpret_cast<const uchar *>(data);
+    int used = int(m_length % 64);
+    m_length += quint64(len);
+
+    if (used) {
+        const int fill = int(qMin(qint64(64 - used), len));
+        memcpy(m_buffer + used, in, size_t(fill));
+        in += fill;
+        len -= fill;
+        if (used + fill < 64) {
+            return;
+        }
+        transform(m_buffer);
+    }
+
+    for (; len >= 64; in += 64, len -= 64) {
+        transform(in);
+    }
+    memcpy(m_buffer, in, size_t(len));
+}
+
+QByteArray Md5::result() const
+{
+    // Padding goes to a copy, so more data can still be added
+    Md5 copy = *this;
+    const quint64 bits = m_length * 8;
+
+    uchar pad[72] = { 0x80 };
+    const int used = int(m_length % 64);
+    const int padLen = used < 56 ? 56 - used : 120 - used;
+    copy.addData(reinterpret_cast<const char *>(pad), padLen);
+    qToLittleEndian(bits, pad);
+    copy.addData(reinterpret_cast<const char *>(pad), 8);
+
+    QByteArray ret(16, Qt::Uninitialized);
+    for (int i = 0; i < 4; ++i) {
+        qToLittleEndian(copy.m_h[i], reinterpret_cast<uchar *>(ret.data()) + i * 4);
+    }
+    return ret;
+}
+
+QByteArray Md5::state() const
+{
+    const int used = int(m_length % 64);
+    QByteArray ret(StateHeader + used, Qt::Uninitialized);
+    auto out = reinterpret_cast<uchar *>(ret.data());
+    for (int i = 0; i < 4; ++i) {
+        qToLittleEndian(m_h[i], out + i * 4);
+    }
+    qToLittleEndian(m_length, out + 16);
+    memcpy(out + StateHeader, m_buffer, size_t(used));
+    return ret;
+}
+
+bool Md5::restoreState(const QByteArray &state)
+{
+    if (state.size() < StateHeader) {
+        return false;
+    }
+
+    auto in = reinterpret_cast<const uchar *>(state.constData());
+    const quint64 length = qFromLittleEndian<quint64>(in + 16);
+    if (state.size() != StateHeader + int(length % 64)) {
+        return false;
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        m_h[i] = qFromLittleEndian<quint32>(in + i * 4);
+    }
+    m_length = length;
+    memcpy(m_buffer, in + StateHeader, size_t(length % 64));
+    return true;
+}
+
+void Md5::transform(const uchar *block)
+{
+    quint32 w[16];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = qFromLittleEndian<quint32>(block + i * 4);
+    }
+
+    quint32 a = m_h[0];
+    quint32 b = m_h[1];
+    quint32 c = m_h[2];
+    quint32 d = m_h[3];
+    for (int i = 0; i < 64; ++i) {
+        quint32 f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        const quint32 next = d;
+        d = c;
+        c = b;
+        b = b + rotl(a + f + K[i] + w[g], S[i]);
+        a = next;
+    }
+
+    m_h[0] += a;
+    m_h[1] += b;
+    m_h[2] += c;
+    m_h[3] += d;
+}
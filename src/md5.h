@@ -0,0 +1,33 @@
+#ifndef MD5_H
+#define MD5_H
+
+#include <QByteArray>
+
+/**
+ * MD5 whose intermediate state can be saved and restored, which
+ * QCryptographicHash can't do, so an upload sent in several requests is
+ * hashed as it arrives without reading back what came before.
+ */
+class Md5
+{
+public:
+    Md5();
+
+    void addData(const char *data, qint64 len);
+
+    /** The digest of what was added so far, more can be added after */
+    QByteArray result() const;
+
+    /** Opaque, for restoreState() on this or another instance */
+    QByteArray state() const;
+    bool restoreState(const QByteArray &state);
+
+private:
+    void transform(const uchar *block);
+
+    quint32 m_h[4];
+    quint64 m_length = 0;
+    uchar m_buffer[64];
+};
+
+#endif // MD5_H
@@ -0,0 +1,493 @@
+#include "metrics.h"
+
+#include "sqlquery.h"
+
+#include <Cutelyst/Application>
+#include <Cutelyst/Context>
+#include <Cutelyst/Request>
+#include <Cutelyst/Response>
+
+#include <QMutex>
+#include <QJsonObject>
+#include <QTemporaryFile>
+
+#include <QLoggingCategory>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <vector>
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+Q_LOGGING_CATEGORY(CLOUDLYST_METRICS, "cloudlyst.metrics", QtWarningMsg)
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Shared counters need lock free 64 bit atomics");
+
+namespace {
+
+enum Method {
+    MethodGet,
+    MethodHead,
+    MethodPut,
+    MethodPost,
+    MethodDelete,
+    MethodOptions,
+    MethodPropfind,
+    MethodProppatch,
+    MethodMkcol,
+    MethodCopy,
+    MethodMove,
+    MethodLock,
+    MethodUnlock,
+    MethodOther,
+    MethodCount,
+};
+
+const char *methodNames[MethodCount] = {
+    "GET", "HEAD", "PUT", "POST", "DELETE", "OPTIONS", "PROPFIND", "PROPPATCH", "MKCOL", "COPY", "MOVE", "LOCK", "UNLOCK", "other",
+};
+
+const char *statusNames[] = { "1xx", "2xx", "3xx", "4xx", "5xx" };
+const int StatusCount = 5;
+
+const char *cacheNames[Metrics::CacheCount] = { "preview", "file" };
+
+const char *admissionNames[Metrics::AdmissionCount] = { "admitted", "queued", "throttled", "shed", "timed_out" };
+
+// Upper bounds, the last bucket is +Inf
+const double latencyBounds[] = { 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+const int LatencyBuckets = sizeof(latencyBounds) / sizeof(latencyBounds[0]) + 1;
+
+const quint64 sqlBounds[] = { 0, 1, 2, 5, 10, 20, 50, 100 };
+const int SqlBuckets = sizeof(sqlBounds) / sizeof(sqlBounds[0]) + 1;
+
+const qint64 spoolBounds[] = { 64 << 10, 1 << 20, 16 << 20, 256 << 20, Q_INT64_C(1) << 30 };
+const int SpoolBuckets = sizeof(spoolBounds) / sizeof(spoolBounds[0]) + 1;
+
+const int MaxWorkers = 256;
+
+typedef std::atomic<quint64> Counter;
+
+struct Slot {
+    std::atomic<qint64> pid;
+    Counter latency[MethodCount][StatusCount][LatencyBuckets];
+    Counter latencySum[MethodCount][StatusCount]; // usecs
+    Counter bytesIn[MethodCount];
+    Counter bytesOut[MethodCount];
+    Counter sqlQueries;
+    Counter sqlNsecs;
+    Counter sqlPerRequest[SqlBuckets];
+    Counter stmtCalls[SqlQuery::StatementCount];
+    Counter stmtErrors[SqlQuery::StatementCount];
+    Counter stmtRows[SqlQuery::StatementCount];
+    Counter stmtNsecs[SqlQuery::StatementCount];
+    Counter stmtMaxNsecs[SqlQuery::StatementCount];
+    Counter cacheHits[Metrics::CacheCount];
+    Counter cacheMisses[Metrics::CacheCount];
+    Counter admission[Metrics::AdmissionCount];
+    Counter spool[SpoolBuckets];
+    Counter spoolSum;
+    std::atomic<qint64> spoolCurrent;
+};
+
+struct Shared {
+    std::atomic<int> nextSlot;
+    Slot slots[MaxWorkers];
+};
+
+Shared *shared = nullptr;
+std::atomic<Slot *> currentSlot(nullptr);
+qint64 currentSlotPid = 0;
+QMutex slotMutex;
+
+// Per thread totals, a request accounts the difference between its start and end
+thread_local quint64 threadSqlQueries = 0;
+thread_local quint64 threadSqlNsecs = 0;
+
+inline qint64 now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void add(Counter &counter, quint64 value = 1)
+{
+    counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+inline quint64 load(const Counter &counter)
+{
+    return counter.load(std::memory_order_relaxed);
+}
+
+Method methodIndex(const QString &method)
+{
+    for (int i = 0; i < MethodOther; ++i) {
+        if (method == QLatin1String(methodNames[i])) {
+            return Method(i);
+        }
+    }
+    return MethodOther;
+}
+
+template <typename T, int N>
+int bucket(const T (&bounds)[N], T value)
+{
+    int i = 0;
+    while (i < N && value > bounds[i]) {
+        ++i;
+    }
+    return i;
+}
+
+bool alive(qint64 pid)
+{
+    return pid > 0 && (kill(pid_t(pid), 0) == 0 || errno == EPERM);
+}
+
+}
+
+Metrics::Metrics(Application *parent) : Plugin(parent)
+{
+}
+
+bool Metrics::setup(Application *app)
+{
+    {
+        QMutexLocker locker(&slotMutex);
+        if (!shared) {
+            // Anonymous and shared, so it survives fork() and is visible to every worker
+            void *mem = mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) {
+                qCCritical(CLOUDLYST_METRICS) << "Failed to map metrics memory" << strerror(errno);
+                return false;
+            }
+            shared = static_cast<Shared *>(mem);
+        }
+    }
+    claimSlot();
+
+    connect(app, &Application::postForked, this, [] {
+        claimSlot();
+    });
+    connect(app, &Application::beforeDispatch, this, &Metrics::beforeDispatch);
+    connect(app, &Application::afterDispatch, this, &Metrics::afterDispatch);
+
+    return true;
+}
+
+void Metrics::recordStatement(int statement, qint64 nsecs, int rows, bool ok)
+{
+    Slot *slot = currentSlot.load(std::memory_order_relaxed);
+    if (slot) {
+        add(slot->sqlQueries);
+        add(slot->sqlNsecs, quint64(nsecs));
+        add(slot->stmtCalls[statement]);
+        add(slot->stmtRows[statement], quint64(rows));
+        add(slot->stmtNsecs[statement], quint64(nsecs));
+        if (!ok) {
+            add(slot->stmtErrors[statement]);
+        }
+
+        Counter &max = slot->stmtMaxNsecs[statement];
+        quint64 current = load(max);
+        while (quint64(nsecs) > current && !max.compare_exchange_weak(current, quint64(nsecs), std::memory_order_relaxed)) {
+        }
+    }
+
+    ++threadSqlQueries;
+    threadSqlNsecs += quint64(nsecs);
+}
+
+QJsonArray Metrics::statementStats()
+{
+    struct Totals {
+        quint64 calls = 0;
+        quint64 errors = 0;
+        quint64 rows = 0;
+        quint64 nsecs = 0;
+        quint64 maxNsecs = 0;
+        int statement;
+    };
+
+    std::vector<Totals> totals(SqlQuery::StatementCount);
+    const int slots = shared ? qMin(shared->nextSlot.load(), MaxWorkers) : 0;
+    for (int i = 0; i < SqlQuery::StatementCount; ++i) {
+        Totals &t = totals[size_t(i)];
+        t.statement = i;
+        for (int s = 0; s < slots; ++s) {
+            const Slot &slot = shared->slots[s];
+            t.calls += load(slot.stmtCalls[i]);
+            t.errors += load(slot.stmtErrors[i]);
+            t.rows += load(slot.stmtRows[i]);
+            t.nsecs += load(slot.stmtNsecs[i]);
+            t.maxNsecs = qMax(t.maxNsecs, load(slot.stmtMaxNsecs[i]));
+        }
+    }
+    std::sort(totals.begin(), totals.end(), [] (const Totals &a, const Totals &b) {
+        return a.nsecs > b.nsecs;
+    });
+
+    QJsonArray ret;
+    for (const Totals &t : totals) {
+        const auto statement = SqlQuery::Statement(t.statement);
+        ret.append(QJsonObject{
+                       {QStringLiteral("statement"), QLatin1String(SqlQuery::name(statement))},
+                       {QStringLiteral("calls"), double(t.calls)},
+                       {QStringLiteral("errors"), double(t.errors)},
+                       {QStringLiteral("rows"), double(t.rows)},
+                       {QStringLiteral("total_ms"), t.nsecs / 1e6},
+                       {QStringLiteral("mean_ms"), t.calls ? t.nsecs / 1e6 / t.calls : 0.0},
+                       {QStringLiteral("max_ms"), t.maxNsecs / 1e6},
+                       {QStringLiteral("sql"), SqlQuery::sql(statement)},
+                   });
+    }
+    return ret;
+}
+
+void Metrics::recordCache(Cache cache, bool hit)
+{
+    Slot *slot = currentSlot.load(std::memory_order_relaxed);
+    if (slot) {
+        add(hit ? slot->cacheHits[cache] : slot->cacheMisses[cache]);
+    }
+}
+
+void Metrics::recordAdmission(Admission result)
+{
+    Slot *slot = currentSlot.load(std::memory_order_relaxed);
+    if (slot) {
+        add(slot->admission[result]);
+    }
+}
+
+void Metrics::beforeDispatch(Context *c)
+{
+    RequestState &state = m_requests[c];
+    state = { now(), 0, threadSqlQueries, threadSqlNsecs };
+
+    // Bodies bigger than the engine's buffer get spooled to a temporary file
+    auto tmp = qobject_cast<QTemporaryFile *>(c->request()->body());
+    Slot *slot = currentSlot.load(std::memory_order_relaxed);
+    if (tmp && slot) {
+        state.spool = tmp->size();
+        add(slot->spool[bucket(spoolBounds, state.spool)]);
+        add(slot->spoolSum, quint64(state.spool));
+        slot->spoolCurrent.fetch_add(state.spool, std::memory_order_relaxed);
+    }
+}
+
+void Metrics::afterDispatch(Context *c)
+{
+    auto it = m_requests.find(c);
+    if (it == m_requests.end()) {
+        return;
+    }
+    const RequestState state = it.value();
+    m_requests.erase(it);
+
+    Slot *slot = currentSlot.load(std::memory_order_relaxed);
+    if (!slot) {
+        return;
+    }
+
+    Request *req = c->request();
+    Response *res = c->response();
+
+    const Method method = methodIndex(req->method());
+    const int status = qBound(0, int(res->status()) / 100 - 1, StatusCount - 1);
+    const double secs = (now() - state.start) / 1e9;
+
+    add(slot->latency[method][status][bucket(latencyBounds, secs)]);
+    add(slot->latencySum[method][status], quint64(secs * 1e6));
+
+    const qint64 bytesIn = req->headers().contentLength();
+    if (bytesIn > 0) {
+        add(slot->bytesIn[method], quint64(bytesIn));
+    }
+    QIODevice *device = res->bodyDevice();
+    const qint64 bytesOut = device ? device->size() : res->body().size();
+    if (bytesOut > 0) {
+        add(slot->bytesOut[method], quint64(bytesOut));
+    }
+
+    add(slot->sqlPerRequest[bucket(sqlBounds, threadSqlQueries - state.sqlQueries)]);
+
+    if (state.spool) {
+        slot->spoolCurrent.fetch_sub(state.spool, std::memory_order_relaxed);
+    }
+}
+
+void Metrics::claimSlot()
+{
+    QMutexLocker locker(&slotMutex);
+    const qint64 pid = getpid();
+    if (!shared || currentSlotPid == pid) {
+        return;
+    }
+
+    Slot *slot = nullptr;
+    const int index = shared->nextSlot.fetch_add(1);
+    if (index < MaxWorkers) {
+        slot = &shared->slots[index];
+    } else {
+        // Take over the slot of a dead worker, its counters keep counting up
+        for (int i = 0; i < MaxWorkers && !slot; ++i) {
+            qint64 owner = shared->slots[i].pid.load();
+            if (!alive(owner) && shared->slots[i].pid.compare_exchange_strong(owner, pid)) {
+                slot = &shared->slots[i];
+            }
+        }
+        if (!slot) {
+            qCWarning(CLOUDLYST_METRICS) << "No free metrics slot, sharing the last one";
+            slot = &shared->slots[MaxWorkers - 1];
+        }
+        slot->spoolCurrent.store(0);
+    }
+    slot->pid.store(pid);
+
+    currentSlotPid = pid;
+    currentSlot.store(slot);
+}
+
+QByteArray Metrics::scrape()
+{
+    QByteArray ret;
+    if (!shared) {
+        return ret;
+    }
+
+    const int slots = qMin(shared->nextSlot.load(), MaxWorkers);
+
+    auto sum = [slots] (const std::function<const Counter &(const Slot &)> &get) {
+        quint64 total = 0;
+        for (int i = 0; i < slots; ++i) {
+            total += load(get(shared->slots[i]));
+        }
+        return total;
+    };
+
+    auto header = [&ret] (const char *name, const char *type, const char *help) {
+        ret.append("# HELP ").append(name).append(' ').append(help).append('\n');
+        ret.append("# TYPE ").append(name).append(' ').append(type).append('\n');
+    };
+
+    auto line = [&ret] (const QByteArray &name, const QByteArray &labels, const QByteArray &value) {
+        ret.append(name);
+        if (!labels.isEmpty()) {
+            ret.append('{').append(labels).append('}');
+        }
+        ret.append(' ').append(value).append('\n');
+    };
+
+    header("cloudlyst_http_request_duration_seconds", "histogram", "Request latency by method and status class.");
+    for (int m = 0; m < MethodCount; ++m) {
+        for (int s = 0; s < StatusCount; ++s) {
+            quint64 cumulative = 0;
+            QByteArray buckets;
+            const QByteArray labels = QByteArray("method=\"") + methodNames[m] + "\",status=\"" + statusNames[s] + '"';
+            for (int b = 0; b < LatencyBuckets; ++b) {
+                cumulative += sum([m, s, b] (const Slot &slot) -> const Counter & { return slot.latency[m][s][b]; });
+                const QByteArray le = b < LatencyBuckets - 1 ? QByteArray::number(latencyBounds[b]) : QByteArray("+Inf");
+                buckets.append("cloudlyst_http_request_duration_seconds_bucket{").append(labels)
+                        .append(",le=\"").append(le).append("\"} ").append(QByteArray::number(cumulative)).append('\n');
+            }
+            if (!cumulative) {
+                continue;
+            }
+            ret.append(buckets);
+            const quint64 usecs = sum([m, s] (const Slot &slot) -> const Counter & { return slot.latencySum[m][s]; });
+            line("cloudlyst_http_request_duration_seconds_sum", labels, QByteArray::number(usecs / 1e6, 'f', 6));
+            line("cloudlyst_http_request_duration_seconds_count", labels, QByteArray::number(cumulative));
+        }
+    }
+
+    header("cloudlyst_http_request_bytes_total", "counter", "Request body bytes by method.");
+    for (int m = 0; m < MethodCount; ++m) {
+        const quint64 value = sum([m] (const Slot &slot) -> const Counter & { return slot.bytesIn[m]; });
+        if (value) {
+            line("cloudlyst_http_request_bytes_total", QByteArray("method=\"") + methodNames[m] + '"', QByteArray::number(value));
+        }
+    }
+
+    header("cloudlyst_http_response_bytes_total", "counter", "Response body bytes by method.");
+    for (int m = 0; m < MethodCount; ++m) {
+        const quint64 value = sum([m] (const Slot &slot) -> const Counter & { return slot.bytesOut[m]; });
+        if (value) {
+            line("cloudlyst_http_response_bytes_total", QByteArray("method=\"") + methodNames[m] + '"', QByteArray::number(value));
+        }
+    }
+
+    header("cloudlyst_sql_queries_total", "counter", "SQL statements executed.");
+    line("cloudlyst_sql_queries_total", QByteArray(), QByteArray::number(sum([] (const Slot &slot) -> const Counter & { return slot.sqlQueries; })));
+    header("cloudlyst_sql_seconds_total", "counter", "Time spent executing SQL statements.");
+    line("cloudlyst_sql_seconds_total", QByteArray(), QByteArray::number(sum([] (const Slot &slot) -> const Counter & { return slot.sqlNsecs; }) / 1e9, 'f', 6));
+
+    header("cloudlyst_sql_statement_seconds_total", "counter", "Time spent executing each SQL statement.");
+    for (int i = 0; i < SqlQuery::StatementCount; ++i) {
+        const quint64 nsecs = sum([i] (const Slot &slot) -> const Counter & { return slot.stmtNsecs[i]; });
+        if (nsecs) {
+            line("cloudlyst_sql_statement_seconds_total", QByteArray("statement=\"") + SqlQuery::name(SqlQuery::Statement(i)) + '"',
+                 QByteArray::number(nsecs / 1e9, 'f', 6));
+        }
+    }
+
+    header("cloudlyst_sql_queries_per_request", "histogram", "SQL statements executed per request.");
+    {
+        quint64 cumulative = 0;
+        for (int b = 0; b < SqlBuckets; ++b) {
+            cumulative += sum([b] (const Slot &slot) -> const Counter & { return slot.sqlPerRequest[b]; });
+            const QByteArray le = b < SqlBuckets - 1 ? QByteArray::number(sqlBounds[b]) : QByteArray("+Inf");
+            line("cloudlyst_sql_queries_per_request_bucket", "le=\"" + le + '"', QByteArray::number(cumulative));
+        }
+        line("cloudlyst_sql_queries_per_request_count", QByteArray(), QByteArray::number(cumulative));
+    }
+
+    header("cloudlyst_cache_requests_total", "counter", "Cache lookups by cache and result.");
+    for (int i = 0; i < CacheCount; ++i) {
+        const QByteArray labels = QByteArray("cache=\"") + cacheNames[i] + "\",result=\"";
+        line("cloudlyst_cache_requests_total", labels + "hit\"",
+             QByteArray::number(sum([i] (const Slot &slot) -> const Counter & { return slot.cacheHits[i]; })));
+        line("cloudlyst_cache_requests_total", labels + "miss\"",
+             QByteArray::number(sum([i] (const Slot &slot) -> const Counter & { return slot.cacheMisses[i]; })));
+    }
+
+    header("cloudlyst_admission_total", "counter", "Admission control decisions by result.");
+    for (int i = 0; i < AdmissionCount; ++i) {
+        line("cloudlyst_admission_total", QByteArray("result=\"") + admissionNames[i] + '"',
+             QByteArray::number(sum([i] (const Slot &slot) -> const Counter & { return slot.admission[i]; })));
+    }
+
+    header("cloudlyst_spool_bytes", "histogram", "Size of request bodies spooled to disk.");
+    {
+        quint64 cumulative = 0;
+        for (int b = 0; b < SpoolBuckets; ++b) {
+            cumulative += sum([b] (const Slot &slot) -> const Counter & { return slot.spool[b]; });
+            const QByteArray le = b < SpoolBuckets - 1 ? QByteArray::number(spoolBounds[b]) : QByteArray("+Inf");
+            line("cloudlyst_spool_bytes_bucket", "le=\"" + le + '"', QByteArray::number(cumulative));
+        }
+        line("cloudlyst_spool_bytes_sum", QByteArray(), QByteArray::number(sum([] (const Slot &slot) -> const Counter & { return slot.spoolSum; })));
+        line("cloudlyst_spool_bytes_count", QByteArray(), QByteArray::number(cumulative));
+    }
+
+    // Gauges only make sense for live workers
+    qint64 spoolCurrent = 0;
+    int workers = 0;
+    for (int i = 0; i < slots; ++i) {
+        if (alive(shared->slots[i].pid.load())) {
+            spoolCurrent += shared->slots[i].spoolCurrent.load(std::memory_order_relaxed);
+            ++workers;
+        }
+    }
+    header("cloudlyst_spool_current_bytes", "gauge", "Bytes currently held in spooled request bodies.");
+    line("cloudlyst_spool_current_bytes", QByteArray(), QByteArray::number(spoolCurrent));
+    header("cloudlyst_workers", "gauge", "Live worker processes reporting metrics.");
+    line("cloudlyst_workers", QByteArray(), QByteArray::number(workers));
+
+    return ret;
+}
@@ -0,0 +1,72 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <Cutelyst/Plugin>
+
+#include <QHash>
+#include <QJsonArray>
+
+using namespace Cutelyst;
+
+/**
+ * Prometheus metrics registry.
+ *
+ * Counters and histograms live in an anonymous shared mapping created
+ * before the workers are forked, each worker process increments its own
+ * slot with relaxed atomics and a scrape sums all slots, so whichever
+ * worker answers /metrics reports the whole server. In lazy mode (app
+ * loaded after fork) each worker only sees its own numbers.
+ */
+class Metrics : public Plugin
+{
+    Q_OBJECT
+public:
+    enum Cache {
+        PreviewCache,
+        FileCache,
+        CacheCount,
+    };
+
+    enum Admission {
+        AdmissionAdmitted,
+        AdmissionQueued,
+        AdmissionThrottled,
+        AdmissionShed,
+        AdmissionTimedOut,
+        AdmissionCount,
+    };
+
+    explicit Metrics(Application *parent);
+
+    virtual bool setup(Application *app) override;
+
+    /** Accounts an SqlQuery::Statement execution to the current request */
+    static void recordStatement(int statement, qint64 nsecs, int rows, bool ok);
+
+    /** Per statement totals of all workers, slowest first */
+    static QJsonArray statementStats();
+
+    static void recordCache(Cache cache, bool hit);
+
+    static void recordAdmission(Admission result);
+
+    /** Aggregated text exposition format */
+    static QByteArray scrape();
+
+private:
+    struct RequestState {
+        qint64 start;
+        qint64 spool;
+        quint64 sqlQueries;
+        quint64 sqlNsecs;
+    };
+
+    void beforeDispatch(Context *c);
+    void afterDispatch(Context *c);
+
+    static void claimSlot();
+
+    QHash<Context *, RequestState> m_requests;
+};
+
+#endif // METRICS_H
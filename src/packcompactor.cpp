@@ -0,0 +1,321 @@
+#include "packcompactor.h"
+
+#include "cloudlyst.h"
+#include "packstore.h"
+#include "sqlquery.h"
+
+#include <Cutelyst/Plugins/Utils/Sql>
+
+#include <QSqlQuery>
+#include <QSqlError>
+
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QThread>
+
+#include <QLoggingCategory>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+Q_LOGGING_CATEGORY(CLOUDLYST_COMPACT, "cloudlyst.compact", QtInfoMsg)
+
+using namespace Cutelyst;
+
+namespace {
+
+// How long a retired segment stays readable
+const int RetireGrace = 300;
+// Copied per append, so a large segment isn't held in memory whole
+const qint64 SliceSize = 4 * 1024 * 1024;
+
+QString retiredMarker(const QString &userDir, int packId)
+{
+    return PackStore::segmentPath(userDir, packId) + QLatin1String(".retired");
+}
+
+}
+
+PackCompactor::PackCompactor(const QString &baseDir, QObject *parent) : QObject(parent)
+  , m_baseDir(baseDir)
+{
+    m_timer.setInterval(3600 * 1000);
+    connect(&m_timer, &QTimer::timeout, this, &PackCompactor::compactAll);
+}
+
+void PackCompactor::setInterval(int secs)
+{
+    m_timer.setInterval(qMax(60, secs) * 1000);
+}
+
+void PackCompactor::setThreshold(double threshold)
+{
+    m_threshold = qBound(0.0, threshold, 1.0);
+}
+
+void PackCompactor::startService(const QString &baseDir, int interval, double threshold)
+{
+#ifdef Q_OS_LINUX
+    const QByteArray lockFile = QFile::encodeName(baseDir + QLatin1String(".compactor.lock"));
+    int lockFd = ::open(lockFile.constData(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lockFd == -1) {
+        qCWarning(CLOUDLYST_COMPACT) << "Failed to open compactor lock" << lockFile << qt_error_string(errno);
+        return;
+    }
+
+    // Only one worker compacts, the lock goes away together with its process
+    if (::flock(lockFd, LOCK_EX | LOCK_NB) == -1) {
+        ::close(lockFd);
+        QTimer::singleShot(30 * 1000, [baseDir, interval, threshold] {
+            startService(baseDir, interval, threshold);
+        });
+        return;
+    }
+
+    auto thread = new QThread;
+    auto compactor = new PackCompactor(baseDir);
+    compactor->setInterval(interval);
+    compactor->setThreshold(threshold);
+    compactor->moveToThread(thread);
+    connect(thread, &QThread::started, compactor, &PackCompactor::start);
+    connect(thread, &QThread::finished, compactor, &QObject::deleteLater);
+    thread->setObjectName(QStringLiteral("PackCompactor"));
+    thread->start(QThread::IdlePriority);
+#else
+    Q_UNUSED(baseDir)
+    Q_UNUSED(interval)
+    Q_UNUSED(threshold)
+    qCWarning(CLOUDLYST_COMPACT) << "Pack compaction is not supported on this platform";
+#endif
+}
+
+bool PackCompactor::start()
+{
+    if (!Cloudlyst::openDatabase()) {
+        return false;
+    }
+
+    m_timer.start();
+    qCInfo(CLOUDLYST_COMPACT) << "Compacting packs in" << m_baseDir << "every" << m_timer.interval() / 1000 << "s";
+    return true;
+}
+
+QString PackCompactor::errorString() const
+{
+    return m_error;
+}
+
+void PackCompactor::compactAll()
+{
+    QSqlQuery query(Sql::databaseThread(QStringLiteral("cloudlyst")));
+    if (!query.exec(QStringLiteral("SELECT id, username FROM cloudlyst.users"))) {
+        qCWarning(CLOUDLYST_COMPACT) << "Failed to list users" << query.lastError().databaseText();
+        return;
+    }
+
+    while (query.next()) {
+        const QString userDir = m_baseDir + query.value(1).toString() + QLatin1Char('/');
+        if (QFileInfo(PackStore::packDir(userDir)).isDir() && !compact(userDir, query.value(0))) {
+            qCWarning(CLOUDLYST_COMPACT) << "Compaction failed" << userDir << m_error;
+        }
+    }
+}
+
+bool PackCompactor::compact(const QString &userDir, const QVariant &userId)
+{
+    m_error.clear();
+
+    const QString dir = PackStore::packDir(userDir);
+    if (!QFileInfo(dir).isDir()) {
+        return true;
+    }
+
+    // One compaction per pack at a time, the server's or cloudlyst-scan's
+    QFile lock(dir + QLatin1String("compact.lock"));
+    if (!lock.open(QIODevice::ReadWrite)) {
+        m_error = lock.errorString();
+        return false;
+    }
+    if (::flock(lock.handle(), LOCK_EX | LOCK_NB) == -1) {
+        qCDebug(CLOUDLYST_COMPACT) << "Already being compacted" << dir;
+        return true;
+    }
+
+    if (!prune(userId)) {
+        return false;
+    }
+
+    SqlQuery usage(SqlQuery::FilesPackUsage);
+    usage.bindValue(QStringLiteral(":owner_id"), userId);
+    if (!usage.exec()) {
+        m_error = usage.lastError().databaseText();
+        return false;
+    }
+    QHash<int, qint64> live;
+    while (usage.next()) {
+        live.insert(usage.value(0).toInt(), usage.value(1).toLongLong());
+    }
+
+    const qint64 now = QDateTime::currentSecsSinceEpoch();
+    const int active = PackStore::activeSegment(userDir);
+    const QList<int> segments = PackStore::segments(userDir);
+    for (int packId : segments) {
+        const QString path = PackStore::segmentPath(userDir, packId);
+        const QFileInfo marker(retiredMarker(userDir, packId));
+        if (marker.exists()) {
+            if (marker.lastModified().toSecsSinceEpoch() + RetireGrace < now && !removeRetired(userDir, userId, packId)) {
+                return false;
+            }
+            continue;
+        }
+
+        // Appends only ever go to the active segment
+        const qint64 size = QFileInfo(path).size();
+        if (packId >= active || (size && live.value(packId) >= size * m_threshold)) {
+            continue;
+        }
+
+        if (!compactSegment(userDir, userId, packId)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PackCompactor::compactSegment(const QString &userDir, const QVariant &userId, int packId)
+{
+    std::vector<std::pair<qint64, int> > blobs;
+    if (!liveBlobs(userId, packId, blobs) || !relocate(userDir, userId, packId, blobs)) {
+        return false;
+    }
+
+    // A COPY may have pointed a new row at it meanwhile, the next run takes it
+    blobs.clear();
+    if (!liveBlobs(userId, packId, blobs)) {
+        return false;
+    }
+    if (!blobs.empty()) {
+        qCDebug(CLOUDLYST_COMPACT) << "Still in use" << PackStore::segmentPath(userDir, packId) << blobs.size();
+        return true;
+    }
+
+    QFile marker(retiredMarker(userDir, packId));
+    if (!marker.open(QIODevice::WriteOnly)) {
+        m_error = marker.errorString();
+        return false;
+    }
+    qCInfo(CLOUDLYST_COMPACT) << "Retired" << PackStore::segmentPath(userDir, packId);
+    return true;
+}
+
+bool PackCompactor::removeRetired(const QString &userDir, const QVariant &userId, int packId)
+{
+    // A COPY that raced the relocation copied the old location, and a stale
+    // one becomes valid again if its file gets the same content back
+    std::vector<std::pair<qint64, int> > blobs;
+    if (!prune(userId) || !liveBlobs(userId, packId, blobs)) {
+        return false;
+    }
+
+    const QString path = PackStore::segmentPath(userDir, packId);
+    if (!blobs.empty()) {
+        qCInfo(CLOUDLYST_COMPACT) << "Relocating again" << path << blobs.size();
+        if (!relocate(userDir, userId, packId, blobs)) {
+            return false;
+        }
+
+        // Another grace period for whoever looked up the old locations
+        QFile marker(retiredMarker(userDir, packId));
+        if (!marker.open(QIODevice::WriteOnly) || !marker.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime)) {
+            m_error = marker.errorString();
+            return false;
+        }
+        return true;
+    }
+
+    qCInfo(CLOUDLYST_COMPACT) << "Removing" << path;
+    QFile::remove(path);
+    QFile::remove(retiredMarker(userDir, packId));
+    return true;
+}
+
+bool PackCompactor::relocate(const QString &userDir, const QVariant &userId, int packId,
+                             const std::vector<std::pair<qint64, int> > &blobs)
+{
+    QSqlDatabase db = Sql::databaseThread(QStringLiteral("cloudlyst"));
+    for (size_t begin = 0; begin < blobs.size();) {
+        std::vector<QByteArray> contents;
+        qint64 sliceSize = 0;
+        size_t end = begin;
+        for (; end < blobs.size() && (end == begin || sliceSize + blobs[end].second <= SliceSize); ++end) {
+            QByteArray content;
+            if (!PackStore::read(userDir, { packId, blobs[end].first, blobs[end].second }, content, m_error)) {
+                return false;
+            }
+            sliceSize += content.size();
+            contents.push_back(content);
+        }
+
+        std::vector<PackStore::Blob> moved;
+        if (!PackStore::append(userDir, contents, moved, m_error)) {
+            return false;
+        }
+
+        // Rows still at the old place, copies of a file share their location
+        bool ok = db.transaction();
+        for (size_t i = begin; ok && i < end; ++i) {
+            SqlQuery query(SqlQuery::FilesPackRelocate);
+            query.bindValue(QStringLiteral(":new_pack_id"), moved[i - begin].packId);
+            query.bindValue(QStringLiteral(":new_offset"), moved[i - begin].offset);
+            query.bindValue(QStringLiteral(":owner_id"), userId);
+            query.bindValue(QStringLiteral(":pack_id"), packId);
+            query.bindValue(QStringLiteral(":pack_offset"), blobs[i].first);
+            ok = query.exec();
+            if (!ok) {
+                m_error = query.lastError().databaseText();
+            }
+        }
+        if (!ok || !db.commit()) {
+            if (m_error.isEmpty()) {
+                m_error = db.lastError().databaseText();
+            }
+            db.rollback();
+            return false;
+        }
+        begin = end;
+    }
+    return true;
+}
+
+bool PackCompactor::prune(const QVariant &userId)
+{
+    // Locations left behind by files written since in some other way
+    SqlQuery query(SqlQuery::FilesPackPrune);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+    if (!query.exec()) {
+        m_error = query.lastError().databaseText();
+        return false;
+    }
+    return true;
+}
+
+bool PackCompactor::liveBlobs(const QVariant &userId, int packId, std::vector<std::pair<qint64, int> > &blobs)
+{
+    SqlQuery query(SqlQuery::FilesPackList);
+    query.setForwardOnly(true);
+    query.bindValue(QStringLiteral(":owner_id"), userId);
+    query.bindValue(QStringLiteral(":pack_id"), packId);
+    if (!query.exec()) {
+        m_error = query.lastError().databaseText();
+        return false;
+    }
+
+    while (query.next()) {
+        blobs.push_back({ query.value(0).toLongLong(), query.value(1).toInt() });
+    }
+    return true;
+}
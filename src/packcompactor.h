@@ -0,0 +1,58 @@
+#ifndef PACKCOMPACTOR_H
+#define PACKCOMPACTOR_H
+
+#include <QObject>
+#include <QTimer>
+#include <QVariant>
+
+#include <vector>
+
+/**
+ * Reclaims the space PackStore segments keep for files that were removed
+ * or replaced since.
+ *
+ * A segment, but the active one, whose live files take less than the
+ * threshold of its size has them appended again and is retired. It is
+ * removed once a grace period has passed, so requests that looked up the
+ * old location just before can still read it, and only once no row points
+ * at it anymore.
+ */
+class PackCompactor : public QObject
+{
+    Q_OBJECT
+public:
+    explicit PackCompactor(const QString &baseDir = QString(), QObject *parent = nullptr);
+
+    void setInterval(int secs);
+    void setThreshold(double threshold);
+
+    /**
+     * Starts a compactor thread unless another worker already holds the
+     * data dir compactor lock, retrying like FilesWatcher::startService().
+     */
+    static void startService(const QString &baseDir, int interval, double threshold);
+
+    /** Compacts the pack of one user, blocks until done */
+    bool compact(const QString &userDir, const QVariant &userId);
+
+    QString errorString() const;
+
+public Q_SLOTS:
+    bool start();
+
+private:
+    void compactAll();
+    bool compactSegment(const QString &userDir, const QVariant &userId, int packId);
+    bool removeRetired(const QString &userDir, const QVariant &userId, int packId);
+    bool relocate(const QString &userDir, const QVariant &userId, int packId,
+                  const std::vector<std::pair<qint64, int> > &blobs);
+    bool prune(const QVariant &userId);
+    bool liveBlobs(const QVariant &userId, int packId, std::vector<std::pair<qint64, int> > &blobs);
+
+    QString m_baseDir;
+    QTimer m_timer;
+    QString m_error;
+    double m_threshold = 0.5;
+};
+
+#endif // PACKCOMPACTOR_H
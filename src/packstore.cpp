@@ -0,0 +1,186 @@
+#include "packstore.h"
+
+#include "filessql.h"
+
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+
+#include <QLoggingCategory>
+
+#include <algorithm>
+
+#include <errno.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+Q_LOGGING_CATEGORY(CLOUDLYST_PACK, "cloudlyst.pack", QtWarningMsg)
+
+namespace {
+
+qint64 maxSize = 0;
+qint64 maxSegmentSize = 64 * 1024 * 1024;
+
+int readHead(QFile &head)
+{
+    head.seek(0);
+    const int packId = head.readAll().trimmed().toInt();
+    return packId > 0 ? packId : 1;
+}
+
+bool writeHead(QFile &head, int packId)
+{
+    const QByteArray data = QByteArray::number(packId);
+    return head.resize(0) && head.seek(0) && head.write(data) == data.size();
+}
+
+}
+
+void PackStore::setup(qint64 maxFileSize, qint64 segmentSize)
+{
+    maxSize = qMax(Q_INT64_C(0), maxFileSize);
+    if (segmentSize > 0) {
+        maxSegmentSize = segmentSize;
+    }
+    if (maxSize) {
+        qCInfo(CLOUDLYST_PACK) << "Packing files up to" << maxSize << "bytes in segments of" << maxSegmentSize << "bytes";
+    }
+}
+
+bool PackStore::fits(qint64 size)
+{
+    return maxSize && size <= maxSize;
+}
+
+QString PackStore::packDir(const QString &userDir)
+{
+    return userDir + QLatin1String(".packs/");
+}
+
+QString PackStore::segmentPath(const QString &userDir, int packId)
+{
+    return packDir(userDir) + QString::number(packId) + QLatin1String(".pack");
+}
+
+int PackStore::activeSegment(const QString &userDir)
+{
+    QFile head(packDir(userDir) + QLatin1String("head"));
+    if (!head.open(QIODevice::ReadOnly)) {
+        return 0;
+    }
+    return readHead(head);
+}
+
+QList<int> PackStore::segments(const QString &userDir)
+{
+    QList<int> ret;
+    const QStringList names = QDir(packDir(userDir)).entryList({ QStringLiteral("*.pack") }, QDir::Files);
+    for (const QString &name : names) {
+        const int packId = name.left(name.size() - 5).toInt();
+        if (packId > 0) {
+            ret.append(packId);
+        }
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+bool PackStore::append(const QString &userDir, const std::vector<QByteArray> &contents, std::vector<Blob> &blobs, QString &error)
+{
+    const QString dir = packDir(userDir);
+    if (!QDir().mkpath(dir)) {
+        error = QLatin1String("Could not create ") + dir;
+        return false;
+    }
+
+    // Holds the active segment id, its lock serializes the writers of all workers
+    QFile head(dir + QLatin1String("head"));
+    if (!head.open(QIODevice::ReadWrite | QIODevice::Unbuffered)) {
+        error = head.errorString();
+        return false;
+    }
+    if (::flock(head.handle(), LOCK_EX) == -1) {
+        error = qt_error_string(errno);
+        return false;
+    }
+
+    int packId = readHead(head);
+    QFile segment(segmentPath(userDir, packId));
+    if (!segment.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Unbuffered)) {
+        error = segment.errorString();
+        return false;
+    }
+
+    if (segment.size() >= maxSegmentSize) {
+        segment.close();
+        segment.setFileName(segmentPath(userDir, ++packId));
+        if (!segment.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Unbuffered) || !writeHead(head, packId)) {
+            error = segment.errorString();
+            return false;
+        }
+    }
+
+    const qint64 offset = segment.size();
+    QByteArray data;
+    blobs.clear();
+    blobs.reserve(contents.size());
+    for (const QByteArray &content : contents) {
+        blobs.push_back({ packId, offset + data.size(), content.size() });
+        data.append(content);
+    }
+
+    if (segment.write(data) != data.size() || ::fdatasync(segment.handle()) == -1) {
+        error = segment.error() != QFileDevice::NoError ? segment.errorString() : qt_error_string(errno);
+        // Cut back, so a torn write never ends up in the middle of a segment
+        if (!segment.resize(offset)) {
+            qCWarning(CLOUDLYST_PACK) << "Failed to truncate" << segment.fileName() << segment.errorString();
+        }
+        return false;
+    }
+    return true;
+}
+
+bool PackStore::read(const QString &userDir, const Blob &blob, QByteArray &content, QString &error)
+{
+    QFile segment(segmentPath(userDir, blob.packId));
+    if (!segment.open(QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+        error = segment.errorString();
+        return false;
+    }
+
+    content.resize(blob.length);
+    qint64 done = 0;
+    while (done < blob.length) {
+        const ssize_t len = ::pread(segment.handle(), content.data() + done, size_t(blob.length - done), off_t(blob.offset + done));
+        if (len > 0) {
+            done += len;
+        } else if (len == 0) {
+            error = QLatin1String("Segment shorter than its files ") + segment.fileName();
+            return false;
+        } else if (errno != EINTR) {
+            error = qt_error_string(errno);
+            return false;
+        }
+    }
+    return true;
+}
+
+QIODevice *PackStore::open(const QString &userDir, const FileItem &item, QString &error, QObject *parent)
+{
+    QByteArray content;
+    if (!read(userDir, { item.packId, item.packOffset, item.packLength }, content, error)) {
+        return nullptr;
+    }
+
+    // Cheap at these sizes, and never serves the bytes of some other file
+    if (QString::fromLatin1(QCryptographicHash::hash(content, QCryptographicHash::Md5).toHex()) != item.etag) {
+        error = QLatin1String("Packed content doesn't match its etag ") + item.path;
+        return nullptr;
+    }
+
+    auto buffer = new QBuffer(parent);
+    buffer->setData(content);
+    buffer->open(QIODevice::ReadOnly);
+    return buffer;
+}
@@ -0,0 +1,68 @@
+#ifndef PACKSTORE_H
+#define PACKSTORE_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+#include <vector>
+
+struct FileItem;
+class QIODevice;
+class QObject;
+
+/**
+ * Packed storage for tiny files (PackMaxSize).
+ *
+ * Instead of a file of their own, each costing an inode, a directory
+ * entry and a filesystem block, small files are appended to the segments
+ * of their owner's pack, <user>/.packs/<id>.pack, and
+ * cloudlyst.file_packs tells where. A location only counts while its
+ * etag matches the one of the file, so a file written in any other way
+ * leaves its packed copy behind without touching the pack.
+ *
+ * Segments are only ever appended to, the last one until it reaches
+ * PackSegmentSize. The space of files removed or replaced is reclaimed
+ * by PackCompactor.
+ */
+class PackStore
+{
+public:
+    struct Blob {
+        int packId;
+        qint64 offset;
+        int length;
+    };
+
+    /** \p maxFileSize 0 keeps new files out of packs, existing ones are still read */
+    static void setup(qint64 maxFileSize, qint64 segmentSize);
+
+    /** True if new files of \p size go into packs */
+    static bool fits(qint64 size);
+
+    /** Where the segments of \p userDir are, with a trailing slash */
+    static QString packDir(const QString &userDir);
+    static QString segmentPath(const QString &userDir, int packId);
+
+    /** The segment being appended to, 0 if there is none yet */
+    static int activeSegment(const QString &userDir);
+
+    /** The ids of all segments, sorted */
+    static QList<int> segments(const QString &userDir);
+
+    /**
+     * Appends all of \p contents to the active segment in one write and
+     * syncs it before returning, \p blobs get where each one went.
+     */
+    static bool append(const QString &userDir, const std::vector<QByteArray> &contents, std::vector<Blob> &blobs, QString &error);
+
+    static bool read(const QString &userDir, const Blob &blob, QByteArray &content, QString &error);
+
+    /**
+     * The packed content of \p item, checked against its etag. Returns
+     * nullptr with \p error set on failure.
+     */
+    static QIODevice *open(const QString &userDir, const FileItem &item, QString &error, QObject *parent = nullptr);
+};
+
+#endif // PACKSTORE_H
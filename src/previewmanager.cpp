@@ -0,0 +1,358 @@
+#include "previewmanager.h"
+
+#include "metrics.h"
+#include "packstore.h"
+#include "storedfile.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QImage>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QPainter>
+#include <QSaveFile>
+#include <QThread>
+
+#include <QLoggingCategory>
+
+#include <algorithm>
+#include <memory>
+#include <new>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Q_LOGGING_CATEGORY(CLOUDLYST_PREVIEW, "cloudlyst.preview", QtWarningMsg)
+
+// Refuse to decode anything bigger than this many pixels
+static const qint64 maxSourcePixels = 100 * 1000 * 1000;
+// A hit only marks a preview used again once this much older, in ms
+static const qint64 touchInterval = 60 * 1000;
+
+class PreviewTask : public QRunnable
+{
+public:
+    PreviewTask(PreviewManager *manager, const PreviewRequest &req, const QString &fileName, int quality)
+        : m_manager(manager), m_req(req), m_fileName(fileName), m_quality(quality) {}
+
+    void run() override
+    {
+        m_manager->renderFinished(m_fileName, render());
+    }
+
+private:
+    PreviewManager::Result render()
+    {
+        // Packed or compressed at rest, the content isn't the file on disk
+        QString error;
+        std::unique_ptr<QIODevice> source(m_req.item.packId ? PackStore::open(m_req.userDir, m_req.item, error)
+                                                            : StoredFile::open(m_req.sourcePath, error));
+        if (!source) {
+            qCWarning(CLOUDLYST_PREVIEW) << "Failed to open" << m_req.sourcePath << error;
+            return PreviewManager::Failed;
+        }
+
+        QImageReader reader(source.get());
+        reader.setAutoTransform(true);
+
+        QSize sourceSize = reader.size();
+        if (!sourceSize.isValid() || qint64(sourceSize.width()) * sourceSize.height() > maxSourcePixels) {
+            qCWarning(CLOUDLYST_PREVIEW) << "Refusing to decode" << m_req.sourcePath << sourceSize << reader.errorString();
+            return PreviewManager::Failed;
+        }
+
+        // The reader scales before applying the EXIF rotation
+        QSize target(m_req.width, m_req.height);
+        if (reader.transformation() & QImageIOHandler::TransformationRotate90) {
+            target.transpose();
+        }
+
+        // Let the decoder downscale (JPEG does it while decoding), never upscale
+        if (sourceSize.width() > target.width() || sourceSize.height() > target.height()) {
+            reader.setScaledSize(sourceSize.scaled(target, m_req.keepAspect ? Qt::KeepAspectRatio : Qt::KeepAspectRatioByExpanding));
+        }
+
+        QImage image = reader.read();
+        if (image.isNull()) {
+            qCWarning(CLOUDLYST_PREVIEW) << "Failed to decode" << m_req.sourcePath << reader.errorString();
+            return PreviewManager::Failed;
+        }
+
+        if (!m_req.keepAspect && (image.width() > m_req.width || image.height() > m_req.height)) {
+            const int w = qMin(image.width(), m_req.width);
+            const int h = qMin(image.height(), m_req.height);
+            image = image.copy((image.width() - w) / 2, (image.height() - h) / 2, w, h);
+        }
+
+        if (image.hasAlphaChannel() && m_req.format == "jpeg") {
+            QImage flattened(image.size(), QImage::Format_RGB32);
+            flattened.fill(Qt::white);
+            QPainter painter(&flattened);
+            painter.drawImage(0, 0, image);
+            painter.end();
+            image = flattened;
+        }
+
+        QDir().mkpath(QFileInfo(m_fileName).absolutePath());
+
+        QSaveFile file(m_fileName);
+        if (!file.open(QIODevice::WriteOnly)) {
+            qCWarning(CLOUDLYST_PREVIEW) << "Failed to create" << m_fileName << file.errorString();
+            return PreviewManager::Failed;
+        }
+
+        QImageWriter writer(&file, m_req.format);
+        writer.setQuality(m_quality);
+        if (!writer.write(image) || !file.commit()) {
+            qCWarning(CLOUDLYST_PREVIEW) << "Failed to write" << m_fileName << writer.errorString();
+            return PreviewManager::Failed;
+        }
+
+        return PreviewManager::Ok;
+    }
+
+    PreviewManager *m_manager;
+    PreviewRequest m_req;
+    QString m_fileName;
+    int m_quality;
+};
+
+PreviewManager::PreviewManager(QObject *parent) : QObject(parent)
+  , m_cacheSize(&m_localCacheSize)
+{
+    m_pool.setMaxThreadCount(qMax(1, QThread::idealThreadCount() / 2));
+
+    const QList<QByteArray> mimeTypes = QImageReader::supportedMimeTypes();
+    for (const QByteArray &mimeType : mimeTypes) {
+        m_supportedMimeTypes.append(QString::fromLatin1(mimeType));
+    }
+}
+
+PreviewManager *PreviewManager::instance()
+{
+    // Shared by all worker threads of the process so renders are coalesced
+    static PreviewManager *manager = new PreviewManager;
+    return manager;
+}
+
+void PreviewManager::setCacheDir(const QString &cacheDir)
+{
+    QMutexLocker locker(&m_mutex);
+    m_cacheDir = cacheDir;
+    if (!m_cacheDir.endsWith(QLatin1Char('/'))) {
+        m_cacheDir.append(QLatin1Char('/'));
+    }
+    m_cacheLoaded = false;
+}
+
+bool PreviewManager::setMaxCacheSize(qint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+    m_maxCacheSize = bytes;
+    if (m_cacheSize != &m_localCacheSize) {
+        return true;
+    }
+
+    // Anonymous and shared, so it survives fork() and every worker counts
+    // against the same limit
+    void *mem = mmap(nullptr, sizeof(std::atomic<qint64>), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        qCCritical(CLOUDLYST_PREVIEW) << "Failed to map preview cache size" << strerror(errno);
+        return false;
+    }
+    m_cacheSize = new (mem) std::atomic<qint64>(m_cacheSize->load());
+    return true;
+}
+
+void PreviewManager::setMaxWorkers(int workers)
+{
+    m_pool.setMaxThreadCount(qMax(1, workers));
+}
+
+void PreviewManager::setMaxQueue(int queue)
+{
+    QMutexLocker locker(&m_mutex);
+    m_maxQueue = queue;
+}
+
+void PreviewManager::setQuality(int quality)
+{
+    QMutexLocker locker(&m_mutex);
+    m_quality = quality;
+}
+
+bool PreviewManager::canPreview(const QString &mimetype) const
+{
+    return m_supportedMimeTypes.contains(mimetype);
+}
+
+bool PreviewManager::supportsFormat(const QByteArray &format) const
+{
+    return QImageWriter::supportedImageFormats().contains(format);
+}
+
+void PreviewManager::request(const PreviewRequest &req, QObject *receiver, Callback callback)
+{
+    const QString fileName = cacheFileName(req);
+    Waiter waiter{ receiver, callback };
+
+    QMutexLocker locker(&m_mutex);
+    if (!m_cacheLoaded) {
+        loadCache();
+    }
+
+    auto cacheIt = m_cache.find(fileName);
+    if (cacheIt != m_cache.end()) {
+        // Another process might have evicted it
+        if (QFile::exists(fileName)) {
+            // Evictions go by mtime, so the other workers see it was used
+            const qint64 now = QDateTime::currentMSecsSinceEpoch();
+            if (cacheIt->lastAccess + touchInterval < now) {
+                ::utimensat(AT_FDCWD, QFile::encodeName(fileName).constData(), nullptr, 0);
+            }
+            cacheIt->lastAccess = now;
+            locker.unlock();
+            Metrics::recordCache(Metrics::PreviewCache, true);
+            deliver(waiter, fileName, Ok);
+            return;
+        }
+        m_cache.erase(cacheIt);
+    } else if (QFile::exists(fileName)) {
+        // Rendered by another worker process
+        m_cache.insert(fileName, { QFileInfo(fileName).size(), QDateTime::currentMSecsSinceEpoch() });
+        locker.unlock();
+        Metrics::recordCache(Metrics::PreviewCache, true);
+        deliver(waiter, fileName, Ok);
+        return;
+    }
+
+    Metrics::recordCache(Metrics::PreviewCache, false);
+
+    auto inflightIt = m_inflight.find(fileName);
+    if (inflightIt != m_inflight.end()) {
+        inflightIt->push_back(waiter);
+        return;
+    }
+
+    if (m_inflight.size() >= m_maxQueue) {
+        locker.unlock();
+        deliver(waiter, QString(), Busy);
+        return;
+    }
+
+    m_inflight.insert(fileName, { waiter });
+    m_pool.start(new PreviewTask(this, req, fileName, m_quality));
+}
+
+QString PreviewManager::cacheFileName(const PreviewRequest &req) const
+{
+    QString etag = req.etag;
+    etag.remove(QRegExp(QStringLiteral("[^0-9A-Za-z]")));
+
+    return m_cacheDir
+            + QString::number(req.fileId % 256, 16) + QLatin1Char('/')
+            + QString::number(req.fileId) + QLatin1Char('-') + etag + QLatin1Char('-')
+            + QString::number(req.width) + QLatin1Char('x') + QString::number(req.height)
+            + (req.keepAspect ? QLatin1String("") : QLatin1String("-c"))
+            + QLatin1Char('.') + QString::fromLatin1(req.format);
+}
+
+void PreviewManager::renderFinished(const QString &fileName, Result result)
+{
+    QMutexLocker locker(&m_mutex);
+    const QVector<Waiter> waiters = m_inflight.take(fileName);
+
+    if (result == Ok) {
+        const qint64 size = QFileInfo(fileName).size();
+        m_cache.insert(fileName, { size, QDateTime::currentMSecsSinceEpoch() });
+        if (m_cacheSize->fetch_add(size) + size > m_maxCacheSize) {
+            evict();
+        }
+    }
+    locker.unlock();
+
+    for (const Waiter &waiter : waiters) {
+        deliver(waiter, fileName, result);
+    }
+}
+
+qint64 PreviewManager::readCache()
+{
+    const QHash<QString, CacheEntry> previous = m_cache;
+    m_cache.clear();
+
+    qint64 total = 0;
+    QDirIterator it(m_cacheDir, QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        it.next();
+        const QFileInfo info = it.fileInfo();
+        const QString fileName = info.absoluteFilePath();
+        const qint64 lastAccess = qMax(info.lastModified().toMSecsSinceEpoch(), previous.value(fileName).lastAccess);
+        m_cache.insert(fileName, { info.size(), lastAccess });
+        total += info.size();
+    }
+    return total;
+}
+
+void PreviewManager::loadCache()
+{
+    m_cacheLoaded = true;
+    m_cacheSize->store(readCache());
+
+    if (m_cacheSize->load() > m_maxCacheSize) {
+        evict();
+    }
+}
+
+void PreviewManager::evict()
+{
+    // One worker evicts at a time, from what is on disk, as the others add to it too
+    QFile lock(m_cacheDir + QLatin1String(".lock"));
+    if (!lock.open(QIODevice::ReadWrite) || ::flock(lock.handle(), LOCK_EX | LOCK_NB) == -1) {
+        return;
+    }
+
+    qint64 total = readCache();
+    std::vector<std::pair<qint64, QString>> entries;
+    entries.reserve(size_t(m_cache.size()));
+    for (auto it = m_cache.constBegin(); it != m_cache.constEnd(); ++it) {
+        entries.push_back({ it->lastAccess, it.key() });
+    }
+    std::sort(entries.begin(), entries.end());
+
+    // Evict down to 90% so we don't evict again on the next insert
+    const qint64 target = m_maxCacheSize * 9 / 10;
+    for (const auto &entry : entries) {
+        if (total <= target) {
+            break;
+        }
+        if (m_inflight.contains(entry.second)) {
+            continue;
+        }
+
+        QFile::remove(entry.second);
+        total -= m_cache.take(entry.second).size;
+    }
+    m_cacheSize->store(total);
+    qCDebug(CLOUDLYST_PREVIEW) << "Evicted cache down to" << total;
+}
+
+void PreviewManager::deliver(const Waiter &waiter, const QString &fileName, Result result)
+{
+    QObject *receiver = waiter.receiver.data();
+    if (!receiver) {
+        return;
+    }
+
+    Callback callback = waiter.callback;
+    QMetaObject::invokeMethod(receiver, [callback, fileName, result] {
+        callback(fileName, result);
+    }, Qt::QueuedConnection);
+}
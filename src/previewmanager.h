@@ -0,0 +1,106 @@
+#ifndef PREVIEWMANAGER_H
+#define PREVIEWMANAGER_H
+
+#include <QObject>
+#include <QHash>
+#include <QMutex>
+#include <QPointer>
+#include <QThreadPool>
+
+#include "filessql.h"
+
+#include <atomic>
+#include <functional>
+
+struct PreviewRequest
+{
+    // The file in userDir, read through PackStore or StoredFile
+    QString userDir;
+    FileItem item;
+    QString sourcePath;
+    QString etag;
+    QByteArray format;
+    qint64 fileId = 0;
+    int width = 0;
+    int height = 0;
+    bool keepAspect = true;
+};
+
+/**
+ * Renders image previews on a bounded worker pool and keeps them in an
+ * on-disk LRU cache keyed by (file id, etag, size), so a stale preview
+ * can never be served.
+ *
+ * Concurrent requests for the same preview wait on a single render.
+ */
+class PreviewManager : public QObject
+{
+    Q_OBJECT
+public:
+    enum Result {
+        Ok,
+        Failed,
+        Busy,
+    };
+
+    typedef std::function<void(const QString &fileName, Result result)> Callback;
+
+    static PreviewManager *instance();
+
+    void setCacheDir(const QString &cacheDir);
+    /**
+     * The limit for all worker processes together, call before forking
+     * so they share the count.
+     */
+    bool setMaxCacheSize(qint64 bytes);
+    void setMaxWorkers(int workers);
+    void setMaxQueue(int queue);
+    void setQuality(int quality);
+
+    bool canPreview(const QString &mimetype) const;
+    bool supportsFormat(const QByteArray &format) const;
+
+    /**
+     * Calls \p callback in \p receiver's thread once the preview is ready,
+     * the callback is dropped if \p receiver is destroyed meanwhile.
+     */
+    void request(const PreviewRequest &req, QObject *receiver, Callback callback);
+
+private:
+    explicit PreviewManager(QObject *parent = nullptr);
+
+    struct Waiter {
+        QPointer<QObject> receiver;
+        Callback callback;
+    };
+
+    struct CacheEntry {
+        qint64 size;
+        qint64 lastAccess;
+    };
+
+    QString cacheFileName(const PreviewRequest &req) const;
+    void renderFinished(const QString &fileName, Result result);
+    qint64 readCache();
+    void loadCache();
+    void evict();
+
+    static void deliver(const Waiter &waiter, const QString &fileName, Result result);
+
+    friend class PreviewTask;
+
+    QMutex m_mutex;
+    QThreadPool m_pool;
+    QHash<QString, QVector<Waiter>> m_inflight;
+    QHash<QString, CacheEntry> m_cache;
+    QStringList m_supportedMimeTypes;
+    QString m_cacheDir;
+    std::atomic<qint64> m_localCacheSize{0};
+    std::atomic<qint64> *m_cacheSize;
+    qint64 m_maxCacheSize = 512 * 1024 * 1024;
+    int m_maxQueue = 64;
+    int m_quality = 80;
+    bool m_cacheLoaded = false;
+};
+
+#endif // PREVIEWMANAGER_H
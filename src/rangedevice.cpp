@@ -0,0 +1,49 @@
+#include "rangedevice.h"
+
+RangeDevice::RangeDevice(QIODevice *device, qint64 begin, qint64 length, QObject *parent) : QIODevice(parent)
+  , m_device(device)
+  , m_begin(begin)
+  , m_length(length)
+{
+    m_device->setParent(this);
+}
+
+bool RangeDevice::open(OpenMode mode)
+{
+    return QIODevice::open(mode | QIODevice::Unbuffered) && seek(0);
+}
+
+bool RangeDevice::isSequential() const
+{
+    return false;
+}
+
+qint64 RangeDevice::size() const
+{
+    return m_length;
+}
+
+bool RangeDevice::seek(qint64 pos)
+{
+    if (!QIODevice::seek(pos) || !m_device->seek(m_begin + pos)) {
+        return false;
+    }
+    m_pos = pos;
+    return true;
+}
+
+qint64 RangeDevice::readData(char *data, qint64 maxSize)
+{
+    const qint64 len = m_device->read(data, qMin(maxSize, m_length - m_pos));
+    if (len > 0) {
+        m_pos += len;
+    }
+    return len;
+}
+
+qint64 RangeDevice::writeData(const char *data, qint64 len)
+{
+    Q_UNUSED(data)
+    Q_UNUSED(len)
+    return -1;
+}
@@ -0,0 +1,33 @@
+#ifndef RANGEDEVICE_H
+#define RANGEDEVICE_H
+
+#include <QIODevice>
+
+/**
+ * \p length bytes of \p device from \p begin, which it takes over, as the
+ * body of a Range response. The engine seeks bodies to 0 before sending,
+ * so the window has to be a device of its own.
+ */
+class RangeDevice : public QIODevice
+{
+    Q_OBJECT
+public:
+    RangeDevice(QIODevice *device, qint64 begin, qint64 length, QObject *parent = nullptr);
+
+    bool open(OpenMode mode) override;
+    bool isSequential() const override;
+    qint64 size() const override;
+    bool seek(qint64 pos) override;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 len) override;
+
+private:
+    QIODevice *m_device;
+    qint64 m_begin;
+    qint64 m_length;
+    qint64 m_pos = 0;
+};
+
+#endif // RANGEDEVICE_H
@@ -0,0 +1,229 @@
+#include "replicarouter.h"
+
+#include "asyncpg.h"
+
+#include <QLoggingCategory>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+Q_LOGGING_CATEGORY(CLOUDLYST_REPLICA, "cloudlyst.replica", QtWarningMsg)
+
+namespace {
+
+const int PinSlots = 4096;
+const int PinProbe = 8;
+
+struct Pin {
+    std::atomic<qint64> user;
+    std::atomic<quint64> lsn;
+    std::atomic<qint64> deadline;
+    // Writes whose WAL position isn't known yet
+    std::atomic<int> pending;
+};
+
+struct Shared {
+    std::atomic<quint64> replayLsn;
+    // Everyone reads from the primary until then, when the pin table is full
+    std::atomic<qint64> pinAllUntil;
+    Pin pins[PinSlots];
+};
+
+struct ThreadState {
+    std::unique_ptr<AsyncPgConnection> replica;
+    qint64 lastPoll = 0;
+    qint64 lastReply = 0;
+    bool polling = false;
+};
+
+Shared *shared = nullptr;
+QByteArray replicaConnInfo;
+qint64 pollMsecs = 100;
+qint64 pinMsecs = 30000;
+
+thread_local ThreadState threadState;
+
+// Monotonic clock, the same one in every process
+inline qint64 now()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void storeMax(std::atomic<quint64> &value, quint64 v)
+{
+    quint64 current = value.load(std::memory_order_relaxed);
+    while (v > current && !value.compare_exchange_weak(current, v, std::memory_order_relaxed)) {
+    }
+}
+
+inline int slotIndex(qint64 user, int probe)
+{
+    return int((quint64(user) * Q_UINT64_C(0x9E3779B97F4A7C15) >> 32) + quint64(probe)) & (PinSlots - 1);
+}
+
+bool pinActive(const Pin &pin, qint64 t)
+{
+    return t < pin.deadline.load() &&
+            (pin.pending.load() > 0 || pin.lsn.load() > shared->replayLsn.load(std::memory_order_relaxed));
+}
+
+bool isPinned(qint64 user)
+{
+    const qint64 t = now();
+    if (t < shared->pinAllUntil.load(std::memory_order_relaxed)) {
+        return true;
+    }
+
+    for (int i = 0; i < PinProbe; ++i) {
+        const Pin &pin = shared->pins[slotIndex(user, i)];
+        if (pin.user.load() == user) {
+            return pinActive(pin, t);
+        }
+    }
+    return false;
+}
+
+Pin *claimPin(qint64 user, qint64 t)
+{
+    for (int i = 0; i < PinProbe; ++i) {
+        Pin &pin = shared->pins[slotIndex(user, i)];
+        if (pin.user.load() == user) {
+            return &pin;
+        }
+    }
+
+    for (int i = 0; i < PinProbe; ++i) {
+        Pin &pin = shared->pins[slotIndex(user, i)];
+        qint64 current = pin.user.load();
+        if ((current == 0 || !pinActive(pin, t)) && pin.user.compare_exchange_strong(current, user)) {
+            pin.pending.store(0);
+            pin.lsn.store(0);
+            return &pin;
+        }
+    }
+    return nullptr;
+}
+
+void pollReplica(ThreadState &state, qint64 t)
+{
+    if (state.polling || t - state.lastPoll < pollMsecs) {
+        return;
+    }
+    state.polling = true;
+    state.lastPoll = t;
+
+    if (!state.replica) {
+        state.replica.reset(new AsyncPgConnection(replicaConnInfo));
+    }
+
+    state.replica->exec(QByteArrayLiteral("SELECT pg_last_wal_replay_lsn()"), nullptr, [&state] (AsyncPgResult &result) {
+        state.polling = false;
+        if (result.error()) {
+            qCWarning(CLOUDLYST_REPLICA) << "Replica poll failed" << result.errorString();
+            return;
+        }
+        if (!result.size() || result.isNull(0, 0)) {
+            qCWarning(CLOUDLYST_REPLICA) << "DatabaseReplicaConnInfo doesn't point to a server in recovery";
+            return;
+        }
+
+        storeMax(shared->replayLsn, ReplicaRouter::parseLsn(result.value(0, 0)));
+        state.lastReply = now();
+    });
+}
+
+}
+
+bool ReplicaRouter::setup(const QString &connInfo, int pollInterval, int pinTimeout)
+{
+    if (connInfo.isEmpty() || shared) {
+        return true;
+    }
+
+    // Anonymous and shared, so it survives fork() and is visible to every worker
+    void *mem = mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        qCCritical(CLOUDLYST_REPLICA) << "Failed to map replica pins" << strerror(errno);
+        return false;
+    }
+    shared = static_cast<Shared *>(mem);
+
+    replicaConnInfo = connInfo.toUtf8();
+    pollMsecs = qMax(10, pollInterval);
+    pinMsecs = qMax(1000, pinTimeout);
+    return true;
+}
+
+bool ReplicaRouter::isEnabled()
+{
+    return shared;
+}
+
+AsyncPgConnection *ReplicaRouter::readConnection(const QVariant &userId)
+{
+    AsyncPgConnection *primary = AsyncPgConnection::thread();
+    if (!shared) {
+        return primary;
+    }
+
+    ThreadState &state = threadState;
+    const qint64 t = now();
+    pollReplica(state, t);
+
+    // A replica that stopped answering polls gets no reads
+    if (!state.lastReply || t - state.lastReply > qMax(Q_INT64_C(1000), pollMsecs * 5)) {
+        return primary;
+    }
+
+    if (isPinned(userId.toLongLong())) {
+        return primary;
+    }
+    return state.replica.get();
+}
+
+void ReplicaRouter::pinWrite(const QVariant &userId)
+{
+    if (!shared) {
+        return;
+    }
+
+    const qint64 user = userId.toLongLong();
+    const qint64 t = now();
+    const qint64 deadline = t + pinMsecs;
+
+    Pin *pin = claimPin(user, t);
+    if (!pin) {
+        qCWarning(CLOUDLYST_REPLICA) << "Pin table full, reading everything from the primary";
+        qint64 current = shared->pinAllUntil.load();
+        while (deadline > current && !shared->pinAllUntil.compare_exchange_weak(current, deadline)) {
+        }
+        return;
+    }
+
+    // Pinned before the write is even sent, the WAL position narrows it
+    // down once known, or the deadline ends it if that query fails
+    pin->pending.fetch_add(1);
+    pin->deadline.store(deadline);
+
+    AsyncPgConnection::thread()->exec(QByteArrayLiteral("SELECT pg_current_wal_lsn()"), nullptr, [pin, user] (AsyncPgResult &result) {
+        if (result.error() || !result.size() || pin->user.load() != user) {
+            return;
+        }
+        storeMax(pin->lsn, parseLsn(result.value(0, 0)));
+        pin->pending.fetch_sub(1);
+    });
+}
+
+quint64 ReplicaRouter::parseLsn(const QString &lsn)
+{
+    const int slash = lsn.indexOf(QLatin1Char('/'));
+    if (slash == -1) {
+        return 0;
+    }
+    return (lsn.leftRef(slash).toULongLong(nullptr, 16) << 32) | lsn.midRef(slash + 1).toULongLong(nullptr, 16);
+}
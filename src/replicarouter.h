@@ -0,0 +1,40 @@
+#ifndef REPLICAROUTER_H
+#define REPLICAROUTER_H
+
+#include <QString>
+#include <QVariant>
+
+class AsyncPgConnection;
+
+/**
+ * Routes metadata reads to a streaming replica when
+ * DatabaseReplicaConnInfo is set.
+ *
+ * A user that writes is pinned to the primary until the replica has
+ * replayed past the WAL position of that write, so users always read
+ * their own writes. The pin table and the replica's replay LSN live in
+ * memory shared by all workers, a write handled by one pins the reads
+ * of every other. Reads go to the primary while the replica doesn't
+ * answer its replay LSN polls.
+ */
+class ReplicaRouter
+{
+public:
+    /** Called before forking, \p pollInterval and \p pinTimeout in ms */
+    static bool setup(const QString &connInfo, int pollInterval, int pinTimeout);
+
+    static bool isEnabled();
+
+    /** The connection \p userId's metadata should be read from */
+    static AsyncPgConnection *readConnection(const QVariant &userId);
+
+    /**
+     * Pins \p userId to the primary, call right after queueing a write on
+     * the primary so its WAL position is taken once the write is done.
+     */
+    static void pinWrite(const QVariant &userId);
+
+    static quint64 parseLsn(const QString &lsn);
+};
+
+#endif // REPLICAROUTER_H
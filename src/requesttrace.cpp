@@ -0,0 +1,174 @@
+#include "requesttrace.h"
+
+#include <Cutelyst/Application>
+#include <Cutelyst/Context>
+#include <Cutelyst/Request>
+#include <Cutelyst/Response>
+#include <Cutelyst/Plugins/Authentication/authentication.h>
+
+#include <QDateTime>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QRandomGenerator>
+
+#include <QLoggingCategory>
+
+#include <chrono>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+Q_LOGGING_CATEGORY(CLOUDLYST_TRACE, "cloudlyst.trace", QtWarningMsg)
+
+thread_local RequestTrace *RequestTrace::s_current = nullptr;
+
+static const char *phaseNames[RequestTrace::PhaseCount] = { "app", "auth", "sql", "fs", "xml" };
+
+static QMutex traceLogMutex;
+static int traceLogFd = -1;
+
+static inline qint64 now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+RequestTrace::Phase RequestTrace::enter(Phase phase)
+{
+    const qint64 t = now();
+    m_nsecs[m_active] += t - m_phaseStart;
+    m_phaseStart = t;
+    ++m_count[phase];
+
+    const Phase previous = m_active;
+    m_active = phase;
+    return previous;
+}
+
+void RequestTrace::leave(Phase previous)
+{
+    const qint64 t = now();
+    m_nsecs[m_active] += t - m_phaseStart;
+    m_phaseStart = t;
+    m_active = previous;
+}
+
+void RequestTrace::account(Phase phase, qint64 nsecs)
+{
+    const qint64 t = now();
+    m_nsecs[m_active] += t - m_phaseStart - nsecs;
+    m_phaseStart = t;
+    m_nsecs[phase] += nsecs;
+    ++m_count[phase];
+}
+
+RequestTracer::RequestTracer(Application *parent) : Plugin(parent)
+{
+}
+
+RequestTracer::~RequestTracer()
+{
+    qDeleteAll(m_traces);
+}
+
+bool RequestTracer::setup(Application *app)
+{
+    m_serverTiming = app->config(QStringLiteral("ServerTiming"), false).toBool();
+    m_traceLog = app->config(QStringLiteral("TraceLog")).toString();
+    m_threshold = app->config(QStringLiteral("TraceThreshold"), 500).toLongLong() * 1000 * 1000;
+    m_sampleRate = qBound(0.0, app->config(QStringLiteral("TraceSampleRate"), 1.0).toDouble(), 1.0);
+
+    if (m_serverTiming || (!m_traceLog.isEmpty() && m_sampleRate > 0)) {
+        connect(app, &Application::beforeDispatch, this, &RequestTracer::beforeDispatch);
+        connect(app, &Application::afterDispatch, this, &RequestTracer::afterDispatch);
+    }
+
+    return true;
+}
+
+void RequestTracer::beforeDispatch(Context *c)
+{
+    auto trace = new RequestTrace;
+    trace->m_start = trace->m_phaseStart = now();
+    m_traces.insert(c, trace);
+
+    RequestTrace::s_current = trace;
+}
+
+void RequestTracer::afterDispatch(Context *c)
+{
+    RequestTrace *trace = m_traces.take(c);
+    if (!trace) {
+        return;
+    }
+    if (RequestTrace::s_current == trace) {
+        RequestTrace::s_current = nullptr;
+    }
+
+    trace->leave(RequestTrace::App);
+    const qint64 total = now() - trace->m_start;
+
+    // Headers are already gone if the action wrote the body directly
+    Response *res = c->response();
+    if (m_serverTiming && !res->isFinalizedHeaders()) {
+        QString timing;
+        for (int i = RequestTrace::Auth; i < RequestTrace::PhaseCount; ++i) {
+            if (trace->m_count[i]) {
+                timing += QLatin1String(phaseNames[i]) + QLatin1String(";dur=") + QString::number(trace->m_nsecs[i] / 1e6, 'f', 2);
+                if (i == RequestTrace::Sql) {
+                    timing += QLatin1String(";desc=\"") + QString::number(trace->m_count[i]) + QLatin1String(" queries\"");
+                }
+                timing += QLatin1String(", ");
+            }
+        }
+        timing += QLatin1String("app;dur=") + QString::number(trace->m_nsecs[RequestTrace::App] / 1e6, 'f', 2)
+                + QLatin1String(", total;dur=") + QString::number(total / 1e6, 'f', 2);
+        res->setHeader(QStringLiteral("SERVER_TIMING"), timing);
+    }
+
+    if (!m_traceLog.isEmpty() && total >= m_threshold &&
+            (m_sampleRate >= 1 || QRandomGenerator::global()->generateDouble() < m_sampleRate)) {
+        writeTrace(c, trace, total);
+    }
+
+    delete trace;
+}
+
+void RequestTracer::writeTrace(Context *c, const RequestTrace *trace, qint64 total)
+{
+    Request *req = c->request();
+
+    QJsonObject obj{
+        {QStringLiteral("time"), QDateTime::currentDateTimeUtc().toString(Qt::ISODateWithMs)},
+        {QStringLiteral("method"), req->method()},
+        {QStringLiteral("path"), req->path()},
+        {QStringLiteral("status"), int(c->response()->status())},
+        {QStringLiteral("user"), Authentication::user(c).value(QStringLiteral("username")).toString()},
+        {QStringLiteral("pid"), qint64(getpid())},
+        {QStringLiteral("total_ms"), total / 1e6},
+    };
+    for (int i = 0; i < RequestTrace::PhaseCount; ++i) {
+        obj.insert(QLatin1String(phaseNames[i]) + QLatin1String("_ms"), trace->m_nsecs[i] / 1e6);
+    }
+    obj.insert(QStringLiteral("sql_count"), trace->m_count[RequestTrace::Sql]);
+
+    const QByteArray line = QJsonDocument(obj).toJson(QJsonDocument::Compact) + '\n';
+
+    QMutexLocker locker(&traceLogMutex);
+    if (traceLogFd == -1) {
+        traceLogFd = ::open(QFile::encodeName(m_traceLog).constData(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+        if (traceLogFd == -1) {
+            qCWarning(CLOUDLYST_TRACE) << "Failed to open trace log" << m_traceLog << strerror(errno);
+            m_traceLog.clear();
+            return;
+        }
+    }
+
+    // A single O_APPEND write keeps lines from different workers whole
+    if (::write(traceLogFd, line.constData(), size_t(line.size())) != line.size()) {
+        qCWarning(CLOUDLYST_TRACE) << "Failed to write trace log" << strerror(errno);
+    }
+}
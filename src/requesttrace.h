@@ -0,0 +1,110 @@
+#ifndef REQUESTTRACE_H
+#define REQUESTTRACE_H
+
+#include <Cutelyst/Plugin>
+
+#include <QHash>
+
+using namespace Cutelyst;
+
+/**
+ * Time spent by a request in each phase.
+ *
+ * Phases don't overlap: entering a nested phase (SQL done while
+ * writing XML) pauses the outer one, time outside any phase is "app".
+ */
+class RequestTrace
+{
+public:
+    enum Phase {
+        App,
+        Auth,
+        Sql,
+        Fs,
+        Xml,
+        PhaseCount,
+    };
+
+    /** The trace of the request being dispatched in this thread, null when tracing is off */
+    static inline RequestTrace *current() { return s_current; }
+
+    /**
+     * Makes \p trace current while an async continuation of its request
+     * runs, returns the one to restore afterwards.
+     */
+    static inline RequestTrace *setCurrent(RequestTrace *trace) {
+        RequestTrace *previous = s_current;
+        s_current = trace;
+        return previous;
+    }
+
+    Phase enter(Phase phase);
+    void leave(Phase previous);
+
+    /** Moves \p nsecs the request spent waiting on \p phase out of the active one */
+    void account(Phase phase, qint64 nsecs);
+
+private:
+    friend class RequestTracer;
+
+    static thread_local RequestTrace *s_current;
+
+    qint64 m_start;
+    qint64 m_phaseStart;
+    qint64 m_nsecs[PhaseCount] = {};
+    int m_count[PhaseCount] = {};
+    Phase m_active = App;
+};
+
+class ScopedTimer
+{
+public:
+    explicit inline ScopedTimer(RequestTrace::Phase phase) : m_trace(RequestTrace::current()) {
+        if (Q_UNLIKELY(m_trace)) {
+            m_previous = m_trace->enter(phase);
+        }
+    }
+
+    inline ~ScopedTimer() {
+        if (Q_UNLIKELY(m_trace)) {
+            m_trace->leave(m_previous);
+        }
+    }
+
+private:
+    Q_DISABLE_COPY(ScopedTimer)
+
+    RequestTrace *m_trace;
+    RequestTrace::Phase m_previous = RequestTrace::App;
+};
+
+/**
+ * Traces requests when ServerTiming or TraceLog are configured, adding
+ * a Server-Timing header and/or appending one JSON line per request
+ * slower than TraceThreshold (ms) to TraceLog, sampled by
+ * TraceSampleRate.
+ *
+ * When both are off no trace exists and ScopedTimer is a null check.
+ */
+class RequestTracer : public Plugin
+{
+    Q_OBJECT
+public:
+    explicit RequestTracer(Application *parent);
+    ~RequestTracer();
+
+    virtual bool setup(Application *app) override;
+
+private:
+    void beforeDispatch(Context *c);
+    void afterDispatch(Context *c);
+    void writeTrace(Context *c, const RequestTrace *trace, qint64 total);
+
+    QHash<Context *, RequestTrace *> m_traces;
+    QString m_traceLog;
+    qint64 m_threshold = 0;
+    double m_sampleRate = 1;
+    bool m_serverTiming = false;
+};
+
+#endif // REQUESTTRACE_H
@@ -1,11 +1,22 @@
 #include "root.h"
 
+#include "filessql.h"
+#include "metrics.h"
+#include "previewmanager.h"
+
+#include <Cutelyst/Plugins/Authentication/authentication.h>
+#include <Cutelyst/Application>
+
 #include <QJsonObject>
 #include <QJsonArray>
+#include <QStandardPaths>
+#include <QFile>
+#include <QHostAddress>
 
 #include <QLoggingCategory>
 
 Q_LOGGING_CATEGORY(WEBDAV_HACK, "webdav.HACK", QtWarningMsg)
+Q_LOGGING_CATEGORY(CLOUDLYST_PREVIEW_ROOT, "cloudlyst.preview.root", QtWarningMsg)
 
 using namespace Cutelyst;
 
@@ -60,6 +71,17 @@ void Root::remoteDavPhp(Context *c, const QStringList &pathParts)
     c->forward(QStringLiteral("/webdav/dav"));
 }
 
+void Root::remoteDavBulkPhp(Context *c)
+{
+    c->forward(QStringLiteral("/webdav/bulk"));
+}
+
+void Root::remoteDavTusPhp(Context *c, const QStringList &pathParts)
+{
+    Q_UNUSED(pathParts)
+    c->forward(QStringLiteral("/webdav/tus"));
+}
+
 void Root::remotePhp(Context *c, const QStringList &pathParts)
 {
     Q_UNUSED(pathParts)
@@ -129,6 +151,7 @@ void Root::capabilitiesPhp(Context *c)
                     }},
                 {QStringLiteral("dav"), QJsonObject{
                         {QStringLiteral("chunking"), "1.0"},
+                        {QStringLiteral("bulkupload"), "1.0"},
                     }},
                 {QStringLiteral("end-to-end-encryption"), QJsonObject{
                         {QStringLiteral("enabled"), false},
@@ -153,3 +176,114 @@ void Root::capabilitiesPhp(Context *c)
                                      });
 }
 
+
+void Root::corePreview(Context *c)
+{
+    if (!Authentication::userExists(c) && !Authentication::authenticate(c, QStringLiteral("Cloudlyst"))) {
+        return;
+    }
+
+    Request *req = c->request();
+    Response *res = c->response();
+    const AuthenticationUser user = Authentication::user(c);
+
+    const qint64 fileId = req->queryParam(QStringLiteral("fileId")).toLongLong();
+    const QString aspect = req->queryParam(QStringLiteral("a"));
+
+    PreviewRequest preview;
+    preview.width = qBound(1, req->queryParam(QStringLiteral("x"), QStringLiteral("32")).toInt(), 2048);
+    preview.height = qBound(1, req->queryParam(QStringLiteral("y"), QStringLiteral("32")).toInt(), 2048);
+    preview.keepAspect = aspect == QLatin1String("1") || aspect == QLatin1String("true");
+
+    QString error;
+    const FileItem item = FilesSql::itemById(fileId, user.id(), error);
+
+    PreviewManager *manager = PreviewManager::instance();
+    if (!item.id || !manager->canPreview(item.mimetype)) {
+        qCDebug(CLOUDLYST_PREVIEW_ROOT) << "No preview for" << fileId << item.mimetype << error;
+        res->setStatus(Response::NotFound);
+        return;
+    }
+
+    preview.fileId = item.id;
+    preview.etag = item.etag;
+    preview.userDir = m_baseDir + user.value(QStringLiteral("username")).toString() + QLatin1Char('/');
+    preview.item = item;
+    preview.sourcePath = preview.userDir + item.path;
+    preview.format = "jpeg";
+    if (m_previewWebp && req->header(QStringLiteral("ACCEPT")).contains(QLatin1String("image/webp")) &&
+            manager->supportsFormat("webp")) {
+        preview.format = "webp";
+    }
+
+    c->detachAsync();
+    manager->request(preview, c, [c] (const QString &fileName, PreviewManager::Result result) {
+        Response *res = c->response();
+        auto file = new QFile(fileName, c);
+        if (result == PreviewManager::Ok && file->open(QIODevice::ReadOnly)) {
+            Headers &headers = res->headers();
+            headers.setContentType(fileName.endsWith(QLatin1String(".webp")) ? QStringLiteral("image/webp")
+                                                                              : QStringLiteral("image/jpeg"));
+            headers.setContentLength(file->size());
+            headers.setHeader(QStringLiteral("CACHE_CONTROL"), QStringLiteral("private, max-age=86400"));
+            res->setBody(file);
+        } else if (result == PreviewManager::Busy) {
+            res->headers().setHeader(QStringLiteral("RETRY_AFTER"), QStringLiteral("1"));
+            res->setStatus(Response::ServiceUnavailable);
+        } else {
+            res->setStatus(Response::NotFound);
+        }
+        c->attachAsync();
+    });
+}
+
+void Root::indexPhpCorePreview(Context *c)
+{
+    corePreview(c);
+}
+
+void Root::metrics(Context *c)
+{
+    // Scrapers are not authenticated, so only answer to configured addresses
+    const QHostAddress address = c->request()->address();
+    bool allowed = false;
+    for (const QString &allow : m_metricsAllow) {
+        if (address.isEqual(QHostAddress(allow), QHostAddress::TolerantConversion)) {
+            allowed = true;
+            break;
+        }
+    }
+
+    if (!allowed) {
+        c->response()->setStatus(Response::Forbidden);
+        return;
+    }
+
+    c->response()->setContentType(QStringLiteral("text/plain; version=0.0.4"));
+    c->response()->setBody(Metrics::scrape());
+}
+
+bool Root::preFork(Application *app)
+{
+    m_metricsAllow = app->config(QStringLiteral("MetricsAllow"), QStringLiteral("127.0.0.1,::1")).toString().split(QLatin1Char(','), QString::SkipEmptyParts);
+    for (QString &allow : m_metricsAllow) {
+        allow = allow.trimmed();
+    }
+
+    m_baseDir = app->config(QStringLiteral("DataDir"), QStandardPaths::writableLocation(QStandardPaths::DataLocation)).toString();
+    if (!m_baseDir.endsWith(QLatin1Char('/'))) {
+        m_baseDir.append(QLatin1Char('/'));
+    }
+
+    PreviewManager *manager = PreviewManager::instance();
+    manager->setCacheDir(app->config(QStringLiteral("PreviewCacheDir"), m_baseDir + QLatin1String(".previews")).toString());
+    if (!manager->setMaxCacheSize(app->config(QStringLiteral("PreviewCacheSize"), 512).toLongLong() * 1024 * 1024)) {
+        return false;
+    }
+    manager->setMaxWorkers(app->config(QStringLiteral("PreviewWorkers"), 2).toInt());
+    manager->setMaxQueue(app->config(QStringLiteral("PreviewQueue"), 64).toInt());
+    manager->setQuality(app->config(QStringLiteral("PreviewQuality"), 80).toInt());
+    m_previewWebp = app->config(QStringLiteral("PreviewWebp"), false).toBool();
+
+    return true;
+}
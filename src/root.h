@@ -27,6 +27,12 @@ public:
     C_ATTR(remoteDavPhp, :Path('remote.php/dav/files') :AutoArgs)
     void remoteDavPhp(Context *c, const QStringList &pathParts);
 
+    C_ATTR(remoteDavBulkPhp, :Path('remote.php/dav/bulk') :AutoArgs)
+    void remoteDavBulkPhp(Context *c);
+
+    C_ATTR(remoteDavTusPhp, :Path('remote.php/dav/tus') :AutoArgs)
+    void remoteDavTusPhp(Context *c, const QStringList &pathParts);
+
     C_ATTR(remotePhp, :Path('remote.php/webdav') :AutoArgs)
     void remotePhp(Context *c, const QStringList &pathParts);
 
@@ -36,7 +42,23 @@ public:
     C_ATTR(capabilitiesPhp, :Path('ocs/v1.php/cloud/capabilities') :AutoArgs)
     void capabilitiesPhp(Context *c);
 
+    C_ATTR(corePreview, :Path('core/preview') :AutoArgs)
+    void corePreview(Context *c);
+
+    // Hackery to work with NextCloud-client
+    C_ATTR(indexPhpCorePreview, :Path('index.php/core/preview') :AutoArgs)
+    void indexPhpCorePreview(Context *c);
+
+    C_ATTR(metrics, :Path('metrics') :AutoArgs)
+    void metrics(Context *c);
+
+    virtual bool preFork(Application *app) override final;
+
 private:
+    QStringList m_metricsAllow;
+    QString m_baseDir;
+    bool m_previewWebp = false;
+
 //    C_ATTR(End, :ActionClass("RenderView"))
 //    void End(Context *c) { Q_UNUSED(c); }
 };
@@ -0,0 +1,77 @@
+#include "spoolswap.h"
+
+#include <QFile>
+#include <QStringList>
+#include <QLoggingCategory>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+Q_LOGGING_CATEGORY(CLOUDLYST_SPOOL, "cloudlyst.spool", QtWarningMsg)
+
+bool exchangeFiles(const QString &a, const QString &b)
+{
+#if defined(Q_OS_LINUX) && defined(SYS_renameat2)
+    return ::syscall(SYS_renameat2, AT_FDCWD, QFile::encodeName(a).constData(),
+                     AT_FDCWD, QFile::encodeName(b).constData(), RENAME_EXCHANGE) == 0;
+#else
+    Q_UNUSED(a)
+    Q_UNUSED(b)
+    return false;
+#endif
+}
+
+SpoolSwap::~SpoolSwap()
+{
+    // Neither committed nor rolled back, the new content stays
+    const QStringList resources = m_placed.keys();
+    for (const QString &resource : resources) {
+        commit(resource);
+    }
+}
+
+bool SpoolSwap::place(const QString &spool, const QString &resource)
+{
+    const bool exists = QFile::exists(resource);
+    const bool exchanged = exists && exchangeFiles(spool, resource);
+    if (!exchanged && ::rename(QFile::encodeName(spool).constData(), QFile::encodeName(resource).constData()) != 0) {
+        return false;
+    }
+
+    std::vector<Placed> &placed = m_placed[resource];
+    placed.push_back({ spool, exchanged, placed.empty() ? exists : placed.front().existed });
+    return true;
+}
+
+void SpoolSwap::commit(const QString &resource)
+{
+    const std::vector<Placed> placed = m_placed.take(resource);
+    for (const Placed &p : placed) {
+        if (p.exchanged) {
+            QFile::remove(p.spool);
+        }
+    }
+}
+
+void SpoolSwap::rollback(const QString &resource)
+{
+    const std::vector<Placed> placed = m_placed.take(resource);
+    for (auto it = placed.crbegin(); it != placed.crend(); ++it) {
+        if (it->exchanged) {
+            if (!exchangeFiles(it->spool, resource)) {
+                qCWarning(CLOUDLYST_SPOOL) << "Could not put back" << resource << qt_error_string(errno);
+            }
+            QFile::remove(it->spool);
+        }
+    }
+    if (!placed.empty() && !placed.front().existed) {
+        QFile::remove(resource);
+    }
+}
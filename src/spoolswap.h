@@ -0,0 +1,43 @@
+#ifndef SPOOLSWAP_H
+#define SPOOLSWAP_H
+
+#include <QHash>
+#include <QString>
+
+#include <vector>
+
+/** Swaps two files in one step, false if the filesystem can't */
+bool exchangeFiles(const QString &a, const QString &b);
+
+/**
+ * Spooled uploads put in place before their metadata is written.
+ *
+ * An existing destination is exchanged with the upload, its old content
+ * stays at the spool path until commit() drops it or rollback() puts it
+ * back. A destination placed more than once is rolled back in reverse
+ * order, to what it was before the first place().
+ */
+class SpoolSwap
+{
+public:
+    ~SpoolSwap();
+
+    /** Moves \p spool to \p resource, false with errno set if it can't */
+    bool place(const QString &spool, const QString &resource);
+
+    /** Keeps what \p resource has now, removing what it replaced */
+    void commit(const QString &resource);
+
+    /** Puts back what \p resource had, removing it if it didn't exist */
+    void rollback(const QString &resource);
+
+private:
+    struct Placed {
+        QString spool;
+        bool exchanged;
+        bool existed;
+    };
+    QHash<QString, std::vector<Placed>> m_placed;
+};
+
+#endif // SPOOLSWAP_H
@@ -0,0 +1,527 @@
+#include "sqlquery.h"
+
+#include "metrics.h"
+#include "requesttrace.h"
+
+#include <Cutelyst/Plugins/Utils/Sql>
+
+#include <QSqlDatabase>
+#include <QJsonArray>
+#include <QJsonDocument>
+
+#include <QLoggingCategory>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <ctype.h>
+
+Q_LOGGING_CATEGORY(CLOUDLYST_SQL, "cloudlyst.sql", QtWarningMsg)
+
+using namespace Cutelyst;
+
+namespace {
+
+struct StatementInfo {
+    const char *name;
+    const char *sql;
+    // The SQLite variant, nullptr when the same SQL works. SQLite has no
+    // stored procedures, they are ported as scripts: the statements up to
+    // the last run first and the last one gives the result.
+    const char *sqlite;
+};
+
+const StatementInfo statements[SqlQuery::StatementCount] = {
+    { "users.by_name",
+      "SELECT id, username, displayname, password "
+      "FROM cloudlyst.users "
+      "WHERE username = :username" },
+    { "users.id_by_name",
+      "SELECT id FROM cloudlyst.users WHERE username = :username" },
+    { "files.put",
+      "SELECT cloudlyst_put"
+      "(:path, :name, :parent_path, :mtime, :storage_mtime, :mimetype, :size, :etag, :owner_id)",
+      "INSERT INTO cloudlyst.mimetypes (name) VALUES (:mimetype) ON CONFLICT (name) DO NOTHING; "
+      "INSERT INTO cloudlyst.files "
+      "(path, name, mtime, storage_mtime, mimetype_id, size, etag, owner_id, parent_id) "
+      "VALUES "
+      "(:path, :name, :mtime, :storage_mtime, (SELECT id FROM cloudlyst.mimetypes WHERE name = :mimetype), "
+      ":size, :etag, :owner_id, (SELECT id FROM cloudlyst.files "
+      "WHERE path = CASE WHEN :parent_path <> '' THEN :parent_path ELSE 'files' END AND owner_id = :owner_id)) "
+      "ON CONFLICT (path, owner_id) "
+      "DO UPDATE SET mtime = excluded.mtime, storage_mtime = excluded.storage_mtime, "
+      "mimetype_id = excluded.mimetype_id, size = excluded.size, etag = excluded.etag; "
+      "SELECT id FROM cloudlyst.files WHERE path = :path AND owner_id = :owner_id" },
+    { "files.remove",
+      "DELETE FROM cloudlyst.files WHERE path = :path AND owner_id = :owner_id" },
+    { "files.item_by_path",
+      "SELECT f.id, f.path, f.name, f.size, m.name, f.etag, f.mtime, k.pack_id, k.pack_offset, k.pack_length "
+      "FROM cloudlyst.files f "
+      "INNER JOIN cloudlyst.mimetypes m ON m.id = f.mimetype_id "
+      "LEFT JOIN cloudlyst.file_packs k ON k.file_id = f.id AND k.etag = f.etag "
+      "WHERE f.path = :path AND f.owner_id = :owner_id" },
+    { "files.item_by_id",
+      "SELECT f.id, f.path, f.name, f.size, m.name, f.etag, f.mtime, k.pack_id, k.pack_offset, k.pack_length "
+      "FROM cloudlyst.files f "
+      "INNER JOIN cloudlyst.mimetypes m ON m.id = f.mimetype_id "
+      "LEFT JOIN cloudlyst.file_packs k ON k.file_id = f.id AND k.etag = f.etag "
+      "WHERE f.id = :id AND f.owner_id = :owner_id" },
+    { "files.children",
+      "SELECT f.id, f.path, f.name, f.size, m.name, f.etag, f.mtime, k.pack_id, k.pack_offset, k.pack_length "
+      "FROM cloudlyst.files f "
+      "INNER JOIN cloudlyst.mimetypes m ON m.id = f.mimetype_id "
+      "LEFT JOIN cloudlyst.file_packs k ON k.file_id = f.id AND k.etag = f.etag "
+      "WHERE parent_id = :parent_id" },
+    { "files.copy",
+      "SELECT cloudlyst_copy"
+      "(:path, :dest_parent_path, :dest_path, :dest_name, :owner_id)",
+      "INSERT INTO cloudlyst.files "
+      "(path, name, mtime, storage_mtime, mimetype_id, size, etag, owner_id, parent_id) "
+      "SELECT :dest_path, :dest_name, mtime, storage_mtime, mimetype_id, size, etag, :owner_id, "
+      "(SELECT id FROM cloudlyst.files "
+      "WHERE path = CASE WHEN :dest_parent_path <> '' THEN :dest_parent_path ELSE 'files' END AND owner_id = :owner_id) "
+      "FROM cloudlyst.files WHERE path = :path; "
+      "SELECT id FROM cloudlyst.files WHERE path = :dest_path AND owner_id = :owner_id" },
+    { "files.move",
+      "SELECT cloudlyst_move(:path, :destPath, :destName, :owner_id)",
+      "UPDATE cloudlyst.files SET path = :destPath, name = :destName "
+      "WHERE path = :path AND owner_id = :owner_id; "
+      "UPDATE cloudlyst.files SET path = :destPath || substr(path, length(:path) + 1) "
+      "WHERE substr(path, 1, length(:path) + 1) = :path || '/' AND owner_id = :owner_id; "
+      "SELECT NULL" },
+    { "files.scan_list",
+      "SELECT f.path, f.size, f.storage_mtime, m.name = 'httpd/unix-directory', k.file_id IS NOT NULL "
+      "FROM cloudlyst.files f "
+      "LEFT JOIN cloudlyst.mimetypes m ON m.id = f.mimetype_id "
+      "LEFT JOIN cloudlyst.file_packs k ON k.file_id = f.id AND k.etag = f.etag "
+      "WHERE f.owner_id = :owner_id" },
+    { "files.scan_lookup",
+      "SELECT f.size, f.storage_mtime, m.name = 'httpd/unix-directory' "
+      "FROM cloudlyst.files f "
+      "LEFT JOIN cloudlyst.mimetypes m ON m.id = f.mimetype_id "
+      "WHERE f.path = :path AND f.owner_id = :owner_id" },
+    { "properties.by_files",
+      "SELECT file_id, name, value "
+      "FROM cloudlyst.file_properties "
+      "WHERE file_id = ANY(:file_ids)",
+      "SELECT file_id, name, value "
+      "FROM cloudlyst.file_properties "
+      "WHERE file_id IN (SELECT value FROM json_each(:file_ids))" },
+    { "properties.by_parent",
+      "SELECT file_id, name, value "
+      "FROM cloudlyst.file_properties "
+      "WHERE file_id = :parent_id "
+      "OR file_id IN (SELECT id FROM cloudlyst.files WHERE parent_id = :parent_id)" },
+    { "properties.set",
+      "INSERT INTO cloudlyst.file_properties "
+      "(file_id, name, value) "
+      "VALUES "
+      "(:file_id, :name, :value) "
+      "ON CONFLICT ON CONSTRAINT file_properties_file_id_name_key "
+      "DO UPDATE SET value = :updatevalue",
+      "INSERT INTO cloudlyst.file_properties "
+      "(file_id, name, value) "
+      "VALUES "
+      "(:file_id, :name, :value) "
+      "ON CONFLICT (file_id, name) "
+      "DO UPDATE SET value = :updatevalue" },
+    { "properties.remove",
+      "DELETE FROM cloudlyst.file_properties "
+      "WHERE file_id = :file_id AND name = :name" },
+    { "properties.patch",
+      "WITH removed AS ("
+      "DELETE FROM cloudlyst.file_properties "
+      "WHERE file_id = :file_id AND name = ANY(:remove_names::text[])) "
+      "INSERT INTO cloudlyst.file_properties "
+      "(file_id, name, value) "
+      "SELECT :file_id, p.name, p.value "
+      "FROM unnest(:set_names::text[], :set_values::text[]) AS p(name, value) "
+      "ON CONFLICT ON CONSTRAINT file_properties_file_id_name_key "
+      "DO UPDATE SET value = EXCLUDED.value",
+      "DELETE FROM cloudlyst.file_properties "
+      "WHERE file_id = :file_id AND name IN (SELECT value FROM json_each(:remove_names)); "
+      "INSERT INTO cloudlyst.file_properties "
+      "(file_id, name, value) "
+      "SELECT :file_id, n.value, v.value "
+      "FROM json_each(:set_names) n INNER JOIN json_each(:set_values) v ON v.key = n.key "
+      "WHERE true "
+      "ON CONFLICT (file_id, name) "
+      "DO UPDATE SET value = excluded.value" },
+    { "files.item_by_path_props",
+      "SELECT f.id, f.path, f.name, f.size, m.name, f.etag, f.mtime, k.pack_id, k.pack_offset, k.pack_length, p.props "
+      "FROM cloudlyst.files f "
+      "INNER JOIN cloudlyst.mimetypes m ON m.id = f.mimetype_id "
+      "LEFT JOIN cloudlyst.file_packs k ON k.file_id = f.id AND k.etag = f.etag "
+      "LEFT JOIN cloudlyst.file_props p ON p.file_id = f.id "
+      "WHERE f.path = :path AND f.owner_id = :owner_id" },
+    { "files.children_props",
+      "SELECT f.id, f.path, f.name, f.size, m.name, f.etag, f.mtime, k.pack_id, k.pack_offset, k.pack_length, p.props "
+      "FROM cloudlyst.files f "
+      "INNER JOIN cloudlyst.mimetypes m ON m.id = f.mimetype_id "
+      "LEFT JOIN cloudlyst.file_packs k ON k.file_id = f.id AND k.etag = f.etag "
+      "LEFT JOIN cloudlyst.file_props p ON p.file_id = f.id "
+      "WHERE f.parent_id = :parent_id" },
+    { "properties_jsonb.by_files",
+      "SELECT p.file_id, e.key, e.value "
+      "FROM cloudlyst.file_props p, jsonb_each_text(p.props) e "
+      "WHERE p.file_id = ANY(:file_ids)" },
+    { "properties_jsonb.by_parent",
+      "SELECT p.file_id, e.key, e.value "
+      "FROM cloudlyst.file_props p, jsonb_each_text(p.props) e "
+      "WHERE p.file_id = :parent_id "
+      "OR p.file_id IN (SELECT id FROM cloudlyst.files WHERE parent_id = :parent_id)" },
+    { "properties_jsonb.patch",
+      "INSERT INTO cloudlyst.file_props "
+      "(file_id, props) "
+      "VALUES "
+      "(:file_id, jsonb_object(:set_names::text[], :set_values::text[])) "
+      "ON CONFLICT (file_id) "
+      "DO UPDATE SET props = (file_props.props - :remove_names::text[]) || EXCLUDED.props" },
+    // files.remove that also returns what ON DELETE CASCADE takes along,
+    // nothing when the DELETE itself found no row
+    { "files.remove_tree",
+      "WITH RECURSIVE tree AS ("
+      "SELECT id FROM cloudlyst.files WHERE path = :path AND owner_id = :owner_id "
+      "UNION ALL "
+      "SELECT f.id FROM cloudlyst.files f INNER JOIN tree t ON f.parent_id = t.id"
+      "), removed AS ("
+      "DELETE FROM cloudlyst.files WHERE path = :path AND owner_id = :owner_id RETURNING id"
+      ") "
+      "SELECT tree.id FROM tree, removed",
+      // changes() counts the rows the DELETE itself removed
+      "DELETE FROM temp.removed_ids; "
+      "WITH RECURSIVE tree(id) AS ("
+      "SELECT id FROM cloudlyst.files WHERE path = :path AND owner_id = :owner_id "
+      "UNION ALL "
+      "SELECT f.id FROM cloudlyst.files f INNER JOIN tree t ON f.parent_id = t.id"
+      ") "
+      "INSERT INTO temp.removed_ids (id) SELECT id FROM tree; "
+      "DELETE FROM cloudlyst.files WHERE path = :path AND owner_id = :owner_id; "
+      "SELECT id FROM temp.removed_ids WHERE changes() > 0" },
+    // files.put for many files in one statement, the parents are updated
+    // once rather than for each row. SQLite keeps its per row triggers.
+    { "files.put_bulk",
+      "SELECT file_id, file_path FROM cloudlyst_put_bulk"
+      "(:paths, :names, :parent_paths, :mtimes, :storage_mtimes, :mimetypes, :sizes, :etags, :owner_id)",
+      "INSERT INTO cloudlyst.mimetypes (name) SELECT DISTINCT value FROM json_each(:mimetypes) WHERE true "
+      "ON CONFLICT (name) DO NOTHING; "
+      "INSERT INTO cloudlyst.files "
+      "(path, name, mtime, storage_mtime, mimetype_id, size, etag, owner_id, parent_id) "
+      "SELECT i.value, n.value, mt.value, smt.value, m.id, s.value, e.value, :owner_id, p.id "
+      "FROM json_each(:paths) i "
+      "INNER JOIN json_each(:names) n ON n.key = i.key "
+      "INNER JOIN json_each(:parent_paths) pp ON pp.key = i.key "
+      "INNER JOIN json_each(:mtimes) mt ON mt.key = i.key "
+      "INNER JOIN json_each(:storage_mtimes) smt ON smt.key = i.key "
+      "INNER JOIN json_each(:mimetypes) mi ON mi.key = i.key "
+      "INNER JOIN json_each(:sizes) s ON s.key = i.key "
+      "INNER JOIN json_each(:etags) e ON e.key = i.key "
+      "INNER JOIN cloudlyst.mimetypes m ON m.name = mi.value "
+      "INNER JOIN cloudlyst.files p "
+      "ON p.path = CASE WHEN pp.value <> '' THEN pp.value ELSE 'files' END AND p.owner_id = :owner_id "
+      "WHERE true ON CONFLICT (path, owner_id) "
+      "DO UPDATE SET mtime = excluded.mtime, storage_mtime = excluded.storage_mtime, "
+      "mimetype_id = excluded.mimetype_id, size = excluded.size, etag = excluded.etag; "
+      "SELECT f.id, f.path FROM cloudlyst.files f INNER JOIN json_each(:paths) i ON f.path = i.value "
+      "WHERE f.owner_id = :owner_id" },
+    // Packed storage, a location only counts while its etag is the file's
+    { "files.pack_set",
+      "INSERT INTO cloudlyst.file_packs "
+      "(file_id, owner_id, pack_id, pack_offset, pack_length, etag) "
+      "SELECT id, owner_id, CAST(:pack_id AS integer), CAST(:pack_offset AS bigint), CAST(:pack_length AS integer), etag "
+      "FROM cloudlyst.files WHERE path = :path AND owner_id = :owner_id "
+      "ON CONFLICT (file_id) "
+      "DO UPDATE SET pack_id = excluded.pack_id, pack_offset = excluded.pack_offset, "
+      "pack_length = excluded.pack_length, etag = excluded.etag" },
+    { "files.pack_copy",
+      "INSERT INTO cloudlyst.file_packs "
+      "(file_id, owner_id, pack_id, pack_offset, pack_length, etag) "
+      "SELECT d.id, d.owner_id, k.pack_id, k.pack_offset, k.pack_length, d.etag "
+      "FROM cloudlyst.files s "
+      "INNER JOIN cloudlyst.file_packs k ON k.file_id = s.id AND k.etag = s.etag "
+      "INNER JOIN cloudlyst.files d ON d.path = :dest_path AND d.owner_id = :owner_id "
+      "WHERE s.path = :path AND s.owner_id = :owner_id" },
+    { "files.pack_tree",
+      "SELECT f.id, f.path, f.name, f.size, m.name, f.etag, f.mtime, k.pack_id, k.pack_offset, k.pack_length "
+      "FROM cloudlyst.file_packs k "
+      "INNER JOIN cloudlyst.files f ON f.id = k.file_id AND f.etag = k.etag "
+      "INNER JOIN cloudlyst.mimetypes m ON m.id = f.mimetype_id "
+      "WHERE k.owner_id = :owner_id "
+      "AND substr(f.path, 1, length(CAST(:path AS text)) + 1) = CAST(:path AS text) || '/'" },
+    { "files.pack_prune",
+      "DELETE FROM cloudlyst.file_packs "
+      "WHERE owner_id = :owner_id AND file_id IN ("
+      "SELECT k.file_id FROM cloudlyst.file_packs k INNER JOIN cloudlyst.files f ON f.id = k.file_id "
+      "WHERE k.owner_id = :owner_id AND f.etag <> k.etag)" },
+    // Copies of a file share their location, it is only counted once
+    { "files.pack_usage",
+      "SELECT u.pack_id, sum(u.pack_length) FROM ("
+      "SELECT DISTINCT pack_id, pack_offset, pack_length FROM cloudlyst.file_packs WHERE owner_id = :owner_id"
+      ") u GROUP BY u.pack_id" },
+    { "files.pack_list",
+      "SELECT DISTINCT k.pack_offset, k.pack_length "
+      "FROM cloudlyst.file_packs k "
+      "INNER JOIN cloudlyst.files f ON f.id = k.file_id AND f.etag = k.etag "
+      "WHERE k.owner_id = :owner_id AND k.pack_id = :pack_id "
+      "ORDER BY k.pack_offset" },
+    { "files.pack_relocate",
+      "UPDATE cloudlyst.file_packs SET pack_id = :new_pack_id, pack_offset = :new_offset "
+      "WHERE owner_id = :owner_id AND pack_id = :pack_id AND pack_offset = :pack_offset" },
+};
+
+struct Positional {
+    QByteArray sql;
+    QStringList names;
+};
+
+// Maps :name placeholders to $1..$n, a repeated name reuses its number
+Positional toPositional(const char *sql)
+{
+    Positional ret;
+    const QByteArray in(sql);
+    bool quoted = false;
+    for (int i = 0; i < in.size(); ++i) {
+        const char ch = in.at(i);
+        if (ch == '\'') {
+            quoted = !quoted;
+        } else if (!quoted && ch == ':' && i + 1 < in.size() && (isalpha(in.at(i + 1)) || in.at(i + 1) == '_') &&
+                   (i == 0 || in.at(i - 1) != ':')) {
+            int end = i + 1;
+            while (end < in.size() && (isalnum(in.at(end)) || in.at(end) == '_')) {
+                ++end;
+            }
+            const QString name = QString::fromLatin1(in.mid(i, end - i));
+            int pos = ret.names.indexOf(name);
+            if (pos == -1) {
+                pos = ret.names.size();
+                ret.names.append(name);
+            }
+            ret.sql.append('$').append(QByteArray::number(pos + 1));
+            i = end - 1;
+            continue;
+        }
+        ret.sql.append(ch);
+    }
+    return ret;
+}
+
+const std::vector<Positional> &positional()
+{
+    static const std::vector<Positional> ret = [] {
+        std::vector<Positional> ret;
+        for (const StatementInfo &info : statements) {
+            ret.push_back(toPositional(info.sql));
+        }
+        return ret;
+    }();
+    return ret;
+}
+
+std::atomic<qint64> slowQueryNsecs(Q_INT64_C(100) * 1000 * 1000);
+
+SqlQuery::Driver currentDriver = SqlQuery::PostgreSQL;
+
+thread_local std::unique_ptr<QSqlQuery> prepared[2][SqlQuery::StatementCount];
+
+// The leading statements of SQLite scripts, the last one is the SqlQuery
+struct ScriptPart {
+    std::unique_ptr<QSqlQuery> query;
+    QStringList names;
+};
+thread_local std::vector<ScriptPart> scriptParts[SqlQuery::StatementCount];
+
+QStringList scriptStatements(SqlQuery::Statement statement)
+{
+    QStringList ret;
+    const QStringList parts = SqlQuery::sql(statement).split(QLatin1Char(';'), QString::SkipEmptyParts);
+    for (const QString &part : parts) {
+        ret.append(part.trimmed());
+    }
+    return ret;
+}
+
+SqlQuery::Target availableTarget(SqlQuery::Target target)
+{
+    if (target == SqlQuery::Replica) {
+        const QString name = Sql::databaseNameThread(QStringLiteral("cloudlyst_replica"));
+        if (!QSqlDatabase::contains(name) || !QSqlDatabase::database(name, false).isOpen()) {
+            return SqlQuery::Primary;
+        }
+    }
+    return target;
+}
+
+QSqlQuery preparedStatement(SqlQuery::Statement statement, SqlQuery::Target target)
+{
+    std::unique_ptr<QSqlQuery> &query = prepared[target][statement];
+    if (!query) {
+        const QString connection = target == SqlQuery::Replica ? QStringLiteral("cloudlyst_replica") : QStringLiteral("cloudlyst");
+        const QString sql = currentDriver == SqlQuery::SQLite ? scriptStatements(statement).last() : SqlQuery::sql(statement);
+        query.reset(new QSqlQuery(Sql::preparedQuery(sql, Sql::databaseThread(connection))));
+    }
+    return *query;
+}
+
+}
+
+SqlQuery::SqlQuery(Statement statement, Target target) : m_statement(statement)
+  , m_target(availableTarget(target))
+  , m_script(currentDriver == SQLite && statements[statement].sqlite)
+{
+    QSqlQuery::operator=(preparedStatement(statement, m_target));
+}
+
+void SqlQuery::bindValue(const QString &placeholder, const QVariant &value)
+{
+    if (m_script) {
+        m_values.insert(placeholder, value);
+    }
+    QSqlQuery::bindValue(placeholder, value);
+}
+
+bool SqlQuery::exec()
+{
+    ScopedTimer timer(RequestTrace::Sql);
+
+    const auto start = std::chrono::steady_clock::now();
+    m_scriptError = QSqlError();
+    const bool ret = (!m_script || execScript()) && QSqlQuery::exec();
+    const qint64 nsecs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    const int rows = ret ? (isSelect() ? size() : numRowsAffected()) : 0;
+    Metrics::recordStatement(m_statement, nsecs, qMax(0, rows), ret);
+
+    if (!ret) {
+        qCWarning(CLOUDLYST_SQL) << "Failed" << statements[m_statement].name << lastError().databaseText();
+    } else if (nsecs >= slowQueryNsecs.load(std::memory_order_relaxed)) {
+        qCWarning(CLOUDLYST_SQL) << "Slow query" << statements[m_statement].name << nsecs / 1000000 << "ms"
+                                 << rows << "rows" << boundValues();
+    }
+
+    return ret;
+}
+
+QSqlError SqlQuery::lastError() const
+{
+    return m_scriptError.isValid() ? m_scriptError : QSqlQuery::lastError();
+}
+
+bool SqlQuery::execScript()
+{
+    QSqlDatabase db = Sql::databaseThread(QStringLiteral("cloudlyst"));
+
+    std::vector<ScriptPart> &parts = scriptParts[m_statement];
+    if (parts.empty()) {
+        const QStringList sqls = scriptStatements(m_statement);
+        for (int i = 0; i < sqls.size() - 1; ++i) {
+            ScriptPart part;
+            part.query.reset(new QSqlQuery(db));
+            part.query->prepare(sqls.at(i));
+            part.names = toPositional(sqls.at(i).toUtf8().constData()).names;
+            parts.push_back(std::move(part));
+        }
+    }
+
+    // Applied as a whole, also inside a transaction of the caller. The
+    // last statement only reads, so it runs after the release and its
+    // rows don't keep the savepoint open.
+    QSqlQuery savepoint(db);
+    savepoint.exec(QStringLiteral("SAVEPOINT cloudlyst_script"));
+    for (ScriptPart &part : parts) {
+        for (const QString &name : part.names) {
+            part.query->bindValue(name, m_values.value(name));
+        }
+        if (!part.query->exec()) {
+            m_scriptError = part.query->lastError();
+            savepoint.exec(QStringLiteral("ROLLBACK TO cloudlyst_script"));
+            savepoint.exec(QStringLiteral("RELEASE cloudlyst_script"));
+            return false;
+        }
+    }
+    return savepoint.exec(QStringLiteral("RELEASE cloudlyst_script"));
+}
+
+const char *SqlQuery::name(Statement statement)
+{
+    return statements[statement].name;
+}
+
+QString SqlQuery::sql(Statement statement)
+{
+    const StatementInfo &info = statements[statement];
+    return QString::fromLatin1(currentDriver == SQLite && info.sqlite ? info.sqlite : info.sql);
+}
+
+void SqlQuery::setDriver(Driver driver)
+{
+    currentDriver = driver;
+}
+
+SqlQuery::Driver SqlQuery::driver()
+{
+    return currentDriver;
+}
+
+QByteArray SqlQuery::positionalSql(Statement statement)
+{
+    return positional()[size_t(statement)].sql;
+}
+
+QStringList SqlQuery::placeholders(Statement statement)
+{
+    return positional()[size_t(statement)].names;
+}
+
+void SqlQuery::setSlowQueryThreshold(int msecs)
+{
+    slowQueryNsecs.store(qint64(msecs) * 1000 * 1000);
+}
+
+QString SqlQuery::arrayLiteral(const QStringList &values)
+{
+    if (currentDriver == SQLite) {
+        return QString::fromUtf8(QJsonDocument(QJsonArray::fromStringList(values)).toJson(QJsonDocument::Compact));
+    }
+
+    QString ret = QStringLiteral("{");
+    for (const QString &value : values) {
+        QString escaped = value;
+        escaped.replace(QLatin1Char('\\'), QLatin1String("\\\\"));
+        escaped.replace(QLatin1Char('"'), QLatin1String("\\\""));
+        ret.append(QLatin1Char('"') + escaped + QLatin1String("\","));
+    }
+    if (ret.size() > 1) {
+        ret.chop(1);
+    }
+    ret.append(QLatin1Char('}'));
+    return ret;
+}
+
+QByteArray SqlQuery::idArrayLiteral(const std::vector<qint64> &ids)
+{
+    // bigint[] for PostgreSQL, which infers the type from file_id = ANY($1)
+    const bool sqlite = currentDriver == SQLite;
+    QByteArray ret(1, sqlite ? '[' : '{');
+    for (qint64 id : ids) {
+        ret.append(QByteArray::number(id)).append(',');
+    }
+    if (ret.size() > 1) {
+        ret.chop(1);
+    }
+    ret.append(sqlite ? ']' : '}');
+    return ret;
+}
+
+void SqlQuery::clearThread()
+{
+    for (auto &target : prepared) {
+        for (std::unique_ptr<QSqlQuery> &query : target) {
+            query.reset();
+        }
+    }
+    for (std::vector<ScriptPart> &parts : scriptParts) {
+        parts.clear();
+    }
+}
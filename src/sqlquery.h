@@ -0,0 +1,119 @@
+#ifndef SQLQUERY_H
+#define SQLQUERY_H
+
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QStringList>
+#include <QVariantMap>
+
+#include <vector>
+
+/**
+ * A prepared statement from the registry below.
+ *
+ * Statements are prepared once per thread connection and every exec()
+ * is timed and accounted per statement (see Metrics), failures are
+ * logged with the statement name and statements slower than
+ * SqlSlowQuery (ms) are logged with their bound values.
+ *
+ * Replica statements run on the cloudlyst_replica connection when
+ * DatabaseReplicaConnInfo is set and it is open, on the primary
+ * otherwise.
+ *
+ * With the SQLite driver statements that need it have their own SQL,
+ * the stored procedures are ported as scripts run in a savepoint.
+ */
+class SqlQuery : public QSqlQuery
+{
+public:
+    enum Statement {
+        UserByName,
+        UserIdByName,
+        FilesPut,
+        FilesRemove,
+        FilesItemByPath,
+        FilesItemById,
+        FilesChildren,
+        FilesCopy,
+        FilesMove,
+        FilesScanList,
+        FilesScanLookup,
+        PropertiesByFiles,
+        PropertiesByParent,
+        PropertySet,
+        PropertyRemove,
+        PropertiesPatch,
+        FilesItemByPathProps,
+        FilesChildrenProps,
+        PropertiesJsonbByFiles,
+        PropertiesJsonbByParent,
+        PropertiesJsonbPatch,
+        FilesRemoveTree,
+        FilesPutBulk,
+        FilesPackSet,
+        FilesPackCopy,
+        FilesPackTree,
+        FilesPackPrune,
+        FilesPackUsage,
+        FilesPackList,
+        FilesPackRelocate,
+        StatementCount,
+    };
+
+    enum Target {
+        Primary,
+        Replica,
+    };
+
+    enum Driver {
+        PostgreSQL,
+        SQLite,
+    };
+
+    explicit SqlQuery(Statement statement, Target target = Primary);
+
+    /** Hides QSqlQuery::bindValue(), scripts bind to each of their statements */
+    void bindValue(const QString &placeholder, const QVariant &value);
+
+    /** Hides QSqlQuery::exec() so registry statements are always accounted */
+    bool exec();
+
+    /** Hides QSqlQuery::lastError() to also report failed script statements */
+    QSqlError lastError() const;
+
+    /** Set before the first statement, see DatabaseDriver */
+    static void setDriver(Driver driver);
+    static Driver driver();
+
+    static const char *name(Statement statement);
+    static QString sql(Statement statement);
+
+    /** The statement with libpq's $n placeholders, in placeholders() order */
+    static QByteArray positionalSql(Statement statement);
+    static QStringList placeholders(Statement statement);
+
+    /** The connection the statement actually runs on */
+    Target target() const { return m_target; }
+
+    static void setSlowQueryThreshold(int msecs);
+
+    /** \p values as a PostgreSQL array literal, for the text[] parameters, a JSON array with SQLite */
+    static QString arrayLiteral(const QStringList &values);
+
+    /** Same for bigint[] parameters */
+    static QByteArray idArrayLiteral(const std::vector<qint64> &ids);
+
+    /** Drops this thread's prepared statements, before its connection is removed */
+    static void clearThread();
+
+private:
+    bool execScript();
+
+    Statement m_statement;
+    Target m_target;
+    bool m_script;
+    QVariantMap m_values;
+    QSqlError m_scriptError;
+};
+
+#endif // SQLQUERY_H
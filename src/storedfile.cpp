@@ -0,0 +1,147 @@
+#include "storedfile.h"
+
+#include "iopolicy.h"
+#ifdef CLOUDLYST_HAS_ZSTD
+#include "zstdfile.h"
+#endif
+
+#include <QFile>
+#include <QtEndian>
+
+#include <QLoggingCategory>
+
+#include <string.h>
+#include <unistd.h>
+
+Q_LOGGING_CATEGORY(CLOUDLYST_STORED, "cloudlyst.stored", QtWarningMsg)
+
+namespace {
+
+const quint32 SeekTableMagic = 0x184D2A5E;
+const quint32 SeekableMagic = 0x8F92EAB1;
+
+// Entry count, descriptor and magic
+const int FooterSize = 9;
+const int EntrySize = 8;
+// Skippable frame magic and size
+const int FrameHeaderSize = 8;
+
+bool readAt(QFileDevice *file, qint64 offset, char *data, qint64 len)
+{
+    return ::pread(file->handle(), data, size_t(len), off_t(offset)) == len;
+}
+
+}
+
+QByteArray StoredFile::header()
+{
+    static const QByteArray marker = QByteArrayLiteral("\x5A\x2A\x4D\x18\x10\x00\x00\x00" "Cloudlyst zstd 1");
+    return marker;
+}
+
+bool StoredFile::readIndex(QFileDevice *file, std::vector<Frame> &frames)
+{
+    const qint64 fileSize = file->size();
+    if (fileSize < HeaderSize + FrameHeaderSize + FooterSize) {
+        return false;
+    }
+
+    char head[HeaderSize];
+    if (!readAt(file, 0, head, HeaderSize) || memcmp(head, header().constData(), HeaderSize) != 0) {
+        return false;
+    }
+
+    uchar footer[FooterSize];
+    if (!readAt(file, fileSize - FooterSize, reinterpret_cast<char *>(footer), FooterSize) ||
+            qFromLittleEndian<quint32>(footer + 5) != SeekableMagic || footer[4] != 0) {
+        qCWarning(CLOUDLYST_STORED) << "Compressed file without a seek table" << file->fileName();
+        return false;
+    }
+
+    const qint64 count = qFromLittleEndian<quint32>(footer);
+    const qint64 tableSize = count * EntrySize + FooterSize;
+    const qint64 tableStart = fileSize - tableSize - FrameHeaderSize;
+    if (tableStart < HeaderSize) {
+        qCWarning(CLOUDLYST_STORED) << "Seek table larger than the file" << file->fileName();
+        return false;
+    }
+
+    QByteArray table(int(tableSize + FrameHeaderSize - FooterSize), Qt::Uninitialized);
+    if (!readAt(file, tableStart, table.data(), table.size())) {
+        return false;
+    }
+    auto in = reinterpret_cast<const uchar *>(table.constData());
+    if (qFromLittleEndian<quint32>(in) != SeekTableMagic || qFromLittleEndian<quint32>(in + 4) != tableSize) {
+        qCWarning(CLOUDLYST_STORED) << "Corrupt seek table" << file->fileName();
+        return false;
+    }
+    in += FrameHeaderSize;
+
+    frames.clear();
+    frames.reserve(size_t(count));
+    qint64 offset = HeaderSize;
+    qint64 start = 0;
+    for (qint64 i = 0; i < count; ++i, in += EntrySize) {
+        Frame frame;
+        frame.offset = offset;
+        frame.start = start;
+        frame.compressedSize = qFromLittleEndian<quint32>(in);
+        frame.size = qFromLittleEndian<quint32>(in + 4);
+        if (frame.size > FrameSize) {
+            qCWarning(CLOUDLYST_STORED) << "Frame too large" << file->fileName() << frame.size;
+            return false;
+        }
+        frames.push_back(frame);
+        offset += frame.compressedSize;
+        start += frame.size;
+    }
+
+    if (offset != tableStart) {
+        qCWarning(CLOUDLYST_STORED) << "Seek table doesn't match the frames" << file->fileName();
+        return false;
+    }
+    return true;
+}
+
+qint64 StoredFile::contentSize(const QString &fileName, qint64 size)
+{
+    QFile file(fileName);
+    std::vector<Frame> frames;
+    if (size < HeaderSize || !file.open(QIODevice::ReadOnly) || !readIndex(&file, frames)) {
+        return size;
+    }
+    return frames.empty() ? 0 : frames.back().start + frames.back().size;
+}
+
+QIODevice *StoredFile::open(const QString &fileName, QString &error, QObject *parent)
+{
+    auto file = new SequentialFile(fileName, parent);
+    if (!file->open(QIODevice::ReadOnly)) {
+        error = file->errorString();
+        delete file;
+        return nullptr;
+    }
+
+    std::vector<Frame> frames;
+    if (readIndex(file, frames)) {
+        QIODevice *content = decompress(file, frames, parent);
+        if (content) {
+            return content;
+        }
+    }
+    return file;
+}
+
+QIODevice *StoredFile::decompress(QFileDevice *file, const std::vector<Frame> &frames, QObject *parent)
+{
+#ifdef CLOUDLYST_HAS_ZSTD
+    auto content = new ZstdReader(file, frames, parent);
+    content->open(QIODevice::ReadOnly);
+    return content;
+#else
+    Q_UNUSED(frames)
+    Q_UNUSED(parent)
+    qCWarning(CLOUDLYST_STORED) << "Built without zstd, reading as is" << file->fileName();
+    return nullptr;
+#endif
+}
@@ -0,0 +1,65 @@
+#ifndef STOREDFILE_H
+#define STOREDFILE_H
+
+#include <QString>
+
+#include <vector>
+
+class QFileDevice;
+class QIODevice;
+class QObject;
+
+/**
+ * Files compressed at rest (Compression=zstd).
+ *
+ * Such a file starts with a skippable frame marking it as ours, followed
+ * by independent zstd frames of up to FrameSize bytes of content each
+ * and ends with the seek table of the zstd seekable format. The whole is
+ * a valid zstd stream, `zstd -d` reads it and it is sent as is to clients
+ * accepting zstd, while the seek table lets a range be read by
+ * decompressing only the frames it covers.
+ *
+ * The database has the size of the content, everything reading files
+ * goes through open() to get the content back.
+ */
+class StoredFile
+{
+public:
+    struct Frame {
+        qint64 offset;  // in the file
+        qint64 start;   // in the content
+        quint32 compressedSize;
+        quint32 size;
+    };
+
+    enum {
+        FrameSize = 256 * 1024,
+        HeaderSize = 24,
+    };
+
+    /** The marker every compressed file starts with */
+    static QByteArray header();
+
+    /**
+     * Reads the frames of \p file, an open file, without moving its
+     * position. False if it isn't compressed at rest.
+     */
+    static bool readIndex(QFileDevice *file, std::vector<Frame> &frames);
+
+    /** The content size of \p fileName, which is \p size unless compressed */
+    static qint64 contentSize(const QString &fileName, qint64 size);
+
+    /**
+     * Opens \p fileName to read its content, compressed at rest or not.
+     * Returns nullptr with \p error set on failure.
+     */
+    static QIODevice *open(const QString &fileName, QString &error, QObject *parent = nullptr);
+
+    /**
+     * The content of \p file, which the returned device takes over, read
+     * through \p frames. Returns nullptr if built without zstd.
+     */
+    static QIODevice *decompress(QFileDevice *file, const std::vector<Frame> &frames, QObject *parent = nullptr);
+};
+
+#endif // STOREDFILE_H
@@ -1,16 +1,35 @@
 #include "webdav.h"
 
+#include "bulkuploadparser.h"
+#include "md5.h"
 #include "webdavpgsqlpropertystorage.h"
+#ifdef CLOUDLYST_HAS_LMDB
+#include "webdavlmdbpropertystorage.h"
+#endif
+#ifdef CLOUDLYST_HAS_ZSTD
+#include "zstdfile.h"
+#endif
+#include "admissioncontrol.h"
+#include "asyncpg.h"
+#include "filecache.h"
+#include "filessql.h"
+#include "filessqlasync.h"
+#include "fileswatcher.h"
+#include "iopolicy.h"
+#include "packcompactor.h"
+#include "packstore.h"
+#include "rangedevice.h"
+#include "replicarouter.h"
+#include "requesttrace.h"
+#include "spoolswap.h"
+#include "storedfile.h"
+#include "zipstream.h"
 
 #include <Cutelyst/Plugins/Authentication/authentication.h>
-#include <Cutelyst/Plugins/Utils/Sql>
 #include <Cutelyst/utils.h>
 #include <Cutelyst/Application>
 #include <Cutelyst/Headers>
 
-#include <QSqlQuery>
-#include <QSqlError>
-
 #include <QFileInfo>
 #include <QDir>
 #include <QDirIterator>
@@ -22,9 +41,26 @@
 #include <QMimeDatabase>
 #include <QCryptographicHash>
 #include <QStandardPaths>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRegularExpression>
+#include <QSaveFile>
+#include <QSet>
+#include <QTimer>
+#include <QUuid>
 
 #include <QLoggingCategory>
 
+#include <deque>
+#include <memory>
+
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
 Q_LOGGING_CATEGORY(WEBDAV_BASE, "webdav.BASE", QtWarningMsg)
 Q_LOGGING_CATEGORY(WEBDAV_PUT, "webdav.PUT", QtWarningMsg)
 Q_LOGGING_CATEGORY(WEBDAV_HEAD, "webdav.HEAD", QtWarningMsg)
@@ -36,12 +72,297 @@ Q_LOGGING_CATEGORY(WEBDAV_DELETE, "webdav.DELETE", QtWarningMsg)
 Q_LOGGING_CATEGORY(WEBDAV_PROPFIND, "webdav.PROPFIND", QtWarningMsg)
 Q_LOGGING_CATEGORY(WEBDAV_PROPPATCH, "webdav.PROPPATCH", QtWarningMsg)
 Q_LOGGING_CATEGORY(WEBDAV_SQL, "webdav.SQL", QtWarningMsg)
+Q_LOGGING_CATEGORY(WEBDAV_BULK, "webdav.BULK", QtWarningMsg)
+Q_LOGGING_CATEGORY(WEBDAV_TUS, "webdav.TUS", QtWarningMsg)
 
 using namespace Cutelyst;
 
+namespace {
+
+// Written per event loop pass, so the thread's other requests go on
+// while a large collection downloads
+const qint64 ZipSlice = 1024 * 1024;
+
+struct ZipDownload
+{
+    ZipDownload(QIODevice *out, int level) : zip(out, level) {}
+
+    ZipStream zip;
+    // Listed breadth first, one directory's children at a time
+    std::deque<FileItem> dirs;
+    std::deque<FileItem> entries;
+    std::unique_ptr<QIODevice> file;
+    QString filePath;
+    QString base;
+    QVariant userId;
+    int prefixSize = 0;
+    bool deflate = true;
+};
+
+void pumpZip(Context *c, std::shared_ptr<ZipDownload> download)
+{
+    ZipStream &zip = download->zip;
+    qint64 budget = ZipSlice;
+    while (budget > 0 && zip.isValid()) {
+        if (download->file) {
+            ScopedTimer timer(RequestTrace::Fs);
+            char block[64 * 1024];
+            const qint64 len = download->file->read(block, sizeof(block));
+            if (len > 0) {
+                zip.writeData(block, len);
+                budget -= len;
+                continue;
+            }
+
+            // The entry ends with what could be read, its CRC still matches
+            if (len < 0) {
+                qCWarning(WEBDAV_GET) << "Failed to read" << download->filePath << download->file->errorString();
+            }
+            zip.endFile();
+            download->file.reset();
+        } else if (!download->entries.empty()) {
+            const FileItem item = download->entries.front();
+            download->entries.pop_front();
+
+            const QString name = item.path.mid(download->prefixSize);
+            if (item.mimetype == QLatin1String("httpd/unix-directory")) {
+                zip.addDirectory(name, item.mtime);
+                download->dirs.push_back(item);
+                continue;
+            }
+
+            QString error;
+            std::unique_ptr<QIODevice> file(item.packId ? PackStore::open(download->base, item, error)
+                                                        : StoredFile::open(download->base + item.path, error));
+            if (!file) {
+                qCWarning(WEBDAV_GET) << "Leaving out of the archive" << item.path << error;
+                continue;
+            }
+            zip.beginFile(name, item.mtime, download->deflate && !ZipStream::isCompressed(item.mimetype));
+            download->file = std::move(file);
+            download->filePath = item.path;
+        } else if (!download->dirs.empty()) {
+            const FileItem dir = download->dirs.front();
+            download->dirs.pop_front();
+
+            FilesSqlAsync::children(dir.id, download->userId, c, [c, download, dir] (const std::vector<FileItem> &items, const QString &error) {
+                if (!error.isEmpty()) {
+                    qCWarning(WEBDAV_GET) << "Failed to list" << dir.path << error;
+                }
+                download->entries.assign(items.begin(), items.end());
+                pumpZip(c, download);
+            });
+            return;
+        } else {
+            zip.finish();
+            c->attachAsync();
+            return;
+        }
+    }
+
+    if (!zip.isValid()) {
+        qCWarning(WEBDAV_GET) << "Archive download aborted after" << zip.bytesWritten() << "bytes";
+        c->attachAsync();
+        return;
+    }
+
+    QTimer::singleShot(0, c, [c, download] {
+        pumpZip(c, download);
+    });
+}
+
+enum class ByteRange {
+    Whole,
+    Part,
+    Unsatisfiable,
+};
+
+// A single "bytes=" range of \p size as [begin, end), several ranges or
+// a stale If-Range get the whole content
+ByteRange byteRange(Request *req, const QString &etag, qint64 size, qint64 &begin, qint64 &end)
+{
+    const QString range = req->header(QStringLiteral("RANGE"));
+    if (!range.startsWith(QLatin1String("bytes=")) || range.contains(QLatin1Char(','))) {
+        return ByteRange::Whole;
+    }
+
+    QString ifRange = req->header(QStringLiteral("IF_RANGE"));
+    if (!ifRange.isEmpty() && ifRange.remove(QLatin1Char('"')) != etag) {
+        return ByteRange::Whole;
+    }
+
+    const QStringRef spec = range.midRef(6).trimmed();
+    const int dash = spec.indexOf(QLatin1Char('-'));
+    if (dash < 0) {
+        return ByteRange::Whole;
+    }
+
+    bool ok;
+    if (dash == 0) {
+        const qint64 suffix = spec.mid(1).toLongLong(&ok);
+        if (!ok || suffix < 0) {
+            return ByteRange::Whole;
+        } else if (suffix == 0 || size == 0) {
+            return ByteRange::Unsatisfiable;
+        }
+        begin = qMax(Q_INT64_C(0), size - suffix);
+        end = size;
+        return ByteRange::Part;
+    }
+
+    begin = spec.left(dash).toLongLong(&ok);
+    if (!ok || begin < 0) {
+        return ByteRange::Whole;
+    }
+    end = size;
+    if (dash + 1 < spec.size()) {
+        const qint64 last = spec.mid(dash + 1).toLongLong(&ok);
+        if (!ok || last < begin) {
+            return ByteRange::Whole;
+        }
+        end = qMin(size, last + 1);
+    }
+    return begin < size ? ByteRange::Part : ByteRange::Unsatisfiable;
+}
+
+// Unless turned down with q=0
+bool acceptsZstd(Request *req)
+{
+    const QVector<QStringRef> codings = req->header(QStringLiteral("ACCEPT_ENCODING")).splitRef(QLatin1Char(','), QString::SkipEmptyParts);
+    for (const QStringRef &coding : codings) {
+        const QVector<QStringRef> params = coding.split(QLatin1Char(';'));
+        if (params.first().trimmed() == QLatin1String("zstd")) {
+            for (int i = 1; i < params.size(); ++i) {
+                const QStringRef param = params.at(i).trimmed();
+                if (param.startsWith(QLatin1String("q=")) && param.mid(2).toDouble() == 0) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// Those of HEAD and GET but the length
+void fileHeaders(Headers &headers, const FileItem &fileItem)
+{
+    headers.setContentType(fileItem.mimetype);
+    headers.setContentDispositionAttachment(fileItem.name);
+    headers.setETag(fileItem.etag);
+    headers.setHeader(QStringLiteral("ACCEPT_RANGES"), QStringLiteral("bytes"));
+}
+
+// What is known of a resumable upload between its requests, the data
+// itself is in a file next to it
+struct TusUpload
+{
+    QString path;
+    QByteArray md5;
+    qint64 length = 0;
+    qint64 offset = 0;
+    qint64 mtime = 0;
+};
+
+bool loadTus(const QString &fileName, TusUpload &upload)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    const QJsonObject obj = QJsonDocument::fromJson(file.readAll()).object();
+    upload.path = obj.value(QStringLiteral("path")).toString();
+    upload.md5 = QByteArray::fromBase64(obj.value(QStringLiteral("md5")).toString().toLatin1());
+    upload.length = qint64(obj.value(QStringLiteral("length")).toDouble());
+    upload.offset = qint64(obj.value(QStringLiteral("offset")).toDouble());
+    upload.mtime = qint64(obj.value(QStringLiteral("mtime")).toDouble());
+    return !upload.path.isEmpty();
+}
+
+// Replaced atomically, so it always matches data that was synced
+bool saveTus(const QString &fileName, const TusUpload &upload)
+{
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    file.write(QJsonDocument(QJsonObject{
+                                 {QStringLiteral("path"), upload.path},
+                                 {QStringLiteral("md5"), QString::fromLatin1(upload.md5.toBase64())},
+                                 {QStringLiteral("length"), double(upload.length)},
+                                 {QStringLiteral("offset"), double(upload.offset)},
+                                 {QStringLiteral("mtime"), double(upload.mtime)},
+                             }).toJson(QJsonDocument::Compact));
+    return file.commit();
+}
+
+// Upload-Metadata, comma separated keys each followed by a base64 value
+QHash<QString, QString> tusMetadata(const QString &header)
+{
+    QHash<QString, QString> ret;
+    const QVector<QStringRef> pairs = header.splitRef(QLatin1Char(','), QString::SkipEmptyParts);
+    for (const QStringRef &pair : pairs) {
+        const QVector<QStringRef> kv = pair.trimmed().split(QLatin1Char(' '), QString::SkipEmptyParts);
+        if (!kv.isEmpty()) {
+            const QByteArray value = kv.size() > 1 ? QByteArray::fromBase64(kv.at(1).toLatin1()) : QByteArray();
+            ret.insert(kv.at(0).toString(), QString::fromUtf8(value));
+        }
+    }
+    return ret;
+}
+
+// Moves a complete upload into place, \p data is its data file, and
+// answers with \p status
+void finishTus(Context *c, const QString &base, const QString &data, const TusUpload &upload, Response::HttpStatus status)
+{
+    Response *res = c->response();
+    const QString resource = base + upload.path;
+    const bool exists = QFile::exists(resource);
+    if (::rename(QFile::encodeName(data).constData(), QFile::encodeName(resource).constData()) != 0) {
+        qCWarning(WEBDAV_TUS) << "Could not move the upload into place" << resource << qt_error_string(errno);
+        res->setStatus(Response::Conflict);
+        return;
+    }
+    QFile::remove(data + QLatin1String(".json"));
+
+    Md5 md5;
+    md5.restoreState(upload.md5);
+    const QString etag = QString::fromLatin1(md5.result().toHex());
+    const QFileInfo info(resource);
+    const qint64 mtime = upload.mtime;
+
+    const QVariant userId = Authentication::user(c).id();
+    c->detachAsync();
+    FilesSqlAsync::upsert(upload.path, info, -1, mtime, etag, userId, c,
+                          [c, upload, mtime, etag, exists, resource, status] (int ret, const QString &error) {
+        Response *res = c->response();
+        if (ret >= 0) {
+            if (mtime) {
+                res->setHeader(QStringLiteral("X_OC_MTIME"), QStringLiteral("accepted"));
+            }
+            res->headers().setETag(etag);
+            res->setHeader(QStringLiteral("UPLOAD_OFFSET"), QString::number(upload.offset));
+            res->setStatus(status);
+        } else {
+            qCWarning(WEBDAV_TUS) << "put error" << error;
+            res->setStatus(Response::InternalServerError);
+            res->setBody(error);
+            if (!exists) {
+                QFile::remove(resource);
+            }
+        }
+        c->attachAsync();
+    });
+    ReplicaRouter::pinWrite(userId);
+}
+
+}
+
 Webdav::Webdav(QObject *parent) : Controller(parent)
 {
-    m_propStorage = new WebdavPgSqlPropertyStorage(this);
+    m_propStorage = new WebdavPgSqlPropertyStorage(WebdavPgSqlPropertyStorage::Rows, this);
 }
 
 Webdav::~Webdav()
@@ -52,7 +373,17 @@ bool Webdav::dav(Context *c, const QStringList &pathParts)
 {
     Q_UNUSED(pathParts)
 
-    if (Authentication::userExists(c) || Authentication::authenticate(c, QStringLiteral("Cloudlyst"))) {
+    bool authenticated;
+    {
+        ScopedTimer timer(RequestTrace::Auth);
+        authenticated = Authentication::userExists(c) || Authentication::authenticate(c, QStringLiteral("Cloudlyst"));
+    }
+
+    if (authenticated) {
+        if (!AdmissionControl::admit(c, Authentication::user(c).id(), QStringLiteral("/webdav/dav"))) {
+            return false;
+        }
+
         c->response()->setHeader(QStringLiteral("DAV"), QStringLiteral("1"));
 
         return true;
@@ -64,67 +395,153 @@ bool Webdav::dav(Context *c, const QStringList &pathParts)
 void Webdav::dav_HEAD(Context *c, const QStringList &pathParts)
 {
     qCDebug(WEBDAV_HEAD) << pathParts;
-    Response *res = c->response();
 
     const QString path = pathFiles(pathParts);
 
-    QString error;
-    FileItem fileItem = sqlFilesItem(path, Authentication::user(c).id(), error);
-    if (fileItem.id) {
-        Headers &headers = res->headers();
-        headers.setContentType(fileItem.mimetype);
-        headers.setContentDispositionAttachment(fileItem.name);
-        headers.setContentLength(fileItem.size);
-        headers.setETag(fileItem.etag);
-    } else {
-        qCWarning(WEBDAV_HEAD) << "error" << error;
-        res->setStatus(Response::NotFound);
-        res->setBody(QByteArrayLiteral("Content not found."));
-    }
+    c->detachAsync();
+    FilesSqlAsync::item(path, Authentication::user(c).id(), c, [c] (const FileItem &fileItem, const QString &error) {
+        Response *res = c->response();
+        if (fileItem.id) {
+            Headers &headers = res->headers();
+            fileHeaders(headers, fileItem);
+            headers.setContentLength(fileItem.size);
+        } else {
+            qCWarning(WEBDAV_HEAD) << "error" << error;
+            res->setStatus(Response::NotFound);
+            res->setBody(QByteArrayLiteral("Content not found."));
+        }
+        c->attachAsync();
+    });
 }
 
 void Webdav::dav_GET(Context *c, const QStringList &pathParts)
 {
     qCDebug(WEBDAV_GET) << pathParts;
-    Response *res = c->response();
 
     const QString resource = resourcePath(c, pathParts);
     const QString path = pathFiles(pathParts);
     const QVariant userId = Authentication::user(c).id();
+    const bool zip = c->request()->queryParam(QStringLiteral("download")) == QLatin1String("zip");
+
+    c->detachAsync();
+    FilesSqlAsync::item(path, userId, c, [this, c, resource, path, userId, zip] (const FileItem &fileItem, const QString &) {
+        Response *res = c->response();
+
+        ScopedTimer timer(RequestTrace::Fs);
+
+        // Hot small files are answered from memory, without touching the disk
+        const bool cacheable = fileItem.id && FileCache::fits(fileItem.size) &&
+                fileItem.mimetype != QLatin1String("httpd/unix-directory") &&
+                c->request()->header(QStringLiteral("RANGE")).isEmpty();
+        QByteArray cached;
+        if (cacheable && FileCache::find(fileItem.id, fileItem.etag, cached)) {
+            Headers &headers = res->headers();
+            fileHeaders(headers, fileItem);
+            headers.setContentLength(cached.size());
+            res->setBody(cached);
+            c->attachAsync();
+            return;
+        }
 
-    QString error;
-    FileItem fileItem = sqlFilesItem(path, userId, error);
-
-    auto file = new QFile(resource, c);
-    if (fileItem.id && file->open(QIODevice::ReadOnly)) {
-        Headers &headers = res->headers();
-        headers.setContentType(fileItem.mimetype);
-        headers.setContentDispositionAttachment(fileItem.name);
-        headers.setContentLength(fileItem.size);
-        headers.setETag(fileItem.etag);
-
-        // TODO also use X-SENDFILE
-        res->setBody(file);
-    } else {
-        const QFileInfo info(resource);
-        if (fileItem.id && info.isDir()) {
-            res->setStatus(Response::MethodNotAllowed);
-            res->setBody(QByteArrayLiteral("This is the WebDAV interface. It can only be accessed by WebDAV clients."));
-        } else if (fileItem.id) {
+        // Packed, read in one pread from the user's pack
+        QIODevice *content = nullptr;
+        if (fileItem.packId) {
             QString error;
-            int ret = sqlFilesDelete(path, userId, error);
-            if (ret < 0) {
-                qCDebug(WEBDAV_GET) << "GET -> delete sql error" << error;
+            content = PackStore::open(basePath(c), fileItem, error, c);
+            if (!content) {
+                qCWarning(WEBDAV_GET) << "Failed to read packed" << path << error;
                 res->setStatus(Response::InternalServerError);
+                c->attachAsync();
                 return;
-            } else {
-                res->setStatus(Response::Gone);
+            }
+        }
+
+        auto file = content ? nullptr : new SequentialFile(resource, c);
+        if (content || (fileItem.id && file->open(QIODevice::ReadOnly))) {
+            Headers &headers = res->headers();
+            fileHeaders(headers, fileItem);
+
+            std::vector<StoredFile::Frame> frames;
+            if (!content && StoredFile::readIndex(file, frames)) {
+                headers.setHeader(QStringLiteral("VARY"), QStringLiteral("Accept-Encoding"));
+                if (c->request()->header(QStringLiteral("RANGE")).isEmpty() && acceptsZstd(c->request())) {
+                    // Compressed at rest, the file as it is makes a zstd stream
+                    headers.setHeader(QStringLiteral("CONTENT_ENCODING"), QStringLiteral("zstd"));
+                    headers.setContentLength(file->size());
+                    res->setBody(file);
+                    c->attachAsync();
+                    return;
+                }
+
+                content = StoredFile::decompress(file, frames, c);
+            }
+            if (!content) {
+                content = file;
+            }
+
+            // Compressed content is decompressed from the frame holding the start
+            qint64 begin = 0;
+            qint64 end = 0;
+            const qint64 size = content->size();
+            switch (byteRange(c->request(), fileItem.etag, size, begin, end)) {
+            case ByteRange::Whole:
+                if (cacheable && FileCache::admit(fileItem.id, fileItem.etag)) {
+                    // Missed before, so read whole and kept for the next time
+                    const QByteArray body = content->readAll();
+                    if (body.size() == size) {
+                        FileCache::insert(fileItem.id, fileItem.etag, body);
+                    }
+                    headers.setContentLength(body.size());
+                    res->setBody(body);
+                    break;
+                }
+                headers.setContentLength(size);
+                // TODO also use X-SENDFILE
+                res->setBody(content);
+                break;
+            case ByteRange::Part:
+            {
+                auto part = new RangeDevice(content, begin, end - begin, c);
+                part->open(QIODevice::ReadOnly);
+                res->setStatus(Response::PartialContent);
+                headers.setHeader(QStringLiteral("CONTENT_RANGE"),
+                                  QStringLiteral("bytes %1-%2/%3").arg(begin).arg(end - 1).arg(size));
+                headers.setContentLength(end - begin);
+                res->setBody(part);
+                break;
+            }
+            case ByteRange::Unsatisfiable:
+                res->setStatus(Response::RequestedRangeNotSatisfiable);
+                headers.setHeader(QStringLiteral("CONTENT_RANGE"), QStringLiteral("bytes */%1").arg(size));
+                break;
             }
         } else {
-            res->setStatus(Response::NotFound);
-            res->setBody(QByteArrayLiteral("Content not found."));
+            const QFileInfo info(resource);
+            if (fileItem.id && info.isDir() && zip) {
+                writeZip(c, fileItem, userId);
+                return;
+            } else if (fileItem.id && info.isDir()) {
+                res->setStatus(Response::MethodNotAllowed);
+                res->setBody(QByteArrayLiteral("This is the WebDAV interface. It can only be accessed by WebDAV clients."));
+            } else if (fileItem.id) {
+                FilesSqlAsync::remove(path, userId, c, [c] (int ret, const QString &error) {
+                    if (ret < 0) {
+                        qCDebug(WEBDAV_GET) << "GET -> delete sql error" << error;
+                        c->response()->setStatus(Response::InternalServerError);
+                    } else {
+                        c->response()->setStatus(Response::Gone);
+                    }
+                    c->attachAsync();
+                });
+                ReplicaRouter::pinWrite(userId);
+                return;
+            } else {
+                res->setStatus(Response::NotFound);
+                res->setBody(QByteArrayLiteral("Content not found."));
+            }
         }
-    }
+        c->attachAsync();
+    });
 }
 
 void Webdav::dav_DELETE(Context *c, const QStringList &pathParts)
@@ -134,26 +551,33 @@ void Webdav::dav_DELETE(Context *c, const QStringList &pathParts)
     qCDebug(WEBDAV_DELETE) << path << resource;
 
     Response *res = c->response();
-    QFileInfo info(resource);
-    if (info.exists()) {
-        if (removeDestination(info, res)) {
-            res->setStatus(Response::NoContent);
-            QString error;
-            if (sqlFilesDelete(path, Authentication::user(c).id(), error) < 0) {
-                qCWarning(WEBDAV_DELETE) << "sql error" << error;
-            }
+    bool exists;
+    {
+        ScopedTimer timer(RequestTrace::Fs);
+        QFileInfo info(resource);
+        exists = info.exists();
+        if (exists && !removeDestination(info, res)) {
+            return;
         }
-    } else {
-        QString error;
-        int ret = sqlFilesDelete(path, Authentication::user(c).id(), error);
+    }
+
+    const QVariant userId = Authentication::user(c).id();
+    c->detachAsync();
+    FilesSqlAsync::remove(path, userId, c, [c, exists] (int ret, const QString &error) {
+        Response *res = c->response();
         if (ret < 0) {
             qCWarning(WEBDAV_DELETE) << "sql error" << error;
-        } else if (ret == 0) {
+            if (exists) {
+                res->setStatus(Response::NoContent);
+            }
+        } else if (ret == 0 && !exists) {
             res->setStatus(Response::NotFound);
         } else {
             res->setStatus(Response::NoContent);
         }
-    }
+        c->attachAsync();
+    });
+    ReplicaRouter::pinWrite(userId);
 }
 
 void Webdav::dav_COPY(Context *c, const QStringList &pathParts)
@@ -161,6 +585,7 @@ void Webdav::dav_COPY(Context *c, const QStringList &pathParts)
     Request *req = c->request();
     const QString path = pathFiles(pathParts);
     const QString resource = resourcePath(c, pathParts);
+    const QVariant userId = Authentication::user(c).id();
 
     const QUrl destination(req->header(QStringLiteral("DESTINATION")));
     // match will usually be "webdav
@@ -183,85 +608,125 @@ void Webdav::dav_COPY(Context *c, const QStringList &pathParts)
         return;
     }
 
+    lookupPacked(c, QFileInfo::exists(resource) ? QString() : path, QFileInfo::exists(destResource) ? QString() : destPath, userId,
+                 [this, c, path, resource, destPathParts] (const FileItem &item, const FileItem &dest) {
+        copyResource(c, path, resource, destPathParts, item, dest);
+    });
+}
+
+void Webdav::copyResource(Context *c, const QString &path, const QString &resource, const QStringList &destPathParts,
+                          const FileItem &item, const FileItem &dest)
+{
+    Request *req = c->request();
+    Response *res = c->response();
+    const QVariant userId = Authentication::user(c).id();
+    const QString destPath = pathFiles(destPathParts);
+    const QString destResource = resourcePath(c, destPathParts);
+
     const QFileInfo origInfo(resource);
-    if (!origInfo.exists()) {
+    const bool packed = !origInfo.exists() && item.packId;
+    if (!origInfo.exists() && !packed) {
         res->setStatus(Response::NotFound);
         return;
     }
-    qCDebug(WEBDAV_COPY) << "COPY" << origInfo.absoluteFilePath() << origInfo.isDir() << origInfo.isFile();
+    qCDebug(WEBDAV_COPY) << "COPY" << origInfo.absoluteFilePath() << origInfo.isDir() << origInfo.isFile() << packed;
 
     const QFileInfo destInfo(destResource);
-    const bool overwrite = destInfo.exists();
+    const bool overwrite = destInfo.exists() || dest.id;
     if (overwrite) {
         if (req->header(QStringLiteral("OVERWRITE")) == QLatin1String("F")) {
-            qCDebug(WEBDAV_COPY) << "COPY: destination exists but overwrite is disallowed" << path << destPath << destination.path();
+            qCDebug(WEBDAV_COPY) << "COPY: destination exists but overwrite is disallowed" << path << destPath;
             res->setStatus(Response::PreconditionFailed);
             return;
         }
 
         qCDebug(WEBDAV_COPY) << "REMOVING destination" << destInfo.absoluteFilePath();
-        if (!removeDestination(destInfo, res)) {
+        if (destInfo.exists() && !removeDestination(destInfo, res)) {
             qCWarning(WEBDAV_COPY) << "Could NOT remove destination" << destInfo.absolutePath();
             res->setStatus(Response::PreconditionFailed);
             return;
         }
-
-        QString error;
-        int ret = sqlFilesDelete(destPath, Authentication::user(c).id(), error);
-        if (ret < 0) {
-            qCDebug(WEBDAV_COPY) << "DELETE sql error" << error;
-            res->setStatus(Response::InternalServerError);
-            return;
-        }
     }
 
-    if (origInfo.isFile()) {
-        QFile orig(origInfo.absoluteFilePath());
-        if (!orig.open(QIODevice::ReadOnly)) {
-            res->setStatus(Response::NotFound);
-            return;
-        }
-
-        if (orig.copy(destInfo.absoluteFilePath())) {
-            QString error;
-            if (sqlFilesCopy(path, destPathParts, Authentication::user(c).id(), error)) {
-                res->setStatus(overwrite ? Response::NoContent : Response::Created);
-            } else {
-                qCWarning(WEBDAV_COPY) << "Failed to create SQL entry on COPY" << error;
-                res->setBody(error);
-                res->setStatus(Response::InternalServerError);
-                QFile::remove(destInfo.absoluteFilePath());
-            }
-        } else {
+    const bool isFile = origInfo.isFile();
+    const QString origPath = origInfo.absoluteFilePath();
+    const QString destAbsPath = destInfo.absoluteFilePath();
+    {
+        ScopedTimer timer(RequestTrace::Fs);
+        if (packed) {
+            // Only in the database, the copy points at the same blob
             const QFileInfo destInfoPath(destInfo.absolutePath());
             if (!destInfoPath.exists() || !destInfoPath.isDir()) {
                 qCWarning(WEBDAV_COPY) << "Destination directory does not exists or is not a directory";
                 res->setStatus(Response::Conflict);
-            } else {
-                qCWarning(WEBDAV_COPY) << "Failed to COPY file" << path << "to" << destInfo.absoluteFilePath() << orig.errorString();
-                qCWarning(WEBDAV_COPY) << "Failed list" << destination << QDir(destInfo.absolutePath()).entryList();
+                return;
+            }
+        } else if (isFile) {
+            QFile orig(origPath);
+            if (!orig.open(QIODevice::ReadOnly)) {
+                res->setStatus(Response::NotFound);
+                return;
+            }
+
+            if (!orig.copy(destAbsPath)) {
+                const QFileInfo destInfoPath(destInfo.absolutePath());
+                if (!destInfoPath.exists() || !destInfoPath.isDir()) {
+                    qCWarning(WEBDAV_COPY) << "Destination directory does not exists or is not a directory";
+                    res->setStatus(Response::Conflict);
+                } else {
+                    qCWarning(WEBDAV_COPY) << "Failed to COPY file" << path << "to" << destAbsPath << orig.errorString();
+                    qCWarning(WEBDAV_COPY) << "Failed list" << destPath << QDir(destInfo.absolutePath()).entryList();
+                    res->setStatus(Response::InternalServerError);
+                }
+                return;
+            }
+        } else {
+            qCDebug(WEBDAV_COPY) << "COPY DIR" << origPath << destAbsPath;
+            if (!QDir().mkpath(destAbsPath)) {
+                qCWarning(WEBDAV_COPY) << "Could not create destination";
                 res->setStatus(Response::InternalServerError);
+                return;
             }
         }
-    } else {
-        const QString origPath = origInfo.absoluteFilePath();
-        const QString destAbsPath = destInfo.absoluteFilePath();
-        qCDebug(WEBDAV_COPY) << "COPY DIR" << origPath << destAbsPath;
-        QDir dir;
-        if (!dir.mkpath(destAbsPath)) {
-            qCWarning(WEBDAV_COPY) << "Could not create destination";
+    }
+
+    // Dropping the old destination and the copy are one batch, a single
+    // round trip on a pipelined connection
+    AsyncPgConnection *conn = AsyncPgConnection::thread();
+    c->detachAsync();
+    conn->beginBatch();
+    if (overwrite) {
+        FilesSqlAsync::remove(destPath, userId, c, FilesSqlAsync::RowsCallback());
+    }
+    sqlFilesCopy(path, destPathParts, userId, c, FilesSqlAsync::RowsCallback());
+    if (packed) {
+        FilesSqlAsync::copyPack(path, destPath, userId, c, FilesSqlAsync::RowsCallback());
+    }
+    const QString base = basePath(c);
+    conn->endBatch(c, [c, isFile, packed, path, base, userId, origPath, destAbsPath, overwrite] (AsyncPgResult &result) {
+        Response *res = c->response();
+        if (result.error()) {
+            qCWarning(WEBDAV_COPY) << "Failed to create SQL entry on COPY" << result.errorString();
+            res->setBody(result.errorString());
             res->setStatus(Response::InternalServerError);
+            if (isFile) {
+                QFile::remove(destAbsPath);
+            } else if (!packed) {
+                QDir().rmdir(destAbsPath);
+            }
+            c->attachAsync();
             return;
         }
 
-        QString error;
-        if (!sqlFilesCopy(path, destPathParts, Authentication::user(c).id(), error)) {
-            qCWarning(WEBDAV_COPY) << "Failed to create SQL entry on COPY" << error;
-            res->setBody(error);
-            res->setStatus(Response::InternalServerError);
-            dir.rmdir(destAbsPath);
+        if (isFile || packed) {
+            res->setStatus(overwrite ? Response::NoContent : Response::Created);
+            c->attachAsync();
+            return;
         }
 
+        // Entries are only copied once the tree is in the database
+        ScopedTimer timer(RequestTrace::Fs);
+        QDir dir;
         QDirIterator it(origPath, QDirIterator::Subdirectories);
         while (it.hasNext()) {
             QString next = it.next();
@@ -282,7 +747,31 @@ void Webdav::dav_COPY(Context *c, const QStringList &pathParts)
 //                qDebug() << "DIR sub file copy" << itemInfo.absoluteFilePath() << next << ret << file.errorString();
             }
         }
-    }
+
+        if (!QFileInfo::exists(PackStore::packDir(base))) {
+            c->attachAsync();
+            return;
+        }
+
+        // Packed entries are written out as plain files, to be picked up like the others
+        FilesSqlAsync::packedTree(path, userId, c, [c, base, path, destAbsPath] (const std::vector<FileItem> &items, const QString &error) {
+            if (!error.isEmpty()) {
+                qCWarning(WEBDAV_COPY) << "Failed to list packed files" << path << error;
+            }
+
+            ScopedTimer timer(RequestTrace::Fs);
+            for (const FileItem &item : items) {
+                QString readError;
+                std::unique_ptr<QIODevice> content(PackStore::open(base, item, readError));
+                QFile file(destAbsPath + item.path.mid(path.size()));
+                if (!content || !file.open(QIODevice::WriteOnly) || file.write(content->readAll()) != item.packLength) {
+                    qCWarning(WEBDAV_COPY) << "Failed to copy packed" << item.path << readError << file.errorString();
+                }
+            }
+            c->attachAsync();
+        });
+    });
+    ReplicaRouter::pinWrite(userId);
 }
 
 void Webdav::dav_MOVE(Context *c, const QStringList &pathParts)
@@ -302,6 +791,21 @@ void Webdav::dav_MOVE(Context *c, const QStringList &pathParts)
     const QStringList destPathParts = uriPathParts(rawDestPath);
     const QString destPath = pathFiles(destPathParts);
     const QString destResource = resourcePath(c, destPathParts);
+    const QString destName = destination.fileName(QUrl::FullyDecoded);
+
+    lookupPacked(c, QFileInfo::exists(resource) ? QString() : path, QFileInfo::exists(destResource) ? QString() : destPath, userId,
+                 [this, c, path, resource, destPathParts, destName] (const FileItem &item, const FileItem &dest) {
+        moveResource(c, path, resource, destPathParts, destName, item, dest);
+    });
+}
+
+void Webdav::moveResource(Context *c, const QString &path, const QString &resource, const QStringList &destPathParts,
+                          const QString &destName, const FileItem &item, const FileItem &dest)
+{
+    Request *req = c->request();
+    const QVariant userId = Authentication::user(c).id();
+    const QString destPath = pathFiles(destPathParts);
+    const QString destResource = resourcePath(c, destPathParts);
 
     qCDebug(WEBDAV_MOVE) << "MOVE" << resource << destResource;
     const QDir base = baseDir(c);
@@ -310,7 +814,7 @@ void Webdav::dav_MOVE(Context *c, const QStringList &pathParts)
     Response *res = c->response();
 
     QFileInfo destInfo(destResource);
-    bool overwrite = destInfo.exists();
+    bool overwrite = destInfo.exists() || dest.id;
     if (overwrite) {
         if (req->header(QStringLiteral("OVERWRITE")) == QLatin1String("F")) {
             qCDebug(WEBDAV_MOVE) << "MOVE: destination exists but overwrite is disallowed" << path << destResource;
@@ -318,70 +822,82 @@ void Webdav::dav_MOVE(Context *c, const QStringList &pathParts)
             return;
         }
 
-        if (!removeDestination(destInfo, res)) {
+        if (destInfo.exists() && !removeDestination(destInfo, res)) {
             qCWarning(WEBDAV_MOVE) << "Destination exists and could not be removed";
             res->setStatus(Response::InternalServerError);
             return;
         }
-
-        QString error;
-        int ret = sqlFilesDelete(destPath, userId, error);
-        if (ret < 0) {
-            qCWarning(WEBDAV_MOVE) << "DELETE sql error" << error;
-            res->setStatus(Response::InternalServerError);
-            return;
-        }
     }
 
-    QFileInfo srcInfo(resource);
-    qCDebug(WEBDAV_MOVE) << "MOVE info" << resource << srcInfo.isFile() << srcInfo.isDir();
-
-    if (srcInfo.isFile()) {
-        QFile file(resource);
-        if (file.rename(destResource)) {
-            QString error;
-            int ret = sqlFilesMove(base.relativeFilePath(resource), base.relativeFilePath(destResource), destination.fileName(QUrl::FullyDecoded), userId, error);
-            if (ret < 0) {
-                qCWarning(WEBDAV_MOVE) << "MOVE sql error" << error;
+    bool moved = false;
+    bool packed = false;
+    bool gone = false;
+    {
+        ScopedTimer timer(RequestTrace::Fs);
+        QFileInfo srcInfo(resource);
+        qCDebug(WEBDAV_MOVE) << "MOVE info" << resource << srcInfo.isFile() << srcInfo.isDir();
+
+        if (srcInfo.isFile()) {
+            QFile file(resource);
+            if (!file.rename(destResource)) {
+                qCWarning(WEBDAV_MOVE) << "MOVE failed" << file.errorString();
                 res->setStatus(Response::InternalServerError);
-                QFile::rename(destResource, resource);
+                res->setBody(file.errorString());
                 return;
             }
-            res->setStatus(overwrite ? Response::NoContent : Response::Created);
-        } else {
-            qCWarning(WEBDAV_MOVE) << "MOVE failed" << file.errorString();
-            res->setStatus(Response::InternalServerError);
-            res->setBody(file.errorString());
-        }
-
-    } else if (srcInfo.isDir()) {
-        QDir dir;
-        if (dir.rename(resource, destResource)) {
-            QString error;
-            int ret = sqlFilesMove(base.relativeFilePath(resource), base.relativeFilePath(destResource), destination.fileName(QUrl::FullyDecoded), userId, error);
-            if (ret < 0) {
-                qCWarning(WEBDAV_MOVE) << "MOVE sql error" << error;
+            moved = true;
+        } else if (srcInfo.isDir()) {
+            QDir dir;
+            if (!dir.rename(resource, destResource)) {
+                qCWarning(WEBDAV_MOVE) << "MOVE dir failed";
                 res->setStatus(Response::InternalServerError);
-                QFile::rename(destResource, resource);
                 return;
             }
-
-            res->setStatus(overwrite ? Response::NoContent : Response::Created);
-        } else {
-            qCWarning(WEBDAV_MOVE) << "MOVE dir failed";
-            res->setStatus(Response::InternalServerError);
+            moved = true;
+        } else if (!srcInfo.exists() && item.packId) {
+            // Only in the database, nothing to rename
+            if (!QFileInfo(destInfo.absolutePath()).isDir()) {
+                res->setStatus(Response::Conflict);
+                return;
+            }
+            packed = true;
+        } else if (!srcInfo.exists()) {
+            gone = true;
         }
-    } else if (!srcInfo.exists()) {
-        QString error;
-        int ret = sqlFilesDelete(path, userId, error);
-        if (ret < 0) {
-            qCWarning(WEBDAV_MOVE) << "MOVE sql error" << error;
+    }
+
+    // Dropping the old destination and the move are one batch, a single
+    // round trip on a pipelined connection
+    AsyncPgConnection *conn = AsyncPgConnection::thread();
+    c->detachAsync();
+    conn->beginBatch();
+    if (overwrite) {
+        FilesSqlAsync::remove(destPath, userId, c, FilesSqlAsync::RowsCallback());
+    }
+    if (moved) {
+        FilesSqlAsync::move(base.relativeFilePath(resource), base.relativeFilePath(destResource),
+                            destName, userId, c, FilesSqlAsync::RowsCallback());
+    } else if (packed) {
+        FilesSqlAsync::move(path, destPath, destName, userId, c, FilesSqlAsync::RowsCallback());
+    } else if (gone) {
+        FilesSqlAsync::remove(path, userId, c, FilesSqlAsync::RowsCallback());
+    }
+    conn->endBatch(c, [c, resource, destResource, overwrite, moved, packed, gone] (AsyncPgResult &result) {
+        Response *res = c->response();
+        if (result.error()) {
+            qCWarning(WEBDAV_MOVE) << "MOVE sql error" << result.errorString();
             res->setStatus(Response::InternalServerError);
-            return;
-        } else {
+            if (moved) {
+                QFile::rename(destResource, resource);
+            }
+        } else if (moved || packed) {
+            res->setStatus(overwrite ? Response::NoContent : Response::Created);
+        } else if (gone) {
             res->setStatus(Response::Gone);
         }
-    }
+        c->attachAsync();
+    });
+    ReplicaRouter::pinWrite(userId);
 }
 
 void Webdav::dav_MKCOL(Context *c, const QStringList &pathParts)
@@ -397,6 +913,7 @@ void Webdav::dav_MKCOL(Context *c, const QStringList &pathParts)
 
     const QString path = pathFiles(pathParts);
     const QString resource = resourcePath(c, pathParts);
+    ScopedTimer timer(RequestTrace::Fs);
     QDir dir(resource);
     if (dir.exists()) {
         res->setStatus(Response::MethodNotAllowed);
@@ -409,18 +926,24 @@ void Webdav::dav_MKCOL(Context *c, const QStringList &pathParts)
 
             const qint64 ocMTime = c->request()->header(QStringLiteral("X_OC_MTIME")).toLongLong();
 
-            QString error;
-            if (sqlFilesUpsert(pathParts, dirInfo, ocMTime, etag, Authentication::user(c).id(), error)) {
-                if (ocMTime) {
-                    c->response()->setHeader(QStringLiteral("X_OC_MTIME"), QStringLiteral("accepted"));
+            const QVariant userId = Authentication::user(c).id();
+            c->detachAsync();
+            sqlFilesUpsert(pathParts, dirInfo, -1, ocMTime, etag, userId, c,
+                           [c, ocMTime, resource] (int ret, const QString &error) {
+                if (ret >= 0) {
+                    if (ocMTime) {
+                        c->response()->setHeader(QStringLiteral("X_OC_MTIME"), QStringLiteral("accepted"));
+                    }
+                    c->response()->setStatus(Response::Created);
+                } else {
+                    c->response()->setStatus(Response::InternalServerError);
+                    c->response()->setBody(error);
+                    QDir().rmdir(resource);
+                    qCWarning(WEBDAV_MKCOL) << "error" << error;
                 }
-                c->response()->setStatus(Response::Created);
-            } else {
-                c->response()->setStatus(Response::InternalServerError);
-                c->response()->setBody(error);
-                dir.rmdir(resource);
-                qCWarning(WEBDAV_MKCOL) << "error" << error;
-            }
+                c->attachAsync();
+            });
+            ReplicaRouter::pinWrite(userId);
         } else {
             qCWarning(WEBDAV_MKCOL) << "failed to create" << path;
             res->setStatus(Response::Conflict);
@@ -455,57 +978,73 @@ void Webdav::dav_PUT(Context *c, const QStringList &pathParts)
         return;
     }
 
-    QFile file(resource);
-    bool exists = file.exists();
+    // Small new files go to the pack, one that is already a plain file stays one
+    QIODevice *body = req->body();
+    if (PackStore::fits(body->size()) && !QFileInfo::exists(resource)) {
+        body->seek(0);
+        const QByteArray content = body->readAll();
+        if (!content.startsWith(StoredFile::header())) {
+            putPacked(c, pathParts, content);
+            return;
+        }
+        body->seek(0);
+    }
 
+    ScopedTimer timer(RequestTrace::Fs);
     QCryptographicHash hash(QCryptographicHash::Md5);
 
+    // The body goes into the spool, on the same filesystem as the
+    // destination, and is renamed over it once complete
     QIODevice *uploadIO = req->body();
     auto tmp = qobject_cast<QTemporaryFile *>(uploadIO);
-    if (tmp) {
-        if (exists) {
-            file.remove();
-        }
-
-        if (!tmp->rename(resource)) {
-            qCWarning(WEBDAV_PUT) << "Could not rename temporary file" << tmp->errorString() << tmp->fileName() << resource;
-            tmp = nullptr;
-        } else {
-            char block[64 * 1024];
-            while (!tmp->atEnd()) {
-                qint64 in = tmp->read(block, sizeof(block));
-                if (in <= 0) {
-                    break;
-                }
-
-                hash.addData(block, in);
-            }
-            tmp->setAutoRemove(false);
-        }
+    std::unique_ptr<QTemporaryFile> spooled;
+    qint64 contentSize = -1;
+    if (compressAtRest(resource, uploadIO)) {
+        spooled.reset(spoolCompressed(uploadIO, hash));
     }
 
-    if (!tmp) {
-        if (!file.open(QFile::WriteOnly | QFile::Truncate)) {
-            qCWarning(WEBDAV_PUT) << "Could not open file for writting" << file.errorString();
-            c->response()->setStatus(Response::BadRequest);
+    if (spooled) {
+        // Hashed as it was compressed, the database gets the content size
+        contentSize = uploadIO->size();
+        tmp = spooled.get();
+    } else if (tmp && tmp->fileName().startsWith(m_spoolDir)) {
+        // Already spooled there by the engine, see SpoolDir in the README.
+        // Written back and dropped behind the hashing
+        IoPolicy policy(tmp, tmp->size(), IoPolicy::Write);
+        copyAndHash(tmp, nullptr, hash, &policy);
+    } else {
+        // Kept in memory by the engine, or spooled somewhere else
+        spooled.reset(new QTemporaryFile(m_spoolDir + QLatin1String("put-XXXXXX")));
+        if (!spooled->open()) {
+            qCWarning(WEBDAV_PUT) << "Could not create spool file" << spooled->errorString();
+            c->response()->setStatus(Response::InternalServerError);
             return;
         }
 
-        char block[64 * 1024];
-        while (!uploadIO->atEnd()) {
-            qint64 in = uploadIO->read(block, sizeof(block));
-            if (in <= 0) {
-                break;
-            }
-
-            if (file.write(block, in) != in) {
-                qCWarning(WEBDAV_PUT) << "Failed to write body";
-                break;
-            }
-            hash.addData(block, in);
+        const qint64 length = req->headers().contentLength();
+        IoPolicy::preallocate(spooled.get(), length);
+        IoPolicy policy(spooled.get(), length, IoPolicy::Write);
+        if (!copyAndHash(uploadIO, spooled.get(), hash, &policy) || !spooled->flush()) {
+            qCWarning(WEBDAV_PUT) << "Failed to write body" << spooled->errorString();
+            c->response()->setStatus(spooled->error() == QFileDevice::ResourceError ? Response::InsufficientStorage
+                                                                                     : Response::InternalServerError);
+            return;
         }
-        file.close();
+        tmp = spooled.get();
+    }
+
+    // An existing file is exchanged with the upload, so it can be put
+    // back if the metadata can't be updated
+    const QString spool = tmp->fileName();
+    const bool exists = QFile::exists(resource);
+    const bool exchanged = exists && exchangeFiles(spool, resource);
+    if (!exchanged && ::rename(QFile::encodeName(spool).constData(), QFile::encodeName(resource).constData()) != 0) {
+        const int error = errno;
+        qCWarning(WEBDAV_PUT) << "Could not rename spool file" << spool << resource << qt_error_string(error);
+        c->response()->setStatus(error == ENOENT ? Response::Conflict : Response::InternalServerError);
+        return;
     }
+    tmp->setAutoRemove(false);
 
     const QString etag = QString::fromLatin1(hash.result().toHex());
 
@@ -513,21 +1052,122 @@ void Webdav::dav_PUT(Context *c, const QStringList &pathParts)
 
     const qint64 ocMTime = c->request()->header(QStringLiteral("X_OC_MTIME")).toLongLong();
 
-    QString error;
-    if (sqlFilesUpsert(pathParts, info, ocMTime, etag, Authentication::user(c).id(), error)) {
-        if (ocMTime) {
-            c->response()->setHeader(QStringLiteral("X_OC_MTIME"), QStringLiteral("accepted"));
+    const QVariant userId = Authentication::user(c).id();
+    c->detachAsync();
+    sqlFilesUpsert(pathParts, info, contentSize, ocMTime, etag, userId, c,
+                   [c, ocMTime, etag, exists, exchanged, resource, spool] (int ret, const QString &error) {
+        if (ret >= 0) {
+            if (ocMTime) {
+                c->response()->setHeader(QStringLiteral("X_OC_MTIME"), QStringLiteral("accepted"));
+            }
+            c->response()->headers().setETag(etag);
+            c->response()->setStatus(exists ? Response::OK : Response::Created);
+            if (exchanged) {
+                QFile::remove(spool);
+            }
+        } else {
+            qCWarning(WEBDAV_PUT) << "put error" << error;
+            c->response()->setStatus(Response::InternalServerError);
+            c->response()->setBody(error);
+            if (exchanged) {
+                if (!exchangeFiles(spool, resource)) {
+                    qCWarning(WEBDAV_PUT) << "Could not put back" << resource << qt_error_string(errno);
+                }
+                QFile::remove(spool);
+            } else if (!exists) {
+                QFile::remove(resource);
+            }
         }
-        c->response()->headers().setETag(etag);
-        c->response()->setStatus(exists ? Response::OK : Response::Created);
-    } else {
-        qCWarning(WEBDAV_PUT) << "put error" << error;
-        c->response()->setStatus(Response::InternalServerError);
-        c->response()->setBody(error);
-        if (!exists) {
-            file.remove();
+        c->attachAsync();
+    });
+    ReplicaRouter::pinWrite(userId);
+}
+
+void Webdav::putPacked(Context *c, const QStringList &pathParts, const QByteArray &content)
+{
+    const QString path = pathFiles(pathParts);
+    const QString resource = resourcePath(c, pathParts);
+    const QFileInfo info(resource);
+    if (!QFileInfo(info.absolutePath()).isDir()) {
+        c->response()->setStatus(Response::Conflict);
+        return;
+    }
+
+    std::vector<PackStore::Blob> blobs;
+    {
+        ScopedTimer timer(RequestTrace::Fs);
+        QString error;
+        if (!PackStore::append(basePath(c), { content }, blobs, error)) {
+            qCWarning(WEBDAV_PUT) << "Failed to pack" << path << error;
+            c->response()->setStatus(Response::InternalServerError);
+            return;
         }
     }
+
+    const qint64 ocMTime = c->request()->header(QStringLiteral("X_OC_MTIME")).toLongLong();
+
+    FilePut put;
+    put.path = path;
+    put.parentPath = FilesSql::parentPath(path);
+    put.name = pathParts.last();
+    put.mimetype = FilesSql::mimetype(info);
+    put.etag = QString::fromLatin1(QCryptographicHash::hash(content, QCryptographicHash::Md5).toHex());
+    put.storageMtime = QDateTime::currentSecsSinceEpoch();
+    put.mtime = ocMTime ? ocMTime : put.storageMtime;
+    put.size = content.size();
+
+    // Whether it replaced a file, the row and its location are one batch
+    const QVariant userId = Authentication::user(c).id();
+    auto existed = std::make_shared<bool>(false);
+    AsyncPgConnection *conn = AsyncPgConnection::thread();
+    c->detachAsync();
+    conn->beginBatch();
+    FilesSqlAsync::lookup(path, userId, c, [existed] (int ret, const QString &error) {
+        Q_UNUSED(error)
+        *existed = ret > 0;
+    });
+    FilesSqlAsync::put(put, userId, c, FilesSqlAsync::RowsCallback());
+    FilesSqlAsync::setPack(path, blobs.front(), userId, c, FilesSqlAsync::RowsCallback());
+    const QString etag = put.etag;
+    conn->endBatch(c, [c, ocMTime, etag, existed] (AsyncPgResult &result) {
+        Response *res = c->response();
+        if (result.error()) {
+            // What was appended is left for PackCompactor
+            qCWarning(WEBDAV_PUT) << "put error" << result.errorString();
+            res->setStatus(Response::InternalServerError);
+            res->setBody(result.errorString());
+        } else {
+            if (ocMTime) {
+                res->setHeader(QStringLiteral("X_OC_MTIME"), QStringLiteral("accepted"));
+            }
+            res->headers().setETag(etag);
+            res->setStatus(*existed ? Response::OK : Response::Created);
+        }
+        c->attachAsync();
+    });
+    ReplicaRouter::pinWrite(userId);
+}
+
+void Webdav::lookupPacked(Context *c, const QString &path, const QString &destPath, const QVariant &userId,
+                          std::function<void (const FileItem &, const FileItem &)> callback)
+{
+    // Only files missing on disk can be packed, and only once there is a pack
+    if ((path.isEmpty() && destPath.isEmpty()) || !QFileInfo::exists(PackStore::packDir(basePath(c)))) {
+        callback(FileItem(), FileItem());
+        return;
+    }
+
+    auto item = std::make_shared<FileItem>();
+    c->detachAsync();
+    FilesSqlAsync::item(path, userId, c, [item] (const FileItem &fileItem, const QString &error) {
+        Q_UNUSED(error)
+        *item = fileItem;
+    });
+    FilesSqlAsync::item(destPath, userId, c, [c, item, callback] (const FileItem &dest, const QString &error) {
+        Q_UNUSED(error)
+        callback(*item, dest);
+        c->attachAsync();
+    });
 }
 
 void Webdav::dav_PROPFIND(Context *c, const QStringList &pathParts)
@@ -550,23 +1190,45 @@ void Webdav::dav_PROPFIND(Context *c, const QStringList &pathParts)
         return;
     }
 
-    Response *res = c->response();
-    res->setStatus(Response::MultiStatus);
-    res->setContentType(QStringLiteral("application/xml; charset=utf-8"));
+    const QString baseUri = QLatin1Char('/') + req->match() + QLatin1Char('/');
 
-    QXmlStreamWriter stream(res);
+    qCDebug(WEBDAV_PROPFIND) << "***********" << resourcePath(c, pathParts) << baseUri << path;
+    if (depth == -1) {
+        writePropFindNotFound(c, path);
+        return;
+    }
 
-    const QString baseUri = QLatin1Char('/') + req->match() + QLatin1Char('/');
+    const QVariant userId = Authentication::user(c).id();
+    c->detachAsync();
+    FilesSqlAsync::item(path, userId, c, [this, c, path, baseUri, props, depth, userId] (const FileItem &file, const QString &error) {
+        if (!file.id) {
+            qCDebug(WEBDAV_PROPFIND) << "Not found" << path << error;
+            writePropFindNotFound(c, path);
+            c->attachAsync();
+            return;
+        }
 
-    const QString resource = resourcePath(c, pathParts);
-    qCDebug(WEBDAV_PROPFIND) << "***********" << resource << baseUri << path;
-    if (depth != -1) {
-        const QVariant userId = Authentication::user(c).id();
-        QString error;
-        FileItem file = sqlFilesItem(path, userId, error);
+        const bool isDir = file.mimetype == QLatin1String("httpd/unix-directory");
+        qCDebug(WEBDAV_PROPFIND) << "DIR" << isDir << "DEPTH" << depth;
+
+        const bool listChildren = depth == 1 && isDir;
+        // Inline properties came with the items already, local ones are
+        // read while writing the response
+        const bool inlineProps = FilesSqlAsync::inlineProperties();
+        const bool localProps = !inlineProps && m_propStorage->hasLocalReads() && hasDeadProperties(props);
+        const bool wantsDead = !inlineProps && !m_propStorage->hasLocalReads() && hasDeadProperties(props);
+
+        auto files = std::make_shared<std::vector<FileItem>>(1, file);
+        auto deadProps = std::make_shared<PathPropertyHash>();
+
+        auto respond = [this, c, baseUri, props, files, deadProps, inlineProps, localProps] {
+            Response *res = c->response();
+            res->setStatus(Response::MultiStatus);
 
-        if (file.id) {
+            ScopedTimer timer(RequestTrace::Xml);
+            res->setContentType(QStringLiteral("application/xml; charset=utf-8"));
 
+            QXmlStreamWriter stream(res);
             stream.setAutoFormatting(m_autoFormatting);
             stream.writeStartDocument();
             stream.writeNamespace(QStringLiteral("DAV:"), QStringLiteral("d"));
@@ -574,64 +1236,505 @@ void Webdav::dav_PROPFIND(Context *c, const QStringList &pathParts)
 
             stream.writeStartElement(QStringLiteral("d:multistatus"));
 
-            writePropFindResponseItem(file, stream, baseUri, props);
+            for (const FileItem &item : *files) {
+                const PropertyValueHash dead = inlineProps ? item.properties :
+                                                             localProps ? m_propStorage->properties(item.id) : deadProps->value(item.id);
+                writePropFindResponseItem(item, stream, baseUri, props, dead);
+            }
+
+            stream.writeEndElement(); // multistatus
+
+            stream.writeEndDocument();
+            c->attachAsync();
+        };
 
-            const QString mime = file.mimetype;
-            bool isDir = mime == QLatin1String("httpd/unix-directory");
+        auto pending = std::make_shared<int>(int(listChildren) + int(wantsDead));
+        if (*pending == 0) {
+            respond();
+            return;
+        }
+        auto done = [pending, respond] {
+            if (--*pending == 0) {
+                respond();
+            }
+        };
 
-            qCDebug(WEBDAV_PROPFIND) << "DIR" << isDir << "DEPTH" << depth;
-            qCDebug(WEBDAV_PROPFIND) << "BASE" << req->match() << req->path();
-            if (depth == 1 && isDir) {
-                qint64 parentId = file.id;
-                qCDebug(WEBDAV_PROPFIND) << "DIR" << parentId;
+        auto gotProperties = [deadProps, done] (const PathPropertyHash &properties, const QString &error) {
+            if (!error.isEmpty()) {
+                qCWarning(WEBDAV_PROPFIND) << "FAILED to get properties" << error;
+            }
+            *deadProps = properties;
+            done();
+        };
+
+        // The listing and the dead properties don't depend on each other,
+        // so both go out in the same round trip. The property cache needs
+        // the ids first, the files it misses cost a second round trip.
+        const bool fromCache = listChildren && wantsDead && WebdavPgSqlPropertyStorage::cacheEnabled();
+        if (listChildren) {
+            qCDebug(WEBDAV_PROPFIND) << "DIR" << file.id;
+            FilesSqlAsync::children(file.id, userId, c, [c, userId, files, done, gotProperties, fromCache] (const std::vector<FileItem> &children, const QString &error) {
+                if (!error.isEmpty()) {
+                    qCWarning(WEBDAV_PROPFIND) << "FAILED to list children" << error;
+                }
+                files->insert(files->end(), children.begin(), children.end());
+                if (fromCache) {
+                    std::vector<qint64> ids;
+                    ids.reserve(files->size());
+                    for (const FileItem &item : *files) {
+                        ids.push_back(item.id);
+                    }
+                    FilesSqlAsync::properties(ids, userId, c, gotProperties);
+                }
+                done();
+            });
+        }
+
+        if (wantsDead && !fromCache) {
+            if (listChildren) {
+                FilesSqlAsync::childProperties(file.id, userId, c, gotProperties);
+            } else {
+                FilesSqlAsync::properties({ file.id }, userId, c, gotProperties);
+            }
+        }
+    });
+}
+
+void Webdav::dav_PROPPATCH(Context *c, const QStringList &pathParts)
+{
+    Request *req = c->request();
+    const QString path = pathFiles(pathParts);
+    qCDebug(WEBDAV_PROPPATCH) << path << req->body() << req->headers();
+
+    if (!req->body()) {
+        c->response()->setStatus(Response::BadRequest);
+        return;
+    }
+
+    const QVariant userId = Authentication::user(c).id();
+    c->detachAsync();
+    FilesSqlAsync::item(path, userId, c, [this, c, path, userId] (const FileItem &item, const QString &error) {
+        if (!item.id) {
+            qCWarning(WEBDAV_PROPPATCH) << "Not found" << path << error;
+            c->attachAsync();
+            return;
+        }
+
+        PropPatches updates;
+        if (!parsePropPatch(c, updates)) {
+            c->attachAsync();
+            return;
+        }
+
+        // All or nothing (RFC 4918 9.2), so every property shares one status
+        queuePropPatch(item.id, updates);
+        m_propStorage->commitAsync(c, [this, c, item, updates] (bool ok) {
+            if (ok) {
+                writePropPatchResponse(c, item, updates);
+            } else {
+                qCWarning(WEBDAV_PROPPATCH) << "Failed to store properties";
+                c->response()->setStatus(Response::InternalServerError);
+            }
+            c->attachAsync();
+        });
+        ReplicaRouter::pinWrite(userId);
+    });
+}
+
+void Webdav::bulk(Context *c)
+{
+    bool authenticated;
+    {
+        ScopedTimer timer(RequestTrace::Auth);
+        authenticated = Authentication::userExists(c) || Authentication::authenticate(c, QStringLiteral("Cloudlyst"));
+    }
+    if (!authenticated || !AdmissionControl::admit(c, Authentication::user(c).id(), QStringLiteral("/webdav/bulk"))) {
+        return;
+    }
+
+    Request *req = c->request();
+    Response *res = c->response();
+    if (!req->isPost()) {
+        res->setHeader(QStringLiteral("ALLOW"), QStringLiteral("POST"));
+        res->setStatus(Response::MethodNotAllowed);
+        return;
+    }
+
+    const QByteArray boundary = BulkUploadParser::boundary(req->header(QStringLiteral("CONTENT_TYPE")));
+    if (boundary.isEmpty() || !req->body()) {
+        qCWarning(WEBDAV_BULK) << "Not a multipart/related body" << req->header(QStringLiteral("CONTENT_TYPE"));
+        res->setStatus(Response::BadRequest);
+        return;
+    }
+
+    // Keyed by X-File-Path, as the client sent it
+    QJsonObject results;
+    auto failed = [&results] (const QString &davPath, const QString &message) {
+        qCDebug(WEBDAV_BULK) << "Failed" << davPath << message;
+        results.insert(davPath, QJsonObject{
+                           {QStringLiteral("error"), true},
+                           {QStringLiteral("message"), message},
+                       });
+    };
+
+    std::vector<FilePut> puts;
+    QStringList davPaths;
+    QHash<QString, int> putIndex;
+    auto swap = std::make_shared<SpoolSwap>();
+
+    const QString base = basePath(c);
+    BulkUploadParser parser(req->body(), boundary);
+    {
+        ScopedTimer timer(RequestTrace::Fs);
+        while (parser.next()) {
+            const QString davPath = QString::fromUtf8(parser.header(QByteArrayLiteral("x-file-path")));
+            const QByteArray md5 = parser.header(QByteArrayLiteral("x-file-md5")).toLower();
+            const QStringList pathParts = davPath.split(QLatin1Char('/'), QString::SkipEmptyParts);
+            if (pathParts.isEmpty() || pathParts.contains(QStringLiteral("..")) || pathParts.contains(QStringLiteral("."))) {
+                failed(davPath, QStringLiteral("Invalid X-File-Path"));
+                continue;
+            }
+            if (md5.isEmpty()) {
+                failed(davPath, QStringLiteral("Missing X-File-MD5"));
+                continue;
+            }
+
+            // Written to the spool and swapped with the destination, so a
+            // bad checksum or a failed put leaves an existing file alone
+            const QString path = pathFiles(pathParts);
+            const QString resource = base + path;
+            QTemporaryFile tmp(m_spoolDir + QLatin1String("bulk-XXXXXX"));
+            if (!tmp.open()) {
+                failed(davPath, tmp.errorString());
+                continue;
+            }
+
+            QCryptographicHash hash(QCryptographicHash::Md5);
+            if (!parser.readContent(&tmp, &hash)) {
+                break;
+            }
+            if (tmp.error() != QFile::NoError) {
+                failed(davPath, tmp.errorString());
+                continue;
+            }
+            tmp.close();
+
+            const QByteArray etag = hash.result().toHex();
+            if (etag != md5) {
+                failed(davPath, QStringLiteral("Computed md5 hash is incorrect"));
+                continue;
+            }
+
+            if (!swap->place(tmp.fileName(), resource)) {
+                failed(davPath, errno == ENOENT ? QStringLiteral("Parent folder not found") : qt_error_string(errno));
+                continue;
+            }
+            tmp.setAutoRemove(false);
+
+            const QFileInfo info(resource);
+            FilePut put;
+            put.path = path;
+            put.parentPath = FilesSql::parentPath(path);
+            put.name = pathParts.last();
+            put.mimetype = FilesSql::mimetype(info);
+            put.etag = QString::fromLatin1(etag);
+            put.storageMtime = info.lastModified().toSecsSinceEpoch();
+            const qint64 mtime = parser.header(QByteArrayLiteral("x-file-mtime")).toLongLong();
+            put.mtime = mtime ? mtime : put.storageMtime;
+            put.size = info.size();
+
+            // A path sent twice keeps what was written last
+            const int index = putIndex.value(path, -1);
+            if (index == -1) {
+                putIndex.insert(path, int(puts.size()));
+                puts.push_back(put);
+                davPaths.append(davPath);
+            } else {
+                puts[size_t(index)] = put;
+                davPaths[index] = davPath;
+            }
+        }
+    }
+
+    // What was written before a broken part still goes in, it is on disk
+    const QString parseError = parser.errorString();
+    if (!parseError.isEmpty()) {
+        qCWarning(WEBDAV_BULK) << "Malformed body" << parseError;
+    }
+
+    auto respond = [c, parseError] (const QJsonObject &results) {
+        Response *res = c->response();
+        if (!parseError.isEmpty()) {
+            res->setStatus(Response::BadRequest);
+        }
+        res->setJsonObjectBody(results);
+    };
+
+    if (puts.empty()) {
+        respond(results);
+        return;
+    }
+
+    const QVariant userId = Authentication::user(c).id();
+    c->detachAsync();
+    FilesSqlAsync::putBulk(puts, userId, c, [c, puts, davPaths, swap, results, respond, base] (const QHash<QString, qint64> &fileIds, const QString &error) {
+        QJsonObject ret = results;
+        for (size_t i = 0; i < puts.size(); ++i) {
+            const FilePut &put = puts[i];
+            const qint64 id = fileIds.value(put.path);
+            if (id) {
+                swap->commit(base + put.path);
+                ret.insert(davPaths.at(int(i)), QJsonObject{
+                               {QStringLiteral("error"), false},
+                               {QStringLiteral("etag"), put.etag},
+                               {QStringLiteral("fileid"), QString::number(id)},
+                           });
+            } else {
+                qCWarning(WEBDAV_BULK) << "put error" << put.path << error;
+                ret.insert(davPaths.at(int(i)), QJsonObject{
+                               {QStringLiteral("error"), true},
+                               {QStringLiteral("message"), error.isEmpty() ? QStringLiteral("Parent folder not found") : error},
+                           });
+                swap->rollback(base + put.path);
+            }
+        }
+        respond(ret);
+        c->attachAsync();
+    });
+    ReplicaRouter::pinWrite(userId);
+}
+
+void Webdav::tus(Context *c, const QStringList &pathParts)
+{
+    bool authenticated;
+    {
+        ScopedTimer timer(RequestTrace::Auth);
+        authenticated = Authentication::userExists(c) || Authentication::authenticate(c, QStringLiteral("Cloudlyst"));
+    }
+    if (!authenticated || !AdmissionControl::admit(c, Authentication::user(c).id(), QStringLiteral("/webdav/tus"))) {
+        return;
+    }
+
+    Request *req = c->request();
+    Response *res = c->response();
+    res->setHeader(QStringLiteral("TUS_RESUMABLE"), QStringLiteral("1.0.0"));
+
+    if (req->method() == QLatin1String("OPTIONS")) {
+        res->setHeader(QStringLiteral("TUS_VERSION"), QStringLiteral("1.0.0"));
+        res->setHeader(QStringLiteral("TUS_EXTENSION"), QStringLiteral("creation,termination"));
+        if (m_uploadMaxSize) {
+            res->setHeader(QStringLiteral("TUS_MAX_SIZE"), QString::number(m_uploadMaxSize));
+        }
+        res->setStatus(Response::NoContent);
+        return;
+    }
+
+    if (req->header(QStringLiteral("TUS_RESUMABLE")) != QLatin1String("1.0.0")) {
+        res->setHeader(QStringLiteral("TUS_VERSION"), QStringLiteral("1.0.0"));
+        res->setStatus(Response::PreconditionFailed);
+        return;
+    }
+
+    ScopedTimer timer(RequestTrace::Fs);
+    const QString base = basePath(c);
+    const QString uploads = base + QLatin1String(".uploads/");
+
+    if (pathParts.isEmpty()) {
+        if (!req->isPost()) {
+            res->setHeader(QStringLiteral("ALLOW"), QStringLiteral("OPTIONS, POST"));
+            res->setStatus(Response::MethodNotAllowed);
+            return;
+        }
+
+        bool ok;
+        TusUpload upload;
+        upload.length = req->header(QStringLiteral("UPLOAD_LENGTH")).toLongLong(&ok);
+        if (!ok || upload.length < 0) {
+            res->setStatus(Response::BadRequest);
+            return;
+        }
+        if (m_uploadMaxSize && upload.length > m_uploadMaxSize) {
+            res->setStatus(Response::RequestEntityTooLarge);
+            return;
+        }
+
+        const QHash<QString, QString> metadata = tusMetadata(req->header(QStringLiteral("UPLOAD_METADATA")));
+        const QStringList destParts = metadata.value(QStringLiteral("path")).split(QLatin1Char('/'), QString::SkipEmptyParts);
+        if (destParts.isEmpty() || destParts.contains(QStringLiteral("..")) || destParts.contains(QStringLiteral("."))) {
+            qCDebug(WEBDAV_TUS) << "Invalid path in Upload-Metadata" << metadata;
+            res->setStatus(Response::BadRequest);
+            return;
+        }
+        upload.path = pathFiles(destParts);
+        upload.mtime = metadata.value(QStringLiteral("mtime")).toLongLong();
+        upload.md5 = Md5().state();
+        if (!QFileInfo(QFileInfo(base + upload.path).absolutePath()).isDir()) {
+            res->setStatus(Response::Conflict);
+            return;
+        }
+
+        // Abandoned uploads are swept when their user starts a new one
+        QDir().mkpath(uploads);
+        const QDateTime expired = QDateTime::currentDateTimeUtc().addSecs(-m_uploadExpiry);
+        QDirIterator it(uploads, { QStringLiteral("tus-*.json") }, QDir::Files);
+        while (it.hasNext()) {
+            it.next();
+            if (it.fileInfo().lastModified() < expired) {
+                qCDebug(WEBDAV_TUS) << "Removing expired upload" << it.fileName();
+                QFile::remove(it.filePath().left(it.filePath().size() - 5));
+                QFile::remove(it.filePath());
+            }
+        }
+
+        const QString id = QString::fromLatin1(QUuid::createUuid().toRfc4122().toHex());
+        const QString data = uploads + QLatin1String("tus-") + id;
+        QFile file(data);
+        if (!file.open(QIODevice::WriteOnly) || !saveTus(data + QLatin1String(".json"), upload)) {
+            qCWarning(WEBDAV_TUS) << "Could not create upload" << data << file.errorString();
+            file.remove();
+            res->setStatus(Response::InternalServerError);
+            return;
+        }
+        // Allocated once, however many pieces it comes in
+        IoPolicy::preallocate(&file, upload.length);
+        file.close();
+        qCDebug(WEBDAV_TUS) << "Created" << id << upload.path << upload.length;
+
+        QUrl location = req->uri();
+        location.setPath(location.path() + (location.path().endsWith(QLatin1Char('/')) ? QString() : QStringLiteral("/")) + id);
+        location.setQuery(QString());
+        res->setHeader(QStringLiteral("LOCATION"), location.toString(QUrl::FullyEncoded));
+        res->setStatus(Response::Created);
+
+        // Nothing to PATCH, it is complete already
+        if (!upload.length) {
+            finishTus(c, base, data, upload, Response::Created);
+        }
+        return;
+    }
+
+    const QString id = pathParts.first();
+    static const QRegularExpression idRe(QStringLiteral("^[0-9a-f]{32}$"));
+    if (pathParts.size() != 1 || !idRe.match(id).hasMatch()) {
+        res->setStatus(Response::NotFound);
+        return;
+    }
+    const QString data = uploads + QLatin1String("tus-") + id;
+    const QString state = data + QLatin1String(".json");
+
+    TusUpload upload;
+    if (req->isHead()) {
+        if (!loadTus(state, upload)) {
+            res->setStatus(Response::NotFound);
+            return;
+        }
+        res->setHeader(QStringLiteral("UPLOAD_OFFSET"), QString::number(upload.offset));
+        res->setHeader(QStringLiteral("UPLOAD_LENGTH"), QString::number(upload.length));
+        res->setHeader(QStringLiteral("CACHE_CONTROL"), QStringLiteral("no-store"));
+        return;
+    }
+
+    const bool patch = req->method() == QLatin1String("PATCH");
+    if (!patch && !req->isDelete()) {
+        res->setHeader(QStringLiteral("ALLOW"), QStringLiteral("OPTIONS, HEAD, PATCH, DELETE"));
+        res->setStatus(Response::MethodNotAllowed);
+        return;
+    }
+    if (patch && req->header(QStringLiteral("CONTENT_TYPE")) != QLatin1String("application/offset+octet-stream")) {
+        res->setStatus(Response::UnsupportedMediaType);
+        return;
+    }
+
+    // The lock keeps requests for the same upload from interleaving, the
+    // state is read under it
+    QFile file(data);
+    if (!file.exists() || !file.open(QIODevice::ReadWrite | QIODevice::Append) || !loadTus(state, upload)) {
+        res->setStatus(Response::NotFound);
+        return;
+    }
+    if (::flock(file.handle(), LOCK_EX | LOCK_NB) != 0) {
+        res->setStatus(Response::Locked);
+        return;
+    }
+
+    if (!patch) {
+        qCDebug(WEBDAV_TUS) << "Terminated" << id;
+        file.remove();
+        QFile::remove(state);
+        res->setStatus(Response::NoContent);
+        return;
+    }
+
+    bool ok;
+    const qint64 offset = req->header(QStringLiteral("UPLOAD_OFFSET")).toLongLong(&ok);
+    if (!ok || offset != upload.offset) {
+        res->setHeader(QStringLiteral("UPLOAD_OFFSET"), QString::number(upload.offset));
+        res->setStatus(Response::Conflict);
+        return;
+    }
 
-                std::vector<FileItem> files = sqlFilesItems(parentId, error);
+    QIODevice *body = req->body();
+    const qint64 size = body ? body->size() : 0;
+    if (upload.offset + size > upload.length) {
+        res->setStatus(Response::RequestEntityTooLarge);
+        return;
+    }
 
-                for (const FileItem &file : files) {
-                    writePropFindResponseItem(file, stream, baseUri, props);
-                }
-            }
+    Md5 md5;
+    if (!md5.restoreState(upload.md5)) {
+        qCWarning(WEBDAV_TUS) << "Corrupt upload state" << state;
+        res->setStatus(Response::InternalServerError);
+        return;
+    }
 
-            stream.writeEndElement(); // multistatus
+    // Whatever a failed request left past the saved offset is dropped
+    if (file.size() != upload.offset && !file.resize(upload.offset)) {
+        qCWarning(WEBDAV_TUS) << "Could not truncate upload" << data << file.errorString();
+        res->setStatus(Response::InternalServerError);
+        return;
+    }
 
-            stream.writeEndDocument();
+    IoPolicy policy(&file, upload.length, IoPolicy::Write, upload.offset);
+    char block[64 * 1024];
+    qint64 written = 0;
+    while (written < size) {
+        const qint64 len = body->read(block, qMin(size - written, qint64(sizeof(block))));
+        if (len <= 0) {
+            break;
+        }
+        if (file.write(block, len) != len) {
+            qCWarning(WEBDAV_TUS) << "Failed to write upload" << data << file.errorString();
+            res->setStatus(file.error() == QFileDevice::ResourceError ? Response::InsufficientStorage : Response::InternalServerError);
             return;
         }
+        md5.addData(block, len);
+        written += len;
+        policy.advance(upload.offset + written);
     }
 
-    res->setStatus(Response::NotFound);
-
-    stream.setAutoFormatting(m_autoFormatting);
-    stream.writeStartDocument();
-    stream.writeNamespace(QStringLiteral("DAV:"), QStringLiteral("d"));
-    stream.writeNamespace(QStringLiteral("http://sabredav.org/ns"), QStringLiteral("s"));
-
-    stream.writeStartElement(QStringLiteral("d:error"));
-    stream.writeTextElement(QStringLiteral("s:exception"), QStringLiteral("Sabre\\DAV\\Exception\\NotFound"));
-    stream.writeTextElement(QStringLiteral("s:message"), QLatin1String("File with name ") + path + QLatin1String(" could not be located"));
-    stream.writeEndElement(); // error
-
-    stream.writeEndDocument();
-}
-
-void Webdav::dav_PROPPATCH(Context *c, const QStringList &pathParts)
-{
-    Request *req = c->request();
-    const QString path = pathFiles(pathParts);
-    qCDebug(WEBDAV_PROPPATCH) << path << req->body() << req->headers();
+    // Only what is on disk may be acknowledged
+    if (!file.flush() || ::fdatasync(file.handle()) != 0) {
+        qCWarning(WEBDAV_TUS) << "Failed to sync upload" << data << qt_error_string(errno);
+        res->setStatus(Response::InternalServerError);
+        return;
+    }
 
-    if (!req->body()) {
-        c->response()->setStatus(Response::BadRequest);
+    upload.offset += written;
+    upload.md5 = md5.state();
+    if (!saveTus(state, upload)) {
+        qCWarning(WEBDAV_TUS) << "Failed to save upload state" << state;
+        res->setStatus(Response::InternalServerError);
         return;
     }
+    qCDebug(WEBDAV_TUS) << "Patched" << id << upload.offset << "of" << upload.length;
 
-    QString error;
-    FileItem item = sqlFilesItem(path, Authentication::user(c).id(), error);
-    if (item.id) {
-        parsePropPatch(c, item.id);
-    } else {
-        qCWarning(WEBDAV_PROPPATCH) << "Not found" << path << error;
+    if (upload.offset == upload.length) {
+        finishTus(c, base, data, upload, Response::NoContent);
+        return;
     }
+
+    res->setHeader(QStringLiteral("UPLOAD_OFFSET"), QString::number(upload.offset));
+    res->setStatus(Response::NoContent);
 }
 
 bool Webdav::preFork(Application *app)
@@ -644,7 +1747,113 @@ bool Webdav::preFork(Application *app)
     qCDebug(WEBDAV_BASE) << "BASE" << m_baseDir;
     m_storageInfo.setPath(m_baseDir);
 
+    // Uploads are spooled next to the data, so they are renamed into place
+    // rather than copied across filesystems
+    m_spoolDir = app->config(QStringLiteral("SpoolDir"), m_baseDir + QLatin1String(".uploads")).toString();
+    if (!m_spoolDir.endsWith(QLatin1Char('/'))) {
+        m_spoolDir.append(QLatin1Char('/'));
+    }
+    if (!QDir().mkpath(m_spoolDir)) {
+        qCCritical(WEBDAV_BASE) << "Could not create SpoolDir" << m_spoolDir;
+        return false;
+    }
+
+    // Left behind by crashed workers, bodies still coming in are newer
+    const QDateTime orphaned = QDateTime::currentDateTimeUtc().addSecs(-3600);
+    QDirIterator spool(m_spoolDir, QDir::Files | QDir::Hidden);
+    while (spool.hasNext()) {
+        spool.next();
+        if (spool.fileInfo().lastModified() < orphaned && QFile::remove(spool.filePath())) {
+            qCDebug(WEBDAV_BASE) << "Removed orphaned spool file" << spool.fileName();
+        }
+    }
+
     m_autoFormatting = app->config(QStringLiteral("XmlAutoFormatting"), false).toBool();
+    m_watchDataDir = app->config(QStringLiteral("WatchDataDir"), false).toBool();
+    m_watchDebounce = app->config(QStringLiteral("WatchDebounce"), 500).toInt();
+    m_zipLevel = qBound(0, app->config(QStringLiteral("ZipDeflateLevel"), 1).toInt(), 9);
+    m_uploadExpiry = qMax(1, app->config(QStringLiteral("UploadExpiry"), 24).toInt()) * 3600;
+    m_uploadMaxSize = qMax(Q_INT64_C(0), app->config(QStringLiteral("UploadMaxSize"), 0).toLongLong());
+    IoPolicy::setup(app->config(QStringLiteral("IoPreallocateMin"), 1).toLongLong() * 1024 * 1024,
+                    app->config(QStringLiteral("IoStreamMin"), 64).toLongLong() * 1024 * 1024,
+                    app->config(QStringLiteral("IoWindow"), 8).toLongLong() * 1024 * 1024);
+
+    if (!FileCache::setup(app->config(QStringLiteral("FileCacheSize"), 0).toLongLong() * 1024 * 1024,
+                          app->config(QStringLiteral("FileCacheMaxFile"), 64).toLongLong() * 1024)) {
+        return false;
+    }
+
+    PackStore::setup(app->config(QStringLiteral("PackMaxSize"), 0).toLongLong(),
+                     app->config(QStringLiteral("PackSegmentSize"), 64).toLongLong() * 1024 * 1024);
+    m_packCompactInterval = app->config(QStringLiteral("PackCompactInterval"), 3600).toInt();
+    m_packCompactThreshold = app->config(QStringLiteral("PackCompactThreshold"), 0.5).toDouble();
+
+    const QString compression = app->config(QStringLiteral("Compression"), QStringLiteral("none")).toString();
+    if (compression == QLatin1String("zstd")) {
+#ifdef CLOUDLYST_HAS_ZSTD
+        m_compressionLevel = qBound(1, app->config(QStringLiteral("CompressionLevel"), 3).toInt(), 19);
+#else
+        qCCritical(WEBDAV_BASE) << "Compression=zstd needs Cloudlyst built with zstd";
+        return false;
+#endif
+    } else if (compression != QLatin1String("none")) {
+        qCCritical(WEBDAV_BASE) << "Unknown Compression" << compression;
+        return false;
+    }
+    m_compressionMinSize = app->config(QStringLiteral("CompressionMinSize"), 4096).toLongLong();
+    m_compressionMimetypes.clear();
+    const QStringList mimetypes = app->config(QStringLiteral("CompressionMimetypes"), QStringLiteral("text/plain")).toString()
+            .split(QLatin1Char(','), QString::SkipEmptyParts);
+    for (const QString &mimetype : mimetypes) {
+        m_compressionMimetypes.append(mimetype.trimmed());
+    }
+
+    const QString propertyStorage = app->config(QStringLiteral("PropertyStorage"), QStringLiteral("rows")).toString();
+    if (propertyStorage == QLatin1String("jsonb")) {
+        if (SqlQuery::driver() != SqlQuery::PostgreSQL) {
+            qCCritical(WEBDAV_BASE) << "PropertyStorage=jsonb needs PostgreSQL";
+            return false;
+        }
+        delete m_propStorage;
+        m_propStorage = new WebdavPgSqlPropertyStorage(WebdavPgSqlPropertyStorage::Jsonb, this);
+        FilesSqlAsync::setInlineProperties(true);
+#ifdef CLOUDLYST_HAS_LMDB
+    } else if (propertyStorage == QLatin1String("lmdb")) {
+        // The environment itself is opened in postFork()
+        delete m_propStorage;
+        m_propStorage = new WebdavLmdbPropertyStorage(this);
+        FilesSqlAsync::setRemovedHook([] (const std::vector<qint64> &fileIds) {
+            WebdavLmdbPropertyStorage::removeFiles(fileIds);
+        });
+#endif
+    } else if (propertyStorage != QLatin1String("rows")) {
+        qCCritical(WEBDAV_BASE) << "Unknown PropertyStorage" << propertyStorage;
+        return false;
+    } else if (!WebdavPgSqlPropertyStorage::setupCache(app->config(QStringLiteral("PropertyCacheSize"), 0).toInt())) {
+        return false;
+    }
+    return true;
+}
+
+bool Webdav::postFork(Application *app)
+{
+#ifdef CLOUDLYST_HAS_LMDB
+    if (qobject_cast<WebdavLmdbPropertyStorage *>(m_propStorage)) {
+        const QString path = app->config(QStringLiteral("PropertyLmdbPath"), m_baseDir + QLatin1String(".cloudlyst-properties")).toString();
+        const qint64 mapSize = app->config(QStringLiteral("PropertyLmdbMapSize"), 1024).toLongLong() * 1024 * 1024;
+        if (!WebdavLmdbPropertyStorage::open(path, mapSize)) {
+            return false;
+        }
+    }
+#else
+    Q_UNUSED(app)
+#endif
+    if (m_watchDataDir) {
+        FilesWatcher::startService(m_baseDir, m_watchDebounce);
+    }
+    if (m_packCompactInterval > 0) {
+        PackCompactor::startService(m_baseDir, m_packCompactInterval, m_packCompactThreshold);
+    }
     return true;
 }
 
@@ -696,23 +1905,16 @@ void Webdav::parsePropFindElement(QXmlStreamReader &xml, GetProperties &props)
 
 bool Webdav::parsePropFindRequest(Context *c, GetProperties &props)
 {
+    ScopedTimer timer(RequestTrace::Xml);
     Response *res = c->response();
 
     const QByteArray data = c->request()->body()->readAll();
     qCDebug(WEBDAV_PROPFIND) << "PROPS data" << data;
 //    qDebug() << "PROPS current" << m_pathProps[path];
 
-    QXmlStreamReader xml(data);
-    while (!xml.atEnd()) {
-        auto token = xml.readNext();
-//        qCDebug(WEBDAV_PROPFIND) << "PROPS token 1" <<  xml.tokenString() << xml.name();
-        if (token == QXmlStreamReader::StartElement && xml.name() == QLatin1String("propfind")) {
-            parsePropFindElement(xml, props);
-        }
-    }
-
-    if (xml.hasError()) {
-        qCWarning(WEBDAV_PROPFIND) << "PROPS parse error" << xml.errorString();
+    QString error;
+    if (!parsePropFindData(data, props, error)) {
+        qCWarning(WEBDAV_PROPFIND) << "PROPS parse error" << error;
 
         res->setStatus(Response::BadRequest);
 
@@ -724,7 +1926,7 @@ bool Webdav::parsePropFindRequest(Context *c, GetProperties &props)
 
         stream.writeStartElement(QStringLiteral("d:error"));
         stream.writeTextElement(QStringLiteral("s:exception"), QStringLiteral("Sabre\\DAV\\Exception\\NotFound"));
-        stream.writeTextElement(QStringLiteral("s:message"), xml.errorString());
+        stream.writeTextElement(QStringLiteral("s:message"), error);
         stream.writeEndElement(); // error
 
         stream.writeEndDocument();
@@ -734,7 +1936,26 @@ bool Webdav::parsePropFindRequest(Context *c, GetProperties &props)
     return true;
 }
 
-bool Webdav::parsePropPatchValue(QXmlStreamReader &xml, qint64 path, bool set)
+bool Webdav::parsePropFindData(const QByteArray &data, GetProperties &props, QString &error)
+{
+    QXmlStreamReader xml(data);
+    while (!xml.atEnd()) {
+        auto token = xml.readNext();
+//        qCDebug(WEBDAV_PROPFIND) << "PROPS token 1" <<  xml.tokenString() << xml.name();
+        if (token == QXmlStreamReader::StartElement && xml.name() == QLatin1String("propfind")) {
+            parsePropFindElement(xml, props);
+        }
+    }
+
+    if (xml.hasError()) {
+        error = xml.errorString();
+        return false;
+    }
+
+    return true;
+}
+
+bool Webdav::parsePropPatchValue(QXmlStreamReader &xml, PropPatches &updates, bool set)
 {
     int depth = 0;
     while (!xml.atEnd()) {
@@ -743,12 +1964,13 @@ bool Webdav::parsePropPatchValue(QXmlStreamReader &xml, qint64 path, bool set)
         if (type == QXmlStreamReader::StartElement) {
             const QString name = xml.name().toString();
             if (set) {
+                const QString ns = xml.namespaceUri().toString();
                 const QString value = xml.readElementText(QXmlStreamReader::QXmlStreamReader::SkipChildElements);
                 qCDebug(WEBDAV_PROPPATCH) << "NEW PROP" << name << value << xml.tokenString();
-                m_propStorage->setValue(path, WebdavPropertyStorage::propertyKey(xml.name(), xml.namespaceUri()), value);
+                updates.push_back(PropPatch{ name, ns, value, true });
             } else {
                 qCDebug(WEBDAV_PROPPATCH) << "DELETE PROP ";
-                m_propStorage->remove(path, WebdavPropertyStorage::propertyKey(xml.name(), xml.namespaceUri()));
+                updates.push_back(PropPatch{ name, xml.namespaceUri().toString(), QString(), false });
                 xml.skipCurrentElement();
             }
             ++depth;
@@ -761,7 +1983,7 @@ bool Webdav::parsePropPatchValue(QXmlStreamReader &xml, qint64 path, bool set)
     return false;
 }
 
-bool Webdav::parsePropPatchProperty(QXmlStreamReader &xml, qint64 path, bool set)
+bool Webdav::parsePropPatchProperty(QXmlStreamReader &xml, PropPatches &updates, bool set)
 {
     while (!xml.atEnd()) {
         QXmlStreamReader::TokenType type = xml.readNext();
@@ -769,7 +1991,7 @@ bool Webdav::parsePropPatchProperty(QXmlStreamReader &xml, qint64 path, bool set
         if (type == QXmlStreamReader::StartElement) {
             if (xml.name() == QLatin1String("prop")) {
 //                qCDebug(WEBDAV_PROPPATCH) << "PROPS prop" ;
-                if (!parsePropPatchValue(xml, path, set)) {
+                if (!parsePropPatchValue(xml, updates, set)) {
                     return false;
                 }
                 continue;
@@ -782,7 +2004,7 @@ bool Webdav::parsePropPatchProperty(QXmlStreamReader &xml, qint64 path, bool set
     return true;
 }
 
-void Webdav::parsePropPatchUpdate(QXmlStreamReader &xml, qint64 path)
+void Webdav::parsePropPatchUpdate(QXmlStreamReader &xml, PropPatches &updates)
 {
     while (!xml.atEnd()) {
         QXmlStreamReader::TokenType type = xml.readNext();
@@ -790,10 +2012,10 @@ void Webdav::parsePropPatchUpdate(QXmlStreamReader &xml, qint64 path)
         if (type == QXmlStreamReader::StartElement) {
             if (xml.name() == QLatin1String("set")) {
                 qCDebug(WEBDAV_PROPPATCH) << "PROPS set" ;
-                parsePropPatchProperty(xml, path, true);
+                parsePropPatchProperty(xml, updates, true);
             } else if (xml.name() == QLatin1String("remove")) {
                 qCDebug(WEBDAV_PROPPATCH) << "PROPS remove";
-                parsePropPatchProperty(xml, path, false);
+                parsePropPatchProperty(xml, updates, false);
             }
         } else if (type == QXmlStreamReader::EndElement) {
             return;
@@ -801,22 +2023,47 @@ void Webdav::parsePropPatchUpdate(QXmlStreamReader &xml, qint64 path)
     }
 }
 
-bool Webdav::parsePropPatch(Context *c, qint64 path)
+bool Webdav::parsePropPatch(Context *c, PropPatches &updates)
 {
+    ScopedTimer timer(RequestTrace::Xml);
     Response *res = c->response();
 
     const QByteArray data = c->request()->body()->readAll();
     qCDebug(WEBDAV_PROPPATCH) << "PROP PATCH data" << data;
 
-    m_propStorage->begin();
+    QString error;
+    if (!parsePropPatchData(data, updates, error)) {
+        qCWarning(WEBDAV_PROPPATCH) << "PROPS parse error" << error;
 
+        res->setStatus(Response::BadRequest);
+
+        QXmlStreamWriter stream(res);
+        stream.setAutoFormatting(m_autoFormatting);
+        stream.writeStartDocument();
+        stream.writeNamespace(QStringLiteral("DAV:"), QStringLiteral("d"));
+        stream.writeNamespace(QStringLiteral("http://sabredav.org/ns"), QStringLiteral("s"));
+
+        stream.writeStartElement(QStringLiteral("d:error"));
+        stream.writeTextElement(QStringLiteral("s:exception"), QStringLiteral("Sabre\\DAV\\Exception\\NotFound"));
+        stream.writeTextElement(QStringLiteral("s:message"), error);
+        stream.writeEndElement(); // error
+
+        stream.writeEndDocument();
+        return false;
+    }
+
+    return true;
+}
+
+bool Webdav::parsePropPatchData(const QByteArray &data, PropPatches &updates, QString &error)
+{
     QXmlStreamReader xml(data);
     while (!xml.atEnd()) {
         QXmlStreamReader::TokenType type = xml.readNext();
 
 //        qCDebug(WEBDAV_PROPPATCH) << "PROPS token 1" << type <<  xml.tokenString() << xml.name() << xml.text() << xml.namespaceUri();
         if (type == QXmlStreamReader::StartElement && xml.name() == QLatin1String("propertyupdate")) {
-            parsePropPatchUpdate(xml, path);
+            parsePropPatchUpdate(xml, updates);
             qCDebug(WEBDAV_PROPPATCH) << "parsePropPatchUpdate finished" << xml.tokenType() << xml.tokenString() << xml.atEnd() << xml.hasError() << xml.errorString();
 //            QXmlStreamReader::TokenType type = xml.readNext();
 //            qWarning() << "parsePropPatchUpdate finished2" << type << xml.tokenType() << xml.tokenString() << xml.atEnd() << xml.hasError() << xml.errorString();
@@ -824,31 +2071,70 @@ bool Webdav::parsePropPatch(Context *c, qint64 path)
     }
 
     if (xml.hasError()) {
-        qCWarning(WEBDAV_PROPPATCH) << "PROPS parse error" << xml.errorString();
-        m_propStorage->rollback();
+        error = xml.errorString();
+        return false;
+    }
 
-        res->setStatus(Response::BadRequest);
+    return true;
+}
 
-        QXmlStreamWriter stream(res);
-        stream.setAutoFormatting(m_autoFormatting);
-        stream.writeStartDocument();
-        stream.writeNamespace(QStringLiteral("DAV:"), QStringLiteral("d"));
-        stream.writeNamespace(QStringLiteral("http://sabredav.org/ns"), QStringLiteral("s"));
+void Webdav::queuePropPatch(qint64 fileId, const PropPatches &updates)
+{
+    // Queued by the storage until commit, so they go out as one statement
+    m_propStorage->begin();
+    for (const PropPatch &update : updates) {
+        const QString key = WebdavPropertyStorage::propertyKey(update.name, update.ns);
+        if (update.set) {
+            m_propStorage->setValue(fileId, key, update.value);
+        } else {
+            m_propStorage->remove(fileId, key);
+        }
+    }
+}
 
-        stream.writeStartElement(QStringLiteral("d:error"));
-        stream.writeTextElement(QStringLiteral("s:exception"), QStringLiteral("Sabre\\DAV\\Exception\\NotFound"));
-        stream.writeTextElement(QStringLiteral("s:message"), xml.errorString());
-        stream.writeEndElement(); // error
+void Webdav::writePropPatchResponse(Context *c, const FileItem &file, const PropPatches &updates)
+{
+    Response *res = c->response();
+    res->setStatus(Response::MultiStatus);
 
-        stream.writeEndDocument();
-        return false;
+    ScopedTimer timer(RequestTrace::Xml);
+    res->setContentType(QStringLiteral("application/xml; charset=utf-8"));
+
+    QXmlStreamWriter stream(res);
+    stream.setAutoFormatting(m_autoFormatting);
+    stream.writeStartDocument();
+    stream.writeNamespace(QStringLiteral("DAV:"), QStringLiteral("d"));
+    stream.writeNamespace(QStringLiteral("http://sabredav.org/ns"), QStringLiteral("s"));
+
+    stream.writeStartElement(QStringLiteral("d:multistatus"));
+    stream.writeStartElement(QStringLiteral("d:response"));
+    const QString baseUri = QLatin1Char('/') + c->request()->match() + QLatin1Char('/');
+    stream.writeTextElement(QStringLiteral("d:href"), baseUri + file.path.midRef(6));
+
+    stream.writeStartElement(QStringLiteral("d:propstat"));
+    stream.writeStartElement(QStringLiteral("d:prop"));
+
+    QSet<QString> written;
+    for (const PropPatch &update : updates) {
+        const QString key = WebdavPropertyStorage::propertyKey(update.name, update.ns);
+        if (!written.contains(key)) {
+            written.insert(key);
+            stream.writeEmptyElement(update.ns, update.name);
+        }
     }
-    m_propStorage->commit();
 
-    return true;
+    stream.writeEndElement(); // prop
+    stream.writeTextElement(QStringLiteral("d:status"), QStringLiteral("HTTP/1.1 200 OK"));
+    stream.writeEndElement(); // propstat
+
+    stream.writeEndElement(); // response
+    stream.writeEndElement(); // multistatus
+
+    stream.writeEndDocument();
 }
 
-void Webdav::writePropFindResponseItem(const FileItem &file, QXmlStreamWriter &stream, const QString &baseUri, const GetProperties &props)
+void Webdav::writePropFindResponseItem(const FileItem &file, QXmlStreamWriter &stream, const QString &baseUri, const GetProperties &props,
+                                       const PropertyValueHash &deadProps)
 {
     const QString path = file.path;
 
@@ -933,29 +2219,12 @@ void Webdav::writePropFindResponseItem(const FileItem &file, QXmlStreamWriter &s
         propsNotFound.insert(WebdavPropertyStorage::propertyKey(pData.name, pData.ns), pData);
     }
 
-    // avoid doing SQL calls as much as possible
-    if (!propsNotFound.empty()) {
-        QSqlQuery query = CPreparedSqlQueryThreadForDB(QStringLiteral("SELECT name, value "
-                                                                      "FROM cloudlyst.file_properties "
-                                                                      "WHERE file_id = :file_id"),
-                                                       QStringLiteral("cloudlyst"));
-        query.bindValue(QStringLiteral(":file_id"), file.id);
-
-        if (query.exec()) {
-            while (query.next()) {
-                const QString key = query.value(0).toString();
-
-                auto it = propsNotFound.constFind(key);
-                if (it != propsNotFound.constEnd()) {
-                    const Property &pData = it.value();
-                    const QString value = query.value(1).toString();
-                    qWarning() << "FOUND property" << key << value;
-                    stream.writeTextElement(pData.ns, pData.name, value);
-                    propsNotFound.erase(it);
-                }
-            }
-        } else {
-            qCWarning(WEBDAV_PROPFIND) << "FAILED to exec" << query.lastError().databaseText();
+    for (auto it = deadProps.constBegin(); it != deadProps.constEnd() && !propsNotFound.empty(); ++it) {
+        auto propIt = propsNotFound.constFind(it.key());
+        if (propIt != propsNotFound.constEnd()) {
+            const Property &pData = propIt.value();
+            stream.writeTextElement(pData.ns, pData.name, it.value());
+            propsNotFound.erase(propIt);
         }
     }
 
@@ -982,6 +2251,104 @@ void Webdav::writePropFindResponseItem(const FileItem &file, QXmlStreamWriter &s
     stream.writeEndElement(); // response
 }
 
+bool Webdav::copyAndHash(QIODevice *in, QIODevice *out, QCryptographicHash &hash, IoPolicy *policy)
+{
+    char block[64 * 1024];
+    qint64 total = 0;
+    while (!in->atEnd()) {
+        const qint64 len = in->read(block, sizeof(block));
+        if (len <= 0) {
+            break;
+        }
+
+        if (out && out->write(block, len) != len) {
+            return false;
+        }
+        hash.addData(block, int(len));
+
+        total += len;
+        if (policy) {
+            policy->advance(total);
+        }
+    }
+    return true;
+}
+
+bool Webdav::compressAtRest(const QString &resource, QIODevice *body) const
+{
+    if (!m_compressionLevel) {
+        return false;
+    }
+
+    // Content that looks compressed at rest is stored compressed whatever
+    // its type, so it reads back as it was written
+    if (body->peek(StoredFile::HeaderSize) == StoredFile::header()) {
+        return true;
+    } else if (body->size() < m_compressionMinSize) {
+        return false;
+    }
+
+    QMimeDatabase db;
+    const QMimeType mime = db.mimeTypeForFile(resource, QMimeDatabase::MatchExtension);
+    for (const QString &type : m_compressionMimetypes) {
+        if (mime.inherits(type)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+QTemporaryFile *Webdav::spoolCompressed(QIODevice *body, QCryptographicHash &hash)
+{
+#ifdef CLOUDLYST_HAS_ZSTD
+    const bool always = body->peek(StoredFile::HeaderSize) == StoredFile::header();
+    const qint64 length = body->size();
+
+    std::unique_ptr<QTemporaryFile> spooled(new QTemporaryFile(m_spoolDir + QLatin1String("put-XXXXXX")));
+    ZstdWriter writer(spooled.get(), m_compressionLevel);
+    if (spooled->open() && writer.open(QIODevice::WriteOnly) && copyAndHash(body, &writer, hash) &&
+            writer.finish() && spooled->flush()) {
+        // Not worth decompressing on every read for less than an eighth
+        if (always || spooled->size() <= length - length / 8) {
+            return spooled.release();
+        }
+        qCDebug(WEBDAV_PUT) << "Storing uncompressed" << length << spooled->size();
+    } else {
+        qCWarning(WEBDAV_PUT) << "Failed to compress body" << spooled->errorString() << writer.errorString();
+    }
+
+    // Spooled as it is instead
+    hash.reset();
+    body->seek(0);
+#else
+    Q_UNUSED(body)
+    Q_UNUSED(hash)
+#endif
+    return nullptr;
+}
+
+void Webdav::writeZip(Context *c, const FileItem &dir, const QVariant &userId)
+{
+    Response *res = c->response();
+    Headers &headers = res->headers();
+    headers.setContentType(QStringLiteral("application/zip"));
+    headers.setContentDispositionAttachment(dir.name + QLatin1String(".zip"));
+    // The size is only known once everything was written
+    headers.setHeader(QStringLiteral("TRANSFER_ENCODING"), QStringLiteral("chunked"));
+
+    auto download = std::make_shared<ZipDownload>(res, m_zipLevel);
+    download->base = basePath(c);
+    download->userId = userId;
+    download->deflate = m_zipLevel > 0;
+    // Entries are named from the downloaded directory on
+    const QString parentPath = FilesSql::parentPath(dir.path);
+    download->prefixSize = parentPath.isEmpty() ? 0 : parentPath.size() + 1;
+
+    download->zip.addDirectory(dir.path.mid(download->prefixSize), dir.mtime);
+    download->dirs.push_back(dir);
+    pumpZip(c, download);
+}
+
 bool Webdav::removeDestination(const QFileInfo &info, Response *res)
 {
     if (info.isFile()) {
@@ -1004,166 +2371,79 @@ bool Webdav::removeDestination(const QFileInfo &info, Response *res)
     return false;
 }
 
-bool Webdav::sqlFilesUpsert(const QStringList &pathParts, const QFileInfo &info, qint64 mTime, const QString &etag, const QVariant &userId, QString &error)
+void Webdav::writePropFindNotFound(Context *c, const QString &path)
 {
-    const QString path = pathFiles(pathParts);
-    const QString parentPath = pathFiles(pathParts.mid(0, pathParts.size() - 1));
-    qCDebug(WEBDAV_SQL) << "SQL UPSERT" << path << parentPath << etag << userId;
-    QSqlQuery query = CPreparedSqlQueryThreadForDB(
-                QStringLiteral("SELECT cloudlyst_put"
-                               "(:path, :name, :parent_path, :mtime, :storage_mtime, :mimetype, :size, :etag, :owner_id)"),
-                QStringLiteral("cloudlyst"));
-
-    query.bindValue(QStringLiteral(":path"), path);
-    query.bindValue(QStringLiteral(":parent_path"), parentPath);
-    query.bindValue(QStringLiteral(":name"), info.fileName());
-    if (mTime) {
-        query.bindValue(QStringLiteral(":mtime"), mTime);
-    } else {
-        query.bindValue(QStringLiteral(":mtime"), info.lastModified().toSecsSinceEpoch());
-    }
-
-    query.bindValue(QStringLiteral(":storage_mtime"), info.lastModified().toSecsSinceEpoch());
-
-    if (info.isDir()) {
-        query.bindValue(QStringLiteral(":mimetype"), QStringLiteral("httpd/unix-directory"));
-        query.bindValue(QStringLiteral(":size"), 0);
-    } else {
-        const QMimeType mime = m_db.mimeTypeForFile(info);
-        query.bindValue(QStringLiteral(":mimetype"), mime.name());
-        query.bindValue(QStringLiteral(":size"), info.size());
-    }
+    Response *res = c->response();
+    res->setStatus(Response::NotFound);
+    res->setContentType(QStringLiteral("application/xml; charset=utf-8"));
 
-    query.bindValue(QStringLiteral(":etag"), etag);
-    query.bindValue(QStringLiteral(":owner_id"), userId);
+    QXmlStreamWriter stream(res);
+    stream.setAutoFormatting(m_autoFormatting);
+    stream.writeStartDocument();
+    stream.writeNamespace(QStringLiteral("DAV:"), QStringLiteral("d"));
+    stream.writeNamespace(QStringLiteral("http://sabredav.org/ns"), QStringLiteral("s"));
 
-    if (query.exec()) {
-        return true;
-    } else {
-        error = query.lastError().databaseText();
-        return false;
-    }
-}
+    stream.writeStartElement(QStringLiteral("d:error"));
+    stream.writeTextElement(QStringLiteral("s:exception"), QStringLiteral("Sabre\\DAV\\Exception\\NotFound"));
+    stream.writeTextElement(QStringLiteral("s:message"), QLatin1String("File with name ") + path + QLatin1String(" could not be located"));
+    stream.writeEndElement(); // error
 
-bool Webdav::sqlFilesCopy(const QString &path, const QStringList &destPathParts, const QVariant &userId, QString &error)
-{
-    const QString destPath = pathFiles(destPathParts);
-    const QString destParentPath = pathFiles(destPathParts.mid(0, destPathParts.size() - 1));
-    const QString destName = destPathParts.last();
-    qCDebug(WEBDAV_SQL) << "SQL COPY" << path << "TO" << destParentPath << destPath << destName << userId;
-    QSqlQuery query = CPreparedSqlQueryThreadForDB(
-                QStringLiteral("SELECT cloudlyst_copy"
-                               "(:path, :dest_parent_path, :dest_path, :dest_name, :owner_id)"),
-                QStringLiteral("cloudlyst"));
-
-    query.bindValue(QStringLiteral(":path"), path);
-    query.bindValue(QStringLiteral(":dest_parent_path"), destParentPath);
-    query.bindValue(QStringLiteral(":dest_path"), destPath);
-    query.bindValue(QStringLiteral(":dest_name"), destName);
-    query.bindValue(QStringLiteral(":owner_id"), userId);
-
-    if (query.exec()) {
-        return true;
-    } else {
-        error = query.lastError().databaseText();
-        return false;
-    }
+    stream.writeEndDocument();
 }
 
-bool Webdav::sqlFilesMove(const QString &path, const QString &destPath, const QString &destName, const QVariant &userId, QString &error)
+bool Webdav::hasDeadProperties(const GetProperties &props)
 {
-    QSqlQuery query = CPreparedSqlQueryThreadForDB(
-                QStringLiteral("SELECT cloudlyst_move(:path, :destPath, :destName, :owner_id)"),
-                QStringLiteral("cloudlyst"));
-
-    query.bindValue(QStringLiteral(":path"), path);
-    query.bindValue(QStringLiteral(":destPath"), destPath);
-    query.bindValue(QStringLiteral(":destName"), destName);
-    query.bindValue(QStringLiteral(":owner_id"), userId);
-
-    if (query.exec()) {
-        return query.numRowsAffected();
-    } else {
-        error = query.lastError().databaseText();
-        return -1;
+    // Everything writePropFindResponseItem() answers without the database
+    static const QSet<QString> live = [] {
+        const QString davNS = QStringLiteral("DAV:");
+        const QString ocNS = QStringLiteral("http://owncloud.org/ns");
+        return QSet<QString>{
+            WebdavPropertyStorage::propertyKey(QStringLiteral("quota-used-bytes"), davNS),
+            WebdavPropertyStorage::propertyKey(QStringLiteral("quota-available-bytes"), davNS),
+            WebdavPropertyStorage::propertyKey(QStringLiteral("getcontenttype"), davNS),
+            WebdavPropertyStorage::propertyKey(QStringLiteral("getlastmodified"), davNS),
+            WebdavPropertyStorage::propertyKey(QStringLiteral("getcontentlength"), davNS),
+            WebdavPropertyStorage::propertyKey(QStringLiteral("getetag"), davNS),
+            WebdavPropertyStorage::propertyKey(QStringLiteral("resourcetype"), davNS),
+            WebdavPropertyStorage::propertyKey(QStringLiteral("id"), ocNS),
+            WebdavPropertyStorage::propertyKey(QStringLiteral("downloadURL"), ocNS),
+            WebdavPropertyStorage::propertyKey(QStringLiteral("permissions"), ocNS),
+            WebdavPropertyStorage::propertyKey(QStringLiteral("data-fingerprint"), ocNS),
+            WebdavPropertyStorage::propertyKey(QStringLiteral("share-types"), ocNS),
+            WebdavPropertyStorage::propertyKey(QStringLiteral("dDC"), ocNS),
+            WebdavPropertyStorage::propertyKey(QStringLiteral("checksums"), ocNS),
+        };
+    }();
+
+    for (const Property &prop : props) {
+        if (!live.contains(WebdavPropertyStorage::propertyKey(prop.name, prop.ns))) {
+            return true;
+        }
     }
+    return false;
 }
 
-int Webdav::sqlFilesDelete(const QString &path, const QVariant &userId, QString &error)
+void Webdav::sqlFilesUpsert(const QStringList &pathParts, const QFileInfo &info, qint64 size, qint64 mTime, const QString &etag, const QVariant &userId,
+                            QObject *receiver, FilesSqlAsync::RowsCallback callback)
 {
-    QSqlQuery query = CPreparedSqlQueryThreadForDB(
-                QStringLiteral("DELETE FROM cloudlyst.files WHERE path = :path AND owner_id = :owner_id"),
-                QStringLiteral("cloudlyst"));
-
-    query.bindValue(QStringLiteral(":path"), path);
-    query.bindValue(QStringLiteral(":owner_id"), userId);
+    const QString path = pathFiles(pathParts);
+    qCDebug(WEBDAV_SQL) << "SQL UPSERT" << path << etag << userId;
 
-    if (query.exec()) {
-        return query.numRowsAffected();
-    } else {
-        error = query.lastError().databaseText();
-        return -1;
-    }
+    FilesSqlAsync::upsert(path, info, size, mTime, etag, userId, receiver, callback);
 }
 
-FileItem Webdav::sqlFilesItem(const QString &path, const QVariant &userId, QString &error)
+void Webdav::sqlFilesCopy(const QString &path, const QStringList &destPathParts, const QVariant &userId,
+                          QObject *receiver, FilesSqlAsync::RowsCallback callback)
 {
-    FileItem ret;
-
-    QSqlQuery query = CPreparedSqlQueryThreadForDB(
-                QStringLiteral("SELECT f.id, f.path, f.name, f.size, m.name, f.etag, f.mtime "
-                               "FROM cloudlyst.files f "
-                               "INNER JOIN  cloudlyst.mimetypes m ON m.id = f.mimetype_id "
-                               "WHERE f.path = :path AND f.owner_id = :owner_id"),
-                QStringLiteral("cloudlyst"));
-
-    query.bindValue(QStringLiteral(":path"), path);
-    query.bindValue(QStringLiteral(":owner_id"), userId);
-
-    if (query.exec() && query.next()) {
-        ret.id = query.value(0).toLongLong();
-        ret.path = query.value(1).toString();
-        ret.name = query.value(2).toString();
-        ret.size = query.value(3).toLongLong();
-        ret.mimetype = query.value(4).toString();
-        ret.etag = query.value(5).toString();
-        ret.mtime = query.value(6).toLongLong();
-    } else {
-        error = query.lastError().databaseText();
-        return ret;
-    }
-}
+    const QString destPath = pathFiles(destPathParts);
+    const QString destParentPath = pathFiles(destPathParts.mid(0, destPathParts.size() - 1));
+    const QString destName = destPathParts.last();
+    qCDebug(WEBDAV_SQL) << "SQL COPY" << path << "TO" << destParentPath << destPath << destName << userId;
 
-std::vector<FileItem> Webdav::sqlFilesItems(qint64 parentId, QString &error)
-{
-    std::vector<FileItem> rets;
-    QSqlQuery query = CPreparedSqlQueryThreadForDB(
-                QStringLiteral("SELECT f.id, f.path, f.name, f.size, m.name, f.etag, f.mtime "
-                               "FROM cloudlyst.files f "
-                               "INNER JOIN cloudlyst.mimetypes m ON m.id = f.mimetype_id "
-                               "WHERE parent_id = :parent_id"),
-                QStringLiteral("cloudlyst"));
-    query.bindValue(QStringLiteral(":parent_id"), parentId);
-
-    if (query.exec()) {
-        while (query.next()) {
-            FileItem ret;
-            ret.id = query.value(0).toLongLong();
-            ret.path = query.value(1).toString();
-            ret.name = query.value(2).toString();
-            ret.size = query.value(3).toLongLong();
-            ret.mimetype = query.value(4).toString();
-            ret.etag = query.value(5).toString();
-            ret.mtime = query.value(6).toLongLong();
-            rets.push_back(ret);
-        }
-    } else {
-        error = query.lastError().databaseText();
-        return rets;
-    }
+    FilesSqlAsync::copy(path, destParentPath, destPath, destName, userId, receiver, callback);
 }
 
-QString Webdav::pathFiles(const QStringList &pathParts) const
+QString Webdav::pathFiles(const QStringList &pathParts)
 {
     if (pathParts.isEmpty()) {
         return QStringLiteral("files");
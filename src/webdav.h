@@ -3,36 +3,41 @@
 
 #include <Cutelyst/Controller>
 
-#include <QMimeDatabase>
 #include <QStorageInfo>
 
+#include <functional>
+
+#include "filessql.h"
+#include "filessqlasync.h"
+
 using namespace Cutelyst;
 
 typedef QHash<QString, std::pair<QString, QString> > Properties;
 
-struct FileItem
+struct Property
 {
-    QString path;
     QString name;
-    QString etag;
-    QString mimetype;
-    qint64 mtime = -1;
-    qint64 id = 0;
-    qint64 size = -1;
+    QString ns;
 };
+typedef QVector<Property> GetProperties;
 
-struct Property
+struct PropPatch
 {
     QString name;
     QString ns;
+    QString value;
+    bool set;
 };
-typedef QVector<Property> GetProperties;
+typedef QVector<PropPatch> PropPatches;
 
 class QDir;
-class QSqlQuery;
 class QFileInfo;
 class QXmlStreamReader;
 class QXmlStreamWriter;
+class QCryptographicHash;
+class QIODevice;
+class QTemporaryFile;
+class IoPolicy;
 class WebdavPropertyStorage;
 class Webdav : public Controller
 {
@@ -79,39 +84,79 @@ public:
     C_ATTR(dav_PROPPATCH, :Private)
     void dav_PROPPATCH(Context *c, const QStringList &pathParts);
 
+    // Nextcloud bulk upload, many small files in one multipart POST
+    C_ATTR(bulk, :Private)
+    void bulk(Context *c);
+
+    // Resumable uploads, the tus 1.0 core protocol with creation and termination
+    C_ATTR(tus, :Private)
+    void tus(Context *c, const QStringList &pathParts);
+
     virtual bool preFork(Application *app) override final;
 
+    virtual bool postFork(Application *app) override final;
+
 private:
+    friend class BenchWebdav;
+
 //    C_ATTR(End, :Private)
 //    void End(Context *c) { Q_UNUSED(c); }
 
     void parsePropFindPropElement(QXmlStreamReader &xml, GetProperties &props);
     void parsePropFindElement(QXmlStreamReader &xml, GetProperties &props);
     bool parsePropFindRequest(Context *c, GetProperties &props);
-
-    bool parsePropPatchValue(QXmlStreamReader &xml, qint64 path, bool set);
-    bool parsePropPatchProperty(QXmlStreamReader &xml, qint64 path, bool set);
-    void parsePropPatchUpdate(QXmlStreamReader &xml, qint64 path);
-    bool parsePropPatch(Context *c, qint64 path);
-    void writePropFindResponseItem(const FileItem &file, QXmlStreamWriter &stream, const QString &baseUri, const GetProperties &props);
+    bool parsePropFindData(const QByteArray &data, GetProperties &props, QString &error);
+
+    bool parsePropPatchValue(QXmlStreamReader &xml, PropPatches &updates, bool set);
+    bool parsePropPatchProperty(QXmlStreamReader &xml, PropPatches &updates, bool set);
+    void parsePropPatchUpdate(QXmlStreamReader &xml, PropPatches &updates);
+    bool parsePropPatch(Context *c, PropPatches &updates);
+    bool parsePropPatchData(const QByteArray &data, PropPatches &updates, QString &error);
+    void queuePropPatch(qint64 fileId, const PropPatches &updates);
+    void writePropPatchResponse(Context *c, const FileItem &file, const PropPatches &updates);
+    void writePropFindResponseItem(const FileItem &file, QXmlStreamWriter &stream, const QString &baseUri, const GetProperties &props,
+                                   const PropertyValueHash &deadProps);
+    void writePropFindNotFound(Context *c, const QString &path);
+    static bool hasDeadProperties(const GetProperties &props);
+    static bool copyAndHash(QIODevice *in, QIODevice *out, QCryptographicHash &hash, IoPolicy *policy = nullptr);
     bool removeDestination(const QFileInfo &info, Response *res);
-
-    bool sqlFilesUpsert(const QStringList &pathParts, const QFileInfo &info, qint64 mTime, const QString &etag, const QVariant &userId, QString &error);
-    bool sqlFilesCopy(const QString &path, const QStringList &destPathParts, const QVariant &userId, QString &error);
-    bool sqlFilesMove(const QString &path, const QString &destPath, const QString &destName, const QVariant &userId, QString &error);
-    int sqlFilesDelete(const QString &path, const QVariant &userId, QString &error);
-    FileItem sqlFilesItem(const QString &path, const QVariant &userId, QString &error);
-    std::vector<FileItem> sqlFilesItems(qint64 parentId, QString &error);
-
-    inline QString pathFiles(const QStringList &pathParts) const;
+    bool compressAtRest(const QString &resource, QIODevice *body) const;
+    QTemporaryFile *spoolCompressed(QIODevice *body, QCryptographicHash &hash);
+    void writeZip(Context *c, const FileItem &dir, const QVariant &userId);
+
+    void putPacked(Context *c, const QStringList &pathParts, const QByteArray &content);
+    // The database items of \p path and \p destPath, for files that may only be in the pack
+    void lookupPacked(Context *c, const QString &path, const QString &destPath, const QVariant &userId,
+                      std::function<void (const FileItem &item, const FileItem &dest)> callback);
+    void copyResource(Context *c, const QString &path, const QString &resource, const QStringList &destPathParts,
+                      const FileItem &item, const FileItem &dest);
+    void moveResource(Context *c, const QString &path, const QString &resource, const QStringList &destPathParts,
+                      const QString &destName, const FileItem &item, const FileItem &dest);
+
+    void sqlFilesUpsert(const QStringList &pathParts, const QFileInfo &info, qint64 size, qint64 mTime, const QString &etag, const QVariant &userId,
+                        QObject *receiver, FilesSqlAsync::RowsCallback callback);
+    void sqlFilesCopy(const QString &path, const QStringList &destPathParts, const QVariant &userId,
+                      QObject *receiver, FilesSqlAsync::RowsCallback callback);
+
+    static QString pathFiles(const QStringList &pathParts);
     inline QString basePath(Context *c) const;
     inline QDir baseDir(Context *c) const;
     inline QString resourcePath(Context *c, const QStringList &pathParts) const;
-    inline QStringList uriPathParts(const QString &path);
+    static QStringList uriPathParts(const QString &path);
 
-    QMimeDatabase m_db;
     QString m_baseDir;
+    QString m_spoolDir;
     bool m_autoFormatting = true;
+    bool m_watchDataDir = false;
+    int m_watchDebounce = 500;
+    int m_zipLevel = 1;
+    int m_uploadExpiry = 24 * 3600;
+    qint64 m_uploadMaxSize = 0;
+    int m_compressionLevel = 0;
+    qint64 m_compressionMinSize = 4096;
+    QStringList m_compressionMimetypes;
+    int m_packCompactInterval = 3600;
+    double m_packCompactThreshold = 0.5;
     QStorageInfo m_storageInfo;
     WebdavPropertyStorage *m_propStorage;
 };
@@ -0,0 +1,334 @@
+#include "webdavlmdbpropertystorage.h"
+
+#include <QDir>
+#include <QFile>
+#include <QMutex>
+#include <QtEndian>
+#include <QLoggingCategory>
+
+#include <lmdb.h>
+
+#include <string.h>
+#include <unistd.h>
+
+Q_LOGGING_CATEGORY(WEBDAV_LMDB, "webdav.lmdb", QtWarningMsg)
+
+namespace {
+
+const size_t FileIdSize = sizeof(quint64);
+
+QMutex envMutex;
+MDB_env *env = nullptr;
+MDB_dbi dbi = 0;
+pid_t envPid = 0;
+
+// A read transaction and cursor per thread, reset between reads so they
+// don't pin old pages, and renewed rather than allocated again
+struct ReadTxn {
+    ~ReadTxn() {
+        if (cursor) {
+            mdb_cursor_close(cursor);
+        }
+        if (txn) {
+            mdb_txn_abort(txn);
+        }
+    }
+
+    MDB_txn *txn = nullptr;
+    MDB_cursor *cursor = nullptr;
+};
+
+thread_local ReadTxn readTxn;
+
+QByteArray fileKey(qint64 file_id, const QString &key = QString())
+{
+    const QByteArray name = key.toUtf8();
+    QByteArray ret(int(FileIdSize) + name.size(), Qt::Uninitialized);
+    qToBigEndian(quint64(file_id), ret.data());
+    memcpy(ret.data() + FileIdSize, name.constData(), size_t(name.size()));
+    return ret;
+}
+
+inline MDB_val toVal(const QByteArray &data)
+{
+    MDB_val ret;
+    ret.mv_size = size_t(data.size());
+    ret.mv_data = const_cast<char *>(data.constData());
+    return ret;
+}
+
+inline bool sameFile(const MDB_val &key, const QByteArray &prefix)
+{
+    return key.mv_size >= FileIdSize && memcmp(key.mv_data, prefix.constData(), FileIdSize) == 0;
+}
+
+}
+
+WebdavLmdbPropertyStorage::WebdavLmdbPropertyStorage(QObject *parent) : WebdavPropertyStorage(parent)
+{
+
+}
+
+bool WebdavLmdbPropertyStorage::open(const QString &path, qint64 mapSize)
+{
+    QMutexLocker locker(&envMutex);
+    if (env) {
+        // An environment must not be used across fork()
+        if (envPid != getpid()) {
+            qCCritical(WEBDAV_LMDB) << "Environment was opened before forking" << path;
+            return false;
+        }
+        return true;
+    }
+
+    if (!QDir().mkpath(path)) {
+        qCCritical(WEBDAV_LMDB) << "Failed to create" << path;
+        return false;
+    }
+
+    MDB_env *newEnv;
+    int rc = mdb_env_create(&newEnv);
+    if (rc != MDB_SUCCESS) {
+        qCCritical(WEBDAV_LMDB) << "Failed to create environment" << mdb_strerror(rc);
+        return false;
+    }
+
+    // Every thread of every worker keeps a reader slot, MDB_NOTLS ties
+    // them to our transactions rather than to the threads
+    mdb_env_set_maxreaders(newEnv, 1024);
+    rc = mdb_env_set_mapsize(newEnv, size_t(mapSize));
+    if (rc == MDB_SUCCESS) {
+        rc = mdb_env_open(newEnv, QFile::encodeName(path).constData(), MDB_NOTLS, 0660);
+    }
+    if (rc != MDB_SUCCESS) {
+        qCCritical(WEBDAV_LMDB) << "Failed to open" << path << mdb_strerror(rc);
+        mdb_env_close(newEnv);
+        return false;
+    }
+
+    // Slots left behind by workers that died
+    int stale = 0;
+    mdb_reader_check(newEnv, &stale);
+    if (stale) {
+        qCWarning(WEBDAV_LMDB) << "Cleared" << stale << "stale readers";
+    }
+
+    MDB_txn *txn;
+    rc = mdb_txn_begin(newEnv, nullptr, 0, &txn);
+    if (rc == MDB_SUCCESS) {
+        rc = mdb_dbi_open(txn, nullptr, 0, &dbi);
+        if (rc == MDB_SUCCESS) {
+            rc = mdb_txn_commit(txn);
+        } else {
+            mdb_txn_abort(txn);
+        }
+    }
+    if (rc != MDB_SUCCESS) {
+        qCCritical(WEBDAV_LMDB) << "Failed to open the database" << path << mdb_strerror(rc);
+        mdb_env_close(newEnv);
+        return false;
+    }
+
+    env = newEnv;
+    envPid = getpid();
+    qCDebug(WEBDAV_LMDB) << "Opened" << path << "map size" << mapSize;
+    return true;
+}
+
+bool WebdavLmdbPropertyStorage::isOpen()
+{
+    return env;
+}
+
+bool WebdavLmdbPropertyStorage::begin()
+{
+    m_transaction = true;
+    m_changes.clear();
+    return true;
+}
+
+bool WebdavLmdbPropertyStorage::commit()
+{
+    m_transaction = false;
+    const QVector<Change> changes = m_changes;
+    m_changes.clear();
+
+    return apply(changes);
+}
+
+bool WebdavLmdbPropertyStorage::rollback()
+{
+    m_transaction = false;
+    m_changes.clear();
+    return true;
+}
+
+bool WebdavLmdbPropertyStorage::setValue(qint64 file_id, const QString &key, const QString &value)
+{
+    const Change change{ file_id, key, value, false };
+    if (m_transaction) {
+        m_changes.push_back(change);
+        return true;
+    }
+    return apply({ change });
+}
+
+bool WebdavLmdbPropertyStorage::remove(qint64 file_id, const QString &key)
+{
+    const Change change{ file_id, key, QString(), true };
+    if (m_transaction) {
+        m_changes.push_back(change);
+        return true;
+    }
+    return apply({ change });
+}
+
+PropertyValueHash WebdavLmdbPropertyStorage::properties(qint64 file_id)
+{
+    PropertyValueHash ret;
+    forEachProperty(file_id, [&ret] (const char *key, size_t keySize, const char *value, size_t valueSize) {
+        ret.insert(QString::fromUtf8(key, int(keySize)), QString::fromUtf8(value, int(valueSize)));
+    });
+    return ret;
+}
+
+bool WebdavLmdbPropertyStorage::forEachProperty(qint64 file_id, PropertyVisitor visitor)
+{
+    if (!env) {
+        return false;
+    }
+
+    int rc;
+    if (readTxn.txn) {
+        rc = mdb_txn_renew(readTxn.txn);
+        if (rc == MDB_SUCCESS) {
+            rc = mdb_cursor_renew(readTxn.txn, readTxn.cursor);
+        }
+    } else {
+        rc = mdb_txn_begin(env, nullptr, MDB_RDONLY, &readTxn.txn);
+        if (rc == MDB_SUCCESS) {
+            rc = mdb_cursor_open(readTxn.txn, dbi, &readTxn.cursor);
+            if (rc != MDB_SUCCESS) {
+                mdb_txn_abort(readTxn.txn);
+                readTxn.txn = nullptr;
+            }
+        }
+    }
+    if (rc != MDB_SUCCESS) {
+        qCWarning(WEBDAV_LMDB) << "Failed to start a read transaction" << mdb_strerror(rc);
+        return false;
+    }
+
+    const QByteArray prefix = fileKey(file_id);
+    MDB_val key = toVal(prefix);
+    MDB_val value;
+    rc = mdb_cursor_get(readTxn.cursor, &key, &value, MDB_SET_RANGE);
+    while (rc == MDB_SUCCESS && sameFile(key, prefix)) {
+        visitor(static_cast<const char *>(key.mv_data) + FileIdSize, key.mv_size - FileIdSize,
+                static_cast<const char *>(value.mv_data), value.mv_size);
+        rc = mdb_cursor_get(readTxn.cursor, &key, &value, MDB_NEXT);
+    }
+    mdb_txn_reset(readTxn.txn);
+
+    if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) {
+        qCWarning(WEBDAV_LMDB) << "Failed to read properties of" << file_id << mdb_strerror(rc);
+        return false;
+    }
+    return true;
+}
+
+bool WebdavLmdbPropertyStorage::removeFiles(const std::vector<qint64> &fileIds)
+{
+    if (!env || fileIds.empty()) {
+        return env;
+    }
+
+    MDB_txn *txn;
+    int rc = mdb_txn_begin(env, nullptr, 0, &txn);
+    if (rc != MDB_SUCCESS) {
+        qCWarning(WEBDAV_LMDB) << "Failed to start a write transaction" << mdb_strerror(rc);
+        return false;
+    }
+
+    MDB_cursor *cursor = nullptr;
+    rc = mdb_cursor_open(txn, dbi, &cursor);
+
+    for (auto it = fileIds.cbegin(); rc == MDB_SUCCESS && it != fileIds.cend(); ++it) {
+        const QByteArray prefix = fileKey(*it);
+        MDB_val key = toVal(prefix);
+        MDB_val value;
+        // After a delete the cursor already sits on the next entry, which MDB_NEXT returns
+        rc = mdb_cursor_get(cursor, &key, &value, MDB_SET_RANGE);
+        while (rc == MDB_SUCCESS && sameFile(key, prefix)) {
+            rc = mdb_cursor_del(cursor, 0);
+            if (rc == MDB_SUCCESS) {
+                rc = mdb_cursor_get(cursor, &key, &value, MDB_NEXT);
+            }
+        }
+        if (rc == MDB_NOTFOUND) {
+            rc = MDB_SUCCESS;
+        }
+    }
+
+    if (cursor) {
+        mdb_cursor_close(cursor);
+    }
+    if (rc == MDB_SUCCESS) {
+        rc = mdb_txn_commit(txn);
+    } else {
+        mdb_txn_abort(txn);
+    }
+
+    if (rc != MDB_SUCCESS) {
+        qCWarning(WEBDAV_LMDB) << "Failed to remove properties of" << fileIds.size() << "files" << mdb_strerror(rc);
+        return false;
+    }
+    return true;
+}
+
+bool WebdavLmdbPropertyStorage::apply(const QVector<Change> &changes)
+{
+    if (!env) {
+        return false;
+    }
+    if (changes.isEmpty()) {
+        return true;
+    }
+
+    // One write transaction, LMDB has a single writer per environment
+    // so all of them are applied under one lock and one sync
+    MDB_txn *txn;
+    int rc = mdb_txn_begin(env, nullptr, 0, &txn);
+    if (rc != MDB_SUCCESS) {
+        qCWarning(WEBDAV_LMDB) << "Failed to start a write transaction" << mdb_strerror(rc);
+        return false;
+    }
+
+    for (const Change &change : changes) {
+        const QByteArray keyData = fileKey(change.fileId, change.key);
+        MDB_val key = toVal(keyData);
+        if (change.remove) {
+            rc = mdb_del(txn, dbi, &key, nullptr);
+            if (rc == MDB_NOTFOUND) {
+                rc = MDB_SUCCESS;
+            }
+        } else {
+            const QByteArray valueData = change.value.toUtf8();
+            MDB_val value = toVal(valueData);
+            rc = mdb_put(txn, dbi, &key, &value, 0);
+        }
+
+        if (rc != MDB_SUCCESS) {
+            qCWarning(WEBDAV_LMDB) << "Failed to write" << change.fileId << change.key << mdb_strerror(rc);
+            mdb_txn_abort(txn);
+            return false;
+        }
+    }
+
+    rc = mdb_txn_commit(txn);
+    if (rc != MDB_SUCCESS) {
+        qCWarning(WEBDAV_LMDB) << "Failed to commit" << changes.size() << "changes" << mdb_strerror(rc);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,76 @@
+#ifndef WEBDAVLMDBPROPERTYSTORAGE_H
+#define WEBDAVLMDBPROPERTYSTORAGE_H
+
+#include <QObject>
+#include <QVector>
+
+#include <vector>
+
+#include "webdavpropertystorage.h"
+
+/**
+ * Dead properties in an LMDB environment on the local disk, shared by
+ * every worker of the node through the same memory map.
+ *
+ * Keys are the big endian file id followed by the UTF-8 property key,
+ * so the properties of a file are adjacent and read with one cursor
+ * range. Reads reuse a per thread read transaction and hand out values
+ * straight from the map, see forEachProperty().
+ *
+ * Changes made between begin() and commit() go into a single write
+ * transaction. File ids are never reused, so files deleted behind the
+ * server's back (scanner, watcher) only leave unreachable entries.
+ */
+class WebdavLmdbPropertyStorage : public WebdavPropertyStorage
+{
+    Q_OBJECT
+public:
+    explicit WebdavLmdbPropertyStorage(QObject *parent = nullptr);
+
+    /**
+     * Opens the environment at \p path once per process, must be called
+     * after forking. \p mapSize is the most the database can grow to.
+     */
+    static bool open(const QString &path, qint64 mapSize);
+    static bool isOpen();
+
+    virtual bool begin() override final;
+
+    virtual bool commit() override final;
+
+    virtual bool rollback() override final;
+
+    virtual bool setValue(qint64 file_id, const QString &key, const QString &value) override final;
+
+    virtual bool remove(qint64 file_id, const QString &key) override final;
+
+    virtual bool hasLocalReads() const override final { return true; }
+
+    virtual PropertyValueHash properties(qint64 file_id) override final;
+
+    typedef std::function<void(const char *key, size_t keySize, const char *value, size_t valueSize)> PropertyVisitor;
+
+    /**
+     * Calls \p visitor for every property of \p file_id, key and value
+     * point into the map and are only valid during the call.
+     */
+    static bool forEachProperty(qint64 file_id, PropertyVisitor visitor);
+
+    /** Drops every property of \p fileIds in one write transaction */
+    static bool removeFiles(const std::vector<qint64> &fileIds);
+
+private:
+    struct Change {
+        qint64 fileId;
+        QString key;
+        QString value;
+        bool remove;
+    };
+
+    static bool apply(const QVector<Change> &changes);
+
+    QVector<Change> m_changes;
+    bool m_transaction = false;
+};
+
+#endif // WEBDAVLMDBPROPERTYSTORAGE_H
@@ -0,0 +1,170 @@
+#include "webdavmemorypropertystorage.h"
+
+#include <QLoggingCategory>
+
+Q_LOGGING_CATEGORY(WEBDAV_STORAGE, "webdav.storage")
+
+WebdavMemoryPropertyStorage::WebdavMemoryPropertyStorage(QObject *parent) : WebdavPropertyStorage(parent)
+{
+
+}
+
+void WebdavMemoryPropertyStorage::setMaxFiles(int maxFiles)
+{
+    m_maxFiles = qMax(0, maxFiles);
+    evict();
+}
+
+bool WebdavMemoryPropertyStorage::begin()
+{
+    m_transaction = true;
+    m_journal.clear();
+    return true;
+}
+
+bool WebdavMemoryPropertyStorage::commit()
+{
+    if (m_transaction) {
+        m_transaction = false;
+        for (auto it = m_journal.constBegin(); it != m_journal.constEnd(); ++it) {
+            Entry &fileEntry = entry(it.key());
+            apply(fileEntry.values, it.value());
+        }
+        m_journal.clear();
+        evict();
+    }
+    return true;
+}
+
+bool WebdavMemoryPropertyStorage::rollback()
+{
+    m_transaction = false;
+    m_journal.clear();
+    return true;
+}
+
+bool WebdavMemoryPropertyStorage::setValue(qint64 file_id, const QString &key, const QString &value)
+{
+    qCDebug(WEBDAV_STORAGE) << "SET" << file_id << key << value;
+    if (m_transaction) {
+        m_journal[file_id].insert(key, Change{ value, false });
+    } else {
+        entry(file_id).values.insert(key, value);
+        evict();
+    }
+    return true;
+}
+
+bool WebdavMemoryPropertyStorage::remove(qint64 file_id, const QString &key)
+{
+    qCDebug(WEBDAV_STORAGE) << "REMOVE" << file_id << key;
+    if (m_transaction) {
+        m_journal[file_id].insert(key, Change{ QString(), true });
+    } else {
+        auto it = m_files.find(file_id);
+        if (it != m_files.end()) {
+            it->values.remove(key);
+            touch(*it);
+        }
+    }
+    return true;
+}
+
+PropertyValueHash WebdavMemoryPropertyStorage::properties(qint64 file_id)
+{
+    PropertyValueHash ret;
+    properties(file_id, ret);
+    return ret;
+}
+
+bool WebdavMemoryPropertyStorage::properties(qint64 file_id, PropertyValueHash &values, quint64 *tag)
+{
+    auto it = m_files.find(file_id);
+    const auto journalIt = m_transaction ? m_journal.constFind(file_id) : m_journal.constEnd();
+    if (it == m_files.end() && journalIt == m_journal.constEnd()) {
+        return false;
+    }
+
+    if (it != m_files.end()) {
+        values = it->values;
+        if (tag) {
+            *tag = it->tag;
+        }
+        touch(*it);
+    } else {
+        values.clear();
+        if (tag) {
+            *tag = 0;
+        }
+    }
+
+    if (journalIt != m_journal.constEnd()) {
+        apply(values, journalIt.value());
+    }
+    return true;
+}
+
+void WebdavMemoryPropertyStorage::insert(qint64 file_id, const PropertyValueHash &values, quint64 tag)
+{
+    Entry &fileEntry = entry(file_id);
+    fileEntry.values = values;
+    fileEntry.tag = tag;
+    evict();
+}
+
+void WebdavMemoryPropertyStorage::invalidate(qint64 file_id)
+{
+    auto it = m_files.find(file_id);
+    if (it != m_files.end()) {
+        m_lru.erase(it->lru);
+        m_files.erase(it);
+    }
+}
+
+void WebdavMemoryPropertyStorage::clear()
+{
+    m_files.clear();
+    m_lru.clear();
+    m_journal.clear();
+}
+
+WebdavMemoryPropertyStorage::Entry &WebdavMemoryPropertyStorage::entry(qint64 file_id)
+{
+    auto it = m_files.find(file_id);
+    if (it == m_files.end()) {
+        m_lru.push_front(file_id);
+        it = m_files.insert(file_id, Entry());
+        it->lru = m_lru.begin();
+    } else {
+        touch(*it);
+    }
+    return *it;
+}
+
+void WebdavMemoryPropertyStorage::touch(Entry &entry)
+{
+    m_lru.splice(m_lru.begin(), m_lru, entry.lru);
+}
+
+void WebdavMemoryPropertyStorage::evict()
+{
+    if (!m_maxFiles) {
+        return;
+    }
+
+    while (m_files.size() > m_maxFiles) {
+        m_files.remove(m_lru.back());
+        m_lru.pop_back();
+    }
+}
+
+void WebdavMemoryPropertyStorage::apply(PropertyValueHash &values, const QHash<QString, Change> &changes)
+{
+    for (auto it = changes.constBegin(); it != changes.constEnd(); ++it) {
+        if (it->remove) {
+            values.remove(it.key());
+        } else {
+            values.insert(it.key(), it->value);
+        }
+    }
+}
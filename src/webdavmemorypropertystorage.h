@@ -0,0 +1,82 @@
+#ifndef WEBDAVMEMORYPROPERTYSTORAGE_H
+#define WEBDAVMEMORYPROPERTYSTORAGE_H
+
+#include <QObject>
+
+#include <list>
+
+#include "webdavpropertystorage.h"
+
+/**
+ * Dead properties kept in memory, for running without a database and
+ * as the front cache of WebdavPgSqlPropertyStorage.
+ *
+ * A transaction only records its changes in a journal that commit()
+ * applies and rollback() drops, so both cost O(changes) rather than
+ * O(stored properties). With setMaxFiles() the least recently used
+ * files are dropped.
+ */
+class WebdavMemoryPropertyStorage : public WebdavPropertyStorage
+{
+    Q_OBJECT
+public:
+    explicit WebdavMemoryPropertyStorage(QObject *parent = nullptr);
+
+    /** 0, the default, never drops anything */
+    void setMaxFiles(int maxFiles);
+    int maxFiles() const { return m_maxFiles; }
+    int size() const { return m_files.size(); }
+
+    virtual bool begin() override final;
+
+    virtual bool commit() override final;
+
+    virtual bool rollback() override final;
+
+    virtual bool setValue(qint64 file_id, const QString &key, const QString &value) override final;
+
+    virtual bool remove(qint64 file_id, const QString &key) override final;
+
+    virtual bool hasLocalReads() const override final { return true; }
+
+    virtual PropertyValueHash properties(qint64 file_id) override final;
+
+    /**
+     * Properties of \p file_id as this transaction sees them, false when
+     * nothing is stored for it. \p tag gets the one given to insert().
+     */
+    bool properties(qint64 file_id, PropertyValueHash &values, quint64 *tag = nullptr);
+
+    /** Replaces all properties of \p file_id, \p tag is opaque */
+    void insert(qint64 file_id, const PropertyValueHash &values, quint64 tag = 0);
+
+    void invalidate(qint64 file_id);
+
+    void clear();
+
+private:
+    struct Entry {
+        PropertyValueHash values;
+        std::list<qint64>::iterator lru;
+        quint64 tag = 0;
+    };
+
+    struct Change {
+        QString value;
+        bool remove;
+    };
+
+    Entry &entry(qint64 file_id);
+    void touch(Entry &entry);
+    void evict();
+    static void apply(PropertyValueHash &values, const QHash<QString, Change> &changes);
+
+    QHash<qint64, Entry> m_files;
+    QHash<qint64, QHash<QString, Change>> m_journal;
+    // Most recently used first
+    std::list<qint64> m_lru;
+    int m_maxFiles = 0;
+    bool m_transaction = false;
+};
+
+#endif // WEBDAVMEMORYPROPERTYSTORAGE_H
@@ -1,65 +1,310 @@
 #include "webdavpgsqlpropertystorage.h"
 
+#include "asyncpg.h"
+#include "sqlquery.h"
+#include "webdavmemorypropertystorage.h"
+
 #include <Cutelyst/Plugins/Utils/Sql>
 
-#include <QSqlQuery>
+#include <QPointer>
 #include <QSqlError>
+#include <QLoggingCategory>
+
+#include <atomic>
+#include <memory>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+Q_LOGGING_CATEGORY(WEBDAV_PROPCACHE, "webdav.propcache", QtWarningMsg)
 
 using namespace Cutelyst;
 
-WebdavPgSqlPropertyStorage::WebdavPgSqlPropertyStorage(QObject *parent) : WebdavPropertyStorage(parent)
+namespace {
+
+const int CacheBuckets = 65536;
+
+struct CacheShared {
+    std::atomic<quint64> seq;
+    // Sequence of the last commit touching a file that maps here
+    std::atomic<quint64> files[CacheBuckets];
+};
+
+CacheShared *cacheShared = nullptr;
+int cacheMaxFiles = 0;
+
+thread_local std::unique_ptr<WebdavMemoryPropertyStorage> threadCache;
+
+inline std::atomic<quint64> &bucket(qint64 file_id)
+{
+    return cacheShared->files[quint64(file_id) & (CacheBuckets - 1)];
+}
+
+WebdavMemoryPropertyStorage *cache()
+{
+    if (!threadCache) {
+        threadCache.reset(new WebdavMemoryPropertyStorage);
+        threadCache->setMaxFiles(cacheMaxFiles);
+    }
+    return threadCache.get();
+}
+
+// A new sequence for file_id, always above the current one so that a
+// bump racing with ours can't lower it, \p previous is what it replaced
+quint64 bump(qint64 file_id, quint64 &previous)
+{
+    std::atomic<quint64> &current = bucket(file_id);
+    previous = current.load();
+    quint64 seq;
+    do {
+        seq = cacheShared->seq.fetch_add(1) + 1;
+    } while (seq <= previous || !current.compare_exchange_weak(previous, seq));
+    return seq;
+}
+
+}
+
+WebdavPgSqlPropertyStorage::WebdavPgSqlPropertyStorage(Layout layout, QObject *parent) : WebdavPropertyStorage(parent)
+  , m_layout(layout)
 {
 
 }
 
 bool WebdavPgSqlPropertyStorage::begin()
 {
-    QSqlDatabase db = Sql::databaseThread(QStringLiteral("cloudlyst"));
-    return db.transaction();
+    m_transaction = true;
+    m_changes.clear();
+    return true;
 }
 
 bool WebdavPgSqlPropertyStorage::commit()
+{
+    m_transaction = false;
+    const QVector<Change> changes = m_changes;
+    m_changes.clear();
+
+    return execPatches(patches(changes));
+}
+
+bool WebdavPgSqlPropertyStorage::execPatches(const QVector<Patch> &filePatches) const
 {
     QSqlDatabase db = Sql::databaseThread(QStringLiteral("cloudlyst"));
-    return db.commit();
+    const bool transaction = filePatches.size() > 1;
+    if (transaction && !db.transaction()) {
+        return false;
+    }
+
+    for (const Patch &patch : filePatches) {
+        SqlQuery query(patchStatement());
+        query.bindValue(QStringLiteral(":file_id"), patch.fileId);
+        query.bindValue(QStringLiteral(":remove_names"), SqlQuery::arrayLiteral(patch.removeNames));
+        query.bindValue(QStringLiteral(":set_names"), SqlQuery::arrayLiteral(patch.setNames));
+        query.bindValue(QStringLiteral(":set_values"), SqlQuery::arrayLiteral(patch.setValues));
+        if (!query.exec()) {
+            if (transaction) {
+                db.rollback();
+            }
+            committed(filePatches, false);
+            return false;
+        }
+    }
+
+    const bool ok = !transaction || db.commit();
+    committed(filePatches, ok);
+    return ok;
+}
+
+void WebdavPgSqlPropertyStorage::commitAsync(QObject *receiver, std::function<void(bool)> callback)
+{
+    m_transaction = false;
+    const QVector<Change> changes = m_changes;
+    m_changes.clear();
+
+    if (changes.isEmpty()) {
+        callback(true);
+        return;
+    }
+
+    // Runs even if the receiver is gone, other workers must see the commit
+    const QVector<Patch> filePatches = patches(changes);
+    const QPointer<QObject> guard(receiver);
+    AsyncPgCallback done = [callback, filePatches, guard] (AsyncPgResult &result) {
+        committed(filePatches, !result.error());
+        if (guard) {
+            callback(!result.error());
+        }
+    };
+
+    // A single statement is atomic on its own, a PROPPATCH is always one file
+    AsyncPgConnection *conn = AsyncPgConnection::thread();
+    const bool batch = filePatches.size() > 1;
+    if (batch) {
+        conn->beginBatch();
+    }
+    for (const Patch &patch : filePatches) {
+        AsyncPgQuery query(patchStatement());
+        query.bindValue(QStringLiteral(":file_id"), patch.fileId);
+        query.bindValue(QStringLiteral(":remove_names"), patch.removeNames);
+        query.bindValue(QStringLiteral(":set_names"), patch.setNames);
+        query.bindValue(QStringLiteral(":set_values"), patch.setValues);
+        query.exec(conn, nullptr, batch ? AsyncPgCallback() : done);
+    }
+    if (batch) {
+        conn->endBatch(nullptr, done);
+    }
 }
 
 bool WebdavPgSqlPropertyStorage::rollback()
 {
-    QSqlDatabase db = Sql::databaseThread(QStringLiteral("cloudlyst"));
-    return db.rollback();
+    m_transaction = false;
+    m_changes.clear();
+    return true;
 }
 
 bool WebdavPgSqlPropertyStorage::setValue(qint64 file_id, const QString &key, const QString &value)
 {
-    QSqlQuery query = CPreparedSqlQueryThreadForDB(QStringLiteral("INSERT INTO cloudlyst.file_properties "
-                                                                  "(file_id, name, value) "
-                                                                  "VALUES "
-                                                                  "(:file_id, :name, :value) "
-                                                                  "ON CONFLICT ON CONSTRAINT file_properties_file_id_name_key "
-                                                                  "DO UPDATE SET value = :updatevalue"),
-                                                   QStringLiteral("cloudlyst"));
-    query.bindValue(QStringLiteral(":file_id"), file_id);
-    query.bindValue(QStringLiteral(":name"), key);
-    query.bindValue(QStringLiteral(":value"), value);
-    query.bindValue(QStringLiteral(":updatevalue"), value);
-    if (query.exec() && query.numRowsAffected()) {
+    const Change change{ file_id, key, value, false };
+    if (m_transaction) {
+        m_changes.push_back(change);
         return true;
     }
-
-    return false;
+    return execPatches(patches({ change }));
 }
 
 bool WebdavPgSqlPropertyStorage::remove(qint64 file_id, const QString &key)
 {
-    QSqlQuery query = CPreparedSqlQueryThreadForDB(QStringLiteral("DELETE FROM cloudlyst.file_properties "
-                                                                  "WHERE file_id = :file_id AND name = :name"),
-                                                   QStringLiteral("cloudlyst"));
-    query.bindValue(QStringLiteral(":file_id"), file_id);
-    query.bindValue(QStringLiteral(":name"), key);
-    if (query.exec() && query.numRowsAffected()) {
+    const Change change{ file_id, key, QString(), true };
+    if (m_transaction) {
+        m_changes.push_back(change);
+        return true;
+    }
+    return execPatches(patches({ change }));
+}
+
+QVector<WebdavPgSqlPropertyStorage::Patch> WebdavPgSqlPropertyStorage::patches(const QVector<Change> &changes)
+{
+    // Changes apply in order, so only the last one of a property counts,
+    // which also keeps a name out of both the upsert and the DELETE
+    QVector<Patch> ret;
+    QHash<qint64, QHash<QString, int>> last;
+    for (int i = 0; i < changes.size(); ++i) {
+        last[changes.at(i).fileId][changes.at(i).key] = i;
+    }
+
+    QHash<qint64, int> patchIndex;
+    for (int i = 0; i < changes.size(); ++i) {
+        const Change &change = changes.at(i);
+        if (last.value(change.fileId).value(change.key) != i) {
+            continue;
+        }
+
+        auto it = patchIndex.constFind(change.fileId);
+        if (it == patchIndex.constEnd()) {
+            it = patchIndex.insert(change.fileId, ret.size());
+            ret.push_back(Patch{ change.fileId, QStringList(), QStringList(), QStringList() });
+        }
+
+        Patch &patch = ret[it.value()];
+        if (change.remove) {
+            patch.removeNames.append(change.key);
+        } else {
+            patch.setNames.append(change.key);
+            patch.setValues.append(change.value);
+        }
+    }
+    return ret;
+}
+
+SqlQuery::Statement WebdavPgSqlPropertyStorage::patchStatement() const
+{
+    return m_layout == Jsonb ? SqlQuery::PropertiesJsonbPatch : SqlQuery::PropertiesPatch;
+}
+
+bool WebdavPgSqlPropertyStorage::setupCache(int maxFiles)
+{
+    if (maxFiles <= 0 || cacheShared) {
         return true;
     }
 
-    return false;
+    // Anonymous and shared, so it survives fork() and is visible to every worker
+    void *mem = mmap(nullptr, sizeof(CacheShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        qCCritical(WEBDAV_PROPCACHE) << "Failed to map property cache sequences" << strerror(errno);
+        return false;
+    }
+    cacheShared = static_cast<CacheShared *>(mem);
+    cacheMaxFiles = maxFiles;
+    return true;
+}
+
+bool WebdavPgSqlPropertyStorage::cacheEnabled()
+{
+    return cacheShared;
+}
+
+bool WebdavPgSqlPropertyStorage::cachedProperties(qint64 file_id, PropertyValueHash &values)
+{
+    if (!cacheShared) {
+        return false;
+    }
+
+    quint64 tag;
+    if (!cache()->properties(file_id, values, &tag)) {
+        return false;
+    }
+
+    if (bucket(file_id).load() > tag) {
+        cache()->invalidate(file_id);
+        return false;
+    }
+    return true;
+}
+
+quint64 WebdavPgSqlPropertyStorage::cacheSnapshot()
+{
+    return cacheShared ? cacheShared->seq.load() : 0;
+}
+
+void WebdavPgSqlPropertyStorage::cacheProperties(const std::vector<qint64> &fileIds, const PathPropertyHash &properties, quint64 snapshot)
+{
+    if (!cacheShared) {
+        return;
+    }
+
+    // Anything committed after the query was sent may not be in its result
+    for (qint64 id : fileIds) {
+        if (bucket(id).load() <= snapshot) {
+            cache()->insert(id, properties.value(id), snapshot);
+        }
+    }
+}
+
+void WebdavPgSqlPropertyStorage::committed(const QVector<Patch> &filePatches, bool ok)
+{
+    if (!cacheShared) {
+        return;
+    }
+
+    // A failed commit may still have gone through, so it bumps as well
+    WebdavMemoryPropertyStorage *fileCache = cache();
+    for (const Patch &patch : filePatches) {
+        quint64 previous;
+        const quint64 seq = bump(patch.fileId, previous);
+
+        // Write through only if nobody else committed since the entry was read
+        PropertyValueHash values;
+        quint64 tag;
+        if (ok && fileCache->properties(patch.fileId, values, &tag) && previous <= tag) {
+            for (const QString &name : patch.removeNames) {
+                values.remove(name);
+            }
+            for (int i = 0; i < patch.setNames.size(); ++i) {
+                values.insert(patch.setNames.at(i), patch.setValues.at(i));
+            }
+            fileCache->insert(patch.fileId, values, seq);
+        } else {
+            fileCache->invalidate(patch.fileId);
+        }
+    }
 }
@@ -2,24 +2,96 @@
 #define WEBDAVPGSQLPROPERTYSTORAGE_H
 
 #include <QObject>
+#include <QStringList>
+#include <QVector>
+
+#include <vector>
 
 #include "webdavpropertystorage.h"
+#include "sqlquery.h"
 
+/**
+ * Changes made between begin() and commit() are queued, the last change
+ * of each property wins and every file gets a single patch statement.
+ * With more than one file commitAsync() sends them as a batch on the
+ * thread's AsyncPgConnection.
+ *
+ * The Rows layout keeps a cloudlyst.file_properties row per property,
+ * patched with a multi-row upsert plus a DELETE ... = ANY(). The Jsonb
+ * layout keeps a single cloudlyst.file_props row per file with a GIN
+ * indexed jsonb object, read along with the file metadata, see
+ * FilesSqlAsync::setInlineProperties(). Only the Rows layout exists with
+ * the SQLite driver.
+ *
+ * With setupCache() each thread keeps the properties it read or wrote in
+ * a WebdavMemoryPropertyStorage. Commits bump a per file sequence in
+ * memory shared by all workers, and a cached file is only used while
+ * its sequence is not newer than the cache entry.
+ */
 class WebdavPgSqlPropertyStorage : public WebdavPropertyStorage
 {
     Q_OBJECT
 public:
-    explicit WebdavPgSqlPropertyStorage(QObject *parent = nullptr);
+    enum Layout {
+        Rows,
+        Jsonb,
+    };
+
+    explicit WebdavPgSqlPropertyStorage(Layout layout = Rows, QObject *parent = nullptr);
+
+    Layout layout() const { return m_layout; }
 
     virtual bool begin() override final;
 
     virtual bool commit() override final;
 
+    virtual void commitAsync(QObject *receiver, std::function<void(bool ok)> callback) override final;
+
     virtual bool rollback() override final;
 
     virtual bool setValue(qint64 file_id, const QString &key, const QString &value) override final;
 
     virtual bool remove(qint64 file_id, const QString &key) override final;
+
+    /** Called before forking, caches up to \p maxFiles files per thread */
+    static bool setupCache(int maxFiles);
+    static bool cacheEnabled();
+
+    /** True with the properties of \p file_id when cached and current */
+    static bool cachedProperties(qint64 file_id, PropertyValueHash &values);
+
+    /** Taken before sending a properties query, for cacheProperties() */
+    static quint64 cacheSnapshot();
+
+    /**
+     * Caches what a query sent at \p snapshot read for \p fileIds, the
+     * ones missing from \p properties have none.
+     */
+    static void cacheProperties(const std::vector<qint64> &fileIds, const PathPropertyHash &properties, quint64 snapshot);
+
+private:
+    struct Change {
+        qint64 fileId;
+        QString key;
+        QString value;
+        bool remove;
+    };
+
+    struct Patch {
+        qint64 fileId;
+        QStringList setNames;
+        QStringList setValues;
+        QStringList removeNames;
+    };
+
+    static QVector<Patch> patches(const QVector<Change> &changes);
+    static void committed(const QVector<Patch> &filePatches, bool ok);
+    bool execPatches(const QVector<Patch> &filePatches) const;
+    SqlQuery::Statement patchStatement() const;
+
+    QVector<Change> m_changes;
+    Layout m_layout;
+    bool m_transaction = false;
 };
 
 #endif // WEBDAVPGSQLPROPERTYSTORAGE_H
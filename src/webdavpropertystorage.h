@@ -4,9 +4,18 @@
 #include <QObject>
 #include <QHash>
 
+#include <functional>
+
 typedef QHash<QString, QString> PropertyValueHash;
 typedef QHash<qint64, PropertyValueHash> PathPropertyHash;
 
+/**
+ * Where WebDAV dead properties are kept, see WebdavPgSqlPropertyStorage,
+ * WebdavLmdbPropertyStorage and WebdavMemoryPropertyStorage.
+ *
+ * Changes made between begin() and commit() are applied together or not
+ * at all, outside of a transaction they apply right away.
+ */
 class WebdavPropertyStorage : public QObject
 {
     Q_OBJECT
@@ -25,16 +34,25 @@ public:
 
     virtual bool commit();
 
+    /**
+     * Commits without blocking the thread, \p callback runs with the
+     * outcome unless \p receiver is gone. Defaults to commit().
+     */
+    virtual void commitAsync(QObject *receiver, std::function<void(bool ok)> callback);
+
     virtual bool rollback();
 
-    virtual bool setValue(qint64 file_id, const QString &key, const QString &value);
+    virtual bool setValue(qint64 file_id, const QString &key, const QString &value) = 0;
+
+    virtual bool remove(qint64 file_id, const QString &key) = 0;
 
-    virtual bool remove(qint64 file_id, const QString &key);
+    /**
+     * True when properties() can be read right here, without a query,
+     * otherwise they come from FilesSqlAsync.
+     */
+    virtual bool hasLocalReads() const;
 
-private:
-    PathPropertyHash m_pathProps;
-    PathPropertyHash m_pathPropsTransaction;
-    bool m_transaction = false;
+    virtual PropertyValueHash properties(qint64 file_id);
 };
 
 #endif // WEBDAVPROPERTYSTORAGE_H
@@ -0,0 +1,346 @@
+#include "zipstream.h"
+
+#include <QDateTime>
+#include <QIODevice>
+#include <QStringList>
+#include <QtEndian>
+
+#include <zlib.h>
+
+namespace {
+
+const quint16 ZipVersion = 45; // ZIP64
+const quint16 MadeByUnix = 3 << 8;
+// Data descriptor follows, UTF-8 names
+const quint16 Flags = 0x0008 | 0x0800;
+const quint16 Stored = 0;
+const quint16 Deflated = 8;
+const quint32 Zip64Marker = 0xffffffff;
+const int BufferSize = 64 * 1024;
+
+inline void put16(QByteArray &out, quint16 value)
+{
+    char data[2];
+    qToLittleEndian(value, data);
+    out.append(data, 2);
+}
+
+inline void put32(QByteArray &out, quint32 value)
+{
+    char data[4];
+    qToLittleEndian(value, data);
+    out.append(data, 4);
+}
+
+inline void put64(QByteArray &out, quint64 value)
+{
+    char data[8];
+    qToLittleEndian(value, data);
+    out.append(data, 8);
+}
+
+// MS-DOS local time, which can't go before 1980
+void dosDateTime(qint64 mtime, quint16 &time, quint16 &date)
+{
+    QDateTime dt = QDateTime::fromSecsSinceEpoch(qMax(mtime, qint64(0)));
+    if (dt.date().year() < 1980) {
+        dt = QDateTime(QDate(1980, 1, 1), QTime(0, 0));
+    }
+    time = quint16((dt.time().hour() << 11) | (dt.time().minute() << 5) | (dt.time().second() / 2));
+    date = quint16(((dt.date().year() - 1980) << 9) | (dt.date().month() << 5) | dt.date().day());
+}
+
+}
+
+ZipStream::ZipStream(QIODevice *out, int level)
+    : m_out(out)
+    , m_level(level)
+{
+}
+
+ZipStream::~ZipStream()
+{
+    if (m_zstream) {
+        deflateEnd(m_zstream);
+        delete m_zstream;
+    }
+}
+
+bool ZipStream::isCompressed(const QString &mimetype)
+{
+    // Uncompressed formats of otherwise compressed families
+    static const QStringList plain = {
+        QStringLiteral("image/bmp"),
+        QStringLiteral("image/svg+xml"),
+        QStringLiteral("image/x-portable-anymap"),
+        QStringLiteral("image/x-portable-bitmap"),
+        QStringLiteral("image/x-portable-graymap"),
+        QStringLiteral("image/x-portable-pixmap"),
+        QStringLiteral("image/x-xpixmap"),
+        QStringLiteral("image/x-xbitmap"),
+        QStringLiteral("audio/x-wav"),
+        QStringLiteral("audio/x-aiff"),
+    };
+    static const QStringList compressed = {
+        QStringLiteral("application/zip"),
+        QStringLiteral("application/gzip"),
+        QStringLiteral("application/x-7z-compressed"),
+        QStringLiteral("application/x-bzip"),
+        QStringLiteral("application/x-bzip2"),
+        QStringLiteral("application/x-compressed-tar"),
+        QStringLiteral("application/x-lzma"),
+        QStringLiteral("application/x-rar"),
+        QStringLiteral("application/vnd.rar"),
+        QStringLiteral("application/x-xz"),
+        QStringLiteral("application/zstd"),
+        QStringLiteral("application/java-archive"),
+        QStringLiteral("application/epub+zip"),
+        QStringLiteral("application/pdf"),
+        QStringLiteral("application/x-rpm"),
+        QStringLiteral("application/vnd.debian.binary-package"),
+    };
+
+    if (mimetype.startsWith(QLatin1String("image/")) || mimetype.startsWith(QLatin1String("video/")) ||
+            mimetype.startsWith(QLatin1String("audio/"))) {
+        return !plain.contains(mimetype);
+    }
+
+    // Office documents are ZIP files already
+    return compressed.contains(mimetype) ||
+            mimetype.startsWith(QLatin1String("application/vnd.openxmlformats-officedocument.")) ||
+            mimetype.startsWith(QLatin1String("application/vnd.oasis.opendocument."));
+}
+
+void ZipStream::addDirectory(const QString &name, qint64 mtime)
+{
+    QString dirName = name;
+    if (!dirName.endsWith(QLatin1Char('/'))) {
+        dirName.append(QLatin1Char('/'));
+    }
+    beginFile(dirName, mtime, false);
+    m_entries.back().dir = true;
+    endFile();
+}
+
+void ZipStream::beginFile(const QString &name, qint64 mtime, bool deflate)
+{
+    if (m_inFile) {
+        endFile();
+    }
+
+    Entry entry;
+    entry.name = name.toUtf8();
+    entry.offset = quint64(m_offset);
+    entry.compressedSize = 0;
+    entry.size = 0;
+    entry.crc = quint32(crc32(0, nullptr, 0));
+    entry.method = deflate ? Deflated : Stored;
+    dosDateTime(mtime, entry.dosTime, entry.dosDate);
+    entry.dir = false;
+    m_entries.push_back(entry);
+
+    if (deflate) {
+        // Raw deflate, one state reset for every entry
+        if (!m_zstream) {
+            m_zstream = new z_stream;
+            m_zstream->zalloc = Z_NULL;
+            m_zstream->zfree = Z_NULL;
+            m_zstream->opaque = Z_NULL;
+            if (deflateInit2(m_zstream, m_level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                delete m_zstream;
+                m_zstream = nullptr;
+                m_entries.back().method = Stored;
+            }
+        } else {
+            deflateReset(m_zstream);
+        }
+    }
+
+    writeLocalHeader(m_entries.back());
+    m_inFile = true;
+}
+
+bool ZipStream::writeData(const char *data, qint64 len)
+{
+    Entry &entry = m_entries.back();
+    const char *pos = data;
+    qint64 remaining = len;
+    while (remaining > 0) {
+        const uInt chunk = uInt(qMin(remaining, qint64(1 << 30)));
+        entry.crc = quint32(crc32(entry.crc, reinterpret_cast<const Bytef *>(pos), chunk));
+        pos += chunk;
+        remaining -= chunk;
+    }
+    entry.size += quint64(len);
+
+    if (entry.method == Deflated) {
+        return deflate(data, len, Z_NO_FLUSH);
+    }
+    entry.compressedSize += quint64(len);
+    return write(data, len);
+}
+
+bool ZipStream::endFile()
+{
+    if (!m_inFile) {
+        return false;
+    }
+    m_inFile = false;
+
+    Entry &entry = m_entries.back();
+    if (entry.method == Deflated && !deflate(nullptr, 0, Z_FINISH)) {
+        return false;
+    }
+
+    // ZIP64 descriptor, the local header had a ZIP64 extra field
+    QByteArray descriptor;
+    descriptor.reserve(24);
+    put32(descriptor, 0x08074b50);
+    put32(descriptor, entry.crc);
+    put64(descriptor, entry.compressedSize);
+    put64(descriptor, entry.size);
+    return write(descriptor);
+}
+
+bool ZipStream::finish()
+{
+    if (m_inFile) {
+        endFile();
+    }
+
+    const quint64 directoryOffset = quint64(m_offset);
+    QByteArray out;
+    out.reserve(BufferSize + 1024);
+    for (const Entry &entry : m_entries) {
+        put32(out, 0x02014b50);
+        put16(out, MadeByUnix | ZipVersion);
+        put16(out, ZipVersion);
+        put16(out, Flags);
+        put16(out, entry.method);
+        put16(out, entry.dosTime);
+        put16(out, entry.dosDate);
+        put32(out, entry.crc);
+        put32(out, Zip64Marker);
+        put32(out, Zip64Marker);
+        put16(out, quint16(entry.name.size()));
+        put16(out, 28);
+        put16(out, 0); // comment
+        put16(out, 0); // disk
+        put16(out, 0); // internal attributes
+        // Unix mode, plus the MS-DOS directory bit
+        put32(out, entry.dir ? (quint32(040755) << 16) | 0x10 : quint32(0100644) << 16);
+        put32(out, Zip64Marker);
+        out.append(entry.name);
+        put16(out, 0x0001);
+        put16(out, 24);
+        put64(out, entry.size);
+        put64(out, entry.compressedSize);
+        put64(out, entry.offset);
+
+        if (out.size() >= BufferSize) {
+            write(out);
+            out.clear();
+        }
+    }
+
+    const quint64 zip64EndOffset = quint64(m_offset) + quint64(out.size());
+    const quint64 directorySize = zip64EndOffset - directoryOffset;
+    const quint64 count = m_entries.size();
+
+    put32(out, 0x06064b50);
+    put64(out, 44);
+    put16(out, MadeByUnix | ZipVersion);
+    put16(out, ZipVersion);
+    put32(out, 0);
+    put32(out, 0);
+    put64(out, count);
+    put64(out, count);
+    put64(out, directorySize);
+    put64(out, directoryOffset);
+
+    put32(out, 0x07064b50);
+    put32(out, 0);
+    put64(out, zip64EndOffset);
+    put32(out, 1);
+
+    put32(out, 0x06054b50);
+    put16(out, 0);
+    put16(out, 0);
+    put16(out, 0xffff);
+    put16(out, 0xffff);
+    put32(out, Zip64Marker);
+    put32(out, Zip64Marker);
+    put16(out, 0);
+
+    return write(out);
+}
+
+void ZipStream::writeLocalHeader(const Entry &entry)
+{
+    QByteArray header;
+    header.reserve(30 + entry.name.size() + 20);
+    put32(header, 0x04034b50);
+    put16(header, ZipVersion);
+    put16(header, Flags);
+    put16(header, entry.method);
+    put16(header, entry.dosTime);
+    put16(header, entry.dosDate);
+    put32(header, 0); // CRC and sizes are in the descriptor
+    put32(header, Zip64Marker);
+    put32(header, Zip64Marker);
+    put16(header, quint16(entry.name.size()));
+    put16(header, 20);
+    header.append(entry.name);
+    put16(header, 0x0001);
+    put16(header, 16);
+    put64(header, 0);
+    put64(header, 0);
+    write(header);
+}
+
+bool ZipStream::deflate(const char *data, qint64 len, int flush)
+{
+    Entry &entry = m_entries.back();
+    m_buffer.resize(BufferSize);
+
+    m_zstream->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    m_zstream->avail_in = uInt(len);
+    for (;;) {
+        m_zstream->next_out = reinterpret_cast<Bytef *>(m_buffer.data());
+        m_zstream->avail_out = uInt(BufferSize);
+        const int rc = ::deflate(m_zstream, flush);
+        if (rc == Z_STREAM_ERROR) {
+            m_valid = false;
+            return false;
+        }
+
+        const qint64 produced = BufferSize - qint64(m_zstream->avail_out);
+        if (produced && !write(m_buffer.constData(), produced)) {
+            return false;
+        }
+        entry.compressedSize += quint64(produced);
+
+        if (flush == Z_FINISH ? rc == Z_STREAM_END : m_zstream->avail_in == 0 && m_zstream->avail_out != 0) {
+            return true;
+        }
+    }
+}
+
+bool ZipStream::write(const QByteArray &data)
+{
+    return write(data.constData(), data.size());
+}
+
+bool ZipStream::write(const char *data, qint64 len)
+{
+    if (!m_valid) {
+        return false;
+    }
+
+    if (m_out->write(data, len) != len) {
+        m_valid = false;
+        return false;
+    }
+    m_offset += len;
+    return true;
+}
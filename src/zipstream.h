@@ -0,0 +1,71 @@
+#ifndef ZIPSTREAM_H
+#define ZIPSTREAM_H
+
+#include <QByteArray>
+#include <QString>
+
+#include <vector>
+
+class QIODevice;
+struct z_stream_s;
+
+/**
+ * Writes a ZIP64 archive to a device as it goes, for downloads of whole
+ * collections that can't be sized or seeked.
+ *
+ * Entries are written with a data descriptor, so their CRC and sizes
+ * follow the data and are computed while it streams through; nothing but
+ * the central directory record of each entry is kept until finish().
+ * Entries are deflated, or stored when beginFile() is told not to.
+ */
+class ZipStream
+{
+public:
+    explicit ZipStream(QIODevice *out, int level = 1);
+    ~ZipStream();
+
+    /** True for mimetypes whose data is already compressed, storing them is as small and cheaper */
+    static bool isCompressed(const QString &mimetype);
+
+    void addDirectory(const QString &name, qint64 mtime);
+
+    void beginFile(const QString &name, qint64 mtime, bool deflate);
+    bool writeData(const char *data, qint64 len);
+    bool endFile();
+
+    /** Writes the central directory, the archive is complete afterwards */
+    bool finish();
+
+    /** False once a write to the device failed */
+    bool isValid() const { return m_valid; }
+    qint64 bytesWritten() const { return m_offset; }
+
+private:
+    struct Entry {
+        QByteArray name;
+        quint64 offset;
+        quint64 compressedSize;
+        quint64 size;
+        quint32 crc;
+        quint16 method;
+        quint16 dosTime;
+        quint16 dosDate;
+        bool dir;
+    };
+
+    void writeLocalHeader(const Entry &entry);
+    bool deflate(const char *data, qint64 len, int flush);
+    bool write(const QByteArray &data);
+    bool write(const char *data, qint64 len);
+
+    QIODevice *m_out;
+    std::vector<Entry> m_entries;
+    z_stream_s *m_zstream = nullptr;
+    QByteArray m_buffer;
+    qint64 m_offset = 0;
+    int m_level;
+    bool m_inFile = false;
+    bool m_valid = true;
+};
+
+#endif // ZIPSTREAM_H
@@ -0,0 +1,219 @@
+#include "zstdfile.h"
+
+#include <QFileDevice>
+#include <QtEndian>
+
+#include <algorithm>
+
+#include <string.h>
+
+#include <zstd.h>
+
+namespace {
+
+const quint32 SeekTableMagic = 0x184D2A5E;
+const quint32 SeekableMagic = 0x8F92EAB1;
+
+inline void put32(QByteArray &out, quint32 value)
+{
+    char data[4];
+    qToLittleEndian(value, data);
+    out.append(data, 4);
+}
+
+}
+
+ZstdWriter::ZstdWriter(QIODevice *out, int level, QObject *parent) : QIODevice(parent)
+  , m_out(out)
+  , m_cctx(ZSTD_createCCtx())
+{
+    ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_compressionLevel, level);
+    // Corruption at rest is caught when reading rather than served
+    ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_checksumFlag, 1);
+    m_buffer.reserve(StoredFile::FrameSize);
+    m_frame.resize(int(ZSTD_compressBound(StoredFile::FrameSize)));
+}
+
+ZstdWriter::~ZstdWriter()
+{
+    ZSTD_freeCCtx(m_cctx);
+}
+
+bool ZstdWriter::open(OpenMode mode)
+{
+    if (!QIODevice::open(mode | QIODevice::Unbuffered)) {
+        return false;
+    }
+
+    const QByteArray header = StoredFile::header();
+    if (m_out->write(header) != header.size()) {
+        setErrorString(m_out->errorString());
+        return false;
+    }
+    return true;
+}
+
+bool ZstdWriter::finish()
+{
+    if (!m_buffer.isEmpty() && !writeFrame(m_buffer.constData(), m_buffer.size())) {
+        return false;
+    }
+    m_buffer.clear();
+
+    // The seek table of the zstd seekable format, in a skippable frame
+    QByteArray table;
+    put32(table, SeekTableMagic);
+    put32(table, quint32(m_table.size() + 9));
+    table.append(m_table);
+    put32(table, m_count);
+    table.append('\0');
+    put32(table, SeekableMagic);
+    if (m_out->write(table) != table.size()) {
+        setErrorString(m_out->errorString());
+        return false;
+    }
+    return true;
+}
+
+qint64 ZstdWriter::readData(char *data, qint64 maxSize)
+{
+    Q_UNUSED(data)
+    Q_UNUSED(maxSize)
+    return -1;
+}
+
+qint64 ZstdWriter::writeData(const char *data, qint64 len)
+{
+    qint64 done = 0;
+    while (done < len) {
+        // Whole frames don't need to go through the buffer
+        if (m_buffer.isEmpty() && len - done >= StoredFile::FrameSize) {
+            if (!writeFrame(data + done, StoredFile::FrameSize)) {
+                return -1;
+            }
+            done += StoredFile::FrameSize;
+            continue;
+        }
+
+        const int take = int(qMin(len - done, qint64(StoredFile::FrameSize - m_buffer.size())));
+        m_buffer.append(data + done, take);
+        done += take;
+        if (m_buffer.size() == StoredFile::FrameSize) {
+            if (!writeFrame(m_buffer.constData(), m_buffer.size())) {
+                return -1;
+            }
+            m_buffer.clear();
+        }
+    }
+    return len;
+}
+
+bool ZstdWriter::writeFrame(const char *data, int len)
+{
+    const size_t size = ZSTD_compress2(m_cctx, m_frame.data(), size_t(m_frame.size()), data, size_t(len));
+    if (ZSTD_isError(size)) {
+        setErrorString(QString::fromLatin1(ZSTD_getErrorName(size)));
+        return false;
+    }
+
+    if (m_out->write(m_frame.constData(), qint64(size)) != qint64(size)) {
+        setErrorString(m_out->errorString());
+        return false;
+    }
+    put32(m_table, quint32(size));
+    put32(m_table, quint32(len));
+    ++m_count;
+    return true;
+}
+
+ZstdReader::ZstdReader(QFileDevice *file, const std::vector<StoredFile::Frame> &frames, QObject *parent) : QIODevice(parent)
+  , m_file(file)
+  , m_dctx(ZSTD_createDCtx())
+  , m_frames(frames)
+  , m_decoded(frames.size())
+{
+    m_file->setParent(this);
+    if (!m_frames.empty()) {
+        m_size = m_frames.back().start + m_frames.back().size;
+    }
+}
+
+ZstdReader::~ZstdReader()
+{
+    ZSTD_freeDCtx(m_dctx);
+}
+
+bool ZstdReader::open(OpenMode mode)
+{
+    return QIODevice::open(mode | QIODevice::Unbuffered);
+}
+
+bool ZstdReader::isSequential() const
+{
+    return false;
+}
+
+qint64 ZstdReader::size() const
+{
+    return m_size;
+}
+
+bool ZstdReader::seek(qint64 pos)
+{
+    if (!QIODevice::seek(pos)) {
+        return false;
+    }
+    m_pos = pos;
+    return true;
+}
+
+qint64 ZstdReader::readData(char *data, qint64 maxSize)
+{
+    qint64 done = 0;
+    while (done < maxSize && m_pos < m_size) {
+        // The last frame starting at or before the position
+        auto it = std::upper_bound(m_frames.begin(), m_frames.end(), m_pos, [] (qint64 pos, const StoredFile::Frame &frame) {
+            return pos < frame.start;
+        });
+        const size_t frame = size_t(it - m_frames.begin()) - 1;
+        if (frame != m_decoded && !decode(frame)) {
+            return done ? done : -1;
+        }
+
+        const StoredFile::Frame &current = m_frames[frame];
+        const qint64 within = m_pos - current.start;
+        const qint64 len = qMin(maxSize - done, qint64(current.size) - within);
+        memcpy(data + done, m_out.constData() + within, size_t(len));
+        done += len;
+        m_pos += len;
+    }
+    return done;
+}
+
+qint64 ZstdReader::writeData(const char *data, qint64 len)
+{
+    Q_UNUSED(data)
+    Q_UNUSED(len)
+    return -1;
+}
+
+bool ZstdReader::decode(size_t frame)
+{
+    const StoredFile::Frame &current = m_frames[frame];
+    m_in.resize(int(current.compressedSize));
+    if (!m_file->seek(current.offset) || m_file->read(m_in.data(), m_in.size()) != m_in.size()) {
+        setErrorString(m_file->errorString());
+        return false;
+    }
+
+    m_out.resize(int(current.size));
+    const size_t size = ZSTD_decompressDCtx(m_dctx, m_out.data(), size_t(m_out.size()), m_in.constData(), size_t(m_in.size()));
+    if (ZSTD_isError(size) || size != current.size) {
+        setErrorString(ZSTD_isError(size) ? QString::fromLatin1(ZSTD_getErrorName(size))
+                                          : QStringLiteral("Frame shorter than its seek table entry"));
+        m_decoded = m_frames.size();
+        return false;
+    }
+    m_decoded = frame;
+    return true;
+}
@@ -0,0 +1,80 @@
+#ifndef ZSTDFILE_H
+#define ZSTDFILE_H
+
+#include "storedfile.h"
+
+#include <QIODevice>
+
+#include <vector>
+
+typedef struct ZSTD_CCtx_s ZSTD_CCtx;
+typedef struct ZSTD_DCtx_s ZSTD_DCtx;
+
+class QFileDevice;
+
+/**
+ * Compresses what is written into \p out in the StoredFile format, one
+ * frame per StoredFile::FrameSize bytes.
+ */
+class ZstdWriter : public QIODevice
+{
+    Q_OBJECT
+public:
+    ZstdWriter(QIODevice *out, int level, QObject *parent = nullptr);
+    ~ZstdWriter();
+
+    /** Writes the marker, \p mode must be WriteOnly */
+    bool open(OpenMode mode) override;
+
+    /** Writes the last frame and the seek table, false on errors */
+    bool finish();
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 len) override;
+
+private:
+    bool writeFrame(const char *data, int len);
+
+    QIODevice *m_out;
+    ZSTD_CCtx *m_cctx;
+    QByteArray m_buffer;
+    QByteArray m_frame;
+    QByteArray m_table;
+    quint32 m_count = 0;
+};
+
+/**
+ * Reads the content of a file in the StoredFile format, seeking
+ * decompresses from the start of the frame holding the new position.
+ */
+class ZstdReader : public QIODevice
+{
+    Q_OBJECT
+public:
+    ZstdReader(QFileDevice *file, const std::vector<StoredFile::Frame> &frames, QObject *parent = nullptr);
+    ~ZstdReader();
+
+    bool open(OpenMode mode) override;
+    bool isSequential() const override;
+    qint64 size() const override;
+    bool seek(qint64 pos) override;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 len) override;
+
+private:
+    bool decode(size_t frame);
+
+    QFileDevice *m_file;
+    ZSTD_DCtx *m_dctx;
+    std::vector<StoredFile::Frame> m_frames;
+    QByteArray m_in;
+    QByteArray m_out;
+    qint64 m_size = 0;
+    qint64 m_pos = 0;
+    size_t m_decoded;
+};
+
+#endif // ZSTDFILE_H
@@ -0,0 +1,130 @@
+#include "cloudlyst.h"
+#include "filesscanner.h"
+
+#include <Cutelyst/Plugins/Utils/Sql>
+
+#include <QtTest/QtTest>
+
+#include <QDir>
+#include <QFile>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QTemporaryDir>
+
+#include <unistd.h>
+
+using namespace Cutelyst;
+
+class TestFilesScanner : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+
+    void keepsHiddenFiles();
+    void keepsUnreadableDirs();
+
+private:
+    void writeFile(const QString &path, const QByteArray &content);
+    QStringList paths();
+
+    QTemporaryDir m_dir;
+    QString m_userDir;
+    QVariant m_userId;
+};
+
+void TestFilesScanner::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+    Cloudlyst::setSqliteDatabase(m_dir.filePath(QStringLiteral("test.sqlite")));
+    QVERIFY(Cloudlyst::openDatabase());
+    QVERIFY(Cloudlyst::createDB());
+
+    QSqlQuery query(Sql::databaseThread(QStringLiteral("cloudlyst")));
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO cloudlyst.users (username, password) VALUES ('test', 'test')")));
+    m_userId = query.lastInsertId();
+
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO cloudlyst.mimetypes (name) VALUES ('httpd/unix-directory')")));
+    QVERIFY(query.prepare(QStringLiteral("INSERT INTO cloudlyst.files "
+                                         "(path, name, mtime, storage_mtime, mimetype_id, size, etag, owner_id) "
+                                         "SELECT 'files', 'files', 0, 0, m.id, 0, 'dir', :owner_id "
+                                         "FROM cloudlyst.mimetypes m WHERE m.name = 'httpd/unix-directory'")));
+    query.bindValue(QStringLiteral(":owner_id"), m_userId);
+    QVERIFY2(query.exec(), qPrintable(query.lastError().databaseText()));
+
+    m_userDir = m_dir.filePath(QStringLiteral("test")) + QLatin1Char('/');
+    QVERIFY(QDir().mkpath(m_userDir + QLatin1String("files")));
+}
+
+void TestFilesScanner::keepsHiddenFiles()
+{
+    writeFile(QStringLiteral("files/a.txt"), "a");
+    writeFile(QStringLiteral("files/.hidden"), "hidden");
+    QVERIFY(QDir().mkpath(m_userDir + QLatin1String("files/.config")));
+    writeFile(QStringLiteral("files/.config/b.txt"), "b");
+
+    FilesScanner scanner;
+    QVERIFY2(scanner.scan(m_userDir, m_userId), qPrintable(scanner.errorString()));
+    QStringList expected = {
+        QStringLiteral("files/.config"),
+        QStringLiteral("files/.config/b.txt"),
+        QStringLiteral("files/.hidden"),
+        QStringLiteral("files/a.txt"),
+    };
+    QCOMPARE(paths(), expected);
+
+    // A second scan finds nothing to change
+    QVERIFY2(scanner.scan(m_userDir, m_userId), qPrintable(scanner.errorString()));
+    QCOMPARE(scanner.stats().deleted, Q_INT64_C(0));
+    QCOMPARE(scanner.stats().inserted, Q_INT64_C(0));
+    QCOMPARE(paths(), expected);
+}
+
+void TestFilesScanner::keepsUnreadableDirs()
+{
+    if (::geteuid() == 0) {
+        QSKIP("Permissions don't apply to root");
+    }
+
+    QVERIFY(QDir().mkpath(m_userDir + QLatin1String("files/locked")));
+    writeFile(QStringLiteral("files/locked/c.txt"), "c");
+
+    FilesScanner scanner;
+    QVERIFY2(scanner.scan(m_userDir, m_userId), qPrintable(scanner.errorString()));
+    QVERIFY(paths().contains(QStringLiteral("files/locked/c.txt")));
+
+    QFile locked(m_userDir + QLatin1String("files/locked"));
+    const QFileDevice::Permissions permissions = locked.permissions();
+    QVERIFY(locked.setPermissions(QFileDevice::Permissions()));
+    const bool scanned = scanner.scan(m_userDir, m_userId);
+    locked.setPermissions(permissions);
+
+    QVERIFY(!scanned);
+    QCOMPARE(scanner.stats().deleted, Q_INT64_C(0));
+    QVERIFY(paths().contains(QStringLiteral("files/locked/c.txt")));
+}
+
+void TestFilesScanner::writeFile(const QString &path, const QByteArray &content)
+{
+    QFile file(m_userDir + path);
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QCOMPARE(file.write(content), qint64(content.size()));
+}
+
+QStringList TestFilesScanner::paths()
+{
+    QStringList ret;
+    QSqlQuery query(Sql::databaseThread(QStringLiteral("cloudlyst")));
+    query.prepare(QStringLiteral("SELECT path FROM cloudlyst.files WHERE owner_id = :owner_id AND path <> 'files' ORDER BY path"));
+    query.bindValue(QStringLiteral(":owner_id"), m_userId);
+    if (query.exec()) {
+        while (query.next()) {
+            ret.append(query.value(0).toString());
+        }
+    }
+    return ret;
+}
+
+QTEST_GUILESS_MAIN(TestFilesScanner)
+
+#include "testfilesscanner.moc"
@@ -0,0 +1,105 @@
+#include "cloudlyst.h"
+#include "filessqlasync.h"
+
+#include <Cutelyst/Plugins/Utils/Sql>
+
+#include <QtTest/QtTest>
+
+#include <QEventLoop>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QTemporaryDir>
+
+using namespace Cutelyst;
+
+class TestFilesSqlAsync : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+
+    void moveKeepsOtherCase();
+
+private:
+    void insertDir(const QString &path, const QString &name);
+    QStringList paths();
+
+    QTemporaryDir m_dir;
+    QVariant m_userId;
+};
+
+void TestFilesSqlAsync::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+    Cloudlyst::setSqliteDatabase(m_dir.filePath(QStringLiteral("test.sqlite")));
+    QVERIFY(Cloudlyst::openDatabase());
+    QVERIFY(Cloudlyst::createDB());
+
+    QSqlQuery query(Sql::databaseThread(QStringLiteral("cloudlyst")));
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO cloudlyst.users (username, password) VALUES ('test', 'test')")));
+    m_userId = query.lastInsertId();
+
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO cloudlyst.mimetypes (name) VALUES ('httpd/unix-directory')")));
+    insertDir(QStringLiteral("files"), QStringLiteral("files"));
+}
+
+void TestFilesSqlAsync::moveKeepsOtherCase()
+{
+    // LIKE ignores ASCII case on SQLite, files/docs is another tree
+    insertDir(QStringLiteral("files/Docs"), QStringLiteral("Docs"));
+    insertDir(QStringLiteral("files/Docs/a"), QStringLiteral("a"));
+    insertDir(QStringLiteral("files/docs"), QStringLiteral("docs"));
+    insertDir(QStringLiteral("files/docs/b"), QStringLiteral("b"));
+    insertDir(QStringLiteral("files/Docsx"), QStringLiteral("Docsx"));
+
+    QString error = QStringLiteral("not called");
+    QEventLoop loop;
+    FilesSqlAsync::move(QStringLiteral("files/Docs"), QStringLiteral("files/Moved"), QStringLiteral("Moved"), m_userId,
+                        &loop, [&loop, &error] (int, const QString &moveError) {
+        error = moveError;
+        loop.quit();
+    });
+    QTimer::singleShot(5000, &loop, &QEventLoop::quit);
+    loop.exec();
+    QVERIFY2(error.isEmpty(), qPrintable(error));
+
+    const QStringList expected = {
+        QStringLiteral("files/Docsx"),
+        QStringLiteral("files/Moved"),
+        QStringLiteral("files/Moved/a"),
+        QStringLiteral("files/docs"),
+        QStringLiteral("files/docs/b"),
+    };
+    QCOMPARE(paths(), expected);
+}
+
+void TestFilesSqlAsync::insertDir(const QString &path, const QString &name)
+{
+    QSqlQuery query(Sql::databaseThread(QStringLiteral("cloudlyst")));
+    QVERIFY(query.prepare(QStringLiteral("INSERT INTO cloudlyst.files "
+                                         "(path, name, mtime, storage_mtime, mimetype_id, size, etag, owner_id) "
+                                         "SELECT :path, :name, 0, 0, m.id, 0, 'dir', :owner_id "
+                                         "FROM cloudlyst.mimetypes m WHERE m.name = 'httpd/unix-directory'")));
+    query.bindValue(QStringLiteral(":path"), path);
+    query.bindValue(QStringLiteral(":name"), name);
+    query.bindValue(QStringLiteral(":owner_id"), m_userId);
+    QVERIFY2(query.exec(), qPrintable(query.lastError().databaseText()));
+}
+
+QStringList TestFilesSqlAsync::paths()
+{
+    QStringList ret;
+    QSqlQuery query(Sql::databaseThread(QStringLiteral("cloudlyst")));
+    query.prepare(QStringLiteral("SELECT path FROM cloudlyst.files WHERE owner_id = :owner_id AND path <> 'files' ORDER BY path"));
+    query.bindValue(QStringLiteral(":owner_id"), m_userId);
+    if (query.exec()) {
+        while (query.next()) {
+            ret.append(query.value(0).toString());
+        }
+    }
+    return ret;
+}
+
+QTEST_GUILESS_MAIN(TestFilesSqlAsync)
+
+#include "testfilessqlasync.moc"
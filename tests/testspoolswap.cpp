@@ -0,0 +1,217 @@
+#include "cloudlyst.h"
+#include "filessqlasync.h"
+#include "spoolswap.h"
+
+#include <Cutelyst/Plugins/Utils/Sql>
+
+#include <QtTest/QtTest>
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QEventLoop>
+#include <QFile>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QTemporaryDir>
+
+#include <memory>
+
+#include <errno.h>
+
+using namespace Cutelyst;
+
+class TestSpoolSwap : public QObject
+{
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void init();
+
+    void rollback();
+    void commit();
+    void putBulk();
+
+private:
+    void writeFile(const QString &path, const QByteArray &content);
+    QByteArray readFile(const QString &path);
+    QString spool(const QByteArray &content);
+    QStringList spooled();
+
+    QTemporaryDir m_dir;
+    QString m_userDir;
+    QString m_spoolDir;
+    QVariant m_userId;
+    int m_spools = 0;
+};
+
+void TestSpoolSwap::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+    Cloudlyst::setSqliteDatabase(m_dir.filePath(QStringLiteral("test.sqlite")));
+    QVERIFY(Cloudlyst::openDatabase());
+    QVERIFY(Cloudlyst::createDB());
+
+    QSqlQuery query(Sql::databaseThread(QStringLiteral("cloudlyst")));
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO cloudlyst.users (username, password) VALUES ('test', 'test')")));
+    m_userId = query.lastInsertId();
+
+    QVERIFY(query.exec(QStringLiteral("INSERT INTO cloudlyst.mimetypes (name) VALUES ('httpd/unix-directory')")));
+    QVERIFY(query.prepare(QStringLiteral("INSERT INTO cloudlyst.files "
+                                         "(path, name, mtime, storage_mtime, mimetype_id, size, etag, owner_id) "
+                                         "SELECT 'files', 'files', 0, 0, m.id, 0, 'dir', :owner_id "
+                                         "FROM cloudlyst.mimetypes m WHERE m.name = 'httpd/unix-directory'")));
+    query.bindValue(QStringLiteral(":owner_id"), m_userId);
+    QVERIFY2(query.exec(), qPrintable(query.lastError().databaseText()));
+
+    m_userDir = m_dir.filePath(QStringLiteral("test")) + QLatin1Char('/');
+    m_spoolDir = m_dir.filePath(QStringLiteral("spool")) + QLatin1Char('/');
+    QVERIFY(QDir().mkpath(m_spoolDir));
+}
+
+void TestSpoolSwap::init()
+{
+    QDir(m_userDir).removeRecursively();
+    QVERIFY(QDir().mkpath(m_userDir + QLatin1String("files/unknown")));
+}
+
+void TestSpoolSwap::rollback()
+{
+    writeFile(QStringLiteral("files/a.txt"), "old a");
+    writeFile(QStringLiteral("files/c.txt"), "old c");
+
+    // An existing file, a new one, and each of them sent twice
+    SpoolSwap swap;
+    QVERIFY(swap.place(spool("new a"), m_userDir + QLatin1String("files/a.txt")));
+    QVERIFY(swap.place(spool("new b"), m_userDir + QLatin1String("files/b.txt")));
+    QVERIFY(swap.place(spool("new c 1"), m_userDir + QLatin1String("files/c.txt")));
+    QVERIFY(swap.place(spool("new c 2"), m_userDir + QLatin1String("files/c.txt")));
+    QVERIFY(swap.place(spool("new d 1"), m_userDir + QLatin1String("files/d.txt")));
+    QVERIFY(swap.place(spool("new d 2"), m_userDir + QLatin1String("files/d.txt")));
+    QCOMPARE(readFile(QStringLiteral("files/a.txt")), QByteArray("new a"));
+    QCOMPARE(readFile(QStringLiteral("files/c.txt")), QByteArray("new c 2"));
+    QCOMPARE(readFile(QStringLiteral("files/d.txt")), QByteArray("new d 2"));
+
+    for (const QString &name : { QStringLiteral("a"), QStringLiteral("b"), QStringLiteral("c"), QStringLiteral("d") }) {
+        swap.rollback(m_userDir + QLatin1String("files/") + name + QLatin1String(".txt"));
+    }
+    QCOMPARE(readFile(QStringLiteral("files/a.txt")), QByteArray("old a"));
+    QCOMPARE(readFile(QStringLiteral("files/c.txt")), QByteArray("old c"));
+    QVERIFY(!QFile::exists(m_userDir + QLatin1String("files/b.txt")));
+    QVERIFY(!QFile::exists(m_userDir + QLatin1String("files/d.txt")));
+    QCOMPARE(spooled(), QStringList());
+}
+
+void TestSpoolSwap::commit()
+{
+    writeFile(QStringLiteral("files/a.txt"), "old a");
+
+    SpoolSwap swap;
+    QVERIFY(swap.place(spool("new a 1"), m_userDir + QLatin1String("files/a.txt")));
+    QVERIFY(swap.place(spool("new a 2"), m_userDir + QLatin1String("files/a.txt")));
+    QVERIFY(swap.place(spool("new b"), m_userDir + QLatin1String("files/b.txt")));
+    const QString orphan = spool("no parent");
+    QVERIFY(!swap.place(orphan, m_userDir + QLatin1String("files/missing/e.txt")));
+    QCOMPARE(errno, ENOENT);
+    QVERIFY(QFile::remove(orphan));
+
+    swap.commit(m_userDir + QLatin1String("files/a.txt"));
+    swap.commit(m_userDir + QLatin1String("files/b.txt"));
+    QCOMPARE(readFile(QStringLiteral("files/a.txt")), QByteArray("new a 2"));
+    QCOMPARE(readFile(QStringLiteral("files/b.txt")), QByteArray("new b"));
+    QCOMPARE(spooled(), QStringList());
+}
+
+void TestSpoolSwap::putBulk()
+{
+    // files/unknown is on disk but not in the database, so its puts fail
+    // while the others go in, as with a bulk upload
+    writeFile(QStringLiteral("files/a.txt"), "old a");
+    writeFile(QStringLiteral("files/unknown/c.txt"), "old c");
+
+    const QStringList paths = {
+        QStringLiteral("files/a.txt"),
+        QStringLiteral("files/b.txt"),
+        QStringLiteral("files/unknown/c.txt"),
+        QStringLiteral("files/unknown/d.txt"),
+    };
+    auto swap = std::make_shared<SpoolSwap>();
+    std::vector<FilePut> puts;
+    for (const QString &path : paths) {
+        const QByteArray content = "new " + path.toUtf8();
+        QVERIFY(swap->place(spool(content), m_userDir + path));
+
+        FilePut put;
+        put.path = path;
+        put.parentPath = FilesSql::parentPath(path);
+        put.name = path.section(QLatin1Char('/'), -1);
+        put.mimetype = QStringLiteral("text/plain");
+        put.etag = QString::fromLatin1(QCryptographicHash::hash(content, QCryptographicHash::Md5).toHex());
+        put.mtime = 1546300800;
+        put.storageMtime = 1546300800;
+        put.size = content.size();
+        puts.push_back(put);
+    }
+
+    QHash<QString, qint64> ids;
+    QEventLoop loop;
+    FilesSqlAsync::putBulk(puts, m_userId, &loop, [&] (const QHash<QString, qint64> &fileIds, const QString &) {
+        ids = fileIds;
+        for (const FilePut &put : puts) {
+            if (fileIds.value(put.path)) {
+                swap->commit(m_userDir + put.path);
+            } else {
+                swap->rollback(m_userDir + put.path);
+            }
+        }
+        loop.quit();
+    });
+    QTimer::singleShot(5000, &loop, &QEventLoop::quit);
+    loop.exec();
+
+    QVERIFY(ids.value(paths.at(0)));
+    QVERIFY(ids.value(paths.at(1)));
+    QVERIFY(!ids.value(paths.at(2)));
+    QVERIFY(!ids.value(paths.at(3)));
+    QCOMPARE(readFile(paths.at(0)), QByteArray("new files/a.txt"));
+    QCOMPARE(readFile(paths.at(1)), QByteArray("new files/b.txt"));
+    QCOMPARE(readFile(paths.at(2)), QByteArray("old c"));
+    QVERIFY(!QFile::exists(m_userDir + paths.at(3)));
+    QCOMPARE(spooled(), QStringList());
+}
+
+void TestSpoolSwap::writeFile(const QString &path, const QByteArray &content)
+{
+    QFile file(m_userDir + path);
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QCOMPARE(file.write(content), qint64(content.size()));
+}
+
+QByteArray TestSpoolSwap::readFile(const QString &path)
+{
+    QFile file(m_userDir + path);
+    return file.open(QIODevice::ReadOnly) ? file.readAll() : QByteArray();
+}
+
+QString TestSpoolSwap::spool(const QByteArray &content)
+{
+    const QString name = m_spoolDir + QStringLiteral("bulk-%1").arg(++m_spools);
+    QFile file(name);
+    if (file.open(QIODevice::WriteOnly)) {
+        file.write(content);
+    }
+    return name;
+}
+
+QStringList TestSpoolSwap::spooled()
+{
+    QStringList ret;
+    const QStringList names = QDir(m_spoolDir).entryList(QDir::Files);
+    for (const QString &name : names) {
+        ret.append(m_spoolDir + name);
+    }
+    return ret;
+}
+
+QTEST_GUILESS_MAIN(TestSpoolSwap)
+
+#include "testspoolswap.moc"
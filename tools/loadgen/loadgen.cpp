@@ -0,0 +1,321 @@
+#include "loadgen.h"
+
+#include <QDir>
+#include <QFile>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QTextStream>
+#include <QTimer>
+#include <QXmlStreamReader>
+
+#include <algorithm>
+#include <cmath>
+
+static const QByteArray propfindBody = QByteArrayLiteral(
+            "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+            "<d:propfind xmlns:d=\"DAV:\"><d:prop xmlns:oc=\"http://owncloud.org/ns\">"
+            "<d:resourcetype/><d:getlastmodified/><d:getcontentlength/><d:getetag/>"
+            "<oc:id/><oc:downloadURL/><oc:dDC/><oc:permissions/><oc:checksums/>"
+            "</d:prop></d:propfind>\n");
+
+void LoadStats::record(const QString &method, qint64 usecs, bool ok, qint64 bytesIn, qint64 bytesOut)
+{
+    MethodStats &stats = m_methods[method];
+    stats.latencies.push_back(usecs);
+    if (!ok) {
+        ++stats.errors;
+    }
+    stats.bytesIn += bytesIn;
+    stats.bytesOut += bytesOut;
+}
+
+QString LoadStats::report(qint64 elapsedMs) const
+{
+    QString ret;
+    QTextStream out(&ret);
+    const double secs = qMax<qint64>(1, elapsedMs) / 1000.0;
+
+    auto percentile = [] (const std::vector<qint64> &sorted, double p) -> double {
+        if (sorted.empty()) {
+            return 0;
+        }
+        const size_t idx = size_t(std::ceil(p * sorted.size())) - 1;
+        return sorted[qMin(idx, sorted.size() - 1)] / 1000.0;
+    };
+
+    out << qSetFieldWidth(12) << left << "method" << right
+        << "requests" << "req/s" << "errors" << "p50 ms" << "p95 ms" << "p99 ms" << "max ms" << "MiB in" << "MiB out"
+        << qSetFieldWidth(0) << '\n';
+
+    qint64 total = 0;
+    QStringList methods = m_methods.keys();
+    methods.sort();
+    for (const QString &method : methods) {
+        const MethodStats &stats = m_methods[method];
+        std::vector<qint64> sorted = stats.latencies;
+        std::sort(sorted.begin(), sorted.end());
+        total += qint64(sorted.size());
+
+        out << qSetFieldWidth(12) << left << method << right
+            << qint64(sorted.size())
+            << QString::number(sorted.size() / secs, 'f', 1)
+            << stats.errors
+            << QString::number(percentile(sorted, 0.50), 'f', 2)
+            << QString::number(percentile(sorted, 0.95), 'f', 2)
+            << QString::number(percentile(sorted, 0.99), 'f', 2)
+            << QString::number(sorted.empty() ? 0 : sorted.back() / 1000.0, 'f', 2)
+            << QString::number(stats.bytesIn / (1024.0 * 1024.0), 'f', 1)
+            << QString::number(stats.bytesOut / (1024.0 * 1024.0), 'f', 1)
+            << qSetFieldWidth(0) << '\n';
+    }
+    out << "total " << total << " requests in " << QString::number(secs, 'f', 1) << "s, "
+        << QString::number(total / secs, 'f', 1) << " req/s\n";
+
+    return ret;
+}
+
+LoadClient::LoadClient(int id, const LoadOptions &options, LoadStats *stats, QObject *parent) : QObject(parent)
+  , m_options(options)
+  , m_stats(stats)
+  , m_rng(options.seed + quint32(id))
+  , m_id(id)
+{
+    m_authorization = "Basic " + (options.user + QLatin1Char(':') + options.password).toUtf8().toBase64();
+    m_dirs.append(QString());
+}
+
+void LoadClient::start()
+{
+    m_running = true;
+    next();
+}
+
+void LoadClient::stop()
+{
+    m_running = false;
+}
+
+void LoadClient::replay(const QJsonObject &record)
+{
+    QHash<QByteArray, QByteArray> headers;
+    const QString method = record.value(QStringLiteral("method")).toString();
+    const QString path = record.value(QStringLiteral("path")).toString();
+
+    QByteArray body;
+    if (method == QLatin1String("PROPFIND")) {
+        headers.insert("Depth", record.value(QStringLiteral("depth")).toString(QStringLiteral("1")).toLatin1());
+        body = propfindBody;
+    } else if (method == QLatin1String("PUT")) {
+        body = QByteArray(record.value(QStringLiteral("size")).toInt(m_options.putSize), 'x');
+    } else if (method == QLatin1String("MOVE") || method == QLatin1String("COPY")) {
+        headers.insert("Destination", davUrl(record.value(QStringLiteral("destination")).toString()).toEncoded());
+    }
+
+    send(method, path, body, headers);
+}
+
+void LoadClient::next()
+{
+    if (!m_running) {
+        return;
+    }
+
+    // Startup sequence of the desktop client
+    switch (m_step++) {
+    case 0:
+        send(QStringLiteral("GET"), QStringLiteral("status.php"));
+        return;
+    case 1:
+        send(QStringLiteral("GET"), QStringLiteral("ocs/v1.php/cloud/capabilities?format=json"));
+        return;
+    case 2:
+        send(QStringLiteral("PROPFIND"), QString(), propfindBody, {{ "Depth", "0" }});
+        return;
+    }
+
+    // MOVE/DELETE burst over the files this client uploaded
+    if (m_burst > 0 && !m_created.isEmpty()) {
+        --m_burst;
+        if (m_burst % 2) {
+            const QString path = m_created.takeLast();
+            m_created.append(path + QLatin1String(".moved"));
+            send(QStringLiteral("MOVE"), path, QByteArray(), {{ "Destination", davUrl(path + QLatin1String(".moved")).toEncoded() }});
+        } else {
+            send(QStringLiteral("DELETE"), m_created.takeFirst());
+        }
+        return;
+    }
+    m_burst = 0;
+
+    std::uniform_int_distribution<int> dist(0, 99);
+    const int roll = dist(m_rng);
+    if (roll < 40) {
+        send(QStringLiteral("PROPFIND"), randomEntry(m_dirs), propfindBody, {{ "Depth", "1" }});
+    } else if (roll < 60 && !m_files.isEmpty()) {
+        send(QStringLiteral("GET"), randomEntry(m_files));
+    } else if (roll < 75) {
+        const QString path = randomEntry(m_dirs) + QLatin1String("loadgen-") + QString::number(m_id)
+                + QLatin1Char('-') + QString::number(m_rng()) + QLatin1String(".bin");
+        m_created.append(path);
+        send(QStringLiteral("PUT"), path, QByteArray(m_options.putSize, char('a' + m_id % 26)));
+    } else if (roll < 80 && !m_created.isEmpty()) {
+        send(QStringLiteral("PUT"), randomEntry(m_created), QByteArray(m_options.putSize, 'o'));
+    } else if (roll < 90 && !m_created.isEmpty()) {
+        m_burst = qMin(10, m_created.size() * 2);
+        next();
+    } else if (roll < 95) {
+        send(QStringLiteral("GET"), QStringLiteral("ocs/v1.php/cloud/capabilities?format=json"));
+    } else {
+        send(QStringLiteral("GET"), QStringLiteral("status.php"));
+    }
+}
+
+void LoadClient::send(const QString &method, const QString &path, const QByteArray &body, const QHash<QByteArray, QByteArray> &headers)
+{
+    const bool dav = !path.startsWith(QLatin1String("status.php")) && !path.startsWith(QLatin1String("ocs/"));
+    QNetworkRequest request(dav ? davUrl(path) : m_options.baseUrl.resolved(QUrl(path)));
+    request.setRawHeader("Authorization", m_authorization);
+    request.setRawHeader("User-Agent", "Mozilla/5.0 (Linux) mirall/2.5.1 (cloudlyst-loadgen)");
+    for (auto it = headers.constBegin(); it != headers.constEnd(); ++it) {
+        request.setRawHeader(it.key(), it.value());
+    }
+    if (!body.isEmpty()) {
+        request.setHeader(QNetworkRequest::ContentTypeHeader, method == QLatin1String("PUT")
+                          ? QByteArrayLiteral("application/octet-stream") : QByteArrayLiteral("application/xml"));
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    QNetworkReply *reply = m_nam.sendCustomRequest(request, method.toLatin1(), body);
+    const qint64 bytesOut = body.size();
+    connect(reply, &QNetworkReply::finished, this, [this, reply, method, path, timer, bytesOut] {
+        finished(reply, method, path, timer, bytesOut);
+    });
+}
+
+void LoadClient::finished(QNetworkReply *reply, const QString &method, const QString &path, const QElapsedTimer &timer, qint64 bytesOut)
+{
+    reply->deleteLater();
+
+    const QByteArray data = reply->readAll();
+    const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    m_stats->record(method, timer.nsecsElapsed() / 1000, status >= 200 && status < 400, data.size(), bytesOut);
+
+    if (method == QLatin1String("PROPFIND") && status == 207) {
+        discover(path, data);
+    } else if (method == QLatin1String("DELETE") || (method == QLatin1String("GET") && status == 404)) {
+        m_files.removeAll(path);
+    }
+
+    if (m_options.thinkMs) {
+        QTimer::singleShot(m_options.thinkMs, this, &LoadClient::next);
+    } else {
+        QTimer::singleShot(0, this, &LoadClient::next);
+    }
+}
+
+void LoadClient::discover(const QString &path, const QByteArray &xml)
+{
+    Q_UNUSED(path)
+    const QString davPath = davUrl(QString()).path();
+
+    QXmlStreamReader reader(xml);
+    while (!reader.atEnd()) {
+        if (reader.readNext() == QXmlStreamReader::StartElement && reader.name() == QLatin1String("href")) {
+            QString href = QUrl::fromPercentEncoding(reader.readElementText().toUtf8());
+            if (!href.startsWith(davPath)) {
+                continue;
+            }
+            href = href.mid(davPath.size());
+            if (href.isEmpty()) {
+                continue;
+            }
+
+            if (href.endsWith(QLatin1Char('/'))) {
+                if (!m_dirs.contains(href)) {
+                    m_dirs.append(href);
+                }
+            } else if (!m_files.contains(href) && m_files.size() < 10000) {
+                m_files.append(href);
+            }
+        }
+    }
+}
+
+QUrl LoadClient::davUrl(const QString &path) const
+{
+    QUrl url = m_options.baseUrl;
+    url.setPath(url.path() + QLatin1String("remote.php/webdav/") + path);
+    return url;
+}
+
+QString LoadClient::randomEntry(const QStringList &list)
+{
+    std::uniform_int_distribution<int> dist(0, list.size() - 1);
+    return list.at(dist(m_rng));
+}
+
+bool DatasetGenerator::generate(const QString &outputDir, QString &error)
+{
+    std::mt19937 rng(seed);
+    m_dirs = m_files = m_bytes = 0;
+
+    const QString root = QDir(outputDir).filePath(QStringLiteral("files"));
+    if (!QDir().mkpath(root)) {
+        error = QLatin1String("Failed to create ") + root;
+        return false;
+    }
+
+    const bool ret = generateDir(root, 0, rng, error);
+    QTextStream(stdout) << "generated " << m_dirs << " dirs, " << m_files << " files, "
+                        << QString::number(m_bytes / (1024.0 * 1024.0), 'f', 1) << " MiB in " << root << endl;
+    return ret;
+}
+
+bool DatasetGenerator::generateDir(const QString &dir, int level, std::mt19937 &rng, QString &error)
+{
+    // Log-normal sizes: lots of small files and a long tail of big ones
+    std::lognormal_distribution<double> sizeDist(std::log(double(qMax<qint64>(1, meanFileSize))) - 0.5, 1.0);
+
+    QByteArray block(64 * 1024, Qt::Uninitialized);
+    for (int i = 0; i < filesPerDir; ++i) {
+        QFile file(dir + QLatin1String("/file-") + QString::number(i) + QLatin1String(".dat"));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            error = file.errorString();
+            return false;
+        }
+
+        qint64 remaining = qint64(sizeDist(rng));
+        m_bytes += remaining;
+        while (remaining > 0) {
+            for (int j = 0; j < block.size(); j += 4) {
+                const quint32 value = rng();
+                memcpy(block.data() + j, &value, 4);
+            }
+            const qint64 len = qMin<qint64>(remaining, block.size());
+            if (file.write(block.constData(), len) != len) {
+                error = file.errorString();
+                return false;
+            }
+            remaining -= len;
+        }
+        ++m_files;
+    }
+
+    if (level >= depth) {
+        return true;
+    }
+
+    for (int i = 0; i < dirsPerDir; ++i) {
+        const QString subdir = dir + QLatin1String("/dir-") + QString::number(level) + QLatin1Char('-') + QString::number(i);
+        if (!QDir().mkpath(subdir)) {
+            error = QLatin1String("Failed to create ") + subdir;
+            return false;
+        }
+        ++m_dirs;
+        if (!generateDir(subdir, level + 1, rng, error)) {
+            return false;
+        }
+    }
+    return true;
+}
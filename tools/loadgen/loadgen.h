@@ -0,0 +1,110 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QJsonObject>
+#include <QNetworkAccessManager>
+#include <QStringList>
+#include <QUrl>
+
+#include <random>
+#include <vector>
+
+class QNetworkReply;
+
+/**
+ * Latency and throughput bookkeeping shared by all simulated clients.
+ */
+class LoadStats
+{
+public:
+    void record(const QString &method, qint64 usecs, bool ok, qint64 bytesIn, qint64 bytesOut);
+    QString report(qint64 elapsedMs) const;
+
+private:
+    struct MethodStats {
+        std::vector<qint64> latencies;
+        qint64 errors = 0;
+        qint64 bytesIn = 0;
+        qint64 bytesOut = 0;
+    };
+
+    QHash<QString, MethodStats> m_methods;
+};
+
+struct LoadOptions
+{
+    QUrl baseUrl;
+    QString user;
+    QString password;
+    int thinkMs = 0;
+    int putSize = 16 * 1024;
+    quint32 seed = 1;
+};
+
+/**
+ * One simulated Nextcloud desktop client session: polls status and
+ * capabilities, discovers the tree with Depth-1 PROPFIND storms and
+ * mixes GET/PUT with MOVE/DELETE bursts.
+ */
+class LoadClient : public QObject
+{
+    Q_OBJECT
+public:
+    LoadClient(int id, const LoadOptions &options, LoadStats *stats, QObject *parent = nullptr);
+
+    void start();
+    void stop();
+
+    /** Sends a recorded request instead of a synthetic one */
+    void replay(const QJsonObject &record);
+
+private:
+    void next();
+    void send(const QString &method, const QString &path, const QByteArray &body = QByteArray(),
+              const QHash<QByteArray, QByteArray> &headers = QHash<QByteArray, QByteArray>());
+    void finished(QNetworkReply *reply, const QString &method, const QString &path, const QElapsedTimer &timer, qint64 bytesOut);
+    void discover(const QString &path, const QByteArray &xml);
+    QUrl davUrl(const QString &path) const;
+    QString randomEntry(const QStringList &list);
+
+    QNetworkAccessManager m_nam;
+    LoadOptions m_options;
+    LoadStats *m_stats;
+    std::mt19937 m_rng;
+    QStringList m_dirs;
+    QStringList m_files;
+    QStringList m_created;
+    QByteArray m_authorization;
+    int m_id;
+    int m_step = 0;
+    int m_burst = 0;
+    bool m_running = false;
+};
+
+/**
+ * Writes a reproducible tree of directories and files, meant to be
+ * dropped into DataDir/<user>/ and ingested with cloudlyst-scan.
+ */
+class DatasetGenerator
+{
+public:
+    int depth = 3;
+    int dirsPerDir = 5;
+    int filesPerDir = 20;
+    qint64 meanFileSize = 64 * 1024;
+    quint32 seed = 1;
+
+    bool generate(const QString &outputDir, QString &error);
+
+private:
+    bool generateDir(const QString &dir, int level, std::mt19937 &rng, QString &error);
+
+    qint64 m_dirs = 0;
+    qint64 m_files = 0;
+    qint64 m_bytes = 0;
+};
+
+#endif // LOADGEN_H
@@ -0,0 +1,146 @@
+#include "loadgen.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QTextStream>
+#include <QTimer>
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("cloudlyst-loadgen"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Replays sync client traffic against a Cloudlyst server"));
+    parser.addHelpOption();
+    parser.addOptions({
+                          {QStringLiteral("url"), QStringLiteral("Server base URL."), QStringLiteral("url"), QStringLiteral("http://localhost:3000/")},
+                          {QStringLiteral("user"), QStringLiteral("Username."), QStringLiteral("username")},
+                          {QStringLiteral("password"), QStringLiteral("Password."), QStringLiteral("password")},
+                          {QStringLiteral("clients"), QStringLiteral("Simulated clients."), QStringLiteral("n"), QStringLiteral("10")},
+                          {QStringLiteral("duration"), QStringLiteral("Run time in seconds."), QStringLiteral("secs"), QStringLiteral("30")},
+                          {QStringLiteral("think"), QStringLiteral("Pause between requests of a client."), QStringLiteral("ms"), QStringLiteral("0")},
+                          {QStringLiteral("put-size"), QStringLiteral("Body size of synthetic PUTs."), QStringLiteral("bytes"), QStringLiteral("16384")},
+                          {QStringLiteral("seed"), QStringLiteral("Random seed."), QStringLiteral("n"), QStringLiteral("1")},
+                          {QStringLiteral("interval"), QStringLiteral("Print intermediate reports."), QStringLiteral("secs"), QStringLiteral("0")},
+                          {QStringLiteral("replay"), QStringLiteral("Replay a recorded session (JSON lines) instead of the synthetic mix."), QStringLiteral("file")},
+                          {QStringLiteral("speed"), QStringLiteral("Replay speed factor."), QStringLiteral("x"), QStringLiteral("1")},
+                          {QStringLiteral("generate"), QStringLiteral("Generate a dataset in dir and exit."), QStringLiteral("dir")},
+                          {QStringLiteral("depth"), QStringLiteral("Dataset tree depth."), QStringLiteral("n"), QStringLiteral("3")},
+                          {QStringLiteral("dirs"), QStringLiteral("Dataset subdirectories per directory."), QStringLiteral("n"), QStringLiteral("5")},
+                          {QStringLiteral("files"), QStringLiteral("Dataset files per directory."), QStringLiteral("n"), QStringLiteral("20")},
+                          {QStringLiteral("file-size"), QStringLiteral("Dataset mean file size."), QStringLiteral("bytes"), QStringLiteral("65536")},
+                      });
+    parser.process(app);
+
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    const quint32 seed = parser.value(QStringLiteral("seed")).toUInt();
+
+    if (parser.isSet(QStringLiteral("generate"))) {
+        DatasetGenerator generator;
+        generator.depth = parser.value(QStringLiteral("depth")).toInt();
+        generator.dirsPerDir = parser.value(QStringLiteral("dirs")).toInt();
+        generator.filesPerDir = parser.value(QStringLiteral("files")).toInt();
+        generator.meanFileSize = parser.value(QStringLiteral("file-size")).toLongLong();
+        generator.seed = seed;
+
+        QString error;
+        if (!generator.generate(parser.value(QStringLiteral("generate")), error)) {
+            err << "Failed to generate dataset: " << error << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!parser.isSet(QStringLiteral("user"))) {
+        parser.showHelp(1);
+    }
+
+    LoadOptions options;
+    options.baseUrl = QUrl(parser.value(QStringLiteral("url")));
+    if (!options.baseUrl.path().endsWith(QLatin1Char('/'))) {
+        options.baseUrl.setPath(options.baseUrl.path() + QLatin1Char('/'));
+    }
+    options.user = parser.value(QStringLiteral("user"));
+    options.password = parser.value(QStringLiteral("password"));
+    options.thinkMs = parser.value(QStringLiteral("think")).toInt();
+    options.putSize = parser.value(QStringLiteral("put-size")).toInt();
+    options.seed = seed;
+
+    LoadStats stats;
+    QVector<LoadClient *> clients;
+    const int clientCount = qMax(1, parser.value(QStringLiteral("clients")).toInt());
+    for (int i = 0; i < clientCount; ++i) {
+        clients.append(new LoadClient(i, options, &stats, &app));
+    }
+
+    qint64 durationMs = parser.value(QStringLiteral("duration")).toLongLong() * 1000;
+    if (parser.isSet(QStringLiteral("replay"))) {
+        QFile file(parser.value(QStringLiteral("replay")));
+        if (!file.open(QIODevice::ReadOnly)) {
+            err << "Failed to open " << file.fileName() << ": " << file.errorString() << endl;
+            return 1;
+        }
+
+        // Each line: {"offset_ms":0,"client":0,"method":"PROPFIND","path":"dir/","depth":"1"}
+        const double speed = qMax(0.01, parser.value(QStringLiteral("speed")).toDouble());
+        qint64 lastOffset = 0;
+        int line = 0;
+        while (!file.atEnd()) {
+            ++line;
+            const QByteArray data = file.readLine().trimmed();
+            if (data.isEmpty()) {
+                continue;
+            }
+
+            QJsonParseError error;
+            const QJsonObject record = QJsonDocument::fromJson(data, &error).object();
+            if (error.error != QJsonParseError::NoError) {
+                err << file.fileName() << ':' << line << ": " << error.errorString() << endl;
+                return 1;
+            }
+
+            const qint64 offset = qint64(record.value(QStringLiteral("offset_ms")).toDouble() / speed);
+            LoadClient *client = clients.at(record.value(QStringLiteral("client")).toInt() % clientCount);
+            QTimer::singleShot(int(offset), client, [client, record] {
+                client->replay(record);
+            });
+            lastOffset = qMax(lastOffset, offset);
+        }
+
+        if (!parser.isSet(QStringLiteral("duration"))) {
+            durationMs = lastOffset + 10000;
+        }
+    } else {
+        for (LoadClient *client : clients) {
+            client->start();
+        }
+    }
+
+    QElapsedTimer elapsed;
+    elapsed.start();
+
+    QTimer reportTimer;
+    const int interval = parser.value(QStringLiteral("interval")).toInt();
+    if (interval > 0) {
+        QObject::connect(&reportTimer, &QTimer::timeout, [&] {
+            out << stats.report(elapsed.elapsed()) << endl;
+        });
+        reportTimer.start(interval * 1000);
+    }
+
+    QTimer::singleShot(int(durationMs), &app, [&] {
+        for (LoadClient *client : clients) {
+            client->stop();
+        }
+        out << stats.report(elapsed.elapsed()) << flush;
+        app.quit();
+    });
+
+    return app.exec();
+}
@@ -0,0 +1,129 @@
+#include "cloudlyst.h"
+
+#include <Cutelyst/Plugins/Utils/Sql>
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QTextStream>
+
+using namespace Cutelyst;
+
+namespace {
+
+struct Direction {
+    const char *source;
+    const char *copy;
+    const char *remove;
+};
+
+// Copies are idempotent, a run interrupted half way can simply be repeated
+const Direction toJsonb = {
+    "cloudlyst.file_properties",
+    "INSERT INTO cloudlyst.file_props (file_id, props) "
+    "SELECT file_id, jsonb_object_agg(name, value) "
+    "FROM cloudlyst.file_properties "
+    "WHERE file_id > :after AND file_id <= :upto "
+    "GROUP BY file_id "
+    "ON CONFLICT (file_id) DO UPDATE SET props = file_props.props || EXCLUDED.props",
+    "DELETE FROM cloudlyst.file_properties WHERE file_id > :after AND file_id <= :upto",
+};
+
+const Direction toRows = {
+    "cloudlyst.file_props",
+    "INSERT INTO cloudlyst.file_properties (file_id, name, value) "
+    "SELECT p.file_id, e.key, e.value "
+    "FROM cloudlyst.file_props p, jsonb_each_text(p.props) e "
+    "WHERE p.file_id > :after AND p.file_id <= :upto "
+    "ON CONFLICT ON CONSTRAINT file_properties_file_id_name_key DO UPDATE SET value = EXCLUDED.value",
+    "DELETE FROM cloudlyst.file_props WHERE file_id > :after AND file_id <= :upto",
+};
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("cloudlyst-migrate-props"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Moves WebDAV dead properties between the rows and jsonb layouts (PropertyStorage)"));
+    parser.addHelpOption();
+    parser.addOptions({
+                          {QStringLiteral("to"), QStringLiteral("Target layout, rows or jsonb."), QStringLiteral("layout")},
+                          {QStringLiteral("batch-size"), QStringLiteral("Files per transaction."), QStringLiteral("n"), QStringLiteral("1000")},
+                          {QStringLiteral("delete-source"), QStringLiteral("Delete what was copied from the old layout.")},
+                      });
+    parser.process(app);
+
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    const QString to = parser.value(QStringLiteral("to"));
+    if (to != QLatin1String("jsonb") && to != QLatin1String("rows")) {
+        parser.showHelp(1);
+    }
+    const Direction &direction = to == QLatin1String("jsonb") ? toJsonb : toRows;
+    const int batchSize = qMax(1, parser.value(QStringLiteral("batch-size")).toInt());
+    const bool deleteSource = parser.isSet(QStringLiteral("delete-source"));
+
+    if (!Cloudlyst::openDatabase() || !Cloudlyst::createDB()) {
+        return 2;
+    }
+
+    QSqlDatabase db = Sql::databaseThread(QStringLiteral("cloudlyst"));
+
+    QSqlQuery next(db);
+    next.prepare(QLatin1String("SELECT max(file_id) FROM (SELECT DISTINCT file_id FROM ") + QLatin1String(direction.source) +
+                 QLatin1String(" WHERE file_id > :after ORDER BY file_id LIMIT :limit) t"));
+    QSqlQuery copy(db);
+    copy.prepare(QLatin1String(direction.copy));
+    QSqlQuery remove(db);
+    remove.prepare(QLatin1String(direction.remove));
+
+    // Small transactions over file id ranges, so the server keeps serving
+    // and only a batch at a time is locked
+    qint64 after = 0;
+    qint64 files = 0;
+    while (true) {
+        next.bindValue(QStringLiteral(":after"), after);
+        next.bindValue(QStringLiteral(":limit"), batchSize);
+        if (!next.exec() || !next.next()) {
+            err << "Failed to find the next batch: " << next.lastError().databaseText() << endl;
+            return 1;
+        }
+        if (next.isNull(0)) {
+            break;
+        }
+        const qint64 upto = next.value(0).toLongLong();
+
+        if (!db.transaction()) {
+            err << "Failed to start a transaction: " << db.lastError().databaseText() << endl;
+            return 1;
+        }
+
+        copy.bindValue(QStringLiteral(":after"), after);
+        copy.bindValue(QStringLiteral(":upto"), upto);
+        bool ok = copy.exec();
+        if (ok && deleteSource) {
+            remove.bindValue(QStringLiteral(":after"), after);
+            remove.bindValue(QStringLiteral(":upto"), upto);
+            ok = remove.exec();
+        }
+
+        if (!ok || !db.commit()) {
+            err << "Failed to migrate files " << after + 1 << " to " << upto << ": "
+                << (copy.lastError().isValid() ? copy.lastError() : remove.lastError()).databaseText() << endl;
+            db.rollback();
+            return 1;
+        }
+
+        files += copy.numRowsAffected();
+        after = upto;
+        out << "migrated up to file " << upto << endl;
+    }
+
+    out << "done, " << files << (to == QLatin1String("jsonb") ? " files" : " properties") << " written" << endl;
+    return 0;
+}
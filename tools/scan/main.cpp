@@ -0,0 +1,93 @@
+#include "cloudlyst.h"
+#include "filesscanner.h"
+#include "packcompactor.h"
+
+#include <Cutelyst/Plugins/Utils/Sql>
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QSqlQuery>
+#include <QSqlError>
+#include <QTextStream>
+
+using namespace Cutelyst;
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("cloudlyst-scan"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Reconciles Cloudlyst data directories with the database"));
+    parser.addHelpOption();
+    parser.addOptions({
+                          {QStringLiteral("datadir"), QStringLiteral("Cloudlyst DataDir."), QStringLiteral("path")},
+                          {QStringLiteral("user"), QStringLiteral("User to scan, can be repeated."), QStringLiteral("username")},
+                          {QStringLiteral("all"), QStringLiteral("Scan all users.")},
+                          {QStringLiteral("threads"), QStringLiteral("Walk and hash threads."), QStringLiteral("n")},
+                          {QStringLiteral("rate-limit"), QStringLiteral("Max hashing read rate in MiB/s."), QStringLiteral("mib")},
+                          {QStringLiteral("batch-size"), QStringLiteral("Fixes per transaction."), QStringLiteral("n"), QStringLiteral("500")},
+                          {QStringLiteral("dry-run"), QStringLiteral("Only report what would change.")},
+                          {QStringLiteral("compact-packs"), QStringLiteral("Also compact packed storage, see PackMaxSize.")},
+                      });
+    parser.process(app);
+
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    QString dataDir = parser.value(QStringLiteral("datadir"));
+    if (dataDir.isEmpty() || (!parser.isSet(QStringLiteral("all")) && !parser.isSet(QStringLiteral("user")))) {
+        parser.showHelp(1);
+    }
+    if (!dataDir.endsWith(QLatin1Char('/'))) {
+        dataDir.append(QLatin1Char('/'));
+    }
+
+    if (!Cloudlyst::openDatabase()) {
+        return 2;
+    }
+
+    QSqlQuery query(Sql::databaseThread(QStringLiteral("cloudlyst")));
+    bool ok;
+    if (parser.isSet(QStringLiteral("all"))) {
+        ok = query.exec(QStringLiteral("SELECT id, username FROM cloudlyst.users ORDER BY username"));
+    } else {
+        ok = query.prepare(QStringLiteral("SELECT id, username FROM cloudlyst.users WHERE username = ANY(string_to_array(:users, '/'))"));
+        query.bindValue(QStringLiteral(":users"), parser.values(QStringLiteral("user")).join(QLatin1Char('/')));
+        ok = ok && query.exec();
+    }
+    if (!ok) {
+        err << "Failed to list users: " << query.lastError().databaseText() << endl;
+        return 2;
+    }
+
+    FilesScanner scanner;
+    if (parser.isSet(QStringLiteral("threads"))) {
+        scanner.setThreads(parser.value(QStringLiteral("threads")).toInt());
+    }
+    scanner.setRateLimit(parser.value(QStringLiteral("rate-limit")).toLongLong() * 1024 * 1024);
+    scanner.setBatchSize(parser.value(QStringLiteral("batch-size")).toInt());
+    scanner.setDryRun(parser.isSet(QStringLiteral("dry-run")));
+    const bool compactPacks = parser.isSet(QStringLiteral("compact-packs")) && !parser.isSet(QStringLiteral("dry-run"));
+    PackCompactor compactor;
+
+    int ret = 0;
+    while (query.next()) {
+        const QVariant userId = query.value(0);
+        const QString username = query.value(1).toString();
+
+        const bool scanned = scanner.scan(dataDir + username, userId);
+        if (!scanned) {
+            err << username << ": " << scanner.errorString() << endl;
+            ret = 1;
+        }
+        out << username << ": " << scanner.report() << endl;
+
+        if (compactPacks && !compactor.compact(dataDir + username + QLatin1Char('/'), userId)) {
+            err << username << ": " << compactor.errorString() << endl;
+            ret = 1;
+        }
+    }
+
+    return ret;
+}